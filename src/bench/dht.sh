@@ -0,0 +1,8 @@
+#!/bin/bash
+# Compares peer discovery through the tracker and through the DHT on the same swarm.
+# usage: bench/dht.sh [ranks] [clients per rank] [seeders] [segments]
+DIR=$(dirname "$0")
+for mode in "" --dht; do
+    echo "== ${mode:-tracker}"
+    "$DIR/logical.sh" "${1:-4}" "${2:-250}" "${3:-8}" "${4:-100}" $mode
+done
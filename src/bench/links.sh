@@ -0,0 +1,33 @@
+#!/bin/bash
+# Compares peer discovery strategies over emulated heterogeneous links (--links).
+# usage: bench/links.sh [ranks] [clients per rank] [seeders] [segments]
+# Client ranks are fast, medium or slow in turn (rank 1 fast); a link takes the class of its
+# slower end. LINKS=<file> runs a link file of your own instead.
+DIR=$(dirname "$0")
+RANKS=${1:-6}
+LINKS_FILE=${LINKS:-$(mktemp)}
+[ -n "$LINKS" ] || trap 'rm -f "$LINKS_FILE"' EXIT
+
+if [ -z "$LINKS" ]; then
+    # Written fast to slow, since later lines override earlier ones
+    {
+        echo "# <source> <destination> <latency ms> <bandwidth Mbit/s> <jitter ms>"
+        echo "* * 1 100 0.2"
+        for class in 1 2; do
+            for ((rank = 1; rank <= RANKS; ++rank)); do
+                (((rank - 1) % 3 == class)) || continue
+                case $class in
+                    1) link="5 20 1" ;;
+                    2) link="20 2 5" ;;
+                esac
+                echo "$rank * $link"
+                echo "* $rank $link"
+            done
+        done
+    } > "$LINKS_FILE"
+fi
+
+for mode in "" --pex "--pex --super-seed" --dht; do
+    echo "== ${mode:-tracker}"
+    PEERS=1 "$DIR/logical.sh" "$RANKS" "${2:-10}" "${3:-2}" "${4:-100}" --links "$LINKS_FILE" $mode
+done
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Runs a large swarm with many logical clients per rank.
+# usage: bench/logical.sh [ranks] [clients per rank] [seeders] [segments] [tema2 options...]
+# The first `seeders` clients seed file1; every other client downloads it. With PEERS=1 the
+# downloaders also own the same one-segment file2, which makes them peers that upload what they get.
+RANKS=${1:-4}
+PER_RANK=${2:-250}
+SEEDERS=${3:-8}
+SEGMENTS=${4:-100}
+CLIENTS=$((RANKS * PER_RANK))
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+SEEDER_FILE="$WORK/seeder.txt"
+{
+    echo 1
+    echo "file1 $SEGMENTS"
+    for ((s = 0; s < SEGMENTS; ++s)); do
+        printf '%08x%08x%08x%08x\n' 1 1 "$s" "$((s * 7919))"
+    done
+    echo 0
+} > "$SEEDER_FILE"
+
+for ((id = 1; id <= CLIENTS; ++id)); do
+    if ((id <= SEEDERS)); then
+        cp "$SEEDER_FILE" "$WORK/in$id.txt"
+    elif [ -n "$PEERS" ]; then
+        printf '1\nfile2 1\n%08x%08x%08x%08x\n1\nfile1\n' 2 0 0 0 > "$WORK/in$id.txt"
+    else
+        printf '0\n1\nfile1\n' > "$WORK/in$id.txt"
+    fi
+done
+
+cp "$SRC/tema2" "$WORK/" || exit 1
+cd "$WORK" || exit 1
+start=$(date +%s.%N)
+mpirun --oversubscribe -np $((RANKS + 1)) ./tema2 --clients-per-rank "$PER_RANK" "${@:5}" > run.log 2>&1
+status=$?
+end=$(date +%s.%N)
+
+# A download is complete when it holds exactly the seeded hashes
+tail -n +3 "$SEEDER_FILE" | head -n "$SEGMENTS" > expected.txt
+complete=0
+for output in client*_file1; do
+    [ -f "$output" ] && cmp -s "$output" expected.txt && complete=$((complete + 1))
+done
+
+grep -E "^(Registered|Peer discovery|PEX|Seeding|Topology|Fairness|Dedup|Streaming|Upload limits|Download budgets|Subscriptions)" run.log
+echo "$CLIENTS clients on $RANKS ranks: $complete of $((CLIENTS - SEEDERS)) downloads complete" \
+     "in $(awk "BEGIN { printf \"%.2f\", $end - $start }") s (exit $status)"
@@ -0,0 +1,253 @@
+// Microbenchmarks of the client and tracker data structures, on synthetic state and without MPI
+// (nothing here calls MPI_Init: the functions measured never talk to other ranks).
+//
+// usage: microbench [-c clients] [-f files] [-s segments] [-k files per client] [-t ms per benchmark]
+// Every benchmark runs in batches of doubling size until a batch takes the given time, and
+// reports that batch: nanoseconds, heap allocations and allocated bytes per operation.
+// Allocations are counted by wrapping malloc, calloc and realloc at link time (see the Makefile).
+#include "../download.h"
+#include "../tracker.h"
+
+#include <getopt.h>
+#include <time.h>
+
+typedef struct BenchConfig_t {
+    int clients;
+    int files;
+    int segments;
+    int files_per_client;
+    uint64_t min_ns;
+} BenchConfig_t;
+
+typedef struct BenchState_t {
+    const BenchConfig_t *config;
+    FileData_t *file; // * one file holding every segment
+    FileData_t *scratch; // * the file add_segment_to_file_data fills
+    FileSegment_t *segments;
+    FileSegment_t missing;
+    FileData_t *owned; // * config->files files, as a client holds them
+    TrackerDataSet_t tracker;
+    uint64_t rng;
+    uint64_t sink; // * keeps the results alive
+} BenchState_t;
+
+typedef void (*BenchFunc_t)(BenchState_t *state, uint64_t iterations);
+
+// * Allocation counters of the wrapped allocator
+static uint64_t allocations;
+static uint64_t allocated_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_realloc(pointer, size);
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void *bench_alloc(size_t size) {
+    void *memory = calloc(1, size);
+    if (!memory) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static void random_segment(uint64_t *rng, FileSegment_t *segment) {
+    for (size_t i = 0; i < DIGEST_SIZE; i += 8) {
+        uint64_t word = splitmix64(rng);
+        memcpy(&segment->digest.bytes[i], &word, 8);
+    }
+}
+
+static void bench_has_segment_hit(BenchState_t *state, uint64_t iterations) {
+    int segments = state->config->segments;
+    for (uint64_t i = 0; i < iterations; ++i)
+        state->sink += has_segment(state->file, state->segments[i % segments]);
+}
+
+static void bench_has_segment_miss(BenchState_t *state, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i)
+        state->sink += has_segment(state->file, state->missing);
+}
+
+static void bench_find_file_data(BenchState_t *state, uint64_t iterations) {
+    int files = state->config->files;
+    for (uint64_t i = 0; i < iterations; ++i)
+        state->sink += (uintptr_t)find_file_data(state->owned, files, (int)(i % files) + 1);
+}
+
+// Fills the scratch file up to config->segments, then empties it and starts over.
+static void bench_add_segment(BenchState_t *state, uint64_t iterations) {
+    FileData_t *file = state->scratch;
+    size_t segments = (size_t)state->config->segments;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        if (file->segment_count == segments) {
+            file->segment_count = 0;
+            memset(file->have, 0, sizeof(file->have));
+            memset(file->known, 0, sizeof(file->known));
+        }
+        state->sink += add_segment_to_file_data(file, state->segments[file->segment_count]);
+    }
+}
+
+static void bench_create_file_swarms(BenchState_t *state, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        create_file_swarms(&state->tracker);
+        state->sink += state->tracker.swarms[0].clients_in_swarm_count;
+    }
+}
+
+// One DOWN_10 announce per operation: 10 segments of a random file, by a random client.
+static void bench_update_tracker_swarm(BenchState_t *state, uint64_t iterations) {
+    const BenchConfig_t *config = state->config;
+    SegmentRecord_t records[10];
+    for (uint64_t i = 0; i < iterations; ++i) {
+        int client_id = (int)(splitmix64(&state->rng) % config->clients) + 1;
+        int file_id = (int)(splitmix64(&state->rng) % config->files) + 1;
+        uint32_t first = (uint32_t)(splitmix64(&state->rng) % config->segments);
+        for (int r = 0; r < 10; ++r) {
+            records[r].file_id = file_id;
+            records[r].segment_idx = (first + r) % config->segments;
+        }
+        apply_segment_records(&state->tracker, client_id, records, 10);
+    }
+    state->sink += state->tracker.swarms[0].version;
+}
+
+// Runs func in batches of doubling size until one takes config->min_ns, and reports that batch.
+static void run(BenchState_t *state, const char *name, BenchFunc_t func) {
+    uint64_t iterations = 1;
+    while (true) {
+        allocations = allocated_bytes = 0;
+        uint64_t started = now_ns();
+        func(state, iterations);
+        uint64_t elapsed = now_ns() - started;
+        if (elapsed >= state->config->min_ns || iterations >= (1ULL << 40)) {
+            printf("%-28s %12llu ops %12.1f ns/op %10.2f allocs/op %12.1f B/op\n", name,
+                   (unsigned long long)iterations, (double)elapsed / iterations, (double)allocations / iterations,
+                   (double)allocated_bytes / iterations);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+// Builds the synthetic state: one file of config->segments held segments, config->files owned
+// files, and a tracker whose clients each hold config->files_per_client files.
+static void build_state(BenchState_t *state, const BenchConfig_t *config) {
+    memset(state, 0, sizeof(*state));
+    state->config = config;
+    state->rng = 1;
+
+    state->segments = bench_alloc(sizeof(FileSegment_t) * config->segments);
+    state->file = bench_alloc(sizeof(FileData_t));
+    state->scratch = bench_alloc(sizeof(FileData_t));
+    for (int i = 0; i < config->segments; ++i) {
+        random_segment(&state->rng, &state->segments[i]);
+        add_segment_to_file_data(state->file, state->segments[i]);
+    }
+    random_segment(&state->rng, &state->missing);
+
+    state->owned = bench_alloc(sizeof(FileData_t) * config->files);
+    for (int i = 0; i < config->files; ++i)
+        state->owned[i].file_id = i + 1;
+
+    TrackerDataSet_t *tracker = &state->tracker;
+    tracker->client_count = config->clients;
+    tracker->swarm_size = config->files;
+    tracker->data = bench_alloc(sizeof(TrackerData_t) * config->clients);
+    for (int c = 0; c < config->clients; ++c) {
+        TrackerData_t *client = &tracker->data[c];
+        client->client_id = c + 1;
+        client->client_type = PEER;
+        for (int k = 0; k < config->files_per_client; ++k) {
+            int file_id = (c + k) % config->files + 1;
+            tracker_add_file_to_owned(tracker, file_id, c);
+            TrackerFile_t *file = &client->files[client->files_count - 1];
+            file->segment_count = config->segments;
+            for (int s = 0; s < config->segments; ++s)
+                segment_bit_set(file->have, s);
+        }
+    }
+    create_file_swarms(tracker);
+    for (int i = 0; i < config->files; ++i)
+        tracker->swarms[i].segment_total = config->segments;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c clients] [-f files] [-s segments] [-k files per client] [-t ms per benchmark]\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig_t config = {
+        .clients = 1000,
+        .files = MAX_FILES,
+        .segments = MAX_CHUNKS,
+        .files_per_client = 2,
+        .min_ns = 200 * 1000000ULL,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:f:s:k:t:")) != -1) {
+        switch (opt) {
+            case 'c': config.clients = atoi(optarg); break;
+            case 'f': config.files = atoi(optarg); break;
+            case 's': config.segments = atoi(optarg); break;
+            case 'k': config.files_per_client = atoi(optarg); break;
+            case 't': config.min_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.clients < 1 || config.files < 1 || config.segments < 1 || config.segments > MAX_CHUNKS ||
+        config.files_per_client < 1 || config.files_per_client > config.files) {
+        fprintf(stderr, "Error: need at least one client and file, 1..%d segments and 1..files files per client.\n",
+                MAX_CHUNKS);
+        return EXIT_FAILURE;
+    }
+
+    BenchState_t state;
+    build_state(&state, &config);
+    printf("%d clients, %d files of %d segments, %d files per client\n", config.clients, config.files,
+           config.segments, config.files_per_client);
+
+    run(&state, "has_segment (hit)", bench_has_segment_hit);
+    run(&state, "has_segment (miss)", bench_has_segment_miss);
+    run(&state, "find_file_data", bench_find_file_data);
+    run(&state, "add_segment_to_file_data", bench_add_segment);
+    run(&state, "create_file_swarms", bench_create_file_swarms);
+    run(&state, "update_tracker_swarm", bench_update_tracker_swarm);
+
+    free_tracker(&state.tracker);
+    return state.sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+// Message-rate benchmark: the request/ACK exchange of the download and upload threads,
+// either with both threads calling MPI (MPI_THREAD_MULTIPLE) or through the communication
+// engine (MPI_THREAD_FUNNELED).
+//
+// usage: mpirun -np N ./msgrate multiple|funneled [iterations] [window]
+// Every rank requests from the next one: `window` requests in flight, then their ACKs.
+#include "../comm.h"
+
+#define STOP_MESSAGE "STOP"
+
+typedef struct BenchConfig_t {
+    bool funneled;
+    int iterations;
+    int window;
+    int rank;
+    int numtasks;
+} BenchConfig_t;
+
+static int bench_send(const BenchConfig_t *config, CommChannel_t channel, int dest, int tag, const void *data, int size) {
+    if (config->funneled)
+        return comm_send(channel, dest, 0, tag, data, size);
+    return MPI_Send(data, size, MPI_BYTE, dest, tag, comm_channels[channel]);
+}
+
+// Receives one message, returning its source.
+static int bench_recv(const BenchConfig_t *config, CommInbox_t inbox, CommChannel_t channel, int source, int tag,
+                      void *data, int size) {
+    if (config->funneled) {
+        CommStatus_t status;
+        comm_recv(inbox, 0, channel, source, tag, data, size, &status,
+                  inbox == COMM_UPLOAD_INBOX ? COUNTER_SITE_UPLOAD : COUNTER_SITE_SEGMENT);
+        return status.source;
+    }
+    MPI_Status status;
+    MPI_Recv(data, size, MPI_BYTE, source, tag, comm_channels[channel], &status);
+    return status.MPI_SOURCE;
+}
+
+static void *requester_func(void *arg) {
+    const BenchConfig_t *config = arg;
+    int target = (config->rank + 1) % config->numtasks;
+    Digest_t digest;
+    char ack[BUFF_SIZE];
+    memset(&digest, 0xab, sizeof(digest));
+
+    for (int done = 0; done < config->iterations; done += config->window) {
+        int batch = config->iterations - done;
+        if (batch > config->window)
+            batch = config->window;
+        for (int i = 0; i < batch; ++i)
+            bench_send(config, COMM_PEER, target, REQUEST_TAG, &digest, DIGEST_SIZE);
+        for (int i = 0; i < batch; ++i)
+            bench_recv(config, COMM_DOWNLOAD_INBOX, COMM_DATA, target, ACK_TAG, ack, BUFF_SIZE);
+    }
+
+    bench_send(config, COMM_PEER, target, REQUEST_TAG, STOP_MESSAGE, sizeof(STOP_MESSAGE));
+    if (config->funneled)
+        comm_worker_exit();
+    return NULL;
+}
+
+static void *responder_func(void *arg) {
+    const BenchConfig_t *config = arg;
+    char request[BUFF_SIZE];
+
+    while (true) {
+        int source = bench_recv(config, COMM_UPLOAD_INBOX, COMM_PEER, MPI_ANY_SOURCE, REQUEST_TAG, request, BUFF_SIZE);
+        if (strncmp(request, STOP_MESSAGE, sizeof(STOP_MESSAGE)) == 0)
+            break;
+        bench_send(config, COMM_DATA, source, ACK_TAG, "OK", 3);
+    }
+
+    if (config->funneled)
+        comm_worker_exit();
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || (strcmp(argv[1], "multiple") != 0 && strcmp(argv[1], "funneled") != 0)) {
+        fprintf(stderr, "usage: %s multiple|funneled [iterations] [window]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    BenchConfig_t config = {
+        .funneled = strcmp(argv[1], "funneled") == 0,
+        .iterations = argc > 2 ? MAX(atoi(argv[2]), 1) : 10000,
+        .window = argc > 3 ? MAX(atoi(argv[3]), 1) : 8,
+    };
+
+    int required = config.funneled ? MPI_THREAD_FUNNELED : MPI_THREAD_MULTIPLE;
+    int provided;
+    MPI_Init_thread(&argc, &argv, required, &provided);
+    if (provided < required) {
+        fprintf(stderr, "MPI does not support the required threading level.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &config.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &config.numtasks);
+    comm_create_channels();
+
+    if (config.funneled)
+        comm_start();
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+
+    pthread_t requester, responder;
+    pthread_create(&responder, NULL, responder_func, &config);
+    pthread_create(&requester, NULL, requester_func, &config);
+    if (config.funneled)
+        comm_progress(2);
+    pthread_join(requester, NULL);
+    pthread_join(responder, NULL);
+
+    double elapsed = MPI_Wtime() - start, max_elapsed = 0;
+    MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (config.funneled)
+        comm_stop();
+
+    if (config.rank == 0) {
+        // Every iteration is one request and one ACK
+        double messages = 2.0 * config.iterations * config.numtasks;
+        printf("%s: %d ranks, %d iterations, window %d: %.0f msg/s (%.3f s)\n",
+               argv[1], config.numtasks, config.iterations, config.window, messages / max_elapsed, max_elapsed);
+    }
+
+    comm_free_channels();
+    MPI_Finalize();
+    return 0;
+}
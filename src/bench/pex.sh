@@ -0,0 +1,8 @@
+#!/bin/bash
+# Compares a swarm that polls the tracker for new sources with one that gossips them (PEX).
+# usage: bench/pex.sh [ranks] [clients per rank] [seeders] [segments]
+DIR=$(dirname "$0")
+for mode in "" --pex; do
+    echo "== ${mode:-tracker}"
+    PEERS=1 "$DIR/logical.sh" "${1:-4}" "${2:-50}" "${3:-4}" "${4:-100}" $mode
+done
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Runs one synthetic swarm (bench/swarmgen) on several rank counts and records how long it takes.
+# usage: bench/scaling.sh [rank counts] [clients] [tema2 options...]
+# SWARM holds the swarmgen options (files, segments, seeders, peers, wanted files, skew, seed);
+# results go to OUT. The clients are spread evenly over the ranks, rounded up to fill the last one.
+# OUT/summary.csv gets one line per rank count: the whole swarm's time, the completed downloads and
+# the mean, median, 90th percentile and longest per-client times; OUT/ranks<n>.times keeps every
+# downloader's "<client id> <seconds>".
+RANK_COUNTS=${1:-"1 2 4 8"}
+CLIENTS=${2:-200}
+SWARM=${SWARM:-"-f 4 -s 100 -S 4 -p 40 -w 2 -z 1.0"}
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+OUT=$(mkdir -p "${OUT:-scaling}" && cd "${OUT:-scaling}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+[ -x "$SRC/swarmgen" ] || { echo "build the tools first: make tools" >&2; exit 1; }
+echo "ranks,clients,seconds,completed,downloads,mean_ms,p50_ms,p90_ms,max_ms" > "$OUT/summary.csv"
+
+for ranks in $RANK_COUNTS; do
+    per_rank=$(((CLIENTS + ranks - 1) / ranks))
+    clients=$((ranks * per_rank))
+    rm -rf "${WORK:?}"/*
+    # shellcheck disable=SC2086
+    "$SRC/swarmgen" -c "$clients" $SWARM "$WORK" || exit 1
+    cp "$SRC/tema2" "$WORK/" || exit 1
+
+    start=$(date +%s.%N)
+    (cd "$WORK" && mpirun --oversubscribe -np $((ranks + 1)) ./tema2 --clients-per-rank "$per_rank" \
+        --completion-log completion.txt "${@:3}" > run.log 2>&1)
+    status=$?
+    end=$(date +%s.%N)
+
+    # A download is complete when it holds exactly the file's segments
+    downloads=0
+    completed=0
+    while read -r id role wanted; do
+        for file_id in $wanted; do
+            downloads=$((downloads + 1))
+            cmp -s "$WORK/client${id}_file${file_id}" "$WORK/file${file_id}.hashes" && completed=$((completed + 1))
+        done
+    done < "$WORK/swarm.txt"
+
+    sort -n -k 2 "$WORK/completion.txt" 2>/dev/null > "$OUT/ranks$ranks.times"
+    stats=$(awk '{ t[NR] = $2 * 1000; sum += t[NR] }
+                 END { if (NR == 0) { print "0,0,0,0"; exit }
+                       printf "%.1f,%.1f,%.1f,%.1f", sum / NR, t[int((NR + 1) / 2)], t[int(NR * 0.9 + 0.5)], t[NR] }' \
+                "$OUT/ranks$ranks.times")
+    seconds=$(awk "BEGIN { printf \"%.2f\", $end - $start }")
+    echo "$ranks,$clients,$seconds,$completed,$downloads,$stats" >> "$OUT/summary.csv"
+
+    grep -E "^(Run time|Completion)" "$WORK/run.log"
+    echo "$clients clients on $ranks ranks: $completed of $downloads downloads complete in $seconds s (exit $status)"
+done
+cat "$OUT/summary.csv"
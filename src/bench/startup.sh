@@ -0,0 +1,29 @@
+#!/bin/bash
+# Measures tracker registration time with many clients.
+# usage: bench/startup.sh [clients] [files per client] [segments per file]
+# Every client seeds its own files, so the run ends right after registration.
+CLIENTS=${1:-256}
+FILES=${2:-3}
+SEGMENTS=${3:-100}
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Every seeder of fileN must hold the same digests, or the tracker rejects the later claims.
+{
+    echo "$FILES"
+    for ((f = 1; f <= FILES; ++f)); do
+        echo "file$f $SEGMENTS"
+        for ((s = 0; s < SEGMENTS; ++s)); do
+            printf '%08x%08x%08x%08x\n' 0 "$f" "$s" "$((f * SEGMENTS + s))"
+        done
+    done
+    echo 0
+} > "$WORK/in1.txt"
+for ((rank = 2; rank <= CLIENTS; ++rank)); do
+    cp "$WORK/in1.txt" "$WORK/in$rank.txt"
+done
+
+cp "$SRC/tema2" "$WORK/" || exit 1
+cd "$WORK" && mpirun --oversubscribe -np $((CLIENTS + 1)) ./tema2 | grep "^Registered"
@@ -0,0 +1,8 @@
+#!/bin/bash
+# Compares plain seeding with super-seeding on a swarm of peers that gossip their sources.
+# usage: bench/superseed.sh [ranks] [clients per rank] [seeders] [segments]
+DIR=$(dirname "$0")
+for mode in "" --super-seed; do
+    echo "== ${mode:-seeding}"
+    PEERS=1 "$DIR/logical.sh" "${1:-4}" "${2:-50}" "${3:-2}" "${4:-100}" --pex $mode
+done
@@ -0,0 +1,225 @@
+// Synthetic swarm generator: writes the in<id>.txt manifests of a parameterized swarm.
+//
+// usage: swarmgen [-c clients] [-f files] [-s segments] [-S seeders] [-p peers] [-w wanted]
+//                 [-z skew] [-r seed] [dir]
+// Seeders own every file. Peers own one file and want others, leeches only want. Which files a
+// client owns or wants follows a Zipf distribution: file k is picked with weight 1 / k^skew, so
+// skew 0 spreads the downloaders evenly and larger skews pile them onto file1. Roles are shuffled
+// over the client ids, so they spread over the ranks. Every copy of a file has the same segments.
+//
+// Next to the manifests it writes file<n>.hashes (the segments of file n, as a finished download
+// writes them) and swarm.txt: one "<id> <seeder|peer|leech> <wanted file ids...>" line per client.
+#include "../utils.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+
+#define SWARM_MAX_FILES (MAX_FILES - 1) // * file ids are the last digit of the name: file1 .. file9
+
+typedef enum SwarmRole_t {
+    ROLE_SEEDER,
+    ROLE_PEER,
+    ROLE_LEECH
+} SwarmRole_t;
+
+typedef struct SwarmConfig_t {
+    int clients;
+    int files;
+    int segments;
+    int seeders;
+    int peers;
+    int wanted;
+    double skew;
+    uint64_t seed;
+    const char *dir;
+} SwarmConfig_t;
+
+static uint64_t rng_state;
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1).
+static double rng_unit(void) {
+    return (splitmix64(&rng_state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Picks a file id in 1..files by Zipf weight, among the ones not taken yet. Returns 0 if none is left.
+static int pick_file(const SwarmConfig_t *config, const bool *taken) {
+    double total = 0;
+    for (int k = 1; k <= config->files; ++k) {
+        if (!taken[k])
+            total += pow(k, -config->skew);
+    }
+    if (total == 0)
+        return 0;
+
+    double target = rng_unit() * total;
+    int last = 0;
+    for (int k = 1; k <= config->files; ++k) {
+        if (taken[k])
+            continue;
+        last = k;
+        target -= pow(k, -config->skew);
+        if (target < 0)
+            return k;
+    }
+    return last;
+}
+
+// Writes the hex digest of segment idx of a file: the same on every client and run with the same seed.
+static void write_segment(FILE *out, const SwarmConfig_t *config, int file_id, int idx) {
+    uint64_t state = config->seed ^ ((uint64_t)file_id << 32) ^ (uint64_t)idx;
+    for (int written = 0; written < HASH_SIZE; written += 16)
+        fprintf(out, "%016llx", (unsigned long long)splitmix64(&state));
+    fprintf(out, "\n");
+}
+
+static FILE *open_output(const SwarmConfig_t *config, const char *format, int id) {
+    char name[64];
+    char path[PATH_MAX];
+    snprintf(name, sizeof(name), format, id);
+    snprintf(path, sizeof(path), "%s/%s", config->dir, name);
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot write %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return out;
+}
+
+static void write_file(FILE *out, const SwarmConfig_t *config, int file_id) {
+    fprintf(out, "file%d %d\n", file_id, config->segments);
+    for (int idx = 0; idx < config->segments; ++idx)
+        write_segment(out, config, file_id, idx);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c clients] [-f files] [-s segments] [-S seeders] [-p peers] [-w wanted] "
+                    "[-z skew] [-r seed] [dir]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    SwarmConfig_t config = {
+        .clients = 100,
+        .files = 3,
+        .segments = MAX_CHUNKS,
+        .seeders = 2,
+        .peers = 0,
+        .wanted = 1,
+        .skew = 1.0,
+        .seed = 1,
+        .dir = ".",
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:f:s:S:p:w:z:r:")) != -1) {
+        switch (opt) {
+            case 'c': config.clients = atoi(optarg); break;
+            case 'f': config.files = atoi(optarg); break;
+            case 's': config.segments = atoi(optarg); break;
+            case 'S': config.seeders = atoi(optarg); break;
+            case 'p': config.peers = atoi(optarg); break;
+            case 'w': config.wanted = atoi(optarg); break;
+            case 'z': config.skew = atof(optarg); break;
+            case 'r': config.seed = strtoull(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        config.dir = argv[optind];
+
+    if (config.files < 1 || config.files > SWARM_MAX_FILES || config.segments < 1 || config.segments > MAX_CHUNKS ||
+        config.seeders < 1 || config.peers < 0 || config.seeders + config.peers > config.clients ||
+        config.wanted < 1 || config.skew < 0) {
+        fprintf(stderr, "Error: need 1..%d files, 1..%d segments, at least one seeder, "
+                        "seeders + peers <= clients and at least one wanted file.\n", SWARM_MAX_FILES, MAX_CHUNKS);
+        return EXIT_FAILURE;
+    }
+    rng_state = config.seed;
+
+    // Deal the roles out in a shuffled order
+    SwarmRole_t *roles = malloc(config.clients * sizeof(SwarmRole_t));
+    if (!roles) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < config.clients; ++i)
+        roles[i] = i < config.seeders ? ROLE_SEEDER : i < config.seeders + config.peers ? ROLE_PEER : ROLE_LEECH;
+    for (int i = config.clients - 1; i > 0; --i) {
+        int j = (int)(splitmix64(&rng_state) % (uint64_t)(i + 1));
+        SwarmRole_t role = roles[i];
+        roles[i] = roles[j];
+        roles[j] = role;
+    }
+
+    static const char *role_names[] = {"seeder", "peer", "leech"};
+    int wanting[SWARM_MAX_FILES + 1] = {0};
+    FILE *swarm = open_output(&config, "swarm.txt", 0);
+
+    for (int id = 1; id <= config.clients; ++id) {
+        SwarmRole_t role = roles[id - 1];
+        bool taken[SWARM_MAX_FILES + 1] = {false};
+        int wanted[SWARM_MAX_FILES];
+        int wanted_count = 0;
+        FILE *out = open_output(&config, "in%d.txt", id);
+
+        if (role == ROLE_SEEDER) {
+            fprintf(out, "%d\n", config.files);
+            for (int file_id = 1; file_id <= config.files; ++file_id)
+                write_file(out, &config, file_id);
+        } else if (role == ROLE_PEER && config.files > 1) {
+            int owned = pick_file(&config, taken);
+            taken[owned] = true;
+            fprintf(out, "1\n");
+            write_file(out, &config, owned);
+        } else {
+            fprintf(out, "0\n");
+        }
+
+        if (role != ROLE_SEEDER) {
+            while (wanted_count < config.wanted) {
+                int file_id = pick_file(&config, taken);
+                if (file_id == 0)
+                    break;
+                taken[file_id] = true;
+                wanted[wanted_count++] = file_id;
+                wanting[file_id]++;
+            }
+        }
+
+        fprintf(out, "%d\n", wanted_count);
+        fprintf(swarm, "%d %s", id, role_names[role]);
+        for (int i = 0; i < wanted_count; ++i) {
+            fprintf(out, "file%d\n", wanted[i]);
+            fprintf(swarm, " %d", wanted[i]);
+        }
+        fprintf(swarm, "\n");
+        fclose(out);
+    }
+    fclose(swarm);
+
+    for (int file_id = 1; file_id <= config.files; ++file_id) {
+        FILE *out = open_output(&config, "file%d.hashes", file_id);
+        for (int idx = 0; idx < config.segments; ++idx)
+            write_segment(out, &config, file_id, idx);
+        fclose(out);
+    }
+
+    printf("%d clients (%d seeders, %d peers, %d leeches), %d files of %d segments, skew %.2f; downloaders per file:",
+           config.clients, config.seeders, config.peers, config.clients - config.seeders - config.peers,
+           config.files, config.segments, config.skew);
+    for (int file_id = 1; file_id <= config.files; ++file_id)
+        printf(" %d", wanting[file_id]);
+    printf("\n");
+
+    free(roles);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#!/bin/bash
+# Compares random and topology-aware peer selection on simulated nodes of a few ranks each.
+# usage: bench/topology.sh [ranks] [clients per rank] [seeders] [segments] [ranks per node]
+DIR=$(dirname "$0")
+for mode in --no-locality ""; do
+    echo "== ${mode:-locality}"
+    PEERS=1 "$DIR/logical.sh" "${1:-6}" "${2:-20}" "${3:-2}" "${4:-100}" --node-size "${5:-2}" $mode
+done
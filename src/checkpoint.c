@@ -0,0 +1,147 @@
+#include "checkpoint.h"
+#include "digest.h"
+#include "options.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Identifies the download a checkpoint belongs to: the client id and its wanted files, in order.
+static uint64_t wanted_fingerprint(const ClientFiles_t *client) {
+    uint64_t hash = fingerprint_bytes(&client->client_id, sizeof(int), FINGERPRINT_SEED);
+    for (size_t i = 0; i < client->wanted_files_count; ++i) {
+        const char *name = client->wanted_files[i].file_name;
+        hash = fingerprint_bytes(name, strlen(name), hash);
+    }
+    return hash;
+}
+
+// Extracts the numeric file id from a wanted file name (last character, as everywhere else).
+static int wanted_file_id(const ClientFiles_t *client, size_t idx) {
+    const char *name = client->wanted_files[idx].file_name;
+    return atoi(&name[strlen(name) - 1]);
+}
+
+// Checks whether the mapped file holds a checkpoint of this exact download.
+static bool checkpoint_matches(const Checkpoint_t *checkpoint, const ClientFiles_t *client, uint64_t fingerprint) {
+    const CheckpointHeader_t *header = checkpoint->header;
+    return header->magic == CHECKPOINT_MAGIC &&
+           header->version == CHECKPOINT_VERSION &&
+           header->max_chunks == MAX_CHUNKS &&
+           header->client_id == client->client_id &&
+           header->entry_count == client->wanted_files_count &&
+           header->fingerprint == fingerprint;
+}
+
+/*
+ * Opens (or creates) <dir>/client<id>.ckpt and maps it.
+ * An existing checkpoint of the same download is kept so that its segments can be restored;
+ * anything else is reset to an empty checkpoint.
+ */
+Checkpoint_t *checkpoint_open(const ClientFiles_t *client, const char *dir) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/client%d.ckpt", dir, client->client_id);
+
+    size_t size = sizeof(CheckpointHeader_t) + sizeof(CheckpointEntry_t) * client->wanted_files_count;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: Could not open checkpoint %s, continuing without it.\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    bool reusable = fstat(fd, &st) == 0 && (size_t)st.st_size == size;
+    if (!reusable && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+        fprintf(stderr, "Warning: Could not size checkpoint %s, continuing without it.\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Warning: Could not mmap checkpoint %s, continuing without it.\n", path);
+        return NULL;
+    }
+
+    Checkpoint_t *checkpoint = calloc(1, sizeof(Checkpoint_t));
+    if (!checkpoint) {
+        munmap(base, size);
+        return NULL;
+    }
+    checkpoint->base = (uint8_t *)base;
+    checkpoint->size = size;
+    checkpoint->header = (CheckpointHeader_t *)base;
+    checkpoint->entries = (CheckpointEntry_t *)(checkpoint->base + sizeof(CheckpointHeader_t));
+
+    uint64_t fingerprint = wanted_fingerprint(client);
+    if (!reusable || !checkpoint_matches(checkpoint, client, fingerprint)) {
+        memset(base, 0, size);
+        checkpoint->header->magic = CHECKPOINT_MAGIC;
+        checkpoint->header->version = CHECKPOINT_VERSION;
+        checkpoint->header->max_chunks = MAX_CHUNKS;
+        checkpoint->header->client_id = client->client_id;
+        checkpoint->header->entry_count = client->wanted_files_count;
+        checkpoint->header->fingerprint = fingerprint;
+        for (size_t i = 0; i < client->wanted_files_count; ++i) {
+            checkpoint->entries[i].file_id = wanted_file_id(client, i);
+        }
+        checkpoint_sync(checkpoint);
+    }
+
+    return checkpoint;
+}
+
+// Returns the entry of a wanted file, or NULL if the file is not part of the checkpoint.
+const CheckpointEntry_t *checkpoint_entry(const Checkpoint_t *checkpoint, int file_id) {
+    for (uint32_t i = 0; i < checkpoint->header->entry_count; ++i) {
+        if (checkpoint->entries[i].file_id == file_id)
+            return &checkpoint->entries[i];
+    }
+    return NULL;
+}
+
+/*
+ * Records a downloaded segment, with the tree nodes that prove it. These are stores into the
+ * shared mapping; the kernel is asked to write them back (without waiting) every
+ * checkpoint_interval segments.
+ */
+void checkpoint_mark(Checkpoint_t *checkpoint, const FileData_t *file, size_t segment_idx, uint32_t swarm_version) {
+    CheckpointEntry_t *entry = (CheckpointEntry_t *)checkpoint_entry(checkpoint, file->file_id);
+    if (!entry || segment_idx >= MAX_CHUNKS)
+        return;
+
+    entry->root = file->root;
+    memcpy(entry->segments, file->segments, sizeof(entry->segments));
+    memcpy(entry->inner, file->inner, sizeof(entry->inner));
+    segment_bit_set(entry->have, segment_idx);
+    entry->swarm_version = swarm_version;
+
+    if (++checkpoint->dirty >= options.checkpoint_interval)
+        checkpoint_sync(checkpoint);
+}
+
+// Copies the tree a checkpoint kept of a file into file data (nothing of it is trusted yet).
+void checkpoint_restore_tree(const CheckpointEntry_t *entry, FileData_t *file) {
+    file->root = entry->root;
+    memcpy(file->segments, entry->segments, sizeof(file->segments));
+    memcpy(file->inner, entry->inner, sizeof(file->inner));
+}
+
+// Schedules write-back of the mapping; MS_ASYNC keeps the download thread off the disk.
+void checkpoint_sync(Checkpoint_t *checkpoint) {
+    checkpoint->header->generation++;
+    checkpoint->dirty = 0;
+    if (msync(checkpoint->base, checkpoint->size, MS_ASYNC) != 0) {
+        fprintf(stderr, "Warning: msync failed for checkpoint of client %d.\n", checkpoint->header->client_id);
+    }
+}
+
+// Syncs and unmaps the checkpoint. The file stays on disk for the next run.
+void checkpoint_close(Checkpoint_t *checkpoint) {
+    checkpoint_sync(checkpoint);
+    munmap(checkpoint->base, checkpoint->size);
+    free(checkpoint);
+}
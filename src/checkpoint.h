@@ -0,0 +1,51 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "utils.h"
+
+// * Checkpoint File Layout: a fixed-size file mapped MAP_SHARED and updated in place
+// *   CheckpointHeader_t
+// *   CheckpointEntry_t entries[entry_count]   (one per wanted file)
+#define CHECKPOINT_MAGIC 0x54504b43u // * "CKPT"
+#define CHECKPOINT_VERSION 2
+
+typedef struct CheckpointHeader_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t max_chunks;
+    int32_t client_id;
+    uint32_t entry_count;
+    uint64_t fingerprint; // * of the wanted files, rejects a checkpoint left by another manifest
+    uint64_t generation;  // * bumped on every sync
+} CheckpointHeader_t;
+
+typedef struct CheckpointEntry_t {
+    int32_t file_id;
+    uint32_t swarm_version; // * version of the swarm list the segments were downloaded from
+    uint64_t have[SEGMENT_WORDS];
+    Digest_t root; // * of the file the segments belong to
+    FileSegment_t segments[MAX_CHUNKS]; // * the file's Merkle tree as far as it was known (see FileData_t)
+    Digest_t inner[MERKLE_INNER];
+} CheckpointEntry_t;
+
+typedef struct Checkpoint_t {
+    uint8_t *base;
+    size_t size;
+    CheckpointHeader_t *header;
+    CheckpointEntry_t *entries;
+    unsigned int dirty; // * segments marked since the last sync
+} Checkpoint_t;
+
+Checkpoint_t *checkpoint_open(const ClientFiles_t *client, const char *dir);
+
+const CheckpointEntry_t *checkpoint_entry(const Checkpoint_t *checkpoint, int file_id);
+
+void checkpoint_mark(Checkpoint_t *checkpoint, const FileData_t *file, size_t segment_idx, uint32_t swarm_version);
+
+void checkpoint_restore_tree(const CheckpointEntry_t *entry, FileData_t *file);
+
+void checkpoint_sync(Checkpoint_t *checkpoint);
+
+void checkpoint_close(Checkpoint_t *checkpoint);
+
+#endif
@@ -0,0 +1,1035 @@
+#include "comm.h"
+#include "coroutine.h"
+#include "netem.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+
+// * Control message a worker leaves in the outbox after its last send
+#define COMM_EXIT_TAG (-1)
+// * Control message a worker leaves in the outbox once the rank has nothing left to download
+#define COMM_TERMINATION_TAG (-2)
+
+// * Idle back-off of the progress loop: yield for a while (replies usually follow quickly),
+// * then sleep for growing periods, so it does not spin on a shared core
+#define COMM_IDLE_YIELDS 64
+#define COMM_IDLE_MIN_NS 20000L
+#define COMM_IDLE_MAX_NS 1000000L
+
+// * A reply its client no longer waits for, dropped when it arrives
+typedef struct CommDiscard_t {
+    int channel;
+    int tag;
+    uint32_t request_id;
+    struct CommDiscard_t *next;
+} CommDiscard_t;
+
+// * Popped messages of one local client that nobody asked for yet, oldest first
+typedef struct CommPending_t {
+    CommMessage_t *head;
+    CommMessage_t *tail;
+    CommDiscard_t *discards;
+} CommPending_t;
+
+// * A message the link emulation holds until due_ns (a send, or an arrival from the tracker)
+typedef struct CommDelayed_t {
+    uint64_t due_ns;
+    uint64_t seq; // * order of holding, which breaks ties
+    CommMessage_t *message;
+    bool arriving;
+} CommDelayed_t;
+
+// * A client sleeping in comm_sleep until wake_ns
+typedef struct CommSleeper_t {
+    uint64_t wake_ns;
+    int client;
+} CommSleeper_t;
+
+typedef struct CommInboxState_t {
+    CommQueue_t queue; // * filled by the progress loop, and by the other worker for local clients
+    sem_t ready; // * posted once per queued message
+
+    // * Consumer only
+    CommPending_t *pending; // * one list per local id
+
+    // * Consumer only, while comm_run_clients drives the inbox: the client waiting on each
+    // * local id (-1 if none) and a FIFO of the clients that got mail since they last ran
+    int *client_of_local;
+    int *ready_clients;
+    bool *ready_queued;
+    int ready_head;
+    int ready_count;
+    int client_count;
+    int running; // * the client resumed last
+    uint64_t *wake_ns; // * when each sleeping client runs again (0 = not sleeping)
+    // * A min-heap on wake_ns of the sleepers; an entry that no longer matches wake_ns is stale
+    CommSleeper_t *sleepers;
+    int sleeper_count;
+    int sleeper_capacity;
+} CommInboxState_t;
+
+typedef struct CommEngine_t {
+    int rank;
+    int local_count; // * logical clients per rank
+    CommQueue_t outbox;
+    sem_t outbox_ready;
+    CommInboxState_t inboxes[COMM_INBOX_COUNT];
+
+    // * Progress loop only: sends posted with MPI_Isend and not completed yet
+    MPI_Request *send_requests;
+    CommMessage_t **send_messages;
+    int send_count;
+    int send_capacity;
+
+    // * Progress loop only: the termination barrier, once some worker entered it
+    MPI_Request termination;
+    bool termination_posted;
+    bool termination_done;
+
+    // * Progress loop only: the comm_barrier in progress, and the inbox waiting for it
+    MPI_Request barrier;
+    bool barrier_posted;
+    CommInbox_t barrier_inbox;
+
+    // * Progress loop only: messages held by the link emulation, a min-heap on (due_ns, seq)
+    CommDelayed_t *delayed;
+    int delayed_count;
+    int delayed_capacity;
+    uint64_t delayed_seq;
+} CommEngine_t;
+
+static CommEngine_t engine;
+
+MPI_Comm comm_channels[COMM_CHANNEL_COUNT] = {MPI_COMM_NULL, MPI_COMM_NULL, MPI_COMM_NULL};
+
+// Duplicates MPI_COMM_WORLD once per channel. Collective: every rank calls it right after MPI_Init.
+void comm_create_channels(void) {
+    for (int i = 0; i < COMM_CHANNEL_COUNT; ++i) {
+        if (MPI_Comm_dup(MPI_COMM_WORLD, &comm_channels[i]) != MPI_SUCCESS) {
+            fprintf(stderr, "Error: MPI_Comm_dup failed for channel %d.\n", i);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+}
+
+// Frees the channel communicators. Collective, before MPI_Finalize.
+void comm_free_channels(void) {
+    for (int i = 0; i < COMM_CHANNEL_COUNT; ++i) {
+        if (comm_channels[i] != MPI_COMM_NULL)
+            MPI_Comm_free(&comm_channels[i]);
+    }
+}
+
+static void queue_init(CommQueue_t *queue) {
+    atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+    queue->tail = &queue->stub;
+}
+
+// Wait-free for producers: one exchange, then the link.
+static void queue_push(CommQueue_t *queue, CommMessage_t *message) {
+    atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+    CommMessage_t *prev = atomic_exchange_explicit(&queue->head, message, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, message, memory_order_release);
+}
+
+// Returns the oldest message, or NULL if the queue is empty (or a producer is mid-push;
+// its semaphore post follows the link, so the consumer is woken up again).
+static CommMessage_t *queue_pop(CommQueue_t *queue) {
+    CommMessage_t *tail = queue->tail;
+    CommMessage_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (!next)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+        return NULL;
+
+    // tail is the last message: park the stub behind it so tail can be handed out
+    queue_push(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static CommMessage_t *message_alloc(int channel, int peer, int local, int tag, int size) {
+    CommMessage_t *message = malloc(sizeof(CommMessage_t) + (size > 0 ? size : 0));
+    if (!message) {
+        fprintf(stderr, "Error: Memory allocation failed for a message.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    message->channel = channel;
+    message->peer = peer;
+    message->local = local;
+    message->tag = tag;
+    message->size = size;
+    message->data = (char *)(message + 1);
+    return message;
+}
+
+// Segment requests (and the tracker's STOP_UPLOADING, and termination) go to the upload
+// thread; replies, ACKs and swarm lists go to the download thread.
+static CommInbox_t route_of(int channel, int tag) {
+    if (channel == COMM_PEER || (channel == COMM_CONTROL && (tag == REQUEST_TAG || tag == COMM_TERMINATE_TAG)))
+        return COMM_UPLOAD_INBOX;
+    return COMM_DOWNLOAD_INBOX;
+}
+
+static void sem_wait_retry(sem_t *sem) {
+    while (sem_wait(sem) != 0 && errno == EINTR)
+        ;
+}
+
+// Waits on sem until it is posted or the monotonic clock reaches until_ns.
+static void sem_wait_until(sem_t *sem, uint64_t until_ns) {
+    uint64_t now_ns = counters_now_ns();
+    if (until_ns <= now_ns)
+        return;
+
+    // sem_timedwait takes a wall-clock deadline
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nsec = (uint64_t)deadline.tv_nsec + (until_ns - now_ns);
+    deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+    deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+    while (sem_timedwait(sem, &deadline) != 0 && errno == EINTR)
+        ;
+}
+
+// Sets up the queues. Call on the main thread before starting any worker.
+void comm_start(void) {
+    memset(&engine, 0, sizeof(engine));
+    MPI_Comm_rank(MPI_COMM_WORLD, &engine.rank);
+    engine.local_count = options.clients_per_rank;
+    queue_init(&engine.outbox);
+    sem_init(&engine.outbox_ready, 0, 0);
+
+    for (int i = 0; i < COMM_INBOX_COUNT; ++i) {
+        queue_init(&engine.inboxes[i].queue);
+        sem_init(&engine.inboxes[i].ready, 0, 0);
+        engine.inboxes[i].pending = calloc(engine.local_count, sizeof(CommPending_t));
+        if (!engine.inboxes[i].pending) {
+            fprintf(stderr, "Error: Memory allocation failed for inbox lists.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+}
+
+// Hands a message straight to the inbox of its channel and tag.
+static void deliver_local(CommMessage_t *message) {
+    CommInboxState_t *box = &engine.inboxes[route_of(message->channel, message->tag)];
+    queue_push(&box->queue, message);
+    sem_post(&box->ready);
+}
+
+// Queues a send to client dest_local of rank dest. The payload is copied, so the call never
+// blocks (like a buffered MPI_Send). Messages between clients of this rank skip MPI and go
+// straight to the receiving worker. Returns MPI_SUCCESS.
+int comm_send(CommChannel_t channel, int dest, int dest_local, int tag, const void *data, int size) {
+    CommMessage_t *message = message_alloc(channel, dest, dest_local, tag, size);
+    if (size > 0)
+        memcpy(message->data, data, size);
+    counters_sent(tag, size);
+
+    if (dest == engine.rank) {
+        // The source of the delivered message is this rank, the same as its destination
+        deliver_local(message);
+        return MPI_SUCCESS;
+    }
+
+    queue_push(&engine.outbox, message);
+    sem_post(&engine.outbox_ready);
+    return MPI_SUCCESS;
+}
+
+// Tells the progress loop this worker will not send anything else.
+void comm_worker_exit(void) {
+    queue_push(&engine.outbox, message_alloc(COMM_CONTROL, MPI_PROC_NULL, 0, COMM_EXIT_TAG, 0));
+    sem_post(&engine.outbox_ready);
+}
+
+// Tells the progress loop this rank has nothing left to download. Once every rank (and the
+// tracker) did, each local client of the upload inbox gets a COMM_TERMINATE_TAG message.
+void comm_enter_termination(void) {
+    queue_push(&engine.outbox, message_alloc(COMM_CONTROL, MPI_PROC_NULL, 0, COMM_TERMINATION_TAG, 0));
+    sem_post(&engine.outbox_ready);
+}
+
+// Waits until every rank (and the tracker) entered the barrier: a collective on the control
+// channel, run by the progress loop. For a worker thread outside comm_run_clients, receiving
+// on inbox (as local 0).
+void comm_barrier(CommInbox_t inbox) {
+    CommMessage_t *message = message_alloc(COMM_CONTROL, MPI_PROC_NULL, 0, COMM_BARRIER_TAG, 0);
+    message->peer = inbox; // * the inbox to wake up, for the progress loop
+    queue_push(&engine.outbox, message);
+    sem_post(&engine.outbox_ready);
+
+    comm_recv(inbox, 0, COMM_CONTROL, MPI_ANY_SOURCE, COMM_BARRIER_TAG, NULL, 0, NULL, COUNTER_SITE_BARRIER);
+}
+
+// * What a receive waits for; request_id is compared only when has_request_id is set
+typedef struct CommMatch_t {
+    int channel;
+    int source;
+    int tag;
+    bool has_request_id;
+    uint32_t request_id;
+} CommMatch_t;
+
+static bool message_matches(const CommMessage_t *message, const CommMatch_t *match) {
+    if ((match->channel != COMM_ANY_CHANNEL && message->channel != match->channel) ||
+        (match->source != MPI_ANY_SOURCE && message->peer != match->source) ||
+        (match->tag != MPI_ANY_TAG && message->tag != match->tag))
+        return false;
+    if (!match->has_request_id)
+        return true;
+
+    // Replies start with the id of the request they answer
+    uint32_t request_id;
+    if (message->size < (int)sizeof(request_id))
+        return false;
+    memcpy(&request_id, message->data, sizeof(request_id));
+    return request_id == match->request_id;
+}
+
+// Unlinks the oldest pending message that fits match, if there is one.
+static CommMessage_t *take_unmatched(CommPending_t *pending, const CommMatch_t *match) {
+    CommMessage_t *prev = NULL;
+    for (CommMessage_t *message = pending->head; message;
+         prev = message, message = atomic_load_explicit(&message->next, memory_order_relaxed)) {
+        if (!message_matches(message, match))
+            continue;
+
+        CommMessage_t *next = atomic_load_explicit(&message->next, memory_order_relaxed);
+        if (prev)
+            atomic_store_explicit(&prev->next, next, memory_order_relaxed);
+        else
+            pending->head = next;
+        if (pending->tail == message)
+            pending->tail = prev;
+        return message;
+    }
+    return NULL;
+}
+
+static void append_unmatched(CommPending_t *pending, CommMessage_t *message) {
+    atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+    if (pending->tail)
+        atomic_store_explicit(&pending->tail->next, message, memory_order_relaxed);
+    else
+        pending->head = message;
+    pending->tail = message;
+}
+
+// Frees message if its client gave up on it (see comm_discard_reply). Returns true if it did.
+static bool drop_discarded(CommPending_t *pending, CommMessage_t *message) {
+    for (CommDiscard_t **link = &pending->discards; *link; link = &(*link)->next) {
+        CommDiscard_t *discard = *link;
+        CommMatch_t match = {.channel = discard->channel, .source = MPI_ANY_SOURCE, .tag = discard->tag,
+                             .has_request_id = true, .request_id = discard->request_id};
+        if (!message_matches(message, &match))
+            continue;
+
+        *link = discard->next;
+        free(discard);
+        counters_received(message->tag, message->size);
+        free(message);
+        return true;
+    }
+    return false;
+}
+
+// Queues a client of comm_run_clients to run, unless it is queued already.
+static void make_ready(CommInboxState_t *box, int client) {
+    if (box->ready_queued[client])
+        return;
+    box->ready_queued[client] = true;
+    box->ready_clients[(box->ready_head + box->ready_count) % box->client_count] = client;
+    box->ready_count++;
+}
+
+// Moves everything queued for the inbox to the pending lists of the local clients, waking
+// the client that waits on each. Returns how many messages were moved.
+static int drain_inbox(CommInboxState_t *box) {
+    int drained = 0;
+    CommMessage_t *message;
+
+    while ((message = queue_pop(&box->queue))) {
+        drained++;
+        if (message->local < 0 || message->local >= engine.local_count) {
+            fprintf(stderr, "Dropping message for unknown local client %d.\n", message->local);
+            free(message);
+            continue;
+        }
+        CommPending_t *pending = &box->pending[message->local];
+        if (pending->discards && drop_discarded(pending, message))
+            continue;
+        append_unmatched(pending, message);
+        if (box->client_of_local && box->client_of_local[message->local] >= 0)
+            make_ready(box, box->client_of_local[message->local]);
+    }
+    return drained;
+}
+
+// Copies a received message out to the caller and frees it. Returns MPI_ERR_TRUNCATE if it is
+// larger than max_size, MPI_SUCCESS otherwise.
+static int take_message(CommMessage_t *message, void *data, int max_size, CommStatus_t *status) {
+    counters_received(message->tag, message->size);
+
+    int copied = message->size < max_size ? message->size : max_size;
+    if (copied > 0)
+        memcpy(data, message->data, copied);
+    if (status) {
+        status->channel = message->channel;
+        status->source = message->peer;
+        status->tag = message->tag;
+        status->size = copied;
+    }
+
+    int result = message->size > max_size ? MPI_ERR_TRUNCATE : MPI_SUCCESS;
+    free(message);
+    return result;
+}
+
+// Waits until a matching message for client local reaches the inbox. A client run by
+// comm_run_clients yields to the other clients of its worker meanwhile; a plain thread blocks.
+// The wait is counted at site. Returns MPI_ERR_TRUNCATE if the message is larger than max_size,
+// MPI_SUCCESS otherwise.
+static int receive_matching(CommInbox_t inbox, int local, const CommMatch_t *match, void *data, int max_size,
+                            CommStatus_t *status, CounterSite_t site) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    CommPending_t *pending = &box->pending[local];
+    CommMessage_t *message = take_unmatched(pending, match);
+    uint64_t waiting_since = message ? 0 : counters_now_ns();
+
+    while (!message) {
+        // Whoever drained the queue (this worker's scheduler, or this client before it
+        // yielded) may have left the message in the pending list
+        if (drain_inbox(box) == 0) {
+            if (coroutine_running())
+                coroutine_yield();
+            else
+                sem_wait_retry(&box->ready);
+        }
+        message = take_unmatched(pending, match);
+    }
+    counters_receive(site, waiting_since);
+    return take_message(message, data, max_size, status);
+}
+
+// Waits until a message for client local on channel (or COMM_ANY_CHANNEL) from source rank
+// (or MPI_ANY_SOURCE) with tag (or MPI_ANY_TAG) reaches the inbox.
+// Messages of one channel, source and tag arrive in order.
+int comm_recv(CommInbox_t inbox, int local, int channel, int source, int tag, void *data, int max_size,
+              CommStatus_t *status, CounterSite_t site) {
+    CommMatch_t match = {.channel = channel, .source = source, .tag = tag};
+    return receive_matching(inbox, local, &match, data, max_size, status, site);
+}
+
+// Like comm_recv, but only takes the reply to request_id, so replies to several requests in
+// flight can arrive in any order.
+int comm_recv_reply(CommInbox_t inbox, int local, int channel, int source, int tag, uint32_t request_id,
+                    void *data, int max_size, CommStatus_t *status, CounterSite_t site) {
+    CommMatch_t match = {.channel = channel, .source = source, .tag = tag,
+                         .has_request_id = true, .request_id = request_id};
+    return receive_matching(inbox, local, &match, data, max_size, status, site);
+}
+
+/*
+ * Drops the reply to request_id for client local, which the client no longer waits for: at
+ * once if it reached the inbox already, or else as soon as it does, so it does not linger in
+ * the pending list.
+ */
+void comm_discard_reply(CommInbox_t inbox, int local, int channel, int tag, uint32_t request_id) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    CommPending_t *pending = &box->pending[local];
+    CommMatch_t match = {.channel = channel, .source = MPI_ANY_SOURCE, .tag = tag,
+                         .has_request_id = true, .request_id = request_id};
+    drain_inbox(box);
+    CommMessage_t *message = take_unmatched(pending, &match);
+    if (message) {
+        counters_received(message->tag, message->size);
+        free(message);
+        return;
+    }
+
+    CommDiscard_t *discard = malloc(sizeof(CommDiscard_t));
+    if (!discard) {
+        fprintf(stderr, "Error: Memory allocation failed for a discarded reply.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    *discard = (CommDiscard_t){.channel = channel, .tag = tag, .request_id = request_id, .next = pending->discards};
+    pending->discards = discard;
+}
+
+/*
+ * Forgets the replies client local gave up on that have not arrived yet, once the requests they
+ * answer are over (the file is complete, or the client stopped downloading): their holders may
+ * never send them.
+ */
+void comm_forget_discards(CommInbox_t inbox, int local) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    CommPending_t *pending = &box->pending[local];
+    if (!pending->discards)
+        return;
+
+    drain_inbox(box);
+    while (pending->discards) {
+        CommDiscard_t *next = pending->discards->next;
+        free(pending->discards);
+        pending->discards = next;
+    }
+}
+
+/*
+ * Like comm_recv, but never waits: returns false if no matching message for client local has
+ * reached the inbox yet, and true (with *result set like comm_recv's) if it took one.
+ */
+bool comm_poll(CommInbox_t inbox, int local, int channel, int source, int tag, void *data, int max_size,
+               CommStatus_t *status, int *result) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    CommMatch_t match = {.channel = channel, .source = source, .tag = tag};
+    drain_inbox(box);
+    CommMessage_t *message = take_unmatched(&box->pending[local], &match);
+    if (!message)
+        return false;
+    *result = take_message(message, data, max_size, status);
+    return true;
+}
+
+/*
+ * Lets the other clients of the calling worker run before the caller goes on, for a client
+ * that waits on another client's progress rather than on a message. round counts the caller's
+ * pauses in a row: after the first few it also sleeps, for growing periods (up to 1 ms).
+ */
+void comm_pause(CommInbox_t inbox, unsigned int round) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    if (coroutine_running()) {
+        drain_inbox(box);
+        make_ready(box, box->running);
+        coroutine_yield();
+    }
+    if (round < COMM_IDLE_YIELDS / 8)
+        return;
+
+    long idle_ns = COMM_IDLE_MIN_NS << MIN(round - COMM_IDLE_YIELDS / 8, 6u);
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = MIN(idle_ns, COMM_IDLE_MAX_NS)};
+    nanosleep(&pause, NULL);
+}
+
+static void push_sleeper(CommInboxState_t *box, int client, uint64_t wake_ns) {
+    if (box->sleeper_count == box->sleeper_capacity) {
+        int capacity = box->sleeper_capacity ? box->sleeper_capacity * 2 : MAX(box->client_count, 1);
+        CommSleeper_t *sleepers = realloc(box->sleepers, sizeof(CommSleeper_t) * capacity);
+        if (!sleepers) {
+            fprintf(stderr, "Error: Memory allocation failed for sleeping clients.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        box->sleepers = sleepers;
+        box->sleeper_capacity = capacity;
+    }
+
+    CommSleeper_t entry = {.wake_ns = wake_ns, .client = client};
+    int slot = box->sleeper_count++;
+    while (slot > 0 && entry.wake_ns < box->sleepers[(slot - 1) / 2].wake_ns) {
+        box->sleepers[slot] = box->sleepers[(slot - 1) / 2];
+        slot = (slot - 1) / 2;
+    }
+    box->sleepers[slot] = entry;
+}
+
+static void pop_sleeper(CommInboxState_t *box) {
+    CommSleeper_t last = box->sleepers[--box->sleeper_count];
+    int slot = 0;
+    while (true) {
+        int child = 2 * slot + 1;
+        if (child >= box->sleeper_count)
+            break;
+        if (child + 1 < box->sleeper_count && box->sleepers[child + 1].wake_ns < box->sleepers[child].wake_ns)
+            child++;
+        if (box->sleepers[child].wake_ns >= last.wake_ns)
+            break;
+        box->sleepers[slot] = box->sleepers[child];
+        slot = child;
+    }
+    box->sleepers[slot] = last;
+}
+
+/*
+ * Lets the caller sleep until the monotonic clock reaches until_ns (see counters_now_ns). A
+ * client run by comm_run_clients yields, and its worker runs the other clients meanwhile or
+ * sleeps on the inbox until the first sleeper is due; a plain thread sleeps.
+ */
+void comm_sleep(CommInbox_t inbox, uint64_t until_ns) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    uint64_t now_ns;
+    while ((now_ns = counters_now_ns()) < until_ns) {
+        if (!coroutine_running()) {
+            uint64_t left_ns = until_ns - now_ns;
+            struct timespec pause = {.tv_sec = (time_t)(left_ns / 1000000000ULL),
+                                     .tv_nsec = (long)(left_ns % 1000000000ULL)};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // A message for the client may run it early: it goes back to sleep then, on the same entry
+        int client = box->running;
+        if (box->wake_ns[client] != until_ns) {
+            box->wake_ns[client] = until_ns;
+            push_sleeper(box, client, until_ns);
+        }
+        coroutine_yield();
+    }
+    if (coroutine_running())
+        box->wake_ns[box->running] = 0;
+}
+
+// Queues the sleeping clients that are due. Returns when the next one is due (0 = none sleeps).
+static uint64_t wake_sleepers(CommInboxState_t *box) {
+    uint64_t now_ns = counters_now_ns();
+    while (box->sleeper_count > 0) {
+        CommSleeper_t top = box->sleepers[0];
+        bool stale = box->wake_ns[top.client] != top.wake_ns;
+        if (!stale && top.wake_ns > now_ns)
+            return top.wake_ns;
+        pop_sleeper(box);
+        if (!stale)
+            make_ready(box, top.client);
+    }
+    return 0;
+}
+
+/*
+ * Runs func(clients[i]) for every client as a coroutine on the calling worker, until all of
+ * them have returned. clients[i] receives on this inbox as local id locals[i]. A client that
+ * waits for a message yields, and runs again once a message for its local id arrives; when
+ * no client can run, the worker sleeps on the inbox.
+ */
+void comm_run_clients(CommInbox_t inbox, CommClientFunc_t func, void **clients, const int *locals, int count) {
+    CommInboxState_t *box = &engine.inboxes[inbox];
+    Coroutine_t **coroutines = calloc(count ? count : 1, sizeof(Coroutine_t *));
+    bool *finished = calloc(count ? count : 1, sizeof(bool));
+    box->client_of_local = malloc(sizeof(int) * engine.local_count);
+    box->ready_clients = malloc(sizeof(int) * (count ? count : 1));
+    box->ready_queued = calloc(count ? count : 1, sizeof(bool));
+    box->wake_ns = calloc(count ? count : 1, sizeof(uint64_t));
+    if (!coroutines || !finished || !box->client_of_local || !box->ready_clients || !box->ready_queued ||
+        !box->wake_ns) {
+        fprintf(stderr, "Error: Memory allocation failed for local clients.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    box->ready_head = 0;
+    box->ready_count = 0;
+    box->client_count = count;
+    box->sleeper_count = 0;
+
+    for (int local = 0; local < engine.local_count; ++local)
+        box->client_of_local[local] = -1;
+    for (int i = 0; i < count; ++i) {
+        assert(locals[i] >= 0 && locals[i] < engine.local_count);
+        coroutines[i] = coroutine_create(func, clients[i], COROUTINE_STACK_SIZE);
+        box->client_of_local[locals[i]] = i;
+        make_ready(box, i);
+    }
+
+    int remaining = count;
+    while (remaining > 0) {
+        uint64_t next_wake_ns = box->sleeper_count > 0 ? wake_sleepers(box) : 0;
+        if (box->ready_count == 0) {
+            if (drain_inbox(box) == 0) {
+                if (next_wake_ns)
+                    sem_wait_until(&box->ready, next_wake_ns);
+                else
+                    sem_wait_retry(&box->ready);
+            }
+            continue;
+        }
+
+        int client = box->ready_clients[box->ready_head];
+        box->ready_head = (box->ready_head + 1) % count;
+        box->ready_count--;
+        box->ready_queued[client] = false;
+        if (finished[client])
+            continue;
+
+        box->running = client;
+        if (coroutine_resume(coroutines[client])) {
+            finished[client] = true;
+            box->client_of_local[locals[client]] = -1;
+            remaining--;
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+        coroutine_destroy(coroutines[i]);
+    free(coroutines);
+    free(finished);
+    free(box->client_of_local);
+    free(box->ready_clients);
+    free(box->ready_queued);
+    free(box->wake_ns);
+    free(box->sleepers);
+    box->client_of_local = NULL;
+    box->ready_clients = NULL;
+    box->ready_queued = NULL;
+    box->wake_ns = NULL;
+    box->sleepers = NULL;
+    box->sleeper_capacity = 0;
+}
+
+static void post_send(CommMessage_t *message) {
+    if (engine.send_count == engine.send_capacity) {
+        int capacity = engine.send_capacity ? engine.send_capacity * 2 : MAX_CHUNKS;
+        MPI_Request *requests = realloc(engine.send_requests, sizeof(MPI_Request) * capacity);
+        CommMessage_t **messages = realloc(engine.send_messages, sizeof(CommMessage_t *) * capacity);
+        if (!requests || !messages) {
+            fprintf(stderr, "Error: Memory allocation failed for pending sends.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        engine.send_requests = requests;
+        engine.send_messages = messages;
+        engine.send_capacity = capacity;
+    }
+
+    int slot = engine.send_count++;
+    engine.send_messages[slot] = message;
+    if (MPI_Isend(message->data, message->size, MPI_BYTE, message->peer, COMM_WIRE_TAG(message->tag, message->local),
+                  comm_channels[message->channel], &engine.send_requests[slot]) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Isend failed while sending to %d.\n", message->peer);
+        engine.send_requests[slot] = MPI_REQUEST_NULL;
+    }
+}
+
+static bool delayed_before(const CommDelayed_t *a, const CommDelayed_t *b) {
+    return a->due_ns < b->due_ns || (a->due_ns == b->due_ns && a->seq < b->seq);
+}
+
+// Holds message until due_ns: then an arriving one goes to its inbox, any other one is sent.
+static void hold_message(CommMessage_t *message, uint64_t due_ns, bool arriving) {
+    if (engine.delayed_count == engine.delayed_capacity) {
+        int capacity = engine.delayed_capacity ? engine.delayed_capacity * 2 : MAX_CHUNKS;
+        CommDelayed_t *delayed = realloc(engine.delayed, sizeof(CommDelayed_t) * capacity);
+        if (!delayed) {
+            fprintf(stderr, "Error: Memory allocation failed for delayed messages.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        engine.delayed = delayed;
+        engine.delayed_capacity = capacity;
+    }
+
+    CommDelayed_t entry = {.due_ns = due_ns, .seq = engine.delayed_seq++, .message = message, .arriving = arriving};
+    int slot = engine.delayed_count++;
+    while (slot > 0 && delayed_before(&entry, &engine.delayed[(slot - 1) / 2])) {
+        engine.delayed[slot] = engine.delayed[(slot - 1) / 2];
+        slot = (slot - 1) / 2;
+    }
+    engine.delayed[slot] = entry;
+}
+
+static void pop_delayed(void) {
+    CommDelayed_t last = engine.delayed[--engine.delayed_count];
+    int slot = 0;
+    while (true) {
+        int child = 2 * slot + 1;
+        if (child >= engine.delayed_count)
+            break;
+        if (child + 1 < engine.delayed_count && delayed_before(&engine.delayed[child + 1], &engine.delayed[child]))
+            child++;
+        if (!delayed_before(&engine.delayed[child], &last))
+            break;
+        engine.delayed[slot] = engine.delayed[child];
+        slot = child;
+    }
+    engine.delayed[slot] = last;
+}
+
+// Sends or delivers every held message that is due. Returns true if there was any.
+static bool release_delayed(void) {
+    if (engine.delayed_count == 0)
+        return false;
+
+    bool released = false;
+    uint64_t now = counters_now_ns();
+    while (engine.delayed_count > 0 && engine.delayed[0].due_ns <= now) {
+        CommDelayed_t entry = engine.delayed[0];
+        pop_delayed();
+        if (entry.arriving)
+            deliver_local(entry.message);
+        else
+            post_send(entry.message);
+        released = true;
+    }
+    return released;
+}
+
+// Posts a send, unless its link is emulated: then it goes out once the link would have
+// carried it.
+static void send_or_hold(CommMessage_t *message) {
+    if (netem_shapes(engine.rank, message->peer))
+        hold_message(message, netem_due(engine.rank, message->peer, message->size, counters_now_ns()), false);
+    else
+        post_send(message);
+}
+
+// Frees the messages of completed sends. Returns true if any completed.
+static bool complete_sends(void) {
+    if (engine.send_count == 0)
+        return false;
+
+    int completed = 0;
+    int flag = 0;
+    if (MPI_Testall(engine.send_count, engine.send_requests, &flag, MPI_STATUSES_IGNORE) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Testall failed in progress loop.\n");
+    }
+
+    // Requests that completed were set to MPI_REQUEST_NULL; keep the others in order
+    int kept = 0;
+    for (int i = 0; i < engine.send_count; ++i) {
+        if (engine.send_requests[i] == MPI_REQUEST_NULL) {
+            free(engine.send_messages[i]);
+            completed++;
+            continue;
+        }
+        engine.send_requests[kept] = engine.send_requests[i];
+        engine.send_messages[kept] = engine.send_messages[i];
+        kept++;
+    }
+    engine.send_count = kept;
+    return completed > 0;
+}
+
+// Receives one message that MPI_Iprobe found and hands it to the inbox of its channel and tag.
+static void deliver(int channel, const MPI_Status *probe_status) {
+    int size = 0;
+    MPI_Get_count(probe_status, MPI_BYTE, &size);
+
+    // The wire tag carries the protocol tag and the local id of the receiving client
+    int wire_tag = probe_status->MPI_TAG;
+    CommMessage_t *message = message_alloc(channel, probe_status->MPI_SOURCE, wire_tag / COMM_TAG_STRIDE,
+                                           wire_tag % COMM_TAG_STRIDE, size);
+    if (MPI_Recv(message->data, size, MPI_BYTE, message->peer, wire_tag, comm_channels[channel],
+                 MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Recv failed in progress loop.\n");
+        free(message);
+        return;
+    }
+
+    // The tracker sends with plain MPI, so its links are emulated here, on arrival
+    if (message->peer == TRACKER_RANK && netem_shapes(TRACKER_RANK, engine.rank)) {
+        hold_message(message, netem_due(TRACKER_RANK, engine.rank, size, counters_now_ns()), true);
+        return;
+    }
+    deliver_local(message);
+}
+
+// Enters the termination barrier on the control channel without blocking.
+static void post_termination(void) {
+    if (engine.termination_posted)
+        return;
+    if (MPI_Ibarrier(CONTROL_COMM, &engine.termination) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Ibarrier failed while entering termination.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    engine.termination_posted = true;
+}
+
+// Once the termination barrier completes, tells every local uploader to stop. Returns true
+// if it completed in this call.
+static bool complete_termination(void) {
+    if (!engine.termination_posted || engine.termination_done)
+        return false;
+
+    int flag = 0;
+    if (MPI_Test(&engine.termination, &flag, MPI_STATUS_IGNORE) != MPI_SUCCESS || !flag)
+        return false;
+
+    engine.termination_done = true;
+    for (int local = 0; local < engine.local_count; ++local)
+        deliver_local(message_alloc(COMM_CONTROL, engine.rank, local, COMM_TERMINATE_TAG, 0));
+    return true;
+}
+
+// Enters a comm_barrier on the control channel without blocking.
+static void post_barrier(CommInbox_t inbox) {
+    if (MPI_Ibarrier(CONTROL_COMM, &engine.barrier) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Ibarrier failed while entering a barrier.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    engine.barrier_posted = true;
+    engine.barrier_inbox = inbox;
+}
+
+// Wakes up the worker waiting in comm_barrier once the barrier completes. Returns true if it
+// completed in this call.
+static bool complete_barrier(void) {
+    if (!engine.barrier_posted)
+        return false;
+
+    int flag = 0;
+    if (MPI_Test(&engine.barrier, &flag, MPI_STATUS_IGNORE) != MPI_SUCCESS || !flag)
+        return false;
+
+    engine.barrier_posted = false;
+    CommInboxState_t *box = &engine.inboxes[engine.barrier_inbox];
+    queue_push(&box->queue, message_alloc(COMM_CONTROL, engine.rank, 0, COMM_BARRIER_TAG, 0));
+    sem_post(&box->ready);
+    return true;
+}
+
+// Sleeps until a worker queues something or the timeout expires.
+static void wait_for_outbox(long timeout_ns) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += timeout_ns;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(&engine.outbox_ready, &deadline) != 0 && errno == EINTR)
+        ;
+}
+
+// Progress loop, run by the main thread: posts queued sends, receives and routes incoming
+// messages and completes sends, until all workers have exited, every held or posted send has
+// completed and the termination barrier (if a worker entered it) has completed. Returns how many seconds
+// the rank spent waiting for the barrier after its last worker had exited.
+double comm_progress(int workers) {
+    int exited = 0;
+    int idle_rounds = 0;
+    long idle_ns = 0;
+    double workers_done = workers == 0 ? MPI_Wtime() : 0;
+    double idle_time = 0;
+
+    while (exited < workers || engine.send_count > 0 || engine.delayed_count > 0 ||
+           (engine.termination_posted && !engine.termination_done)) {
+        bool active = false;
+
+        CommMessage_t *message;
+        while ((message = queue_pop(&engine.outbox))) {
+            active = true;
+            if (message->tag == COMM_EXIT_TAG || message->tag == COMM_TERMINATION_TAG || message->tag == COMM_BARRIER_TAG) {
+                if (message->tag == COMM_TERMINATION_TAG)
+                    post_termination();
+                else if (message->tag == COMM_BARRIER_TAG)
+                    post_barrier((CommInbox_t)message->peer);
+                else if (++exited == workers)
+                    workers_done = MPI_Wtime();
+                free(message);
+                continue;
+            }
+            send_or_hold(message);
+        }
+
+        for (int channel = 0; channel < COMM_CHANNEL_COUNT; ++channel) {
+            int flag = 0;
+            MPI_Status probe_status;
+            while (MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm_channels[channel], &flag, &probe_status) == MPI_SUCCESS && flag) {
+                deliver(channel, &probe_status);
+                active = true;
+            }
+        }
+
+        if (release_delayed())
+            active = true;
+
+        if (complete_sends())
+            active = true;
+
+        if (complete_barrier())
+            active = true;
+
+        if (complete_termination()) {
+            active = true;
+            if (exited == workers)
+                idle_time = MPI_Wtime() - workers_done;
+        }
+
+        if (active) {
+            idle_rounds = 0;
+            idle_ns = 0;
+            continue;
+        }
+        if (++idle_rounds <= COMM_IDLE_YIELDS) {
+            sched_yield();
+            continue;
+        }
+        idle_ns = idle_ns ? (idle_ns * 2 < COMM_IDLE_MAX_NS ? idle_ns * 2 : COMM_IDLE_MAX_NS) : COMM_IDLE_MIN_NS;
+
+        // Wake up in time for the next held message
+        long timeout_ns = idle_ns;
+        if (engine.delayed_count > 0) {
+            uint64_t now = counters_now_ns();
+            uint64_t due = engine.delayed[0].due_ns;
+            timeout_ns = due > now ? (long)MIN(due - now, (uint64_t)idle_ns) : 0;
+        }
+        if (timeout_ns > 0)
+            wait_for_outbox(timeout_ns);
+    }
+    return idle_time;
+}
+
+// Waits for request like MPI_Wait, but sleeps between tests instead of spinning on a core
+// the clients may need.
+void comm_wait(MPI_Request *request) {
+    long idle_ns = COMM_IDLE_MIN_NS;
+    int flag = 0;
+
+    while (MPI_Test(request, &flag, MPI_STATUS_IGNORE) == MPI_SUCCESS && !flag) {
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = idle_ns};
+        nanosleep(&pause, NULL);
+        idle_ns = idle_ns * 2 < COMM_IDLE_MAX_NS ? idle_ns * 2 : COMM_IDLE_MAX_NS;
+    }
+}
+
+static void free_queue(CommQueue_t *queue) {
+    CommMessage_t *message;
+    while ((message = queue_pop(queue)))
+        free(message);
+}
+
+// Frees whatever was never consumed. Call after the workers have been joined.
+void comm_stop(void) {
+    free_queue(&engine.outbox);
+    sem_destroy(&engine.outbox_ready);
+
+    for (int i = 0; i < COMM_INBOX_COUNT; ++i) {
+        CommInboxState_t *box = &engine.inboxes[i];
+        free_queue(&box->queue);
+        for (int local = 0; local < engine.local_count; ++local) {
+            CommPending_t *pending = &box->pending[local];
+            while (pending->head) {
+                CommMessage_t *next = atomic_load_explicit(&pending->head->next, memory_order_relaxed);
+                free(pending->head);
+                pending->head = next;
+            }
+            while (pending->discards) {
+                CommDiscard_t *next = pending->discards->next;
+                free(pending->discards);
+                pending->discards = next;
+            }
+        }
+        free(box->pending);
+        sem_destroy(&box->ready);
+    }
+
+    for (int i = 0; i < engine.delayed_count; ++i)
+        free(engine.delayed[i].message);
+    free(engine.delayed);
+    free(engine.send_requests);
+    free(engine.send_messages);
+    memset(&engine, 0, sizeof(engine));
+}
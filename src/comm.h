@@ -0,0 +1,129 @@
+#ifndef _COMM_H_
+#define _COMM_H_
+
+#include "utils.h"
+#include "options.h"
+#include "counters.h"
+
+#include <stdatomic.h>
+
+// * Per-rank Communication Engine
+// * Only the main thread calls MPI (MPI_THREAD_FUNNELED). Worker threads hand their sends to
+// * it through one lock-free MPSC outbox and get their messages from per-worker inboxes that
+// * the main thread fills (and the other worker, for messages between clients of this rank).
+
+// * Logical Clients: rank r hosts the clients with ids (r - 1) * K + 1 .. r * K, where K is
+// * options.clients_per_rank, so with K = 1 a client's id is its rank. The engine addresses
+// * them as (rank, local id); the local id travels in the MPI tag, above the protocol tag.
+#define COMM_TAG_STRIDE 8 // * every protocol tag in utils.h is below this
+#define COMM_WIRE_TAG(tag, local) ((tag) + COMM_TAG_STRIDE * (local))
+
+static inline int client_rank_of(int client_id) {
+    return (client_id - 1) / options.clients_per_rank + 1;
+}
+
+static inline int client_local_of(int client_id) {
+    return (client_id - 1) % options.clients_per_rank;
+}
+
+static inline int client_id_of(int rank, int local) {
+    return (rank - 1) * options.clients_per_rank + local + 1;
+}
+
+// * Channels: one duplicated communicator per protocol role, so every receive only scans
+// * the traffic of its role
+typedef enum CommChannel_t {
+    COMM_CONTROL = 0, // * client <-> tracker: registration, swarm lists, announces, ACKs
+    COMM_PEER, // * segment requests between clients
+    COMM_DATA, // * segment replies between clients
+    COMM_CHANNEL_COUNT
+} CommChannel_t;
+
+#define COMM_ANY_CHANNEL (-1)
+
+// * Tag of the message every local uploader gets once all ranks entered termination
+#define COMM_TERMINATE_TAG (-3)
+// * Tag of the message that completes comm_barrier
+#define COMM_BARRIER_TAG (-4)
+
+extern MPI_Comm comm_channels[COMM_CHANNEL_COUNT];
+
+#define CONTROL_COMM (comm_channels[COMM_CONTROL])
+#define PEER_COMM (comm_channels[COMM_PEER])
+#define DATA_COMM (comm_channels[COMM_DATA])
+
+// * Worker Inboxes (messages are routed by channel and tag)
+typedef enum CommInbox_t {
+    COMM_DOWNLOAD_INBOX = 0,
+    COMM_UPLOAD_INBOX,
+    COMM_INBOX_COUNT
+} CommInbox_t;
+
+// * Queued Message (header and payload share one allocation)
+typedef struct CommMessage_t {
+    struct CommMessage_t *_Atomic next;
+    int channel;
+    int peer; // * destination of a send, source of a received message
+    int local; // * local id of the client the message is for
+    int tag; // * protocol tag, without the local id
+    int size;
+    char *data; // * points just past the header
+} CommMessage_t;
+
+// * Intrusive Lock-free Queue (Vyukov): any number of producers, one consumer
+typedef struct CommQueue_t {
+    CommMessage_t *_Atomic head; // * producers swap themselves in here
+    CommMessage_t *tail; // * consumer side
+    CommMessage_t stub;
+} CommQueue_t;
+
+// * Receive Status (what MPI_Status would hold)
+typedef struct CommStatus_t {
+    int channel;
+    int source;
+    int tag;
+    int size;
+} CommStatus_t;
+
+void comm_create_channels(void);
+
+void comm_free_channels(void);
+
+void comm_start(void);
+
+int comm_send(CommChannel_t channel, int dest, int dest_local, int tag, const void *data, int size);
+
+int comm_recv(CommInbox_t inbox, int local, int channel, int source, int tag, void *data, int max_size,
+              CommStatus_t *status, CounterSite_t site);
+
+int comm_recv_reply(CommInbox_t inbox, int local, int channel, int source, int tag, uint32_t request_id,
+                    void *data, int max_size, CommStatus_t *status, CounterSite_t site);
+
+void comm_discard_reply(CommInbox_t inbox, int local, int channel, int tag, uint32_t request_id);
+
+void comm_forget_discards(CommInbox_t inbox, int local);
+
+bool comm_poll(CommInbox_t inbox, int local, int channel, int source, int tag, void *data, int max_size,
+               CommStatus_t *status, int *result);
+
+typedef void (*CommClientFunc_t)(void *client);
+
+void comm_run_clients(CommInbox_t inbox, CommClientFunc_t func, void **clients, const int *locals, int count);
+
+void comm_worker_exit(void);
+
+void comm_enter_termination(void);
+
+void comm_barrier(CommInbox_t inbox);
+
+void comm_pause(CommInbox_t inbox, unsigned int round);
+
+void comm_sleep(CommInbox_t inbox, uint64_t until_ns);
+
+double comm_progress(int workers);
+
+void comm_wait(MPI_Request *request);
+
+void comm_stop(void);
+
+#endif
@@ -0,0 +1,87 @@
+#include "coroutine.h"
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+struct Coroutine_t {
+    ucontext_t context;
+    ucontext_t caller; // * where coroutine_yield returns to
+    CoroutineFunc_t func;
+    void *arg;
+    void *stack; // * mapping, lowest page is a guard
+    size_t stack_size;
+    bool finished;
+};
+
+// * The coroutine this thread is running (NULL on the thread's own stack)
+static __thread Coroutine_t *current;
+
+static void coroutine_entry(void) {
+    Coroutine_t *coroutine = current;
+    coroutine->func(coroutine->arg);
+    coroutine->finished = true;
+    // Returning switches to uc_link, the caller of the last resume
+}
+
+// Creates a suspended coroutine running func(arg) on its own stack. The stack is mapped
+// lazily, so only the pages a client touches are backed by memory.
+Coroutine_t *coroutine_create(CoroutineFunc_t func, void *arg, size_t stack_size) {
+    Coroutine_t *coroutine = calloc(1, sizeof(Coroutine_t));
+    if (!coroutine) {
+        fprintf(stderr, "Error: Memory allocation failed for a coroutine.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page - 1) / page * page + page;
+    coroutine->stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (coroutine->stack == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map a coroutine stack.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    // An overflow faults on the guard page instead of corrupting the next stack
+    mprotect(coroutine->stack, page, PROT_NONE);
+
+    coroutine->stack_size = stack_size;
+    coroutine->func = func;
+    coroutine->arg = arg;
+
+    getcontext(&coroutine->context);
+    coroutine->context.uc_stack.ss_sp = (char *)coroutine->stack + page;
+    coroutine->context.uc_stack.ss_size = stack_size - page;
+    coroutine->context.uc_link = &coroutine->caller;
+    makecontext(&coroutine->context, coroutine_entry, 0);
+    return coroutine;
+}
+
+// Runs the coroutine until it yields or returns. Returns true once it has returned.
+bool coroutine_resume(Coroutine_t *coroutine) {
+    if (coroutine->finished)
+        return true;
+
+    Coroutine_t *previous = current;
+    current = coroutine;
+    swapcontext(&coroutine->caller, &coroutine->context);
+    current = previous;
+    return coroutine->finished;
+}
+
+// Suspends the running coroutine; the next coroutine_resume continues after this call.
+void coroutine_yield(void) {
+    Coroutine_t *coroutine = current;
+    assert(coroutine != NULL);
+    swapcontext(&coroutine->context, &coroutine->caller);
+}
+
+// Tells whether the caller runs inside a coroutine (and may therefore yield).
+bool coroutine_running(void) {
+    return current != NULL;
+}
+
+void coroutine_destroy(Coroutine_t *coroutine) {
+    if (!coroutine)
+        return;
+    munmap(coroutine->stack, coroutine->stack_size);
+    free(coroutine);
+}
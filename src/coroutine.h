@@ -0,0 +1,24 @@
+#ifndef _COROUTINE_H_
+#define _COROUTINE_H_
+
+#include "utils.h"
+
+// * Stackful Coroutines (ucontext): many logical clients share one worker thread. A coroutine
+// * runs until it yields or returns; only the thread that resumes it may run it.
+#define COROUTINE_STACK_SIZE (64 * 1024)
+
+typedef struct Coroutine_t Coroutine_t;
+
+typedef void (*CoroutineFunc_t)(void *arg);
+
+Coroutine_t *coroutine_create(CoroutineFunc_t func, void *arg, size_t stack_size);
+
+bool coroutine_resume(Coroutine_t *coroutine);
+
+void coroutine_yield(void);
+
+bool coroutine_running(void);
+
+void coroutine_destroy(Coroutine_t *coroutine);
+
+#endif
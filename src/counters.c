@@ -0,0 +1,162 @@
+#include "counters.h"
+#include "comm.h"
+
+Counters_t counters;
+__thread CounterBlock_t *counter_block = NULL;
+
+static const char *tag_names[COUNTER_TAGS] = {
+    "HASH", "CLIENT_TYPE", "ACK", "PEERS_SEEDERS_TRANSFER", "REQUEST", "INFORM", "DHT", "SYNC"
+};
+
+static const char *site_names[COUNTER_SITE_COUNT] = {
+    "swarm", "tracker_ack", "segment", "dht_lookup", "dht_publish", "dht_file", "upload", "barrier",
+    "tracker_wanted", "tracker_inform", "tracker_records"
+};
+
+static const char *opcode_names[COUNTER_OP_COUNT] = {
+    "FINISHED_DOWN_ALL", "DOWN_10", "DOWN_X", "RESTORED", "GIVE_PEERS", "UNKNOWN"
+};
+
+// * What one rank contributes to the report: its threads' blocks summed, then segments_from
+typedef struct CounterSums_t {
+    CounterBlock_t block;
+    uint64_t segments_from[];
+} CounterSums_t;
+
+void counters_init(int numtasks, int rank) {
+    memset(&counters, 0, sizeof(counters));
+    counters.ranks = numtasks;
+    counters.rank = rank;
+    counters.segments_from = calloc(numtasks, sizeof(uint64_t));
+    if (!counters.segments_from) {
+        fprintf(stderr, "Memory allocation failed for counters.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+}
+
+// Makes the calling thread count into its own block.
+void counters_attach(CounterThread_t thread) {
+    counter_block = &counters.threads[thread];
+}
+
+const char *counters_opcode_name(CounterOpcode_t opcode) {
+    return opcode >= 0 && opcode < COUNTER_OP_COUNT ? opcode_names[opcode] : opcode_names[COUNTER_OP_UNKNOWN];
+}
+
+CounterOpcode_t counters_opcode(const char *opcode) {
+    for (int op = 0; op < COUNTER_OP_UNKNOWN; ++op) {
+        if (strcmp(opcode, opcode_names[op]) == 0)
+            return (CounterOpcode_t)op;
+    }
+    return COUNTER_OP_UNKNOWN;
+}
+
+// Records one client message the tracker handled, from started_ns on.
+void counters_handled(CounterOpcode_t opcode, uint64_t started_ns) {
+    CounterBlock_t *block = counters_here();
+    block->handled[opcode]++;
+    block->handling_ns[opcode] += counters_now_ns() - started_ns;
+}
+
+static void sum_blocks(CounterBlock_t *sum, const CounterBlock_t *block) {
+    uint64_t *to = (uint64_t *)sum;
+    const uint64_t *from = (const uint64_t *)block;
+    for (int field = 0; field < COUNTER_BLOCK_FIELDS; ++field)
+        to[field] += from[field];
+}
+
+static void write_block(FILE *out, const CounterBlock_t *block, const uint64_t *segments_from, int ranks) {
+    fprintf(out, "\"sent\": {");
+    for (int tag = 0; tag < COUNTER_TAGS; ++tag) {
+        fprintf(out, "%s\"%s\": {\"messages\": %llu, \"bytes\": %llu}", tag ? ", " : "", tag_names[tag],
+                (unsigned long long)block->messages_sent[tag], (unsigned long long)block->bytes_sent[tag]);
+    }
+    fprintf(out, "}, \"received\": {");
+    for (int tag = 0; tag < COUNTER_TAGS; ++tag) {
+        fprintf(out, "%s\"%s\": {\"messages\": %llu, \"bytes\": %llu}", tag ? ", " : "", tag_names[tag],
+                (unsigned long long)block->messages_received[tag], (unsigned long long)block->bytes_received[tag]);
+    }
+    fprintf(out, "}, \"receives\": {");
+    for (int site = 0; site < COUNTER_SITE_COUNT; ++site) {
+        fprintf(out, "%s\"%s\": {\"calls\": %llu, \"blocked_ms\": %.3f}", site ? ", " : "", site_names[site],
+                (unsigned long long)block->receives[site], block->blocked_ns[site] / 1e6);
+    }
+    fprintf(out, "}, \"uploads\": {\"served\": %llu, \"refused\": %llu, \"throttled\": %llu, \"throttled_ms\": %.3f}, "
+            "\"downloads\": {\"throttled\": %llu, \"throttled_ms\": %.3f}, \"tracker\": {",
+            (unsigned long long)block->uploads_served, (unsigned long long)block->uploads_refused,
+            (unsigned long long)block->uploads_throttled, block->uploads_throttled_ns / 1e6,
+            (unsigned long long)block->downloads_throttled, block->downloads_throttled_ns / 1e6);
+    for (int op = 0; op < COUNTER_OP_COUNT; ++op) {
+        fprintf(out, "%s\"%s\": {\"messages\": %llu, \"handling_ms\": %.3f}", op ? ", " : "", opcode_names[op],
+                (unsigned long long)block->handled[op], block->handling_ns[op] / 1e6);
+    }
+    fprintf(out, "}, \"segments_from\": [");
+    for (int r = 0; r < ranks; ++r)
+        fprintf(out, "%s%llu", r ? ", " : "", (unsigned long long)segments_from[r]);
+    fprintf(out, "]");
+}
+
+/*
+ * Gathers every rank's counters on rank 0, which writes them to path ("-" for stdout) as JSON:
+ * the totals, then one object per rank. Collective; call it once the workers have joined.
+ */
+void counters_report(const char *path) {
+    int ranks = counters.ranks;
+    size_t sums_size = sizeof(CounterSums_t) + ranks * sizeof(uint64_t);
+    CounterSums_t *own = calloc(1, sums_size);
+    char *all = counters.rank == TRACKER_RANK ? calloc(ranks, sums_size) : NULL;
+    if (!own || (counters.rank == TRACKER_RANK && !all)) {
+        fprintf(stderr, "Memory allocation failed for counters.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    for (int thread = 0; thread < COUNTER_THREADS; ++thread)
+        sum_blocks(&own->block, &counters.threads[thread]);
+    memcpy(own->segments_from, counters.segments_from, ranks * sizeof(uint64_t));
+
+    int count = (int)(sums_size / sizeof(uint64_t));
+    MPI_Gather(own, count, MPI_UINT64_T, all, count, MPI_UINT64_T, TRACKER_RANK, CONTROL_COMM);
+    free(own);
+    if (counters.rank != TRACKER_RANK)
+        return;
+
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot write counters to %s.\n", path);
+        free(all);
+        return;
+    }
+
+    CounterSums_t *total = calloc(1, sums_size);
+    if (!total) {
+        fprintf(stderr, "Memory allocation failed for counters.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (int r = 0; r < ranks; ++r) {
+        const CounterSums_t *sums = (const CounterSums_t *)(all + r * sums_size);
+        sum_blocks(&total->block, &sums->block);
+        for (int source = 0; source < ranks; ++source)
+            total->segments_from[source] += sums->segments_from[source];
+    }
+
+    fprintf(out, "{\"ranks\": %d, \"total\": {", ranks);
+    write_block(out, &total->block, total->segments_from, ranks);
+    fprintf(out, "},\n\"per_rank\": [\n");
+    for (int r = 0; r < ranks; ++r) {
+        const CounterSums_t *sums = (const CounterSums_t *)(all + r * sums_size);
+        fprintf(out, "  {\"rank\": %d, ", r);
+        write_block(out, &sums->block, sums->segments_from, ranks);
+        fprintf(out, "}%s\n", r + 1 < ranks ? "," : "");
+    }
+    fprintf(out, "]}\n");
+
+    if (out != stdout)
+        fclose(out);
+    free(total);
+    free(all);
+}
+
+void counters_free(void) {
+    free(counters.segments_from);
+    counters.segments_from = NULL;
+}
@@ -0,0 +1,132 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include "utils.h"
+
+#include <time.h>
+
+// * Per-rank Performance Counters
+// * Always on. Each thread of a rank (main, download, upload) counts into its own block, so a
+// * count is a plain add with no atomics or shared cache lines; the blocks are summed only after
+// * the workers joined. At the end of the run every rank's sums are gathered on rank 0, which
+// * writes them as JSON to --counters.
+#define COUNTER_TAGS 8 // * protocol tags 0 .. COMM_TAG_STRIDE - 1
+
+// * Blocking receives, by call site
+typedef enum CounterSite_t {
+    COUNTER_SITE_SWARM = 0, // * download: swarm lists from the tracker
+    COUNTER_SITE_TRACKER_ACK, // * download: the tracker's ACK of an announce
+    COUNTER_SITE_SEGMENT, // * download: a peer's reply to a segment request
+    COUNTER_SITE_DHT_LOOKUP, // * download: DHT lookup replies
+    COUNTER_SITE_DHT_PUBLISH, // * download: DHT replies to a publish
+    COUNTER_SITE_DHT_FILE, // * download: providers' file replies
+    COUNTER_SITE_UPLOAD, // * upload: the next request
+    COUNTER_SITE_BARRIER, // * download: the end of DHT publishing
+    COUNTER_SITE_TRACKER_WANTED, // * tracker: wanted files at registration
+    COUNTER_SITE_TRACKER_INFORM, // * tracker: the next client message
+    COUNTER_SITE_TRACKER_RECORDS, // * tracker: the segment records of an announce
+    COUNTER_SITE_COUNT
+} CounterSite_t;
+
+// * Client messages the tracker handles
+typedef enum CounterOpcode_t {
+    COUNTER_OP_FINISHED_DOWN_ALL = 0,
+    COUNTER_OP_DOWN_10,
+    COUNTER_OP_DOWN_X,
+    COUNTER_OP_RESTORED,
+    COUNTER_OP_GIVE_PEERS,
+    COUNTER_OP_UNKNOWN,
+    COUNTER_OP_COUNT
+} CounterOpcode_t;
+
+typedef enum CounterThread_t {
+    COUNTER_MAIN = 0, // * the progress loop, or the tracker
+    COUNTER_DOWNLOAD,
+    COUNTER_UPLOAD,
+    COUNTER_THREADS
+} CounterThread_t;
+
+// * One thread's counts (all uint64_t, so a rank's sums travel as one array)
+typedef struct CounterBlock_t {
+    uint64_t messages_sent[COUNTER_TAGS];
+    uint64_t bytes_sent[COUNTER_TAGS];
+    uint64_t messages_received[COUNTER_TAGS];
+    uint64_t bytes_received[COUNTER_TAGS];
+    uint64_t receives[COUNTER_SITE_COUNT];
+    uint64_t blocked_ns[COUNTER_SITE_COUNT]; // * waiting for the message to arrive
+    uint64_t uploads_served;
+    uint64_t uploads_refused; // * not held, or left to the swarm by a super-seeder
+    uint64_t uploads_throttled; // * segments held back by the upload rate limits, and for how long
+    uint64_t uploads_throttled_ns;
+    uint64_t downloads_throttled; // * requests held back by the download budgets, and for how long
+    uint64_t downloads_throttled_ns;
+    uint64_t handled[COUNTER_OP_COUNT];
+    uint64_t handling_ns[COUNTER_OP_COUNT];
+} CounterBlock_t;
+
+#define COUNTER_BLOCK_FIELDS ((int)(sizeof(CounterBlock_t) / sizeof(uint64_t)))
+
+typedef struct Counters_t {
+    int ranks;
+    int rank;
+    CounterBlock_t threads[COUNTER_THREADS];
+    uint64_t *segments_from; // * segments downloaded from each source rank (download thread)
+} Counters_t;
+
+extern Counters_t counters;
+extern __thread CounterBlock_t *counter_block; // * the calling thread's block (NULL = main)
+
+static inline CounterBlock_t *counters_here(void) {
+    return counter_block ? counter_block : &counters.threads[COUNTER_MAIN];
+}
+
+static inline uint64_t counters_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline void counters_sent(int tag, int size) {
+    if (tag >= 0 && tag < COUNTER_TAGS) {
+        CounterBlock_t *block = counters_here();
+        block->messages_sent[tag]++;
+        block->bytes_sent[tag] += (uint64_t)size;
+    }
+}
+
+static inline void counters_received(int tag, int size) {
+    if (tag >= 0 && tag < COUNTER_TAGS) {
+        CounterBlock_t *block = counters_here();
+        block->messages_received[tag]++;
+        block->bytes_received[tag] += (uint64_t)size;
+    }
+}
+
+// Records one receive at site that waited from started_ns (0 = the message was already there).
+static inline void counters_receive(CounterSite_t site, uint64_t started_ns) {
+    CounterBlock_t *block = counters_here();
+    block->receives[site]++;
+    if (started_ns)
+        block->blocked_ns[site] += counters_now_ns() - started_ns;
+}
+
+static inline void counters_segment_from(int source_rank) {
+    if (source_rank >= 0 && source_rank < counters.ranks && counters.segments_from)
+        counters.segments_from[source_rank]++;
+}
+
+void counters_init(int numtasks, int rank);
+
+void counters_attach(CounterThread_t thread);
+
+CounterOpcode_t counters_opcode(const char *opcode);
+
+const char *counters_opcode_name(CounterOpcode_t opcode);
+
+void counters_handled(CounterOpcode_t opcode, uint64_t started_ns);
+
+void counters_report(const char *path);
+
+void counters_free(void);
+
+#endif
@@ -0,0 +1,236 @@
+#include "dedup.h"
+#include "digest.h"
+#include "merkle.h"
+
+static size_t digest_slot(const Digest_t *digest, size_t mask) {
+    return (size_t)fingerprint_bytes(digest->bytes, DIGEST_SIZE, FINGERPRINT_SEED) & mask;
+}
+
+// Builds the whole tree of a file from its segment digests. Returns NULL if they do not lead to root.
+static FileData_t *tree_of(const Digest_t *leaves, size_t count, const Digest_t *root) {
+    FileData_t *file = calloc(1, sizeof(FileData_t));
+    if (!file) {
+        fprintf(stderr, "Memory allocation failed for a segment catalog.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    memcpy(file->segments, leaves, sizeof(Digest_t) * count);
+    file->segment_count = count;
+    segment_bits_fill(file->have, count);
+    merkle_build(file);
+    if (!digest_equal(&file->root, root)) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+/*
+ * Keeps the segment digests a client registered for a swarm, if they lead to the swarm's root
+ * and the swarm has none yet. Returns false if they do not belong to the file.
+ */
+bool dedup_take_leaves(Swarm_t *swarm, const Digest_t *leaves, uint32_t count) {
+    if (count != swarm->segment_total || count == 0 || count > MAX_CHUNKS)
+        return false;
+    if (swarm->leaves)
+        return true;
+
+    FileData_t *tree = tree_of(leaves, count, &swarm->root);
+    if (!tree)
+        return false;
+    free(tree);
+
+    swarm->leaves = malloc(sizeof(Digest_t) * count);
+    if (!swarm->leaves) {
+        fprintf(stderr, "Memory allocation failed for the digests of %s.\n", swarm->file_name);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    memcpy(swarm->leaves, leaves, sizeof(Digest_t) * count);
+    return true;
+}
+
+/*
+ * Gives every distinct segment digest of the swarms a content id, and every segment of a swarm
+ * whose digests are known the id of its digest. Runs once the registrations are in.
+ */
+void dedup_index(TrackerDataSet_t *m_tracker) {
+    size_t total = 0;
+    for (int i = 0; i < m_tracker->swarm_size; ++i)
+        total += m_tracker->swarms[i].leaves ? m_tracker->swarms[i].segment_total : 0;
+
+    size_t size = 16;
+    while (size < 2 * total)
+        size *= 2;
+    const Digest_t **keys = calloc(size, sizeof(*keys));
+    uint32_t *ids = calloc(size, sizeof(*ids));
+    if (!keys || !ids) {
+        fprintf(stderr, "Memory allocation failed for the content index.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    m_tracker->content_count = 0;
+    for (int i = 0; i < m_tracker->swarm_size; ++i) {
+        Swarm_t *swarm = &m_tracker->swarms[i];
+        free(swarm->content);
+        swarm->content = NULL;
+        if (!swarm->leaves)
+            continue;
+
+        swarm->content = malloc(sizeof(uint32_t) * swarm->segment_total);
+        if (!swarm->content) {
+            fprintf(stderr, "Memory allocation failed for the content ids of %s.\n", swarm->file_name);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        for (uint32_t idx = 0; idx < swarm->segment_total; ++idx) {
+            const Digest_t *leaf = &swarm->leaves[idx];
+            size_t slot = digest_slot(leaf, size - 1);
+            while (keys[slot] && !digest_equal(keys[slot], leaf))
+                slot = (slot + 1) & (size - 1);
+            if (!keys[slot]) {
+                keys[slot] = leaf;
+                ids[slot] = m_tracker->content_count++;
+            }
+            swarm->content[idx] = ids[slot];
+        }
+    }
+
+    free(ids);
+    free(keys);
+}
+
+// Words of a bitfield over the content ids.
+size_t dedup_content_words(const TrackerDataSet_t *m_tracker) {
+    return MAX((m_tracker->content_count + 63) / 64, 1);
+}
+
+/*
+ * Fills held (dedup_content_words() words) with the content ids of every segment the client
+ * holds, in any file.
+ */
+void dedup_content_held(const TrackerDataSet_t *m_tracker, const TrackerData_t *client_data, uint64_t *held) {
+    memset(held, 0, sizeof(uint64_t) * dedup_content_words(m_tracker));
+    for (size_t j = 0; j < client_data->files_count; ++j) {
+        const TrackerFile_t *file = &client_data->files[j];
+        if (file->file_id <= 0 || file->file_id > m_tracker->swarm_size)
+            continue;
+        const Swarm_t *swarm = &m_tracker->swarms[file->file_id - 1];
+        for (uint32_t idx = 0; idx < file->segment_count && swarm->content; ++idx) {
+            if (segment_bit_test(file->have, idx))
+                segment_bit_set(held, swarm->content[idx]);
+        }
+    }
+}
+
+/*
+ * Fills have with the segments of the swarm's file whose content is in held. Returns the
+ * highest of them + 1 (0 = none).
+ */
+uint32_t dedup_have(const Swarm_t *swarm, const uint64_t *held, uint64_t *have) {
+    uint32_t segment_count = 0;
+    memset(have, 0, sizeof(uint64_t) * SEGMENT_WORDS);
+    for (uint32_t idx = 0; idx < swarm->segment_total && swarm->content; ++idx) {
+        if (segment_bit_test(held, swarm->content[idx])) {
+            segment_bit_set(have, idx);
+            segment_count = idx + 1;
+        }
+    }
+    return segment_count;
+}
+
+/*
+ * Builds the catalog of a wanted file from the segment digests the tracker sent. Digests that
+ * do not lead to the file's root are dropped, and the file is fetched by index only.
+ */
+void dedup_catalog(PeersList_t *peers, const Digest_t *leaves, size_t count) {
+    if (count == 0 || count != peers->segment_total)
+        return;
+    peers->catalog = tree_of(leaves, count, &peers->root);
+    if (!peers->catalog)
+        fprintf(stderr, "Warning: segment digests that do not match the root; fetching by index only.\n");
+}
+
+/*
+ * Finds the segments of a wanted file the client misses but holds a copy of, in this file or
+ * any other: the digests of the missing ones go into a small table, then every held segment is
+ * looked up in it. With only, just the missing segments with that (held) digest are looked at.
+ * Fills matches with their indices and returns how many there are. Download thread only.
+ */
+size_t dedup_matches(const ClientFiles_t *client, const PeersList_t *peers, const FileData_t *file,
+                     const Digest_t *only, uint32_t *matches) {
+    const FileData_t *catalog = peers->catalog;
+    size_t count = 0;
+    if (!catalog)
+        return 0;
+
+    if (only) {
+        for (uint32_t idx = 0; idx < catalog->segment_count; ++idx) {
+            if (!segment_bit_test(file->have, idx) && digest_equal(&catalog->segments[idx].digest, only))
+                matches[count++] = idx;
+        }
+        return count;
+    }
+
+    // slots hold a missing segment's index + 1 (0 = empty); equal digests take a slot each
+    uint8_t slots[DEDUP_TABLE_SIZE] = {0};
+    for (uint32_t idx = 0; idx < catalog->segment_count; ++idx) {
+        if (segment_bit_test(file->have, idx))
+            continue;
+        size_t slot = digest_slot(&catalog->segments[idx].digest, DEDUP_TABLE_SIZE - 1);
+        while (slots[slot])
+            slot = (slot + 1) & (DEDUP_TABLE_SIZE - 1);
+        slots[slot] = (uint8_t)(idx + 1);
+    }
+
+    uint64_t taken[SEGMENT_WORDS] = {0};
+    for (size_t f = 0; f < client->owned_files_count; ++f) {
+        const FileData_t *held = &client->owned_files[f];
+        for (size_t i = 0; i < held->segment_count; ++i) {
+            if (!segment_bit_test(held->have, i))
+                continue;
+            const Digest_t *digest = &held->segments[i].digest;
+            for (size_t slot = digest_slot(digest, DEDUP_TABLE_SIZE - 1); slots[slot];
+                 slot = (slot + 1) & (DEDUP_TABLE_SIZE - 1)) {
+                uint32_t idx = slots[slot] - 1u;
+                if (!segment_bit_test(taken, idx) && digest_equal(&catalog->segments[idx].digest, digest)) {
+                    segment_bit_set(taken, idx);
+                    matches[count++] = idx;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Checks a segment of a wanted file like merkle_verify(). A segment served by content comes
+ * without a proof: with a catalog the client proves it from the catalog itself.
+ */
+bool dedup_verify(const PeersList_t *peers, FileData_t *file, size_t segment_idx, const Digest_t *segment,
+                  const MerkleProof_t *proof) {
+    MerkleProof_t own;
+    if (peers->catalog && proof->length == 0 && merkle_proof(peers->catalog, segment_idx, &own))
+        return merkle_verify(file, segment_idx, segment, &own);
+    return merkle_verify(file, segment_idx, segment, proof);
+}
+
+/*
+ * Finds a held segment with the given digest in any of the client's files. Upload thread: it
+ * sees a segment only once the download thread published it.
+ */
+const FileData_t *dedup_find(ClientFiles_t *client, const Digest_t *digest, size_t *segment_idx) {
+    size_t owned_count = __atomic_load_n(&client->owned_files_count, __ATOMIC_ACQUIRE);
+    for (size_t f = 0; f < owned_count; ++f) {
+        const FileData_t *file = &client->owned_files[f];
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            uint64_t bits = __atomic_load_n(&file->have[word], __ATOMIC_ACQUIRE);
+            while (bits) {
+                size_t idx = (size_t)word * 64 + (size_t)__builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (digest_equal(&file->segments[idx].digest, digest)) {
+                    *segment_idx = idx;
+                    return file;
+                }
+            }
+        }
+    }
+    return NULL;
+}
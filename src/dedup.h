@@ -0,0 +1,40 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "utils.h"
+
+// * Content-addressed Segments (--dedup)
+// * Clients register the segment digests of their files with the roots, and the tracker gives
+// * every distinct digest a content id over all swarms. A downloader gets the digests of each
+// * wanted file after its swarm header (checked against the root, like a torrent's piece list),
+// * and its swarm lists every client holding any of the file's contents, under whatever file it
+// * holds them. A segment the downloader already holds in any file (or at another index of the
+// * same file) is copied without a transfer; every other request carries the digest, so an
+// * uploader that does not hold the segment at that index serves any held copy of it.
+// * Needs the tracker: with --dht the option is ignored. A tracker restored from a snapshot
+// * knows the digests of the clients that registered again only.
+#define DEDUP_TABLE_SIZE 256 // * slots of the downloader's table of missing digests (> MAX_CHUNKS)
+
+// * Tracker side
+bool dedup_take_leaves(Swarm_t *swarm, const Digest_t *leaves, uint32_t count);
+
+void dedup_index(TrackerDataSet_t *m_tracker);
+
+size_t dedup_content_words(const TrackerDataSet_t *m_tracker);
+
+void dedup_content_held(const TrackerDataSet_t *m_tracker, const TrackerData_t *client_data, uint64_t *held);
+
+uint32_t dedup_have(const Swarm_t *swarm, const uint64_t *held, uint64_t *have);
+
+// * Client side
+void dedup_catalog(PeersList_t *peers, const Digest_t *leaves, size_t count);
+
+size_t dedup_matches(const ClientFiles_t *client, const PeersList_t *peers, const FileData_t *file,
+                     const Digest_t *only, uint32_t *matches);
+
+bool dedup_verify(const PeersList_t *peers, FileData_t *file, size_t segment_idx, const Digest_t *segment,
+                  const MerkleProof_t *proof);
+
+const FileData_t *dedup_find(ClientFiles_t *client, const Digest_t *digest, size_t *segment_idx);
+
+#endif
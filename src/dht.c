@@ -0,0 +1,460 @@
+#include "dht.h"
+#include "comm.h"
+#include "digest.h"
+#include "download.h"
+
+// * Salts that keep node ids and keys apart
+#define DHT_NODE_SALT 0x6e6f6465ull
+#define DHT_KEY_SALT 0x6b6579ull
+
+// * A node a lookup may query, ordered by distance to the key
+typedef struct DhtCandidate_t {
+    uint64_t distance;
+    int32_t client_id;
+    uint32_t request_id; // * of the request in flight to it, if queried
+    bool queried;
+    bool responded;
+} DhtCandidate_t;
+
+typedef struct DhtLookup_t {
+    uint64_t key;
+    DhtCandidate_t candidates[DHT_SHORTLIST];
+    int candidate_count;
+    int32_t *providers;
+    int provider_count;
+    int provider_capacity;
+} DhtLookup_t;
+
+// splitmix64 finalizer: spreads ids over the whole 64-bit space.
+static uint64_t dht_hash(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+static uint64_t node_id_of(int client_id) {
+    return dht_hash((uint64_t)client_id ^ (DHT_NODE_SALT << 32));
+}
+
+static uint64_t key_of(int file_id) {
+    return dht_hash((uint64_t)file_id ^ (DHT_KEY_SALT << 32));
+}
+
+// Bucket of a nonzero distance: the index of its highest set bit.
+static int bucket_of(uint64_t distance) {
+    return 63 - __builtin_clzll(distance);
+}
+
+static void *dht_alloc(size_t size) {
+    void *data = malloc(size ? size : 1);
+    if (!data) {
+        fprintf(stderr, "Error: Memory allocation failed for the DHT.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return data;
+}
+
+// Adds a node the client heard from to its routing table, unless its bucket is full: the
+// contacts known the longest stay, as in Kademlia.
+static void add_contact(DhtNode_t *node, int32_t client_id) {
+    if (client_id == node->client_id)
+        return;
+
+    int bucket = bucket_of(node->id ^ node_id_of(client_id));
+    pthread_mutex_lock(&node->lock);
+    bool skip = node->bucket_counts[bucket] == DHT_K;
+    for (int i = 0; i < node->contact_count && !skip; ++i)
+        skip = node->contacts[i] == client_id;
+    if (!skip) {
+        node->bucket_counts[bucket]++;
+        node->contacts[node->contact_count++] = client_id;
+    }
+    pthread_mutex_unlock(&node->lock);
+}
+
+/*
+ * Creates the client's DHT node. Its routing table holds only the DHT_BOOTSTRAP first clients
+ * until dht_join() fills it. Call on the main thread, before the workers start.
+ */
+DhtNode_t *dht_node_create(const ClientFiles_t *client, int client_count) {
+    DhtNode_t *node = dht_alloc(sizeof(DhtNode_t));
+    memset(node, 0, sizeof(*node));
+    node->client_id = client->client_id;
+    node->id = node_id_of(client->client_id);
+    pthread_mutex_init(&node->lock, NULL);
+
+    node->contacts = dht_alloc(sizeof(int32_t) * 64 * DHT_K);
+    for (int client_id = 1; client_id <= MIN(client_count, DHT_BOOTSTRAP); ++client_id)
+        add_contact(node, client_id);
+
+    // One record per file the client may hold, wanted ones included
+    node->published = dht_alloc(sizeof(int32_t) * client->owned_files_capacity);
+    return node;
+}
+
+void dht_node_free(DhtNode_t *node) {
+    if (!node)
+        return;
+    pthread_mutex_destroy(&node->lock);
+    free(node->contacts);
+    free(node->providers);
+    free(node->published);
+    free(node);
+}
+
+// Adds client_id to the sorted shortlist, unless it is there already or farther than all of
+// a full shortlist.
+static void add_candidate(DhtLookup_t *lookup, int32_t client_id) {
+    uint64_t distance = lookup->key ^ node_id_of(client_id);
+    int position = lookup->candidate_count;
+
+    for (int i = 0; i < lookup->candidate_count; ++i) {
+        if (lookup->candidates[i].client_id == client_id)
+            return;
+        if (position == lookup->candidate_count && distance < lookup->candidates[i].distance)
+            position = i;
+    }
+    if (position == DHT_SHORTLIST)
+        return;
+
+    int moved = MIN(lookup->candidate_count, DHT_SHORTLIST - 1) - position;
+    memmove(&lookup->candidates[position + 1], &lookup->candidates[position], sizeof(DhtCandidate_t) * moved);
+    lookup->candidates[position] = (DhtCandidate_t){.distance = distance, .client_id = client_id};
+    lookup->candidate_count = MIN(lookup->candidate_count + 1, DHT_SHORTLIST);
+}
+
+static void add_provider(DhtLookup_t *lookup, int32_t client_id) {
+    for (int i = 0; i < lookup->provider_count; ++i) {
+        if (lookup->providers[i] == client_id)
+            return;
+    }
+    if (lookup->provider_count == lookup->provider_capacity) {
+        lookup->provider_capacity = lookup->provider_capacity ? lookup->provider_capacity * 2 : DHT_MAX_PROVIDERS;
+        lookup->providers = realloc(lookup->providers, sizeof(int32_t) * lookup->provider_capacity);
+        if (!lookup->providers) {
+            fprintf(stderr, "Error: Memory allocation failed for DHT providers.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    lookup->providers[lookup->provider_count++] = client_id;
+}
+
+// Sends a DHT request to a client and returns its request id.
+static uint32_t send_request(ClientFiles_t *client, int32_t target, DhtOpcode_t opcode, int file_id, uint64_t key) {
+    DhtRequest_t request = {
+        .request_id = next_request_id(client),
+        .client_id = client->client_id,
+        .opcode = opcode,
+        .file_id = file_id,
+        .key = key,
+    };
+    if (comm_send(COMM_PEER, client_rank_of(target), client_local_of(target), DHT_TAG, &request,
+                  sizeof(request)) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Send failed while sending a DHT request to client %d.\n", target);
+    }
+    return request.request_id;
+}
+
+/*
+ * Iterative lookup of a key (FIND_PROVIDERS of file_id's key, or FIND_NODE of a node id): keeps
+ * DHT_ALPHA requests in flight to the closest candidates not queried yet, merging the contacts
+ * and providers every reply brings, until the DHT_K closest candidates have all answered. The
+ * nodes that answer join the routing table.
+ */
+static void find_closest(ClientFiles_t *client, DhtOpcode_t opcode, int file_id, uint64_t key, DhtLookup_t *lookup) {
+    DhtNode_t *node = client->dht;
+    int local = client_local_of(client->client_id);
+    memset(lookup, 0, sizeof(*lookup));
+    lookup->key = key;
+
+    add_candidate(lookup, node->client_id);
+    pthread_mutex_lock(&node->lock);
+    for (int i = 0; i < node->contact_count; ++i)
+        add_candidate(lookup, node->contacts[i]);
+    pthread_mutex_unlock(&node->lock);
+
+    int in_flight = 0;
+    while (true) {
+        for (int i = 0; i < lookup->candidate_count && i < DHT_K && in_flight < DHT_ALPHA; ++i) {
+            DhtCandidate_t *candidate = &lookup->candidates[i];
+            if (candidate->queried)
+                continue;
+            candidate->queried = true;
+            candidate->request_id = send_request(client, candidate->client_id, opcode, file_id, key);
+            in_flight++;
+        }
+        if (in_flight == 0)
+            break;
+
+        DhtReply_t reply;
+        if (comm_recv(COMM_DOWNLOAD_INBOX, local, COMM_DATA, MPI_ANY_SOURCE, DHT_TAG, &reply, sizeof(reply),
+                      NULL, COUNTER_SITE_DHT_LOOKUP) != MPI_SUCCESS) {
+            fprintf(stderr, "MPI_Recv failed while receiving a DHT reply.\n");
+            continue;
+        }
+        in_flight--;
+
+        // The candidate may have dropped off the shortlist since it was queried
+        for (int i = 0; i < lookup->candidate_count; ++i) {
+            if (lookup->candidates[i].queried && lookup->candidates[i].request_id == reply.request_id) {
+                lookup->candidates[i].responded = true;
+                add_contact(node, lookup->candidates[i].client_id);
+            }
+        }
+        for (uint32_t i = 0; i < reply.provider_count && i < DHT_MAX_PROVIDERS; ++i)
+            add_provider(lookup, reply.providers[i]);
+        for (uint32_t i = 0; i < reply.contact_count && i < DHT_K; ++i)
+            add_candidate(lookup, reply.contacts[i]);
+    }
+}
+
+// Waits for the replies to requests[0..count) sent to targets[0..count).
+static void wait_for_replies(ClientFiles_t *client, const int32_t *targets, const uint32_t *requests, int count) {
+    DhtReply_t reply;
+    for (int i = 0; i < count; ++i) {
+        if (comm_recv_reply(COMM_DOWNLOAD_INBOX, client_local_of(client->client_id), COMM_DATA,
+                            client_rank_of(targets[i]), DHT_TAG, requests[i], &reply, sizeof(reply),
+                            NULL, COUNTER_SITE_DHT_PUBLISH) != MPI_SUCCESS) {
+            fprintf(stderr, "MPI_Recv failed while waiting for a DHT reply.\n");
+        }
+    }
+}
+
+/*
+ * Fills the node's routing table by looking its own id up: the nodes that answer join the table,
+ * and learn of this node in turn. Runs as a coroutine of the download thread.
+ */
+void dht_join(ClientFiles_t *client) {
+    DhtLookup_t found;
+    find_closest(client, DHT_FIND_NODE, 0, client->dht->id, &found);
+    free(found.providers);
+}
+
+static bool is_published(const DhtNode_t *node, int file_id) {
+    for (int i = 0; i < node->published_count; ++i) {
+        if (node->published[i] == file_id)
+            return true;
+    }
+    return false;
+}
+
+// Stores the client's provider record for file_id on the DHT_K closest nodes that answered the
+// lookup, and waits until all of them have stored it.
+static void store_record(ClientFiles_t *client, int file_id, const DhtLookup_t *found) {
+    DhtNode_t *node = client->dht;
+    int32_t targets[DHT_K];
+    uint32_t requests[DHT_K];
+    int count = 0;
+    for (int j = 0; j < found->candidate_count && count < DHT_K; ++j) {
+        if (!found->candidates[j].responded)
+            continue;
+        targets[count] = found->candidates[j].client_id;
+        requests[count] = send_request(client, targets[count], DHT_ADD_PROVIDER, file_id, 0);
+        count++;
+    }
+    wait_for_replies(client, targets, requests, count);
+    node->published[node->published_count++] = file_id;
+}
+
+/*
+ * Publishes the client as a provider of every file it holds segments of: looks the file's key
+ * up and stores the record on the DHT_K closest nodes that answered. Returns once all of them
+ * have stored it. Runs as a coroutine of the download thread.
+ */
+void dht_publish(ClientFiles_t *client) {
+    DhtLookup_t found;
+
+    for (size_t i = 0; i < client->owned_files_count; ++i) {
+        int file_id = client->owned_files[i].file_id;
+        if (client->owned_files[i].segment_count == 0 || is_published(client->dht, file_id))
+            continue;
+
+        find_closest(client, DHT_FIND_PROVIDERS, file_id, key_of(file_id), &found);
+        store_record(client, file_id, &found);
+        free(found.providers);
+    }
+}
+
+static bool is_peer(const PeersList_t *peers_list, int32_t client_id) {
+    for (int i = 0; i < peers_list->peers_count; ++i) {
+        if (peers_list->peers_array[i].peer_id == client_id)
+            return true;
+    }
+    return false;
+}
+
+// Asks up to limit of the providers found for a wanted file what they hold, those not in the
+// file's peer list first, and adds them to the list. Without a tracker the file is the one the
+// first provider to answer has: providers of another root are left out. The peer array may move.
+static void fetch_provider_files(ClientFiles_t *client, size_t file_idx, int file_id, const DhtLookup_t *found,
+                                 int limit) {
+    PeersList_t *peers_list = &client->peers[file_idx];
+    int32_t *targets = dht_alloc(sizeof(int32_t) * found->provider_count);
+    uint32_t *requests = dht_alloc(sizeof(uint32_t) * found->provider_count);
+    int count = 0;
+    for (int known = 0; known < 2; ++known) {
+        for (int i = 0; i < found->provider_count && count < limit; ++i) {
+            int32_t provider = found->providers[i];
+            if (provider == client->client_id || is_peer(peers_list, provider) != known)
+                continue;
+            targets[count] = provider;
+            requests[count++] = send_request(client, provider, DHT_GET_FILE, file_id, 0);
+        }
+    }
+
+    DhtFileReply_t *reply = dht_alloc(sizeof(DhtFileReply_t));
+    for (int i = 0; i < count; ++i) {
+        int32_t provider = targets[i];
+        if (comm_recv_reply(COMM_DOWNLOAD_INBOX, client_local_of(client->client_id), COMM_DATA,
+                            client_rank_of(provider), DHT_TAG, requests[i], reply, sizeof(*reply),
+                            NULL, COUNTER_SITE_DHT_FILE) != MPI_SUCCESS) {
+            fprintf(stderr, "MPI_Recv failed while receiving file data from client %d.\n", provider);
+            continue;
+        }
+        if (reply->segment_count == 0 || reply->segment_count > MAX_CHUNKS || reply->segment_total > MAX_CHUNKS)
+            continue;
+        if (peers_list->segment_total == 0) {
+            peers_list->segment_total = reply->segment_total;
+            peers_list->root = reply->root;
+        } else if (reply->segment_total != peers_list->segment_total || !digest_equal(&reply->root, &peers_list->root)) {
+            continue;
+        }
+        learn_peer(peers_list, file_id, provider, reply->have, INT32_MAX);
+    }
+
+    free(reply);
+    free(requests);
+    free(targets);
+}
+
+// Builds the peer lists of all wanted files from the DHT instead of the tracker.
+void dht_find_peers(ClientFiles_t *client) {
+    DhtLookup_t found;
+
+    for (size_t i = 0; i < client->wanted_files_count; ++i) {
+        const char *name = client->wanted_files[i].file_name;
+        int file_id = atoi(&name[strlen(name) - 1]);
+
+        find_closest(client, DHT_FIND_PROVIDERS, file_id, key_of(file_id), &found);
+        fetch_provider_files(client, i, file_id, &found, INT32_MAX);
+        free(found.providers);
+    }
+}
+
+/*
+ * Keeps the DHT up to date while the client downloads a wanted file it holds segments of:
+ * stores its provider record for the file the first time, and with find_peers asks DHT_K of
+ * the file's providers, new ones first, what they hold now. The file's
+ * peer list may move.
+ * Runs on the download thread.
+ */
+void dht_refresh(ClientFiles_t *client, size_t file_idx, int file_id, bool find_peers) {
+    bool publish = !is_published(client->dht, file_id);
+    if (!publish && !find_peers)
+        return;
+
+    DhtLookup_t found;
+    find_closest(client, DHT_FIND_PROVIDERS, file_id, key_of(file_id), &found);
+    if (publish)
+        store_record(client, file_id, &found);
+    if (find_peers)
+        fetch_provider_files(client, file_idx, file_id, &found, DHT_K);
+    free(found.providers);
+}
+
+// Fills reply with the providers of the request's file this node keeps (FIND_PROVIDERS): the
+// oldest records, which the initial seeders stored, and the newest ones, half of the reply
+// each. Adds the node's contacts closest to the request's key.
+static void answer_find(DhtNode_t *node, const DhtRequest_t *request, DhtReply_t *reply) {
+    int oldest = 0;
+    for (int i = 0; i < node->provider_count && reply->provider_count < DHT_MAX_PROVIDERS / 2 &&
+                    request->opcode == DHT_FIND_PROVIDERS; ++i, ++oldest) {
+        if (node->providers[i].file_id == request->file_id)
+            reply->providers[reply->provider_count++] = node->providers[i].client_id;
+    }
+    for (int i = node->provider_count - 1; i >= oldest && reply->provider_count < DHT_MAX_PROVIDERS &&
+                    request->opcode == DHT_FIND_PROVIDERS; --i) {
+        if (node->providers[i].file_id == request->file_id)
+            reply->providers[reply->provider_count++] = node->providers[i].client_id;
+    }
+
+    // Keep the DHT_K closest contacts, sorted by insertion
+    uint64_t key = request->key;
+    uint64_t distances[DHT_K];
+    pthread_mutex_lock(&node->lock);
+    for (int i = 0; i < node->contact_count; ++i) {
+        uint64_t distance = key ^ node_id_of(node->contacts[i]);
+        int position = (int)reply->contact_count;
+        while (position > 0 && distances[position - 1] > distance)
+            position--;
+        if (position == DHT_K)
+            continue;
+
+        int moved = (int)MIN(reply->contact_count, DHT_K - 1) - position;
+        memmove(&distances[position + 1], &distances[position], sizeof(uint64_t) * moved);
+        memmove(&reply->contacts[position + 1], &reply->contacts[position], sizeof(int32_t) * moved);
+        distances[position] = distance;
+        reply->contacts[position] = node->contacts[i];
+        reply->contact_count = MIN(reply->contact_count + 1, DHT_K);
+    }
+    pthread_mutex_unlock(&node->lock);
+}
+
+static void store_provider(DhtNode_t *node, int file_id, int client_id) {
+    for (int i = 0; i < node->provider_count; ++i) {
+        if (node->providers[i].file_id == file_id && node->providers[i].client_id == client_id)
+            return;
+    }
+    if (node->provider_count == node->provider_capacity) {
+        node->provider_capacity = node->provider_capacity ? node->provider_capacity * 2 : DHT_K;
+        node->providers = realloc(node->providers, sizeof(DhtProvider_t) * node->provider_capacity);
+        if (!node->providers) {
+            fprintf(stderr, "Error: Memory allocation failed for DHT records.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    node->providers[node->provider_count++] = (DhtProvider_t){.file_id = file_id, .client_id = client_id};
+}
+
+// Answers one DHT request that reached the client's upload coroutine from source_rank.
+void dht_serve(ClientFiles_t *client, int source_rank, const DhtRequest_t *request) {
+    DhtNode_t *node = client->dht;
+    int reply_local = client_local_of(request->client_id);
+    node->requests_served++;
+
+    // Every request teaches the node of its sender
+    add_contact(node, request->client_id);
+
+    if (request->opcode == DHT_GET_FILE) {
+        DhtFileReply_t *reply = dht_alloc(sizeof(DhtFileReply_t));
+        memset(reply, 0, sizeof(*reply));
+        reply->request_id = request->request_id;
+
+        // What the client holds now: the download coroutine publishes new files with release stores
+        size_t owned_count = __atomic_load_n(&client->owned_files_count, __ATOMIC_ACQUIRE);
+        const FileData_t *file = find_file_data(client->owned_files, owned_count, request->file_id);
+        if (file) {
+            reply->segment_count = (uint32_t)file->segment_count;
+            memcpy(reply->have, file->have, sizeof(reply->have));
+            reply->segment_total = (uint32_t)file->segment_total;
+            reply->root = file->root;
+        }
+
+        if (comm_send(COMM_DATA, source_rank, reply_local, DHT_TAG, reply, sizeof(*reply)) != MPI_SUCCESS)
+            fprintf(stderr, "MPI_Send failed while sending file data to client %d.\n", request->client_id);
+        free(reply);
+        return;
+    }
+
+    DhtReply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.request_id = request->request_id;
+    if (request->opcode == DHT_FIND_PROVIDERS || request->opcode == DHT_FIND_NODE)
+        answer_find(node, request, &reply);
+    else if (request->opcode == DHT_ADD_PROVIDER)
+        store_provider(node, request->file_id, request->client_id);
+
+    if (comm_send(COMM_DATA, source_rank, reply_local, DHT_TAG, &reply, sizeof(reply)) != MPI_SUCCESS)
+        fprintf(stderr, "MPI_Send failed while sending a DHT reply to client %d.\n", request->client_id);
+}
@@ -0,0 +1,97 @@
+#ifndef _DHT_H_
+#define _DHT_H_
+
+#include "utils.h"
+
+// * Trackerless Peer Discovery (--dht)
+// * A Kademlia-style distributed hash table over the logical clients. Node ids and keys are
+// * 64-bit hashes of client ids and file ids; the DHT_K nodes closest to a file's key (by XOR
+// * distance) keep the ids of the file's providers. A node starts out knowing only the
+// * DHT_BOOTSTRAP first clients and fills its routing table by looking its own id up. Every client
+// * serves DHT requests from its upload coroutine and looks providers up from its download coroutine.
+#define DHT_K 8 // * bucket size, and how many nodes keep each provider record
+#define DHT_ALPHA 3 // * lookup requests in flight
+#define DHT_SHORTLIST (4 * DHT_K) // * closest candidates a lookup keeps
+#define DHT_MAX_PROVIDERS 32 // * provider ids in one reply
+#define DHT_BOOTSTRAP 3 // * well-known nodes every node starts out with
+#define DHT_JOIN_ROUNDS 2 // * self-lookups of every node, the later ones over the tables the earlier filled
+
+typedef enum DhtOpcode_t {
+    DHT_FIND_PROVIDERS = 0, // * reply: known providers of the key and the closest contacts
+    DHT_ADD_PROVIDER, // * reply: empty, once the record is stored
+    DHT_GET_FILE, // * reply: DhtFileReply_t with what the provider holds of the file
+    DHT_FIND_NODE // * reply: the closest contacts only
+} DhtOpcode_t;
+
+// * DHT Request (client -> client on the peer channel, DHT_TAG)
+typedef struct DhtRequest_t {
+    uint32_t request_id;
+    int32_t client_id; // * requester, who gets the reply
+    int32_t opcode;
+    int32_t file_id;
+    uint64_t key; // * looked up by FIND_PROVIDERS and FIND_NODE
+} DhtRequest_t;
+
+// * Lookup Reply (on the data channel, DHT_TAG)
+typedef struct DhtReply_t {
+    uint32_t request_id;
+    uint32_t provider_count;
+    uint32_t contact_count;
+    int32_t providers[DHT_MAX_PROVIDERS];
+    int32_t contacts[DHT_K]; // * the responder's contacts closest to the key
+} DhtReply_t;
+
+// * File Reply (on the data channel, DHT_TAG): the file's Merkle root and segment total, and
+// * the bitfield of the segments the provider holds
+typedef struct DhtFileReply_t {
+    uint32_t request_id;
+    uint32_t segment_count;
+    uint64_t have[SEGMENT_WORDS];
+    uint32_t segment_total;
+    uint32_t reserved;
+    Digest_t root;
+} DhtFileReply_t;
+
+typedef struct DhtProvider_t {
+    int32_t file_id;
+    int32_t client_id;
+} DhtProvider_t;
+
+// * One client's DHT node
+typedef struct DhtNode_t {
+    uint64_t id;
+    int client_id;
+
+    // * Routing table: at most DHT_K contacts per bucket (distance in [2^b, 2^(b+1))). Both
+    // * coroutines add the nodes they hear from, under the lock.
+    pthread_mutex_t lock;
+    int32_t *contacts;
+    int contact_count;
+    int bucket_counts[64];
+
+    // * Served by the upload coroutine only
+    DhtProvider_t *providers; // * records this node keeps for others
+    int provider_count;
+    int provider_capacity;
+    uint64_t requests_served;
+
+    // * Download coroutine only: the files the client stored its provider record for
+    int32_t *published;
+    int published_count;
+} DhtNode_t;
+
+DhtNode_t *dht_node_create(const ClientFiles_t *client, int client_count);
+
+void dht_node_free(DhtNode_t *node);
+
+void dht_join(ClientFiles_t *client);
+
+void dht_publish(ClientFiles_t *client);
+
+void dht_refresh(ClientFiles_t *client, size_t file_idx, int file_id, bool find_peers);
+
+void dht_find_peers(ClientFiles_t *client);
+
+void dht_serve(ClientFiles_t *client, int source_rank, const DhtRequest_t *request);
+
+#endif
@@ -0,0 +1,124 @@
+#include "digest.h"
+
+// Returns the value of a single hex character, or -1 if it is not one.
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Parses HASH_SIZE hex characters into a raw digest.
+// Returns false if the string is too short or contains non-hex characters.
+bool digest_from_hex(Digest_t* digest, const char* hex) {
+    for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+        int high = hex_value(hex[2 * i]);
+        int low = (high < 0) ? -1 : hex_value(hex[2 * i + 1]);
+        if (low < 0) {
+            return false;
+        }
+        digest->bytes[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
+
+// Formats a raw digest as HASH_SIZE lowercase hex characters plus a terminator.
+// The output buffer must hold at least HASH_SIZE + 1 bytes.
+void digest_to_hex(const Digest_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < DIGEST_SIZE; ++i) {
+        hex[2 * i] = digits[digest->bytes[i] >> 4];
+        hex[2 * i + 1] = digits[digest->bytes[i] & 0x0f];
+    }
+    hex[HASH_SIZE] = '\0';
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// Runs the SHA-256 compression function over one 64-byte block.
+static void sha256_block(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/*
+ * Hashes two sibling nodes of a Merkle tree into their parent: SHA-256 over a 0x01 byte and the
+ * two digests, cut to DIGEST_SIZE bytes. The prefix keeps inner nodes apart from segment digests.
+ */
+void digest_combine(const Digest_t* left, const Digest_t* right, Digest_t* parent) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    // The message and its padding (0x80, zeros, the bit length) fill one or two blocks
+    uint8_t blocks[128] = {0};
+    size_t length = 1 + 2 * DIGEST_SIZE;
+    size_t padded = (length + 9 <= 64) ? 64 : 128;
+    blocks[0] = 0x01;
+    memcpy(&blocks[1], left->bytes, DIGEST_SIZE);
+    memcpy(&blocks[1 + DIGEST_SIZE], right->bytes, DIGEST_SIZE);
+    blocks[length] = 0x80;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; ++i)
+        blocks[padded - 1 - i] = (uint8_t)(bits >> (8 * i));
+
+    for (size_t offset = 0; offset < padded; offset += 64)
+        sha256_block(state, &blocks[offset]);
+
+    for (size_t i = 0; i < DIGEST_SIZE; ++i)
+        parent->bytes[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// 64-bit FNV-1a over a byte range. Chain calls by passing the previous result as seed;
+// start with FINGERPRINT_SEED.
+uint64_t fingerprint_bytes(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = seed;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
@@ -0,0 +1,30 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include "utils.h"
+
+#define FINGERPRINT_SEED 0xcbf29ce484222325ull
+
+bool digest_from_hex(Digest_t* digest, const char* hex);
+
+void digest_to_hex(const Digest_t* digest, char* hex);
+
+// Compares two raw digests a 64-bit word at a time, without branching, so the compiler can
+// use 16-byte vector loads (two for 32-byte digests).
+static inline bool digest_equal(const Digest_t* a, const Digest_t* b) {
+    uint64_t x[DIGEST_SIZE / 8];
+    uint64_t y[DIGEST_SIZE / 8];
+    memcpy(x, a->bytes, DIGEST_SIZE);
+    memcpy(y, b->bytes, DIGEST_SIZE);
+
+    uint64_t diff = 0;
+    for (size_t i = 0; i < DIGEST_SIZE / 8; ++i)
+        diff |= x[i] ^ y[i];
+    return diff == 0;
+}
+
+void digest_combine(const Digest_t* left, const Digest_t* right, Digest_t* parent);
+
+uint64_t fingerprint_bytes(const void* data, size_t size, uint64_t seed);
+
+#endif
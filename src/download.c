@@ -1,4 +1,13 @@
 #include "download.h"
+#include "digest.h"
+#include "checkpoint.h"
+#include "writer.h"
+#include "comm.h"
+#include "dht.h"
+#include "merkle.h"
+#include "trace.h"
+#include "dedup.h"
+#include "subscribe.h"
 
 // Handles MPI errors by printing an error message and aborting the MPI environment.
 static void handle_mpi_error(int error_code, const char* error_message) {
@@ -8,42 +17,34 @@ static void handle_mpi_error(int error_code, const char* error_message) {
     }
 }
 
-// Sends the client type to the tracker.
-// This tells the tracker whether the client is a SEEDER, PEER, or LEECHER.
-static void send_client_type(Client_Type_t client_type) {
-    int result = MPI_Send(&client_type, 1, MPI_INT, TRACKER_RANK,
-                          PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD);
-    handle_mpi_error(result, "Failed to send client_type to tracker");
+// Receives the next message from the tracker with the given tag, for this client.
+static int recv_from_tracker(const ClientFiles_t* client, int tag, void* data, int size) {
+    return comm_recv(COMM_DOWNLOAD_INBOX, client_local_of(client->client_id), COMM_CONTROL, TRACKER_RANK, tag,
+                     data, size, NULL, COUNTER_SITE_SWARM);
 }
 
-// Sends the list of wanted file IDs to the tracker.
-// First sends the number of wanted files, then the actual file IDs.
+// Sends the client's id, type and wanted file IDs to the tracker, in one message.
+// The id tells the tracker which of the rank's clients is asking.
 static void send_wanted_files(ClientFiles_t* client) {
-    size_t count = client->wanted_files_count;
-
-    // Inform the tracker how many files we want
-    int mpi_result = MPI_Send(&count, 1, MPI_UNSIGNED, TRACKER_RANK,
-                              PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD);
-    handle_mpi_error(mpi_result, "Failed to send wanted_files_count to tracker");
-
-    // Allocate memory to hold the file IDs
-    int* file_ids = malloc(sizeof(int) * count);
-    if (!file_ids && count > 0) {
-        fprintf(stderr, "Error: Memory allocation failed for file_ids.\n");
-        MPI_Abort(MPI_COMM_WORLD, 1);
-    }
+    WantedFiles_t wanted;
+    memset(&wanted, 0, sizeof(wanted));
+    wanted.client_id = client->client_id;
+    wanted.client_type = client->client_type;
+    wanted.count = (uint32_t)MIN(client->wanted_files_count, MAX_FILES);
 
     // Extract the numeric file ID from each file name
-    for (size_t i = 0; i < count; ++i) {
+    for (uint32_t i = 0; i < wanted.count; ++i) {
         const char* name = client->wanted_files[i].file_name;
-        file_ids[i] = atoi(&name[strlen(name) - 1]); // Assumes file ID is the last character
+        wanted.file_ids[i] = atoi(&name[strlen(name) - 1]); // Assumes file ID is the last character
+    }
+
+    // Ask the tracker to push what changes in the swarms of these files
+    if (options.subscribe) {
+        wanted.flags |= WANTED_SUBSCRIBE;
     }
 
-    // Send the array of file IDs to the tracker
-    mpi_result = MPI_Send(file_ids, count, MPI_INT, TRACKER_RANK,
-                          PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD);
-    free(file_ids); // Free the allocated memory after sending
-    handle_mpi_error(mpi_result, "Failed to send file IDs to tracker");
+    int mpi_result = comm_send(COMM_CONTROL, TRACKER_RANK, 0, PEERS_SEEDERS_TRANSFER_TAG, &wanted, sizeof(wanted));
+    handle_mpi_error(mpi_result, "Failed to send wanted files to tracker");
 }
 
 // Processes the client if it is a SEEDER.
@@ -61,7 +62,6 @@ static void process_peer_or_leecher(ClientFiles_t* client) {
 // Sends all necessary client information to the tracker based on the client type.
 // This includes the client type and, if applicable, the list of wanted files.
 static void send_client_information(ClientFiles_t* client) {
-    send_client_type(client->client_type);
     if (client->client_type == PEER || client->client_type == LEECHER) {
         process_peer_or_leecher(client);
     } else if (client->client_type == SEEDER) {
@@ -69,70 +69,76 @@ static void send_client_information(ClientFiles_t* client) {
     }
 }
 
-// Receives the count of peers/seeders in the swarm for a specific file from the tracker.
-static int receive_in_swarm_count() {
-    int count;
-    MPI_Status status;
-
-    // Get the number of peers/seeders from the tracker
-    int result = MPI_Recv(&count, 1, MPI_INT, TRACKER_RANK,
-                          PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &status);
+// Receives the header of a wanted file's swarm from the tracker: the member count, the swarm
+// version and the file's Merkle root and segment total.
+static void receive_swarm_header(const ClientFiles_t* client, SwarmHeader_t* header) {
+    int result = recv_from_tracker(client, PEERS_SEEDERS_TRANSFER_TAG, header, sizeof(*header));
     handle_mpi_error(result, "Failed to receive in_swarm_count");
-    return count;
 }
 
-// Receives the ranks of peers in the swarm from the tracker.
-static int* receive_ranks(int count) {
+// Receives the segment digests of a wanted file from the tracker (--dedup) and keeps the tree
+// they build as the file's catalog.
+static void receive_leaves(const ClientFiles_t* client, PeersList_t* peers) {
+    Digest_t leaves[MAX_CHUNKS];
+    int result = recv_from_tracker(client, PEERS_SEEDERS_TRANSFER_TAG, leaves, peers->segment_total * sizeof(Digest_t));
+    handle_mpi_error(result, "Failed to receive segment digests");
+    dedup_catalog(peers, leaves, peers->segment_total);
+}
+
+// Receives the ids of the peers in the swarm from the tracker.
+static int* receive_ranks(const ClientFiles_t* client, int count) {
     // Allocate memory to hold the ranks
     int* ranks = malloc(sizeof(int) * count);
     if (!ranks && count > 0) {
         fprintf(stderr, "Error: Memory allocation failed for ranks_in_swarm.\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    MPI_Status status;
 
     // Get the ranks array from the tracker
-    int result = MPI_Recv(ranks, count, MPI_INT, TRACKER_RANK,
-                          PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &status);
+    int result = recv_from_tracker(client, PEERS_SEEDERS_TRANSFER_TAG, ranks, count * sizeof(int));
     handle_mpi_error(result, "Failed to receive ranks_in_swarm");
     return ranks;
 }
 
-// Receives the file segment hashes from a specific peer in the swarm.
-static void receive_segments(int peer_rank, FileSegment_t* segments, size_t segment_count) {
-    MPI_Status status;
-
-    // Loop through each segment and receive its hash
-    for (size_t i = 0; i < segment_count; ++i) {
-        int result = MPI_Recv(segments[i].hash, HASH_SIZE, MPI_CHAR,
-                              TRACKER_RANK, HASH_TAG, MPI_COMM_WORLD, &status);
-        handle_mpi_error(result, "Failed to receive file segment hash");
-    }
+// Receives the bitfield of the segments a specific peer in the swarm holds. The digests come
+// from the peers themselves, with their proofs.
+static void receive_segments(const ClientFiles_t* client, uint64_t* have) {
+    int result = recv_from_tracker(client, HASH_TAG, have, sizeof(uint64_t) * SEGMENT_WORDS);
+    handle_mpi_error(result, "Failed to receive file segment bitfield");
 }
 
 // Populates the peer information structure with the received data.
 static void populate_peer_info(PeersList_t* peers_list, size_t file_idx,
-                               int swarm_idx, int file_id, int peer_rank,
-                               size_t segment_count, FileSegment_t* segments) {
+                               int swarm_idx, int file_id, int peer_id,
+                               size_t segment_count, const uint64_t* have, const uint64_t* withheld) {
     peers_list[file_idx].peers_array[swarm_idx].file_id = file_id;
-    peers_list[file_idx].peers_array[swarm_idx].peer_rank = peer_rank;
+    peers_list[file_idx].peers_array[swarm_idx].peer_id = peer_id;
+    peers_list[file_idx].peers_array[swarm_idx].refused = false;
     peers_list[file_idx].peers_array[swarm_idx].segment_count = segment_count;
-
-    // Copy the received segments into the peer's segment list
-    memcpy(peers_list[file_idx].peers_array[swarm_idx].segments,
-           segments, sizeof(FileSegment_t) * segment_count);
+    memcpy(peers_list[file_idx].peers_array[swarm_idx].have, have, sizeof(uint64_t) * SEGMENT_WORDS);
+    memcpy(peers_list[file_idx].peers_array[swarm_idx].withheld, withheld, sizeof(uint64_t) * SEGMENT_WORDS);
 }
 
 // Receives and stores the swarm information for a specific wanted file.
 static void receive_and_store_swarm_info(ClientFiles_t* client, size_t file_idx) {
-    // Get the number of peers/seeders for this file
-    int in_swarm = receive_in_swarm_count();
-
-    // Get the ranks of the peers in the swarm
-    int* ranks = receive_ranks(in_swarm);
+    // Get the number of peers/seeders for this file, and what identifies the file
+    SwarmHeader_t header;
+    receive_swarm_header(client, &header);
+    int in_swarm = header.member_count;
 
     PeersList_t* peers_list = client->peers;
     peers_list[file_idx].peers_count = in_swarm;
+    peers_list[file_idx].swarm_version = header.version;
+    peers_list[file_idx].segment_total = MIN(header.segment_total, MAX_CHUNKS);
+    peers_list[file_idx].root = header.root;
+
+    // With --dedup, what the file is made of comes before its members
+    if (header.leaves) {
+        receive_leaves(client, &peers_list[file_idx]);
+    }
+
+    // Get the ids of the peers in the swarm
+    int* ranks = receive_ranks(client, in_swarm);
 
     // Allocate memory for the peers array if there are peers in the swarm
     if (in_swarm > 0) {
@@ -144,35 +150,35 @@ static void receive_and_store_swarm_info(ClientFiles_t* client, size_t file_idx)
         }
     }
 
-    FileSegment_t temp_segments[MAX_CHUNKS]; // Temporary buffer for segments
+    uint64_t temp_have[SEGMENT_WORDS];
+    uint64_t temp_withheld[SEGMENT_WORDS] = {0};
 
     // Loop through each peer in the swarm to receive their segment information
     for (int i = 0; i < in_swarm; ++i) {
-        size_t segment_count;
-        MPI_Status status;
+        unsigned int segment_count = 0;
 
         // Receive the number of segments this peer has for the file
-        int result = MPI_Recv(&segment_count, 1, MPI_UNSIGNED, TRACKER_RANK,
-                              PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &status);
+        int result = recv_from_tracker(client, PEERS_SEEDERS_TRANSFER_TAG, &segment_count, sizeof(segment_count));
         handle_mpi_error(result, "Failed to receive segment_count");
 
-        int peer_rank;
+        int peer_id;
 
-        // Receive the rank of the peer that owns these segments
-        result = MPI_Recv(&peer_rank, 1, MPI_INT, TRACKER_RANK,
-                          PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &status);
+        // Receive the id of the peer that owns these segments
+        result = recv_from_tracker(client, PEERS_SEEDERS_TRANSFER_TAG, &peer_id, sizeof(peer_id));
         handle_mpi_error(result, "Failed to receive peer rank from tracker");
 
-        // Receive the actual segment hashes from the peer
-        receive_segments(peer_rank, temp_segments, segment_count);
+        // Receive which segments the peer holds (and, from a super-seeder, which it withholds)
+        receive_segments(client, temp_have);
+        if (options.super_seed)
+            receive_segments(client, temp_withheld);
 
         // Extract the file ID from the file name (assumes last character is the ID)
         int file_id = atoi(&client->wanted_files[file_idx].file_name[
                 strlen(client->wanted_files[file_idx].file_name) - 1]);
 
         // Populate the peer information with the received data
-        populate_peer_info(peers_list, file_idx, i, file_id, peer_rank,
-                           segment_count, temp_segments);
+        populate_peer_info(peers_list, file_idx, i, file_id, peer_id,
+                           MIN(segment_count, MAX_CHUNKS), temp_have, temp_withheld);
     }
 
     free(ranks); // Free the allocated memory for ranks after processing
@@ -186,8 +192,14 @@ static void receive_all_swarm_info(ClientFiles_t* client) {
     }
 }
 
-// Requests the list of seeders/peers from the tracker and stores the received information.
+// Requests the list of seeders/peers from the tracker (or the DHT, with --dht) and stores the
+// received information.
 void request_seeders_peers_list(ClientFiles_t* client) {
+    if (options.dht) {
+        dht_find_peers(client);
+        return;
+    }
+
     send_client_information(client);   // Send client type and wanted files to the tracker
     receive_all_swarm_info(client);    // Receive swarm information for all wanted files
 }
@@ -204,45 +216,82 @@ bool file_is_owned(ClientFiles_t* client, int file_id) {
 }
 
 // Adds a new file to the client's owned_files array.
-// Initializes the new file with zero segments.
+// Initializes the new file with zero segments. The array has room for the wanted files, so it
+// moves only for a file the client did not ask for, and never under the upload thread's feet;
+// the new entry is published to it together with the count.
 void add_file_to_owned(ClientFiles_t* client, int file_id) {
-    // Reallocate memory to accommodate the new file
-    FileData_t* new_files = realloc(client->owned_files,
-                                    sizeof(FileData_t) * (client->owned_files_count + 1));
-    if (!new_files) {
-        fprintf(stderr, "Error: Memory reallocation failed in add_file_to_owned.\n");
-        MPI_Abort(MPI_COMM_WORLD, 1);
-    }
+    if (client->owned_files_count == client->owned_files_capacity) {
+        // Reallocate memory to accommodate the new file
+        FileData_t* new_files = realloc(client->owned_files,
+                                        sizeof(FileData_t) * (client->owned_files_count + 1));
+        if (!new_files) {
+            fprintf(stderr, "Error: Memory reallocation failed in add_file_to_owned.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
 
-    client->owned_files = new_files; // Update the owned_files pointer
+        client->owned_files = new_files; // Update the owned_files pointer
+        client->owned_files_capacity++;
+    }
 
     // Initialize the newly added file
     FileData_t* new_file = &client->owned_files[client->owned_files_count];
+    memset(new_file, 0, sizeof(FileData_t));
     snprintf(new_file->file_name, sizeof(new_file->file_name), "file%d", file_id);
     new_file->file_id = file_id;
     new_file->segment_count = 0;
 
-    client->owned_files_count++; // Increment the count of owned files
+    // Increment the count of owned files
+    __atomic_store_n(&client->owned_files_count, client->owned_files_count + 1, __ATOMIC_RELEASE);
 }
 
-// Adds a segment to the FileData_t's segments array if there is capacity.
-// Returns true on success, false otherwise.
-bool add_segment_to_file_data(FileData_t *data, const FileSegment_t seg) {
-    if (data->segment_count >= MAX_CHUNKS) {
-        return false; // No more space to add segments
+// Returns the owned file data of a wanted file, adding it (with the root and segment total of
+// the file's swarm) if the client holds nothing of it yet.
+FileData_t* wanted_file_data(ClientFiles_t* client, size_t file_idx) {
+    const char* name = client->wanted_files[file_idx].file_name;
+    int file_id = atoi(&name[strlen(name) - 1]);
+
+    if (!file_is_owned(client, file_id)) {
+        add_file_to_owned(client, file_id);
+    }
+    FileData_t* file_data = find_file_data(client->owned_files, client->owned_files_count, file_id);
+    if (file_data->segment_total == 0) {
+        file_data->segment_total = client->peers[file_idx].segment_total;
+        file_data->root = client->peers[file_idx].root;
+    }
+    return file_data;
+}
+
+// Stores a segment at its index in the file and marks it as held.
+// Returns false if the index is out of range.
+bool store_segment(FileData_t *data, size_t segment_idx, const FileSegment_t seg) {
+    if (segment_idx >= MAX_CHUNKS) {
+        return false; // No slot for this segment
     }
 
-    // Copy the segment's hash into the next available slot
-    strncpy(data->segments[data->segment_count].hash, seg.hash, HASH_SIZE);
-    data->segment_count++; // Increment the segment count
+    // A digest that came in a proof is in place already, and the upload thread may be reading it
+    if (!segment_bit_test(data->known, segment_idx)) {
+        data->segments[segment_idx] = seg;
+        segment_bit_set(data->known, segment_idx);
+    }
+    data->segment_count = MAX(data->segment_count, segment_idx + 1);
+    segment_bit_publish(data->have, segment_idx);
     return true;
 }
 
+// Adds a segment to the FileData_t's segments array if there is capacity.
+// Returns true on success, false otherwise.
+bool add_segment_to_file_data(FileData_t *data, const FileSegment_t seg) {
+    return store_segment(data, data->segment_count, seg);
+}
+
 // Checks if the FileData_t already contains a specific segment by comparing hashes.
 // Returns true if the segment exists, false otherwise.
 bool has_segment(const FileData_t *data, const FileSegment_t seg) {
     for (size_t i = 0; i < data->segment_count; ++i) {
-        if (strcmp(data->segments[i].hash, seg.hash) == 0) {
+        if (!segment_bit_test(data->have, i)) {
+            continue; // Slot not downloaded yet
+        }
+        if (digest_equal(&data->segments[i].digest, &seg.digest)) {
             return true; // Segment already exists
         }
     }
@@ -260,26 +309,220 @@ FileData_t* find_file_data(FileData_t* f_data, size_t search_count, int file_id)
     return NULL; // File not found
 }
 
-// Writes the segments of a FileData_t structure to a file, one hash per line.
-// Flushes the output buffer after each write to ensure data integrity.
-void write_to_file(const char* file_name, FileData_t* data) {
-    if (!data || data->segment_count == 0) {
-        fprintf(stderr, "Warning: write_to_file called with empty or null FileData_t for %s.\n",
-                file_name);
+// Returns the index of the first peer of the list that holds a segment the client's file data
+// lacks, or -1 if there is none. Peers that turned the client away are left out if asked.
+int peer_holding_missing(const PeersList_t* peers, const FileData_t* data, bool skip_refused) {
+    for (int i = 0; i < peers->peers_count; ++i) {
+        const PeerInfo_t* peer = &peers->peers_array[i];
+        if (skip_refused && peer->refused) {
+            continue;
+        }
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            if (peer->have[word] & ~data->have[word]) {
+                return i;
+            }
+        }
     }
+    return -1;
+}
 
-    // Open the file for writing
-    FILE* out = fopen(file_name, "w");
-    if (!out) {
-        fprintf(stderr, "Error: Could not open file %s for writing.\n", file_name);
-        return; // Exit the function gracefully if the file cannot be opened
+/*
+ * Shows the downloader what the super-seeders of a file withheld from it, once no source it
+ * knows holds a segment it misses. Returns true if that gave it a new source.
+ */
+bool reveal_withheld(PeersList_t* peers, const FileData_t* data) {
+    bool revealed = false;
+    for (int i = 0; i < peers->peers_count; ++i) {
+        PeerInfo_t* peer = &peers->peers_array[i];
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            revealed |= (peer->withheld[word] & ~data->have[word]) != 0;
+            peer->have[word] |= peer->withheld[word];
+            peer->withheld[word] = 0;
+        }
     }
+    return revealed;
+}
 
-    // Write each segment's hash to the file
-    for (size_t i = 0; i < data->segment_count; ++i) {
-        fprintf(out, "%s\n", data->segments[i].hash);
-        fflush(out); // Ensure the data is written immediately
+// Sets the have bits of peer for the segments of the file it says it holds, and the peer's
+// segment count. Segments are asked for by index, so no digest is needed.
+static void merge_availability(const PeersList_t* peers_list, PeerInfo_t* peer, const uint64_t* have) {
+    for (size_t idx = 0; idx < peers_list->segment_total; ++idx) {
+        if (segment_bit_test(have, idx)) {
+            segment_bit_set(peer->have, idx);
+            peer->segment_count = MAX(peer->segment_count, idx + 1);
+        }
+    }
+}
+
+/*
+ * Adds what another client says it holds of a file to the file's peer list: a new source joins
+ * the list (if it has fewer than max_peers), a known one gets its new segments. A new source is
+ * kept only if it holds a segment of the file. The peer array may move.
+ * Returns true if a new source joined.
+ */
+bool learn_peer(PeersList_t* peers_list, int file_id, int peer_id, const uint64_t* have, int max_peers) {
+    PeerInfo_t* peer = NULL;
+    for (int i = 0; i < peers_list->peers_count && !peer; ++i) {
+        if (peers_list->peers_array[i].peer_id == peer_id) {
+            peer = &peers_list->peers_array[i];
+        }
+    }
+    if (peer) {
+        merge_availability(peers_list, peer, have);
+        return false;
+    }
+
+    if (peers_list->peers_count >= max_peers) {
+        return false;
+    }
+    PeerInfo_t* peers = realloc(peers_list->peers_array, sizeof(PeerInfo_t) * (peers_list->peers_count + 1));
+    if (!peers) {
+        fprintf(stderr, "Error: Memory allocation failed for a new peer.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    peers_list->peers_array = peers;
+    peer = &peers[peers_list->peers_count++];
+    memset(peer, 0, sizeof(*peer));
+    peer->file_id = file_id;
+    peer->peer_id = peer_id;
+    merge_availability(peers_list, peer, have);
+
+    if (peer->segment_count == 0) {
+        peers_list->peers_count--;
+        return false;
+    }
+    return true;
+}
+
+// Picks the id of the client's next request.
+uint32_t next_request_id(ClientFiles_t* client) {
+    return ++client->last_request_id;
+}
+
+// Sends an opcode to the tracker, to be followed by record_count segment records.
+static int send_opcode(ClientFiles_t* client, const char* opcode, uint32_t* request_id, int record_count) {
+    ControlMessage_t message;
+    memset(&message, 0, sizeof(message));
+    message.request_id = next_request_id(client);
+    message.client_id = client->client_id;
+    strncpy(message.opcode, opcode, OPCODE_SIZE - 1);
+
+    if (request_id) {
+        *request_id = message.request_id;
+    }
+    trace_record(TRACE_ANNOUNCE, 0, true, client->client_id, 0, record_count, 0, counters_opcode(opcode));
+    return comm_send(COMM_CONTROL, TRACKER_RANK, 0, INFORM_TAG, &message, sizeof(message));
+}
+
+// Sends an opcode to the tracker on the control channel, under a new request id.
+int send_control(ClientFiles_t* client, const char* opcode, uint32_t* request_id) {
+    return send_opcode(client, opcode, request_id, 0);
+}
+
+// Waits for the tracker's ACK of one of the client's requests. Returns true if the tracker answered "OK".
+bool wait_for_ack(ClientFiles_t* client, uint32_t request_id) {
+    Reply_t reply;
+    int result = comm_recv_reply(COMM_DOWNLOAD_INBOX, client_local_of(client->client_id), COMM_CONTROL, TRACKER_RANK,
+                                 ACK_TAG, request_id, &reply, sizeof(reply), NULL,
+                                 COUNTER_SITE_TRACKER_ACK);
+    handle_mpi_error(result, "Failed to receive acknowledgment from tracker");
+    return strcmp(reply.status, "OK") == 0;
+}
+
+// Announces newly held segments to the tracker: the opcode, then all records in one message.
+// The tracker ACKs under the request id stored in request_id. Both sends are queued without
+// yielding in between, so no other client of the rank can slip a message between them.
+int announce_segments(ClientFiles_t* client, const char* opcode, const SegmentRecord_t* records, int count,
+                      uint32_t* request_id) {
+    int result = send_opcode(client, opcode, request_id, count);
+    if (result != MPI_SUCCESS) {
+        return result;
+    }
+    return comm_send(COMM_CONTROL, TRACKER_RANK, 0, INFORM_TAG, records, count * sizeof(SegmentRecord_t));
+}
+
+/*
+ * Rebuilds the segments a checkpoint says were already downloaded from the tree it kept of each
+ * file, and announces all of them to the tracker in a single RESTORED batch. A file whose root
+ * changed since is fetched again, and so is any segment its saved tree no longer proves.
+ */
+void restore_from_checkpoint(ClientFiles_t* client) {
+    SegmentRecord_t* records = malloc(sizeof(SegmentRecord_t) * MAX_FILES * MAX_CHUNKS);
+    FileData_t* saved = malloc(sizeof(FileData_t));
+    if (!records || !saved) {
+        fprintf(stderr, "Error: Memory allocation failed for restored segments.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int record_count = 0;
+
+    for (size_t file_idx = 0; file_idx < client->wanted_files_count && file_idx < MAX_FILES; ++file_idx) {
+        const char* name = client->wanted_files[file_idx].file_name;
+        int file_id = atoi(&name[strlen(name) - 1]);
+
+        const CheckpointEntry_t* entry = checkpoint_entry(client->checkpoint, file_id);
+        const PeersList_t* peers = &client->peers[file_idx];
+        if (!entry || peers->segment_total == 0 || !digest_equal(&entry->root, &peers->root)) {
+            continue;
+        }
+
+        bool restorable = false;
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            restorable |= entry->have[word] != 0;
+        }
+        if (!restorable) {
+            continue;
+        }
+
+        // The saved tree proves each segment into the file data like an uploader would
+        checkpoint_restore_tree(entry, saved);
+        saved->segment_total = peers->segment_total;
+        FileData_t* file_data = wanted_file_data(client, file_idx);
+
+        for (size_t segment_idx = 0; segment_idx < peers->segment_total; ++segment_idx) {
+            if (!segment_bit_test(entry->have, segment_idx)) {
+                continue;
+            }
+
+            MerkleProof_t proof;
+            const FileSegment_t segment = saved->segments[segment_idx];
+            if (!merkle_proof(saved, segment_idx, &proof) ||
+                !merkle_verify(file_data, segment_idx, &segment.digest, &proof)) {
+                continue;
+            }
+
+            store_segment(file_data, segment_idx, segment);
+            writer_segment(client->writer, client->client_id, file_id, segment_idx, &segment.digest);
+
+            SegmentRecord_t* record = &records[record_count++];
+            record->file_id = file_id;
+            record->segment_idx = (uint32_t)segment_idx;
+        }
     }
 
-    fclose(out); // Close the file after writing
+    // Without a tracker nobody needs to hear about them
+    if (record_count > 0 && !options.dht) {
+        uint32_t request_id;
+        int result = announce_segments(client, "RESTORED", records, record_count, &request_id);
+        handle_mpi_error(result, "Failed to announce restored segments");
+
+        // Wait until the tracker has recorded them before downloading the rest
+        wait_for_ack(client, request_id);
+    }
+    if (record_count > 0) {
+        printf("Client %d restored %d segments from its checkpoint\n", client->client_id, record_count);
+    }
+
+    free(saved);
+    free(records);
+}
+
+// Fingerprints one file a client holds (which file, and which of its segments).
+// Client and tracker compute it the same way, so a tracker restarted from a snapshot can tell
+// which of a client's files changed. A client's whole fingerprint adds its files' up onto
+// FINGERPRINT_SEED: the tracker learns downloaded files in announce order, not in the client's.
+uint64_t fingerprint_file(int file_id, size_t segment_count, const uint64_t* have, const Digest_t* root) {
+    int32_t header[2] = {file_id, (int32_t)segment_count};
+    uint64_t hash = fingerprint_bytes(header, sizeof(header), FINGERPRINT_SEED);
+    hash = fingerprint_bytes(root, sizeof(*root), hash);
+    return fingerprint_bytes(have, sizeof(uint64_t) * SEGMENT_WORDS, hash);
 }
@@ -9,13 +9,34 @@ bool file_is_owned(ClientFiles_t* client, int file_id);
 
 void add_file_to_owned(ClientFiles_t* client, int file_id);
 
+FileData_t* wanted_file_data(ClientFiles_t* client, size_t file_idx);
+
 bool has_segment(const FileData_t *data, const FileSegment_t seg);
 
+bool store_segment(FileData_t *data, size_t segment_idx, const FileSegment_t seg);
+
 bool add_segment_to_file_data(FileData_t *data, const FileSegment_t seg);
 
 FileData_t* find_file_data(FileData_t* f_data, size_t search_count, int file_id);
 
-void write_to_file(const char* file_name, FileData_t* data);
+bool learn_peer(PeersList_t* peers_list, int file_id, int peer_id, const uint64_t* have, int max_peers);
+
+int peer_holding_missing(const PeersList_t* peers, const FileData_t* data, bool skip_refused);
+bool reveal_withheld(PeersList_t* peers, const FileData_t* data);
+
+uint32_t next_request_id(ClientFiles_t* client);
+
+int send_control(ClientFiles_t* client, const char* opcode, uint32_t* request_id);
+
+bool wait_for_ack(ClientFiles_t* client, uint32_t request_id);
+
+int announce_segments(ClientFiles_t* client, const char* opcode, const SegmentRecord_t* records, int count,
+                      uint32_t* request_id);
+
+void restore_from_checkpoint(ClientFiles_t* client);
+
+uint64_t fingerprint_file(int file_id, size_t segment_count, const uint64_t* have, const Digest_t* root);
+
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,397 @@
+#include "fairness.h"
+#include "comm.h"
+
+Fairness_t fairness;
+
+static const char *type_names[] = {"SEEDER", "PEER", "LEECHER"};
+
+typedef enum FairnessKind_t {
+    FAIRNESS_UPLOADER = 0, // * key: client type; count: served
+    FAIRNESS_PAIR, // * key: requester id; count: served to it
+    FAIRNESS_SEGMENT // * key: file id; count: served copies of the segment
+} FairnessKind_t;
+
+// * A count on its way to rank 0
+typedef struct FairnessEntry_t {
+    int32_t kind;
+    int32_t uploader;
+    int32_t key;
+    int32_t segment;
+    uint64_t count;
+    uint64_t refused; // * uploader entries only
+} FairnessEntry_t;
+
+// * One uploader, as rank 0 reports it
+typedef struct UploaderLoad_t {
+    int client_id;
+    int client_type;
+    uint64_t served;
+    uint64_t refused;
+    uint32_t requesters;
+    uint64_t top_requester;
+} UploaderLoad_t;
+
+// * What one requester got, as rank 0 reports it
+typedef struct RequesterLoad_t {
+    uint64_t received;
+    uint32_t sources;
+    uint64_t top_source;
+} RequesterLoad_t;
+
+UploadLoad_t *fairness_create(int client_count) {
+    UploadLoad_t *load = calloc(1, sizeof(UploadLoad_t));
+    if (load)
+        load->by_requester = calloc(client_count, sizeof(uint32_t));
+    if (!load || !load->by_requester) {
+        fprintf(stderr, "Memory allocation failed for upload counts.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    load->client_count = client_count;
+    return load;
+}
+
+static void fairness_free(UploadLoad_t *load) {
+    if (!load)
+        return;
+    free(load->by_requester);
+    free(load);
+}
+
+// Starts the tracker's replication samples with the state right after registration.
+void fairness_start(const TrackerDataSet_t *m_tracker) {
+    memset(&fairness, 0, sizeof(fairness));
+    fairness.sampling = true;
+    fairness.start_ns = counters_now_ns();
+    fairness_sample(m_tracker, true);
+}
+
+static void add_sample(const ReplicationSample_t *sample) {
+    if (fairness.sample_count == fairness.sample_capacity) {
+        size_t capacity = fairness.sample_capacity ? fairness.sample_capacity * 2 : 64;
+        ReplicationSample_t *samples = realloc(fairness.samples, sizeof(ReplicationSample_t) * capacity);
+        if (!samples) {
+            fprintf(stderr, "Memory allocation failed for replication samples.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        fairness.samples = samples;
+        fairness.sample_capacity = capacity;
+    }
+    fairness.samples[fairness.sample_count++] = *sample;
+}
+
+/*
+ * Counts the holders of every segment of every registered file, once FAIRNESS_SAMPLE_MS
+ * passed since the last sample (or right away if forced), and keeps the spread per file.
+ */
+void fairness_sample(const TrackerDataSet_t *m_tracker, bool force) {
+    if (!fairness.sampling)
+        return;
+    uint64_t now = counters_now_ns();
+    if (!force && now - fairness.last_sample_ns < FAIRNESS_SAMPLE_MS * 1000000ULL)
+        return;
+    fairness.last_sample_ns = now;
+
+    static uint32_t holders[MAX_FILES][MAX_CHUNKS];
+    uint32_t complete[MAX_FILES] = {0};
+    memset(holders, 0, sizeof(holders));
+
+    for (int c = 0; c < m_tracker->client_count; ++c) {
+        const TrackerData_t *client = &m_tracker->data[c];
+        for (size_t f = 0; f < client->files_count; ++f) {
+            const TrackerFile_t *file = &client->files[f];
+            if (file->file_id <= 0 || file->file_id > MIN(m_tracker->swarm_size, MAX_FILES))
+                continue;
+            uint32_t total = m_tracker->swarms[file->file_id - 1].segment_total;
+            uint32_t held = 0;
+            for (uint32_t s = 0; s < total && s < MAX_CHUNKS; ++s) {
+                if (segment_bit_test(file->have, s)) {
+                    holders[file->file_id - 1][s]++;
+                    held++;
+                }
+            }
+            if (total > 0 && held == total)
+                complete[file->file_id - 1]++;
+        }
+    }
+
+    for (int f = 0; f < MIN(m_tracker->swarm_size, MAX_FILES); ++f) {
+        uint32_t total = MIN(m_tracker->swarms[f].segment_total, (uint32_t)MAX_CHUNKS);
+        if (total == 0)
+            continue;
+        ReplicationSample_t sample = {.time = (now - fairness.start_ns) / 1e9, .file_id = f + 1,
+                                      .min_holders = holders[f][0], .complete = complete[f]};
+        uint64_t sum = 0;
+        for (uint32_t s = 0; s < total; ++s) {
+            sample.min_holders = MIN(sample.min_holders, holders[f][s]);
+            sample.max_holders = MAX(sample.max_holders, holders[f][s]);
+            sum += holders[f][s];
+        }
+        sample.mean_holders = (double)sum / total;
+        add_sample(&sample);
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Gini coefficient of values (0 = all equal, towards 1 = all on one); sorts them.
+static double gini(uint64_t *values, int count) {
+    if (count == 0)
+        return 0;
+    qsort(values, count, sizeof(uint64_t), compare_u64);
+    double weighted = 0, sum = 0;
+    for (int i = 0; i < count; ++i) {
+        weighted += (double)(i + 1) * values[i];
+        sum += values[i];
+    }
+    return sum > 0 ? 2 * weighted / (count * sum) - (double)(count + 1) / count : 0;
+}
+
+// Writes the load spread over the uploaders of the given type (-1 = all of them). Returns
+// the Gini coefficient, and the max/mean ratio through max_mean.
+static double write_load(FILE *out, const UploaderLoad_t *uploaders, int count, int client_type, double *max_mean) {
+    uint64_t *values = malloc(sizeof(uint64_t) * (count ? count : 1));
+    if (!values) {
+        fprintf(stderr, "Memory allocation failed for the fairness report.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    int n = 0;
+    uint64_t total = 0, max = 0;
+    for (int i = 0; i < count; ++i) {
+        if (client_type >= 0 && uploaders[i].client_type != client_type)
+            continue;
+        values[n++] = uploaders[i].served;
+        total += uploaders[i].served;
+        max = MAX(max, uploaders[i].served);
+    }
+    double mean = n ? (double)total / n : 0;
+    double coefficient = gini(values, n);
+    *max_mean = mean > 0 ? max / mean : 0;
+    fprintf(out, "{\"uploaders\": %d, \"served\": %llu, \"mean\": %.2f, \"max\": %llu, \"max_mean\": %.3f, "
+                 "\"gini\": %.4f}", n, (unsigned long long)total, mean, (unsigned long long)max, *max_mean, coefficient);
+    free(values);
+    return coefficient;
+}
+
+// Packs this rank's counts, freeing each client's load. Returns how many entries.
+static int pack_entries(ClientFiles_t *clients, int count, FairnessEntry_t **entries) {
+    int total = 0;
+    for (int local = 0; local < count; ++local) {
+        const UploadLoad_t *load = clients[local].load;
+        if (!load)
+            continue;
+        total++;
+        for (int r = 0; r < load->client_count; ++r)
+            total += load->by_requester[r] > 0;
+        for (int f = 0; f < MAX_FILES; ++f) {
+            for (int s = 0; s < MAX_CHUNKS; ++s)
+                total += load->by_segment[f][s] > 0;
+        }
+    }
+
+    *entries = calloc(total ? total : 1, sizeof(FairnessEntry_t));
+    if (!*entries) {
+        fprintf(stderr, "Memory allocation failed for upload counts.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    int filled = 0;
+    for (int local = 0; local < count; ++local) {
+        ClientFiles_t *client = &clients[local];
+        UploadLoad_t *load = client->load;
+        if (!load)
+            continue;
+        (*entries)[filled++] = (FairnessEntry_t){.kind = FAIRNESS_UPLOADER, .uploader = client->client_id,
+                                                 .key = client->client_type, .count = load->served,
+                                                 .refused = load->refused};
+        for (int r = 0; r < load->client_count; ++r) {
+            if (load->by_requester[r] > 0)
+                (*entries)[filled++] = (FairnessEntry_t){.kind = FAIRNESS_PAIR, .uploader = client->client_id,
+                                                         .key = r + 1, .count = load->by_requester[r]};
+        }
+        for (int f = 0; f < MAX_FILES; ++f) {
+            for (int s = 0; s < MAX_CHUNKS; ++s) {
+                if (load->by_segment[f][s] > 0)
+                    (*entries)[filled++] = (FairnessEntry_t){.kind = FAIRNESS_SEGMENT, .uploader = client->client_id,
+                                                             .key = f + 1, .segment = s,
+                                                             .count = load->by_segment[f][s]};
+            }
+        }
+        fairness_free(load);
+        client->load = NULL;
+    }
+    return filled;
+}
+
+// Writes the report from every rank's entries, and prints its summary.
+static void write_report(FILE *out, const FairnessEntry_t *entries, int entry_count, int client_count) {
+    UploaderLoad_t *uploaders = calloc(client_count ? client_count : 1, sizeof(UploaderLoad_t));
+    RequesterLoad_t *requesters = calloc(client_count ? client_count : 1, sizeof(RequesterLoad_t));
+    int *uploader_of = malloc(sizeof(int) * (client_count ? client_count : 1)); // * by client id - 1
+    static uint64_t segments[MAX_FILES][MAX_CHUNKS];
+    if (!uploaders || !requesters || !uploader_of) {
+        fprintf(stderr, "Memory allocation failed for the fairness report.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    memset(segments, 0, sizeof(segments));
+    for (int i = 0; i < client_count; ++i)
+        uploader_of[i] = -1;
+
+    // Uploaders that served nothing but could have count too; leeches only if they served
+    int uploader_count = 0;
+    for (int i = 0; i < entry_count; ++i) {
+        const FairnessEntry_t *entry = &entries[i];
+        if (entry->kind != FAIRNESS_UPLOADER || entry->uploader <= 0 || entry->uploader > client_count)
+            continue;
+        if (entry->key == LEECHER && entry->count == 0)
+            continue;
+        uploader_of[entry->uploader - 1] = uploader_count;
+        uploaders[uploader_count++] = (UploaderLoad_t){.client_id = entry->uploader, .client_type = entry->key,
+                                                       .served = entry->count, .refused = entry->refused};
+    }
+
+    int segment_files = 0;
+    for (int i = 0; i < entry_count; ++i) {
+        const FairnessEntry_t *entry = &entries[i];
+        if (entry->kind == FAIRNESS_PAIR && entry->key > 0 && entry->key <= client_count) {
+            int u = entry->uploader > 0 && entry->uploader <= client_count ? uploader_of[entry->uploader - 1] : -1;
+            if (u >= 0) {
+                uploaders[u].requesters++;
+                uploaders[u].top_requester = MAX(uploaders[u].top_requester, entry->count);
+            }
+            RequesterLoad_t *requester = &requesters[entry->key - 1];
+            requester->received += entry->count;
+            requester->sources++;
+            requester->top_source = MAX(requester->top_source, entry->count);
+        } else if (entry->kind == FAIRNESS_SEGMENT && entry->key > 0 && entry->key <= MAX_FILES &&
+                   entry->segment >= 0 && entry->segment < MAX_CHUNKS) {
+            segments[entry->key - 1][entry->segment] += entry->count;
+            segment_files = MAX(segment_files, entry->key);
+        }
+    }
+
+    double all_max_mean, seeder_max_mean;
+    fprintf(out, "{\"load\": {\"all\": ");
+    double all_gini = write_load(out, uploaders, uploader_count, -1, &all_max_mean);
+    fprintf(out, ", \"seeders\": ");
+    double seeder_gini = write_load(out, uploaders, uploader_count, SEEDER, &seeder_max_mean);
+
+    fprintf(out, "},\n\"uploaders\": [");
+    uint64_t served = 0;
+    for (int u = 0; u < uploader_count; ++u) {
+        const UploaderLoad_t *uploader = &uploaders[u];
+        served += uploader->served;
+        fprintf(out, "%s\n  {\"client\": %d, \"type\": \"%s\", \"served\": %llu, \"refused\": %llu, "
+                     "\"requesters\": %u, \"top_requester_share\": %.3f}", u ? "," : "", uploader->client_id,
+                uploader->client_type >= SEEDER && uploader->client_type <= LEECHER ? type_names[uploader->client_type] : "?",
+                (unsigned long long)uploader->served, (unsigned long long)uploader->refused, uploader->requesters,
+                uploader->served ? (double)uploader->top_requester / uploader->served : 0);
+    }
+
+    fprintf(out, "],\n\"requesters\": [");
+    bool first = true;
+    for (int r = 0; r < client_count; ++r) {
+        const RequesterLoad_t *requester = &requesters[r];
+        if (requester->received == 0)
+            continue;
+        fprintf(out, "%s\n  {\"client\": %d, \"received\": %llu, \"sources\": %u, \"top_source_share\": %.3f}",
+                first ? "" : ",", r + 1, (unsigned long long)requester->received, requester->sources,
+                (double)requester->top_source / requester->received);
+        first = false;
+    }
+
+    fprintf(out, "],\n\"segments\": [");
+    first = true;
+    for (int f = 0; f < segment_files; ++f) {
+        int count = MAX_CHUNKS;
+        while (count > 0 && segments[f][count - 1] == 0)
+            count--;
+        if (count == 0)
+            continue;
+        fprintf(out, "%s\n  {\"file\": %d, \"served\": [", first ? "" : ",", f + 1);
+        for (int s = 0; s < count; ++s)
+            fprintf(out, "%s%llu", s ? ", " : "", (unsigned long long)segments[f][s]);
+        uint64_t values[MAX_CHUNKS];
+        memcpy(values, segments[f], sizeof(uint64_t) * count);
+        fprintf(out, "], \"gini\": %.4f}", gini(values, count));
+        first = false;
+    }
+
+    fprintf(out, "],\n\"replication\": [");
+    for (size_t i = 0; i < fairness.sample_count; ++i) {
+        const ReplicationSample_t *sample = &fairness.samples[i];
+        fprintf(out, "%s\n  {\"t\": %.3f, \"file\": %d, \"min\": %u, \"mean\": %.2f, \"max\": %u, \"complete\": %u}",
+                i ? "," : "", sample->time, sample->file_id, sample->min_holders, sample->mean_holders,
+                sample->max_holders, sample->complete);
+    }
+    fprintf(out, "]}\n");
+
+    printf("Fairness: %d uploaders served %llu segments, max/mean %.2f, Gini %.3f; initial seeders max/mean %.2f, "
+           "Gini %.3f\n", uploader_count, (unsigned long long)served, all_max_mean, all_gini, seeder_max_mean,
+           seeder_gini);
+
+    free(uploaders);
+    free(requesters);
+    free(uploader_of);
+}
+
+/*
+ * Gathers every rank's upload counts on rank 0, which writes the fairness report to path
+ * ("-" for stdout) with the tracker's replication samples. Collective; call it once the
+ * workers have joined. Frees the clients' loads.
+ */
+void fairness_report(ClientFiles_t *clients, int count, int numtasks, int rank, const char *path) {
+    FairnessEntry_t *entries = NULL;
+    int entry_count = pack_entries(clients, count, &entries);
+    int bytes = entry_count * (int)sizeof(FairnessEntry_t);
+
+    int *sizes = NULL;
+    int *displs = NULL;
+    char *all = NULL;
+    if (rank == TRACKER_RANK) {
+        sizes = calloc(numtasks, sizeof(int));
+        displs = calloc(numtasks, sizeof(int));
+        if (!sizes || !displs) {
+            fprintf(stderr, "Memory allocation failed for the fairness report.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Gather(&bytes, 1, MPI_INT, sizes, 1, MPI_INT, TRACKER_RANK, CONTROL_COMM);
+
+    size_t total = 0;
+    if (rank == TRACKER_RANK) {
+        for (int r = 0; r < numtasks; ++r) {
+            displs[r] = (int)total;
+            total += sizes[r];
+        }
+        all = malloc(total ? total : 1);
+        if (!all) {
+            fprintf(stderr, "Memory allocation failed for the fairness report.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Gatherv(entries, bytes, MPI_BYTE, all, sizes, displs, MPI_BYTE, TRACKER_RANK, CONTROL_COMM);
+    free(entries);
+
+    if (rank == TRACKER_RANK) {
+        FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+        if (!out) {
+            fprintf(stderr, "Error: cannot write the fairness report to %s.\n", path);
+        } else {
+            write_report(out, (const FairnessEntry_t *)all, (int)(total / sizeof(FairnessEntry_t)),
+                         options.clients_per_rank * (numtasks - 1));
+            if (out != stdout)
+                fclose(out);
+        }
+    }
+
+    free(all);
+    free(sizes);
+    free(displs);
+    free(fairness.samples);
+    memset(&fairness, 0, sizeof(fairness));
+}
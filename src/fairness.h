@@ -0,0 +1,65 @@
+#ifndef _FAIRNESS_H_
+#define _FAIRNESS_H_
+
+#include "utils.h"
+
+// * Upload Fairness (--fairness)
+// * Every client's upload coroutine counts the segments it serves per requester and per
+// * segment. The tracker samples how many clients hold each segment every
+// * FAIRNESS_SAMPLE_MS while it tracks. At the end rank 0 gathers the counts and writes
+// * them as JSON: the load of every uploader with its Gini coefficient and max/mean ratio
+// * (over all uploaders and over the initial seeders), what each requester got from how many
+// * sources, the uploads of each segment and the replication samples.
+#define FAIRNESS_SAMPLE_MS 50
+
+// * One client's uploads, counted by its upload coroutine only
+typedef struct UploadLoad_t {
+    int client_count;
+    uint32_t *by_requester; // * segments served, by requester id - 1
+    uint32_t by_segment[MAX_FILES][MAX_CHUNKS]; // * by file id - 1 and segment index
+    uint64_t served;
+    uint64_t refused;
+} UploadLoad_t;
+
+// * Replication of one file's segments at one point of the tracking
+typedef struct ReplicationSample_t {
+    double time; // * seconds since the tracker sent the swarms
+    int32_t file_id;
+    uint32_t min_holders;
+    uint32_t max_holders;
+    uint32_t complete; // * clients holding every segment
+    double mean_holders;
+} ReplicationSample_t;
+
+typedef struct Fairness_t {
+    bool sampling; // * on the tracker, between fairness_start and the end of the tracking
+    uint64_t start_ns;
+    uint64_t last_sample_ns;
+    ReplicationSample_t *samples;
+    size_t sample_count;
+    size_t sample_capacity;
+} Fairness_t;
+
+extern Fairness_t fairness;
+
+UploadLoad_t *fairness_create(int client_count);
+
+static inline void fairness_record(UploadLoad_t *load, const SegmentRequest_t *request, bool served) {
+    if (!served) {
+        load->refused++;
+        return;
+    }
+    load->served++;
+    if (request->client_id > 0 && request->client_id <= load->client_count)
+        load->by_requester[request->client_id - 1]++;
+    if (request->file_id > 0 && request->file_id <= MAX_FILES && request->segment_idx < MAX_CHUNKS)
+        load->by_segment[request->file_id - 1][request->segment_idx]++;
+}
+
+void fairness_start(const TrackerDataSet_t *m_tracker);
+
+void fairness_sample(const TrackerDataSet_t *m_tracker, bool force);
+
+void fairness_report(ClientFiles_t *clients, int count, int numtasks, int rank, const char *path);
+
+#endif
@@ -0,0 +1,286 @@
+#include "manifest.h"
+#include "digest.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+// Derives the numeric file id from a file name (e.g., file3 -> 3).
+static int32_t file_id_from_name(const char *name) {
+    size_t len = strlen(name);
+    return (len == 0) ? 0 : atoi(&name[len - 1]);
+}
+
+// Whether a table of count entries of entry_size bytes at offset lies within size bytes
+// (and on the 8-byte boundary every section starts at).
+static bool section_fits(uint64_t offset, uint64_t count, uint64_t entry_size, uint64_t size) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / entry_size;
+}
+
+// Points the section views of a manifest at its backing buffer and checks the header, the
+// bounds of every section and the digests each file's index entry points at.
+static int manifest_bind(Manifest_t *manifest, const char *path) {
+    const ManifestHeader_t *header = (const ManifestHeader_t *)manifest->base;
+
+    if (manifest->size < sizeof(ManifestHeader_t) || header->magic != MANIFEST_MAGIC) {
+        fprintf(stderr, "Error: %s is not a binary manifest\n", path);
+        return -1;
+    }
+    if (header->version != MANIFEST_VERSION || header->digest_size != DIGEST_SIZE) {
+        fprintf(stderr, "Error: %s has version %u / digest size %u, expected %u / %u\n",
+                path, header->version, header->digest_size, MANIFEST_VERSION, DIGEST_SIZE);
+        return -1;
+    }
+    if (header->total_size != manifest->size ||
+        !section_fits(header->files_offset, header->owned_count, sizeof(ManifestFile_t), manifest->size) ||
+        !section_fits(header->wanted_offset, header->wanted_count, sizeof(ManifestFile_t), manifest->size) ||
+        !section_fits(header->index_offset, header->owned_count, sizeof(uint64_t), manifest->size) ||
+        !section_fits(header->digests_offset, header->total_segments, DIGEST_SIZE, manifest->size)) {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        return -1;
+    }
+
+    manifest->header = header;
+    manifest->files = (const ManifestFile_t *)(manifest->base + header->files_offset);
+    manifest->wanted = (const ManifestFile_t *)(manifest->base + header->wanted_offset);
+    manifest->index = (const uint64_t *)(manifest->base + header->index_offset);
+
+    // Every file's digests lie within the digests section; names are NUL-terminated
+    uint64_t digests_end = header->digests_offset + (uint64_t)header->total_segments * DIGEST_SIZE;
+    for (uint32_t i = 0; i < header->owned_count; ++i) {
+        const ManifestFile_t *file = &manifest->files[i];
+        if (file->file_name[MAX_FILENAME] != '\0' || file->segment_count > MAX_CHUNKS ||
+            manifest->index[i] < header->digests_offset || manifest->index[i] > digests_end ||
+            (digests_end - manifest->index[i]) / DIGEST_SIZE < file->segment_count) {
+            fprintf(stderr, "Error: %s has a corrupt entry for owned file %u\n", path, i);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < header->wanted_count; ++i) {
+        if (manifest->wanted[i].file_name[MAX_FILENAME] != '\0') {
+            fprintf(stderr, "Error: %s has a corrupt entry for wanted file %u\n", path, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Maps a binary manifest read-only. No parsing happens: the sections are used in place.
+int manifest_map(Manifest_t *manifest, const char *path) {
+    memset(manifest, 0, sizeof(Manifest_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: Could not stat file %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not mmap file %s\n", path);
+        return -1;
+    }
+
+    manifest->base = (uint8_t *)base;
+    manifest->size = st.st_size;
+    manifest->mapped = true;
+
+    if (manifest_bind(manifest, path) < 0) {
+        manifest_release(manifest);
+        return -1;
+    }
+    return 0;
+}
+
+// Reads one line into buffer, stripping the trailing newline.
+static bool read_line(FILE *in, char *buffer, size_t size) {
+    if (!fgets(buffer, size, in))
+        return false;
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    return true;
+}
+
+// Parses the text format of in<id>.txt and builds the same image a binary manifest holds:
+//   <owned count>
+//   <file name> <segment count>   followed by one hex hash per line, for each owned file
+//   <wanted count>
+//   <file name>                   for each wanted file
+int manifest_parse_text(Manifest_t *manifest, const char *path) {
+    memset(manifest, 0, sizeof(Manifest_t));
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Could not open file %s\n", path);
+        return -1;
+    }
+
+    char line[BUFF_SIZE];
+    ManifestFile_t *files = NULL;
+    ManifestFile_t *wanted = NULL;
+    Digest_t *digests = NULL;
+    uint32_t owned_count = 0, wanted_count = 0, total_segments = 0;
+    int status = -1;
+
+    if (!read_line(in, line, sizeof(line))) {
+        fprintf(stderr, "Error: Could not read owned_files_count\n");
+        goto out;
+    }
+    owned_count = (uint32_t)atoi(line);
+
+    files = calloc(owned_count ? owned_count : 1, sizeof(ManifestFile_t));
+    digests = malloc(sizeof(Digest_t) * (owned_count ? owned_count : 1) * MAX_CHUNKS);
+    if (!files || !digests) {
+        fprintf(stderr, "Error: Memory allocation failed for manifest\n");
+        goto out;
+    }
+
+    for (uint32_t file_idx = 0; file_idx < owned_count; ++file_idx) {
+        if (!read_line(in, line, sizeof(line))) {
+            fprintf(stderr, "Error: Could not read owned file info (line %u)\n", file_idx);
+            goto out;
+        }
+
+        char *parsed_file_name = strtok(line, " ");
+        char *parsed_segment_count = strtok(NULL, " ");
+        if (!parsed_file_name || !parsed_segment_count || strlen(parsed_file_name) > MAX_FILENAME - 1) {
+            fprintf(stderr, "Error: Invalid owned file line in %s\n", path);
+            goto out;
+        }
+
+        ManifestFile_t *file = &files[file_idx];
+        strcpy(file->file_name, parsed_file_name);
+        file->file_id = file_id_from_name(parsed_file_name);
+        file->segment_count = (uint32_t)atoi(parsed_segment_count);
+        if (file->segment_count > MAX_CHUNKS) {
+            fprintf(stderr, "Error: %s has %u segments, at most %d are supported\n",
+                    file->file_name, file->segment_count, MAX_CHUNKS);
+            goto out;
+        }
+
+        for (uint32_t seg_idx = 0; seg_idx < file->segment_count; ++seg_idx) {
+            if (!read_line(in, line, sizeof(line)) || !digest_from_hex(&digests[total_segments], line)) {
+                fprintf(stderr, "Error: Could not read segment hash (line %u)\n", seg_idx);
+                goto out;
+            }
+            total_segments++;
+        }
+    }
+
+    if (!read_line(in, line, sizeof(line))) {
+        fprintf(stderr, "Error: Could not read wanted_files_count\n");
+        goto out;
+    }
+    wanted_count = (uint32_t)atoi(line);
+
+    wanted = calloc(wanted_count ? wanted_count : 1, sizeof(ManifestFile_t));
+    if (!wanted) {
+        fprintf(stderr, "Error: Memory allocation failed for wanted files\n");
+        goto out;
+    }
+
+    for (uint32_t want_idx = 0; want_idx < wanted_count; ++want_idx) {
+        if (!read_line(in, line, sizeof(line)) || strlen(line) > MAX_FILENAME - 1) {
+            fprintf(stderr, "Error: Could not read wanted file info (line %u)\n", want_idx);
+            goto out;
+        }
+        strcpy(wanted[want_idx].file_name, line);
+        wanted[want_idx].file_id = file_id_from_name(line);
+    }
+
+    // Lay the sections out exactly as they are stored on disk
+    uint64_t files_offset = ALIGN8(sizeof(ManifestHeader_t));
+    uint64_t wanted_offset = ALIGN8(files_offset + sizeof(ManifestFile_t) * owned_count);
+    uint64_t index_offset = ALIGN8(wanted_offset + sizeof(ManifestFile_t) * wanted_count);
+    uint64_t digests_offset = ALIGN8(index_offset + sizeof(uint64_t) * owned_count);
+    uint64_t total_size = digests_offset + sizeof(Digest_t) * total_segments;
+
+    manifest->base = calloc(1, total_size);
+    if (!manifest->base) {
+        fprintf(stderr, "Error: Memory allocation failed for manifest image\n");
+        goto out;
+    }
+    manifest->size = total_size;
+    manifest->mapped = false;
+
+    ManifestHeader_t *header = (ManifestHeader_t *)manifest->base;
+    header->magic = MANIFEST_MAGIC;
+    header->version = MANIFEST_VERSION;
+    header->digest_size = DIGEST_SIZE;
+    header->owned_count = owned_count;
+    header->wanted_count = wanted_count;
+    header->total_segments = total_segments;
+    header->files_offset = files_offset;
+    header->wanted_offset = wanted_offset;
+    header->index_offset = index_offset;
+    header->digests_offset = digests_offset;
+    header->total_size = total_size;
+
+    memcpy(manifest->base + files_offset, files, sizeof(ManifestFile_t) * owned_count);
+    memcpy(manifest->base + wanted_offset, wanted, sizeof(ManifestFile_t) * wanted_count);
+    memcpy(manifest->base + digests_offset, digests, sizeof(Digest_t) * total_segments);
+
+    uint64_t *index = (uint64_t *)(manifest->base + index_offset);
+    uint64_t next_offset = digests_offset;
+    for (uint32_t i = 0; i < owned_count; ++i) {
+        index[i] = next_offset;
+        next_offset += sizeof(Digest_t) * files[i].segment_count;
+    }
+
+    status = manifest_bind(manifest, path);
+
+out:
+    if (status < 0)
+        manifest_release(manifest);
+    free(files);
+    free(wanted);
+    free(digests);
+    fclose(in);
+    return status;
+}
+
+// Writes the manifest image to disk, going through a temporary file so readers never see a partial one.
+int manifest_write(const Manifest_t *manifest, const char *path) {
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: Could not open file %s for writing\n", tmp_path);
+        return -1;
+    }
+
+    size_t written = fwrite(manifest->base, 1, manifest->size, out);
+    if (fclose(out) != 0 || written != manifest->size || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error: Could not write manifest %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the digests of the owned file at file_idx, straight from the digest section.
+const Digest_t *manifest_file_digests(const Manifest_t *manifest, size_t file_idx) {
+    return (const Digest_t *)(manifest->base + manifest->index[file_idx]);
+}
+
+// Unmaps or frees the manifest backing buffer.
+void manifest_release(Manifest_t *manifest) {
+    if (manifest->base) {
+        if (manifest->mapped)
+            munmap(manifest->base, manifest->size);
+        else
+            free(manifest->base);
+    }
+    memset(manifest, 0, sizeof(Manifest_t));
+}
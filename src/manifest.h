@@ -0,0 +1,57 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include "utils.h"
+
+// * Binary Manifest Layout (host byte order, every section 8-byte aligned)
+// *   ManifestHeader_t
+// *   ManifestFile_t    files[owned_count]   (owned files)
+// *   ManifestFile_t    wanted[wanted_count] (segment_count = 0)
+// *   uint64_t          index[owned_count]   (byte offset of each file's digests)
+// *   Digest_t          digests[total_segments]
+#define MANIFEST_MAGIC 0x464d5442u // * "BTMF"
+#define MANIFEST_VERSION 1
+
+typedef struct ManifestHeader_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t digest_size;
+    uint32_t owned_count;
+    uint32_t wanted_count;
+    uint32_t total_segments;
+    uint32_t reserved;
+    uint64_t files_offset;
+    uint64_t wanted_offset;
+    uint64_t index_offset;
+    uint64_t digests_offset;
+    uint64_t total_size;
+} ManifestHeader_t;
+
+typedef struct ManifestFile_t {
+    char file_name[MAX_FILENAME + 1];
+    int32_t file_id;
+    uint32_t segment_count;
+} ManifestFile_t;
+
+// * A loaded manifest: either an mmap of a .bin file or an in-memory image built from text
+typedef struct Manifest_t {
+    uint8_t *base;
+    size_t size;
+    bool mapped;
+    const ManifestHeader_t *header;
+    const ManifestFile_t *files;
+    const ManifestFile_t *wanted;
+    const uint64_t *index;
+} Manifest_t;
+
+int manifest_map(Manifest_t *manifest, const char *path);
+
+int manifest_parse_text(Manifest_t *manifest, const char *path);
+
+int manifest_write(const Manifest_t *manifest, const char *path);
+
+const Digest_t *manifest_file_digests(const Manifest_t *manifest, size_t file_idx);
+
+void manifest_release(Manifest_t *manifest);
+
+#endif
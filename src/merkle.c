@@ -0,0 +1,142 @@
+#include "merkle.h"
+#include "digest.h"
+
+// * Where the levels of a tree over a given number of leaves are
+typedef struct MerkleShape_t {
+    int depth; // * levels above the leaves
+    size_t count[MERKLE_DEPTH + 1]; // * nodes of each level, count[0] = leaves
+    size_t offset[MERKLE_DEPTH + 1]; // * where each level above the leaves starts in inner[]
+} MerkleShape_t;
+
+static void shape_of(size_t leaves, MerkleShape_t *shape) {
+    shape->depth = 0;
+    shape->count[0] = leaves;
+    shape->offset[0] = 0;
+
+    size_t next = 0;
+    while (shape->count[shape->depth] > 1) {
+        int level = ++shape->depth;
+        shape->count[level] = (shape->count[level - 1] + 1) / 2;
+        shape->offset[level] = next;
+        next += shape->count[level];
+    }
+}
+
+// Node id in FileData_t.known: leaves first, then inner[].
+static size_t node_id(const MerkleShape_t *shape, int level, size_t idx) {
+    return level == 0 ? idx : MAX_CHUNKS + shape->offset[level] + idx;
+}
+
+static Digest_t *node_at(FileData_t *file, const MerkleShape_t *shape, int level, size_t idx) {
+    return level == 0 ? &file->segments[idx].digest : &file->inner[shape->offset[level] + idx];
+}
+
+static const Digest_t *node_of(const FileData_t *file, const MerkleShape_t *shape, int level, size_t idx) {
+    return level == 0 ? &file->segments[idx].digest : &file->inner[shape->offset[level] + idx];
+}
+
+// Stores a node the tree did not know yet; known nodes are never written again.
+static void remember(FileData_t *file, const MerkleShape_t *shape, int level, size_t idx, const Digest_t *value) {
+    size_t id = node_id(shape, level, idx);
+    if (segment_bit_test(file->known, id))
+        return;
+    *node_at(file, shape, level, idx) = *value;
+    segment_bit_set(file->known, id);
+}
+
+/*
+ * Computes the whole tree of a file the client holds every segment of, and takes the file's
+ * segment count as its total. Runs before the workers start.
+ */
+void merkle_build(FileData_t *file) {
+    MerkleShape_t shape;
+    shape_of(file->segment_count, &shape);
+    file->segment_total = file->segment_count;
+    memset(file->known, 0, sizeof(file->known));
+    memset(&file->root, 0, sizeof(file->root));
+    if (file->segment_total == 0)
+        return;
+
+    for (size_t idx = 0; idx < shape.count[0]; ++idx)
+        segment_bit_set(file->known, idx);
+    for (int level = 1; level <= shape.depth; ++level) {
+        for (size_t idx = 0; idx < shape.count[level]; ++idx) {
+            size_t left = 2 * idx;
+            if (left + 1 < shape.count[level - 1])
+                digest_combine(node_at(file, &shape, level - 1, left), node_at(file, &shape, level - 1, left + 1),
+                               node_at(file, &shape, level, idx));
+            else
+                *node_at(file, &shape, level, idx) = *node_at(file, &shape, level - 1, left);
+            segment_bit_set(file->known, node_id(&shape, level, idx));
+        }
+    }
+    file->root = *node_at(file, &shape, shape.depth, 0);
+}
+
+/*
+ * Fills proof with the siblings of a held segment's path to the root. Every one of them is
+ * known: the file was built whole, or they came with the proof of the segment. Safe on the
+ * upload thread once it saw the segment's have bit.
+ */
+bool merkle_proof(const FileData_t *file, size_t segment_idx, MerkleProof_t *proof) {
+    if (segment_idx >= file->segment_total)
+        return false;
+
+    MerkleShape_t shape;
+    shape_of(file->segment_total, &shape);
+    proof->length = 0;
+    proof->reserved = 0;
+
+    size_t idx = segment_idx;
+    for (int level = 0; level < shape.depth; ++level, idx /= 2) {
+        size_t sibling = idx ^ 1;
+        if (sibling < shape.count[level])
+            proof->siblings[proof->length++] = *node_of(file, &shape, level, sibling);
+    }
+    return true;
+}
+
+/*
+ * Checks that segment sits at segment_idx of the file whose root the file data holds, using the
+ * proof an uploader sent with it. A proof that checks out is kept in the file's tree (but not
+ * the segment itself, see store_segment()), so the client can prove the segment in turn.
+ * Download thread only.
+ */
+bool merkle_verify(FileData_t *file, size_t segment_idx, const Digest_t *segment, const MerkleProof_t *proof) {
+    if (segment_idx >= file->segment_total || proof->length > MERKLE_DEPTH)
+        return false;
+
+    MerkleShape_t shape;
+    shape_of(file->segment_total, &shape);
+
+    // Walk up from the segment, remembering each ancestor
+    Digest_t path[MERKLE_DEPTH + 1];
+    path[0] = *segment;
+    uint32_t used = 0;
+    size_t idx = segment_idx;
+    for (int level = 0; level < shape.depth; ++level, idx /= 2) {
+        size_t sibling = idx ^ 1;
+        if (sibling >= shape.count[level]) {
+            path[level + 1] = path[level]; // * promoted
+            continue;
+        }
+        if (used == proof->length)
+            return false;
+        const Digest_t *other = &proof->siblings[used++];
+        if (idx & 1)
+            digest_combine(other, &path[level], &path[level + 1]);
+        else
+            digest_combine(&path[level], other, &path[level + 1]);
+    }
+    if (used != proof->length || !digest_equal(&path[shape.depth], &file->root))
+        return false;
+
+    used = 0;
+    idx = segment_idx;
+    for (int level = 0; level < shape.depth; ++level, idx /= 2) {
+        if ((idx ^ 1) < shape.count[level])
+            remember(file, &shape, level, idx ^ 1, &proof->siblings[used++]);
+        remember(file, &shape, level + 1, idx / 2, &path[level + 1]);
+    }
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef _MERKLE_H_
+#define _MERKLE_H_
+
+#include "utils.h"
+
+// * Merkle File Identity
+// * A file is known by the root of a binary hash tree over its segment digests: each inner node
+// * is digest_combine() of its two children, and the last node of a level with an odd count is
+// * promoted to the next level unchanged. The tracker keeps only roots; an uploader sends every
+// * segment with the siblings on its path to the root, and the downloader checks them before it
+// * keeps the segment.
+
+void merkle_build(FileData_t *file);
+
+bool merkle_proof(const FileData_t *file, size_t segment_idx, MerkleProof_t *proof);
+
+bool merkle_verify(FileData_t *file, size_t segment_idx, const Digest_t *segment, const MerkleProof_t *proof);
+
+#endif
@@ -0,0 +1,39 @@
+#include "manifest.h"
+
+/*
+ * Converts text manifests (in<id>.txt) to the binary format loaded with --binary-manifest.
+ * Usage: mkmanifest in1.txt [in2.txt ...]   -> writes in1.bin, in2.bin, ...
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <in.txt> [in.txt ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; ++i) {
+        /* Replace the extension (if any) with .bin */
+        char out_path[256];
+        snprintf(out_path, sizeof(out_path), "%s", argv[i]);
+        char *dot = strrchr(out_path, '.');
+        if (dot && !strchr(dot, '/'))
+            *dot = '\0';
+        strncat(out_path, ".bin", sizeof(out_path) - strlen(out_path) - 1);
+
+        Manifest_t manifest;
+        if (manifest_parse_text(&manifest, argv[i]) < 0) {
+            failures++;
+            continue;
+        }
+
+        if (manifest_write(&manifest, out_path) < 0) {
+            failures++;
+        } else {
+            printf("%s -> %s (%u files, %u segments, %zu bytes)\n", argv[i], out_path,
+                   manifest.header->owned_count, manifest.header->total_segments, manifest.size);
+        }
+        manifest_release(&manifest);
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
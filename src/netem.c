@@ -0,0 +1,116 @@
+#include "netem.h"
+#include "options.h"
+
+#include <ctype.h>
+
+Netem_t netem;
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Parses a rank of the link file: a number below numtasks, or * (returned as -1).
+static bool parse_rank(const char *token, int numtasks, int *rank) {
+    if (strcmp(token, "*") == 0) {
+        *rank = -1;
+        return true;
+    }
+    char *end = NULL;
+    long value = strtol(token, &end, 10);
+    if (*token == '\0' || *end != '\0' || value < 0 || value >= numtasks)
+        return false;
+    *rank = (int)value;
+    return true;
+}
+
+static void set_links(int source, int dest, double latency_ms, double bandwidth_mbit, double jitter_ms) {
+    for (int s = 0; s < netem.ranks; ++s) {
+        for (int d = 0; d < netem.ranks; ++d) {
+            if ((source >= 0 && s != source) || (dest >= 0 && d != dest))
+                continue;
+            NetemLink_t *link = netem_link(s, d);
+            link->latency_ns = (uint64_t)(latency_ms * 1e6);
+            link->jitter_ns = (uint64_t)(jitter_ms * 1e6);
+            link->ns_per_byte = bandwidth_mbit > 0 ? 8e3 / bandwidth_mbit : 0;
+        }
+    }
+}
+
+/*
+ * Reads the link file of --links (every rank reads the same one). Without the option the
+ * emulation stays off and costs one NULL test per message.
+ */
+void netem_init(int numtasks, int rank) {
+    memset(&netem, 0, sizeof(netem));
+    netem.ranks = numtasks;
+    netem.rank = rank;
+    if (!options.links_path)
+        return;
+
+    FILE *file = fopen(options.links_path, "r");
+    netem.links = calloc((size_t)numtasks * numtasks, sizeof(NetemLink_t));
+    if (!file || !netem.links) {
+        fprintf(stderr, "Error: cannot load the link file %s.\n", options.links_path);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (int s = 0; s < numtasks; ++s) {
+        for (int d = 0; d < numtasks; ++d)
+            netem_link(s, d)->rng = ((uint64_t)s << 32) | (uint64_t)d;
+    }
+
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *text = line;
+        while (isspace((unsigned char)*text))
+            text++;
+        if (*text == '\0' || *text == '#')
+            continue;
+
+        char source_token[32];
+        char dest_token[32];
+        double latency_ms = 0, bandwidth_mbit = 0, jitter_ms = 0;
+        int source, dest;
+        int fields = sscanf(text, "%31s %31s %lf %lf %lf", source_token, dest_token, &latency_ms, &bandwidth_mbit,
+                            &jitter_ms);
+        if (fields < 4 || !parse_rank(source_token, numtasks, &source) || !parse_rank(dest_token, numtasks, &dest) ||
+            latency_ms < 0 || bandwidth_mbit < 0 || jitter_ms < 0) {
+            fprintf(stderr, "Error: bad link at %s:%d.\n", options.links_path, line_number);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        set_links(source, dest, latency_ms, bandwidth_mbit, jitter_ms);
+    }
+    fclose(file);
+}
+
+/*
+ * Returns when a message of size bytes from source to dest, handed over at now_ns, arrives:
+ * it waits for the link to send what was queued before it, takes size / bandwidth to send,
+ * then latency +- jitter to arrive, but never before the link's previous message.
+ * Only the rank that runs the link calls it (see netem.h).
+ */
+uint64_t netem_due(int source, int dest, int size, uint64_t now_ns) {
+    NetemLink_t *link = netem_link(source, dest);
+
+    uint64_t start_ns = MAX(now_ns, link->free_ns);
+    link->free_ns = start_ns + (uint64_t)(size * link->ns_per_byte);
+
+    uint64_t flight_ns = link->latency_ns;
+    if (link->jitter_ns) {
+        uint64_t offset = splitmix64(&link->rng) % (2 * link->jitter_ns + 1);
+        flight_ns = flight_ns + offset > link->jitter_ns ? flight_ns + offset - link->jitter_ns : 0;
+    }
+
+    uint64_t due_ns = MAX(link->free_ns + flight_ns, link->last_due_ns);
+    link->last_due_ns = due_ns;
+    return due_ns;
+}
+
+void netem_free(void) {
+    free(netem.links);
+    netem.links = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef _NETEM_H_
+#define _NETEM_H_
+
+#include "utils.h"
+
+// * Link Emulation (--links)
+// * On one host every message arrives at once. With --links, the transport holds each message
+// * between two ranks for as long as their link would take: its latency, plus a jitter, after
+// * the link's bandwidth got through the messages queued before it. Each line of the file is
+// * "<source rank> <destination rank> <latency ms> <bandwidth Mbit/s> [<jitter ms>]"; a rank
+// * may be *, later lines override earlier ones, bandwidth 0 is unlimited and links are one-way.
+// * A message is held by the rank that runs its link: the sender for messages from a client
+// * rank, the receiver for the tracker's (the tracker sends with plain MPI). Clients of one
+// * rank reach each other at once.
+
+typedef struct NetemLink_t {
+    uint64_t latency_ns;
+    uint64_t jitter_ns; // * each message gets latency +- up to jitter
+    double ns_per_byte; // * 0 = unlimited bandwidth
+    uint64_t free_ns; // * when the link is done sending what is queued on it
+    uint64_t last_due_ns; // * when its latest message arrives: jitter never reorders a link
+    uint64_t rng; // * the link's own generator, so its delays depend only on its traffic
+} NetemLink_t;
+
+typedef struct Netem_t {
+    int ranks;
+    int rank;
+    NetemLink_t *links; // * by source, then destination (NULL = emulation off)
+} Netem_t;
+
+extern Netem_t netem;
+
+static inline NetemLink_t *netem_link(int source, int dest) {
+    return &netem.links[source * netem.ranks + dest];
+}
+
+// Whether messages from source to dest are held at all.
+static inline bool netem_shapes(int source, int dest) {
+    if (!netem.links || source == dest || source < 0 || dest < 0 || source >= netem.ranks || dest >= netem.ranks)
+        return false;
+    const NetemLink_t *link = netem_link(source, dest);
+    return link->latency_ns || link->jitter_ns || link->ns_per_byte > 0;
+}
+
+void netem_init(int numtasks, int rank);
+
+uint64_t netem_due(int source, int dest, int size, uint64_t now_ns);
+
+void netem_free(void);
+
+#endif
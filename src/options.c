@@ -0,0 +1,181 @@
+#include "options.h"
+#include "stream.h"
+#include "ratelimit.h"
+#include "subscribe.h"
+
+#include <getopt.h>
+
+Options_t options = {
+    .binary_manifest = false,
+    .checkpoint_dir = NULL,
+    .checkpoint_interval = 10,
+    .snapshot_path = NULL,
+    .snapshot_interval = 20,
+    .clients_per_rank = 1,
+    .dht = false,
+    .pex = false,
+    .super_seed = false,
+    .node_size = 0,
+    .rack_map = NULL,
+    .locality = true,
+    .counters_path = NULL,
+    .trace_path = NULL,
+    .completion_log = NULL,
+    .fairness_path = NULL,
+    .links_path = NULL,
+    .dedup = false,
+    .stream_window = 0,
+    .stream_period_ms = STREAM_PERIOD_MS,
+    .upload_rate = 0,
+    .upload_burst = RATELIMIT_BURST,
+    .requester_rate = 0,
+    .requester_burst = RATELIMIT_BURST,
+    .download_rate = 0,
+    .download_burst = RATELIMIT_BURST,
+    .subscribe = false,
+    .subscribe_interval_ms = SUBSCRIBE_INTERVAL_MS,
+};
+
+// Parses "<segments/s>[:<burst>]" into a rate limit; a missing or bad burst keeps the default.
+static void parse_rate(const char *arg, double *rate, double *burst) {
+    const char *colon = strchr(arg, ':');
+    *rate = MAX(atof(arg), 0.0);
+    if (colon && atof(colon + 1) >= 1)
+        *burst = atof(colon + 1);
+}
+
+// Parses the command line shared by all ranks.
+// Unknown options are reported and ignored so that MPI launchers can pass extra arguments.
+void parse_options(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"binary-manifest", no_argument, NULL, 'b'},
+        {"checkpoint-dir", required_argument, NULL, 'c'},
+        {"checkpoint-interval", required_argument, NULL, 'i'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"snapshot-interval", required_argument, NULL, 'S'},
+        {"clients-per-rank", required_argument, NULL, 'k'},
+        {"dht", no_argument, NULL, 'd'},
+        {"pex", no_argument, NULL, 'p'},
+        {"super-seed", no_argument, NULL, 'u'},
+        {"node-size", required_argument, NULL, 'n'},
+        {"rack-map", required_argument, NULL, 'r'},
+        {"no-locality", no_argument, NULL, 'L'},
+        {"counters", required_argument, NULL, 'C'},
+        {"trace", required_argument, NULL, 'T'},
+        {"completion-log", required_argument, NULL, 'l'},
+        {"fairness", required_argument, NULL, 'f'},
+        {"links", required_argument, NULL, 'e'},
+        {"dedup", no_argument, NULL, 'D'},
+        {"stream", required_argument, NULL, 'w'},
+        {"upload-rate", required_argument, NULL, 'U'},
+        {"requester-rate", required_argument, NULL, 'Q'},
+        {"download-rate", required_argument, NULL, 'R'},
+        {"subscribe", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+
+    opterr = 0;
+    optind = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "bc:i:s:S:k:dpun:r:LC:T:l:f:e:Dw:U:Q:R:N:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                options.binary_manifest = true;
+                break;
+            case 'c':
+                options.checkpoint_dir = optarg;
+                break;
+            case 'i':
+                options.checkpoint_interval = (unsigned int)MAX(atoi(optarg), 1);
+                break;
+            case 's':
+                options.snapshot_path = optarg;
+                break;
+            case 'S':
+                options.snapshot_interval = (unsigned int)MAX(atoi(optarg), 1);
+                break;
+            case 'k':
+                options.clients_per_rank = MAX(atoi(optarg), 1);
+                break;
+            case 'd':
+                options.dht = true;
+                break;
+            case 'p':
+                options.pex = true;
+                break;
+            case 'u':
+                options.super_seed = true;
+                break;
+            case 'n':
+                options.node_size = MAX(atoi(optarg), 0);
+                break;
+            case 'r':
+                options.rack_map = optarg;
+                break;
+            case 'L':
+                options.locality = false;
+                break;
+            case 'C':
+                options.counters_path = optarg;
+                break;
+            case 'T':
+                options.trace_path = optarg;
+                break;
+            case 'l':
+                options.completion_log = optarg;
+                break;
+            case 'f':
+                options.fairness_path = optarg;
+                break;
+            case 'e':
+                options.links_path = optarg;
+                break;
+            case 'D':
+                options.dedup = true;
+                break;
+            case 'w': {
+                // <window>[:<ms per segment>]
+                char *period = strchr(optarg, ':');
+                options.stream_window = MAX(atoi(optarg), 1);
+                if (period && atof(period + 1) > 0)
+                    options.stream_period_ms = atof(period + 1);
+                break;
+            }
+            case 'U':
+                parse_rate(optarg, &options.upload_rate, &options.upload_burst);
+                break;
+            case 'Q':
+                parse_rate(optarg, &options.requester_rate, &options.requester_burst);
+                break;
+            case 'R':
+                parse_rate(optarg, &options.download_rate, &options.download_burst);
+                break;
+            case 'N':
+                options.subscribe = true;
+                options.subscribe_interval_ms = MAX(atof(optarg), 0.0);
+                break;
+            default:
+                fprintf(stderr, "Warning: ignoring unknown option %s\n", argv[optind - 1]);
+                break;
+        }
+    }
+
+    // Segments are found by content through the tracker's index; the DHT has none
+    if (options.dht && options.dedup) {
+        fprintf(stderr, "Warning: ignoring --dedup, which needs the tracker\n");
+        options.dedup = false;
+    }
+
+    // A super-seeder sees its segments replicate through the peers' PEX tables
+    if (options.super_seed && !options.pex) {
+        fprintf(stderr, "Warning: ignoring --super-seed, which needs --pex\n");
+        options.super_seed = false;
+    }
+
+    // Only the tracker pushes swarm updates
+    if (options.dht && options.subscribe) {
+        fprintf(stderr, "Warning: ignoring --subscribe, which needs the tracker\n");
+        options.subscribe = false;
+    }
+}
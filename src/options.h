@@ -0,0 +1,42 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "utils.h"
+
+// * Run-time Options (same on every rank, parsed from the command line)
+typedef struct Options_t {
+    bool binary_manifest; // * load in<id>.bin via mmap instead of parsing in<id>.txt
+    const char *checkpoint_dir; // * where client<id>.ckpt files live (NULL = no checkpoints)
+    unsigned int checkpoint_interval; // * downloaded segments between checkpoint syncs
+    const char *snapshot_path; // * tracker snapshot file (NULL = no snapshots)
+    unsigned int snapshot_interval; // * swarm updates between tracker snapshots
+    int clients_per_rank; // * logical clients hosted by every client rank
+    bool dht; // * find peers through the DHT instead of the tracker
+    bool pex; // * learn new sources from peers instead of polling the tracker
+    bool super_seed; // * initial seeders hand out each segment once before serving it again
+    int node_size; // * client ranks per simulated node (0 = the machine's real nodes)
+    const char *rack_map; // * "<host or node<n>> <rack>" lines grouping nodes into racks (NULL = none)
+    bool locality; // * prefer close sources and fetch a segment into a node once (--no-locality turns it off)
+    const char *counters_path; // * where rank 0 writes every rank's counters as JSON ("-" = stdout, NULL = nowhere)
+    const char *trace_path; // * where rank 0 writes the Chrome trace of every rank's events (NULL = no tracing)
+    const char *completion_log; // * where the tracker writes every downloader's completion time (NULL = nowhere)
+    const char *fairness_path; // * where rank 0 writes the upload fairness report ("-" = stdout, NULL = nowhere)
+    const char *links_path; // * latency, bandwidth and jitter of the links between ranks (NULL = no emulation)
+    bool dedup; // * key segments by their digest across files (tracker only)
+    int stream_window; // * urgent segments ahead of the playback cursor (0 = no streaming)
+    double stream_period_ms; // * playback time of a segment while streaming
+    double upload_rate; // * segments per second a rank sends at most, and its burst (0 = unlimited)
+    double upload_burst;
+    double requester_rate; // * segments per second a rank sends one requester at most, and the burst
+    double requester_burst;
+    double download_rate; // * requests per second a downloader sends at most, and the burst
+    double download_burst;
+    bool subscribe; // * the tracker pushes swarm updates to the downloaders
+    double subscribe_interval_ms; // * least time between two pushes to a downloader
+} Options_t;
+
+extern Options_t options;
+
+void parse_options(int argc, char* argv[]);
+
+#endif
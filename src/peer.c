@@ -1,4 +1,11 @@
 #include "peer.h"
+#include "digest.h"
+#include "manifest.h"
+#include "options.h"
+#include "download.h"
+#include "comm.h"
+#include "merkle.h"
+#include "checkpoint.h"
 
 /* 
  * Helper function to handle MPI errors uniformly.
@@ -12,228 +19,260 @@ static void handle_mpi_error(int error_code, const char *error_message) {
 }
 
 /*
- * Sends owned files information from the client to the tracker.
- * We do not change the function name or the name of the called functions.
- * We only renamed local variables and introduced new checks/comments.
+ * Size of one owned file once packed for registration.
  */
-void send_data_to_tracker(ClientFiles_t *client) {
-    /* 
-     * Send the number of owned files to the tracker
-     */
-    int mpi_result = MPI_Send(&client->owned_files_count, 1, MPI_INT,
-                              TRACKER_RANK, HASH_TAG, MPI_COMM_WORLD);
-    handle_mpi_error(mpi_result, "Failed to send owned_files_count to tracker");
-
-    /*
-     * Send client type (SEEDER, PEER, or LEECHER)
-     */
-    mpi_result = MPI_Send(&client->client_type, 1, MPI_INT,
-                          TRACKER_RANK, CLIENT_TYPE_TAG, MPI_COMM_WORLD);
-    handle_mpi_error(mpi_result, "Failed to send client_type to tracker");
+static size_t packed_file_size(const FileData_t *file) {
+    return sizeof(RegisteredFile_t) + (options.dedup ? sizeof(Digest_t) * file->segment_count : 0);
+}
 
-    /*
-     * Now, for each owned file, send:
-     * 1) file name
-     * 2) number of segments
-     * 3) each segment's hash
-     */
-    for (size_t file_idx = 0; file_idx < client->owned_files_count; ++file_idx) {
-        /* Send file name */
-        mpi_result = MPI_Send(client->owned_files[file_idx].file_name,
-                              MAX_FILENAME,
-                              MPI_CHAR,
-                              TRACKER_RANK,
-                              HASH_TAG,
-                              MPI_COMM_WORLD);
-        handle_mpi_error(mpi_result, "Failed to send file name to tracker");
-
-        /* Send the segment count */
-        size_t local_segment_count = client->owned_files[file_idx].segment_count;
-        mpi_result = MPI_Send(&local_segment_count, 1, MPI_UNSIGNED,
-                              TRACKER_RANK, HASH_TAG, MPI_COMM_WORLD);
-        handle_mpi_error(mpi_result, "Failed to send segment_count to tracker");
-
-        /* Send each segment's hash */
-        for (size_t seg_idx = 0; seg_idx < local_segment_count; ++seg_idx) {
-            mpi_result = MPI_Send(client->owned_files[file_idx].segments[seg_idx].hash,
-                                  HASH_SIZE,
-                                  MPI_CHAR,
-                                  TRACKER_RANK,
-                                  HASH_TAG,
-                                  MPI_COMM_WORLD);
-            handle_mpi_error(mpi_result, "Failed to send hash to tracker");
-        }
-    }
+/*
+ * Size of the owned files a client packs for registration, leaving out those the tracker kept.
+ */
+static size_t packed_files_size(const ClientFiles_t *client, uint32_t kept) {
+    size_t size = 0;
+    for (size_t file_idx = 0; file_idx < client->owned_files_count; ++file_idx)
+        size += held_file_kept(kept, file_idx) ? 0 : packed_file_size(&client->owned_files[file_idx]);
+    return size;
 }
 
-/* 
- * Helper function to safely open a file and handle errors.
- * Returns the file pointer if successful, otherwise exits the program.
+/*
+ * Lists the files a client holds for a tracker restarted from a snapshot: its owned files, then
+ * the files its checkpoint holds segments of (the client announces those again once it restored
+ * them). Returns the fingerprint of all of them; a client with more files than the list holds
+ * lists none, and registers all of its owned files.
  */
-static FILE *safe_fopen(const char *path, const char *mode) {
-    FILE *file_ptr = fopen(path, mode);
-    if (!file_ptr) {
-        fprintf(stderr, "Error: Could not open file %s\n", path);
-        MPI_Abort(MPI_COMM_WORLD, 1);
+static uint64_t list_held_files(const ClientFiles_t *client, HeldFiles_t *held) {
+    memset(held, 0, sizeof(*held));
+    uint64_t hash = FINGERPRINT_SEED;
+    uint32_t count = 0;
+
+    for (size_t file_idx = 0; file_idx < client->owned_files_count; ++file_idx, ++count) {
+        const FileData_t *file = &client->owned_files[file_idx];
+        uint64_t fingerprint = fingerprint_file(file->file_id, file->segment_count, file->have, &file->root);
+        hash += fingerprint;
+        if (count < HELD_FILES_MAX)
+            held->files[count] = (HeldFile_t){.file_id = file->file_id,
+                                              .packed_size = (uint32_t) packed_file_size(file),
+                                              .fingerprint = fingerprint};
+    }
+
+    const Checkpoint_t *checkpoint = client->checkpoint;
+    for (uint32_t entry_idx = 0; checkpoint && entry_idx < checkpoint->header->entry_count; ++entry_idx) {
+        const CheckpointEntry_t *entry = &checkpoint->entries[entry_idx];
+        size_t segment_count = 0;
+        for (size_t segment_idx = 0; segment_idx < MAX_CHUNKS; ++segment_idx) {
+            if (segment_bit_test(entry->have, segment_idx))
+                segment_count = segment_idx + 1;
+        }
+        if (segment_count == 0)
+            continue;
+
+        uint64_t fingerprint = fingerprint_file(entry->file_id, segment_count, entry->have, &entry->root);
+        hash += fingerprint;
+        if (count < HELD_FILES_MAX)
+            held->files[count] = (HeldFile_t){.file_id = entry->file_id, .fingerprint = fingerprint};
+        count++;
     }
-    return file_ptr;
+
+    held->count = count <= HELD_FILES_MAX ? count : 0;
+    return hash;
 }
 
-/* 
- * Helper function to trim the trailing newline from a string if it exists.
+/*
+ * Packs a client's owned files (name, id, segment count and Merkle root, then with --dedup the
+ * segment digests) back to back at cursor, leaving out those the tracker kept. Returns the end of
+ * the packed data.
  */
-static void trim_newline(char *str) {
-    if (!str) return;
-    size_t len = strlen(str);
-    if (len == 0) return;
-    if (str[len - 1] == '\n') {
-        str[len - 1] = '\0';
+static uint8_t *pack_files(const ClientFiles_t *client, uint32_t kept, uint8_t *cursor) {
+    for (size_t file_idx = 0; file_idx < client->owned_files_count; ++file_idx) {
+        if (held_file_kept(kept, file_idx))
+            continue;
+        const FileData_t *file = &client->owned_files[file_idx];
+        RegisteredFile_t entry;
+        memset(&entry, 0, sizeof(entry));
+        strncpy(entry.file_name, file->file_name, MAX_FILENAME);
+        entry.file_id = file->file_id;
+        entry.segment_count = (uint32_t) file->segment_count;
+        entry.root = file->root;
+        memcpy(cursor, &entry, sizeof(entry));
+        cursor += sizeof(entry);
+        if (options.dedup) {
+            memcpy(cursor, file->segments, sizeof(Digest_t) * file->segment_count);
+            cursor += sizeof(Digest_t) * file->segment_count;
+        }
     }
+    return cursor;
 }
 
-/* 
- * Reads the client's file data from an input file named "in<rank>.txt"
+/*
+ * Sends owned files information from the rank's clients to the tracker.
+ * Registration is collective: every rank sends one header per logical client, then the
+ * packed owned files of all its clients back to back; the tracker gathers the headers and
+ * then all buffers with a single MPI_Gatherv.
  * We do not change the function name or the name of the called functions.
- * We only renamed local variables and added new checks/comments.
  */
-void read_from_file(ClientFiles_t *client, int rank) {
-    /* Construct the file name (e.g., in2.txt, in3.txt, etc.) */
-    char formatted_file_name[32]; /* Enough to hold "in_9999.txt" safely */
-    sprintf(formatted_file_name, "in%d.txt", rank);
+void send_data_to_tracker(ClientFiles_t *clients, int count) {
+    /*
+     * Headers first: the tracker needs every size before it can gather the buffers
+     */
+    RegistrationHeader_t *headers = (RegistrationHeader_t *) calloc(count, sizeof(RegistrationHeader_t));
+    HeldFiles_t *held = (HeldFiles_t *) calloc(count, sizeof(HeldFiles_t));
+    uint32_t *kept = (uint32_t *) calloc(count, sizeof(uint32_t));
+    if (!headers || !held || !kept) {
+        fprintf(stderr, "Error: Memory allocation failed for registration headers\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const ClientFiles_t *client = &clients[i];
+        headers[i].fingerprint = list_held_files(client, &held[i]);
+        headers[i].client_type = client->client_type;
+        headers[i].files_count = (uint32_t) client->owned_files_count;
+        headers[i].packed_size = (uint32_t) packed_files_size(client, 0);
+    }
+    int mpi_result = MPI_Gather(headers, count * sizeof(RegistrationHeader_t), MPI_BYTE, NULL,
+                                count * sizeof(RegistrationHeader_t), MPI_BYTE, TRACKER_RANK, CONTROL_COMM);
+    handle_mpi_error(mpi_result, "Failed to gather registration header");
 
-    /* Open the file safely */
-    FILE *file_ptr = safe_fopen(formatted_file_name, "r");
+    /*
+     * A tracker restarted from a snapshot compares the files each client holds with its own and
+     * tells the client which ones it kept; kept owned files are left out of the gather
+     */
+    if (options.snapshot_path) {
+        mpi_result = MPI_Gather(held, count * sizeof(HeldFiles_t), MPI_BYTE, NULL, count * sizeof(HeldFiles_t),
+                                MPI_BYTE, TRACKER_RANK, CONTROL_COMM);
+        handle_mpi_error(mpi_result, "Failed to gather held files");
+        mpi_result = MPI_Scatter(NULL, count, MPI_UINT32_T, kept, count, MPI_UINT32_T, TRACKER_RANK, CONTROL_COMM);
+        handle_mpi_error(mpi_result, "Failed to receive registration reply from tracker");
+    }
 
-    /* Buffer for reading lines */
-    char read_buffer[BUFF_SIZE];
+    /*
+     * Pack the owned files the tracker does not hold yet, in local id order
+     */
+    size_t packed_size = 0;
+    for (int i = 0; i < count; ++i)
+        packed_size += packed_files_size(&clients[i], kept[i]);
 
-    /* Read the number of owned files */
-    if (!fgets(read_buffer, BUFF_SIZE, file_ptr)) {
-        fprintf(stderr, "Error: Could not read owned_files_count\n");
-        fclose(file_ptr);
+    uint8_t *packed = (uint8_t *) malloc(packed_size ? packed_size : 1);
+    if (!packed) {
+        fprintf(stderr, "Error: Memory allocation failed for registration buffer\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    client->owned_files_count = (size_t) atoi(read_buffer);
 
-    /* Set the client rank */
-    client->client_rank = rank;
+    uint8_t *cursor = packed;
+    for (int i = 0; i < count; ++i)
+        cursor = pack_files(&clients[i], kept[i], cursor);
+
+    mpi_result = MPI_Gatherv(packed, (int) packed_size, MPI_BYTE, NULL, NULL, NULL, MPI_BYTE,
+                             TRACKER_RANK, CONTROL_COMM);
+    handle_mpi_error(mpi_result, "Failed to gather owned files");
+
+    free(packed);
+    free(kept);
+    free(held);
+    free(headers);
+}
+
+/*
+ * Fills the client's owned and wanted files from a loaded manifest.
+ * Digests are taken from the manifest's digest section without re-parsing any text.
+ */
+static void load_client_from_manifest(ClientFiles_t *client, const Manifest_t *manifest) {
+    const ManifestHeader_t *header = manifest->header;
 
-    /* If the client has no owned files */
-    if (client->owned_files_count == 0) {
+    /* Owned files, with room for the wanted ones */
+    client->owned_files_count = header->owned_count;
+    client->owned_files_capacity = header->owned_count + header->wanted_count;
+    if (client->owned_files_capacity == 0) {
         client->owned_files = NULL;
     } else {
-        /* Allocate memory for the owned files */
-        client->owned_files = (FileData_t *) malloc(sizeof(FileData_t) * client->owned_files_count);
+        client->owned_files = (FileData_t *) malloc(sizeof(FileData_t) * client->owned_files_capacity);
         if (!client->owned_files) {
             fprintf(stderr, "Error: Memory allocation failed for owned_files\n");
-            fclose(file_ptr);
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
 
-        /* For each owned file, read its name and segment data */
         for (size_t file_idx = 0; file_idx < client->owned_files_count; ++file_idx) {
-            if (!fgets(read_buffer, BUFF_SIZE, file_ptr)) {
-                fprintf(stderr, "Error: Could not read owned file info (line %zu)\n", file_idx);
-                fclose(file_ptr);
-                MPI_Abort(MPI_COMM_WORLD, 1);
-            }
+            const ManifestFile_t *entry = &manifest->files[file_idx];
+            const Digest_t *digests = manifest_file_digests(manifest, file_idx);
+            FileData_t *file = &client->owned_files[file_idx];
+            memset(file, 0, sizeof(*file));
 
-            /* Parse the file name and segment count */
-            char *parsed_file_name = strtok(read_buffer, " ");
-            if (!parsed_file_name) {
-                fprintf(stderr, "Error: Invalid file name format\n");
-                fclose(file_ptr);
-                MPI_Abort(MPI_COMM_WORLD, 1);
-            }
-            strcpy(client->owned_files[file_idx].file_name, parsed_file_name);
+            strncpy(file->file_name, entry->file_name, MAX_FILENAME - 1);
+            file->file_name[MAX_FILENAME - 1] = '\0';
+            file->file_id = entry->file_id;
+            file->segment_count = entry->segment_count;
 
-            /* Derive a numeric file id from the last character */
-            client->owned_files[file_idx].file_id = atoi(&parsed_file_name[strlen(parsed_file_name) - 1]);
-
-            /* Next token for the segment count */
-            char *parsed_segment_count = strtok(NULL, "\n");
-            if (!parsed_segment_count) {
-                fprintf(stderr, "Error: Invalid segment count format\n");
-                fclose(file_ptr);
-                MPI_Abort(MPI_COMM_WORLD, 1);
-            }
-            size_t local_segment_count = (size_t) atoi(parsed_segment_count);
-            client->owned_files[file_idx].segment_count = local_segment_count;
-
-            /* For each segment, read its hash */
-            for (size_t seg_idx = 0; seg_idx < local_segment_count; ++seg_idx) {
-                if (!fgets(read_buffer, BUFF_SIZE, file_ptr)) {
-                    fprintf(stderr, "Error: Could not read segment hash (line %zu)\n", seg_idx);
-                    fclose(file_ptr);
-                    MPI_Abort(MPI_COMM_WORLD, 1);
-                }
-                /* Copy the hash string, ensuring we don't exceed HASH_SIZE */
-                strncpy(client->owned_files[file_idx].segments[seg_idx].hash,
-                        read_buffer,
-                        HASH_SIZE);
-                /* Null-terminate explicitly at HASH_SIZE */
-                client->owned_files[file_idx].segments[seg_idx].hash[HASH_SIZE] = '\0';
-            }
+            memcpy(file->segments, digests, sizeof(Digest_t) * file->segment_count);
+            segment_bits_fill(file->have, file->segment_count);
+            merkle_build(file);
         }
     }
 
-    /* Read the number of wanted files */
-    if (!fgets(read_buffer, BUFF_SIZE, file_ptr)) {
-        fprintf(stderr, "Error: Could not read wanted_files_count\n");
-        fclose(file_ptr);
-        MPI_Abort(MPI_COMM_WORLD, 1);
-    }
-    client->wanted_files_count = (size_t) atoi(read_buffer);
-
-    /* If the client wants no files */
+    /* Wanted files */
+    client->wanted_files_count = header->wanted_count;
     if (client->wanted_files_count == 0) {
         client->wanted_files = NULL;
     } else {
-        /* Allocate memory for the wanted files */
         client->wanted_files = (FileName_t *) malloc(sizeof(FileName_t) * client->wanted_files_count);
         if (!client->wanted_files) {
             fprintf(stderr, "Error: Memory allocation failed for wanted_files\n");
-            fclose(file_ptr);
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
 
-        /* Read the names of the wanted files */
         for (size_t want_idx = 0; want_idx < client->wanted_files_count; ++want_idx) {
-            if (!fgets(read_buffer, BUFF_SIZE, file_ptr)) {
-                fprintf(stderr, "Error: Could not read wanted file info (line %zu)\n", want_idx);
-                fclose(file_ptr);
-                MPI_Abort(MPI_COMM_WORLD, 1);
-            }
-
-            /* Trim the newline to avoid strange prints */
-            trim_newline(read_buffer);
-
-            /* Copy the wanted file name safely */
             strncpy(client->wanted_files[want_idx].file_name,
-                    read_buffer,
-                    sizeof(client->wanted_files[want_idx].file_name) - 1);
-            client->wanted_files[want_idx].file_name[sizeof(client->wanted_files[want_idx].file_name) - 1] = '\0';
+                    manifest->wanted[want_idx].file_name,
+                    MAX_FILENAME - 1);
+            client->wanted_files[want_idx].file_name[MAX_FILENAME - 1] = '\0';
         }
     }
+}
+
+/* 
+ * Reads the client's file data from its manifest: the binary "in<id>.bin" (mapped, with
+ * --binary-manifest) or the text "in<id>.txt". With one client per rank the id is the rank.
+ * We do not change the function name or the name of the called functions.
+ */
+void read_from_file(ClientFiles_t *client, int client_id) {
+    /* Construct the file name (e.g., in2.txt, in3.bin, etc.) */
+    char formatted_file_name[32]; /* Enough to hold "in_9999.txt" safely */
+    Manifest_t manifest;
+    int status;
+
+    if (options.binary_manifest) {
+        sprintf(formatted_file_name, "in%d.bin", client_id);
+        status = manifest_map(&manifest, formatted_file_name);
+    } else {
+        sprintf(formatted_file_name, "in%d.txt", client_id);
+        status = manifest_parse_text(&manifest, formatted_file_name);
+    }
+
+    if (status < 0) {
+        fprintf(stderr, "Error: Could not load manifest %s\n", formatted_file_name);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* Set the client id */
+    client->client_id = client_id;
+
+    load_client_from_manifest(client, &manifest);
+    manifest_release(&manifest);
 
     /* Initialize the peers array for the wanted files */
     client->peers = (PeersList_t *) calloc(client->wanted_files_count, sizeof(PeersList_t));
     if (!client->peers && client->wanted_files_count > 0) {
         fprintf(stderr, "Error: Memory allocation failed for peers list\n");
-        fclose(file_ptr);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
     /* Determine client type */
-    if (client->owned_files && client->wanted_files)
+    if (client->owned_files_count > 0 && client->wanted_files)
         client->client_type = PEER;
-    else if (client->owned_files && !client->wanted_files)
+    else if (client->owned_files_count > 0 && !client->wanted_files)
         client->client_type = SEEDER;
     else
         client->client_type = LEECHER;
-
-    /* Close the file */
-    fclose(file_ptr);
 }
 
 /*
@@ -261,6 +300,8 @@ void free_client_files(ClientFiles_t *cf) {
                 free(cf->peers[i].peers_array);
                 cf->peers[i].peers_array = NULL;
             }
+            free(cf->peers[i].catalog);
+            cf->peers[i].catalog = NULL;
         }
 
         free(cf->peers);
@@ -5,9 +5,9 @@
 
 
 
-void send_data_to_tracker(ClientFiles_t* client);
+void send_data_to_tracker(ClientFiles_t* clients, int count);
 
-void read_from_file(ClientFiles_t* client, int rank);
+void read_from_file(ClientFiles_t* client, int client_id);
 
 void free_client_files(ClientFiles_t* cf);
 
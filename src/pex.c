@@ -0,0 +1,120 @@
+#include "pex.h"
+#include "download.h"
+
+#include <stddef.h>
+
+// Number of entries a received delta of size bytes really holds.
+static uint32_t delta_count(const PexDelta_t *delta, int size) {
+    if (size < (int)offsetof(PexDelta_t, entries))
+        return 0;
+    uint32_t fits = (uint32_t)(size - offsetof(PexDelta_t, entries)) / sizeof(PexEntry_t);
+    return MIN(MIN(delta->count, fits), PEX_MAX_ENTRIES);
+}
+
+static int find_entry(const PexTable_t *table, int client_id, int file_id) {
+    for (int i = 0; i < table->count; ++i) {
+        if (table->entries[i].client_id == client_id && table->entries[i].file_id == file_id)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Records that client_id holds the have segments of file_id. Only news is kept: an entry that
+ * adds no segment to what the table knows changes nothing. A changed entry is carried by the
+ * next PEX_FANOUT deltas. Returns true if the entry changed.
+ */
+bool pex_note(PexTable_t *table, int client_id, int file_id, const uint64_t *have) {
+    int slot = find_entry(table, client_id, file_id);
+
+    if (slot >= 0) {
+        bool news = false;
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            news |= (have[word] & ~table->entries[slot].have[word]) != 0;
+            table->entries[slot].have[word] |= have[word];
+        }
+        if (!news)
+            return false;
+    } else {
+        if (table->count < PEX_TABLE_SIZE) {
+            slot = table->count++;
+        } else {
+            // Forget the member heard of longest ago
+            slot = 0;
+            for (int i = 1; i < table->count; ++i) {
+                if (table->stamps[i] < table->stamps[slot])
+                    slot = i;
+            }
+        }
+        table->entries[slot].client_id = client_id;
+        table->entries[slot].file_id = file_id;
+        memcpy(table->entries[slot].have, have, sizeof(table->entries[slot].have));
+    }
+
+    table->pending[slot] = PEX_FANOUT;
+    table->stamps[slot] = ++table->clock;
+    return true;
+}
+
+/*
+ * Fills delta with up to PEX_MAX_ENTRIES changed entries, leaving out the receiver's own.
+ * Rate limited: at most one delta every PEX_PERIOD calls. Returns the number of bytes of the
+ * delta to send, 0 for none.
+ */
+int pex_fill(PexTable_t *table, PexDelta_t *delta, int receiver_id) {
+    delta->count = 0;
+    delta->reserved = 0;
+    if (++table->messages < PEX_PERIOD || table->count == 0)
+        return 0;
+
+    for (int scanned = 0; scanned < table->count && delta->count < PEX_MAX_ENTRIES; ++scanned) {
+        int slot = (table->cursor + scanned) % table->count;
+        if (table->pending[slot] == 0 || table->entries[slot].client_id == receiver_id)
+            continue;
+        table->pending[slot]--;
+        delta->entries[delta->count++] = table->entries[slot];
+    }
+    table->cursor = (table->cursor + 1) % table->count;
+    if (delta->count == 0)
+        return 0;
+
+    table->messages = 0;
+    table->entries_sent += delta->count;
+    return (int)(offsetof(PexDelta_t, entries) + delta->count * sizeof(PexEntry_t));
+}
+
+// Takes the entries of a received delta into the table, except the ones about self_id.
+void pex_receive(PexTable_t *table, int self_id, const PexDelta_t *delta, int size) {
+    uint32_t count = delta_count(delta, size);
+    table->entries_received += count;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const PexEntry_t *entry = &delta->entries[i];
+        if (entry->client_id != self_id && entry->client_id > 0)
+            pex_note(table, entry->client_id, entry->file_id, entry->have);
+    }
+}
+
+/*
+ * Adds what a delta says about the client's wanted files to its peer lists: new sources join
+ * the list (up to PEX_MAX_PEERS), known ones get their new segments. Download thread only.
+ */
+void pex_apply(ClientFiles_t *client, const PexDelta_t *delta, int size) {
+    uint32_t count = delta_count(delta, size);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const PexEntry_t *entry = &delta->entries[i];
+        if (entry->client_id == client->client_id)
+            continue;
+
+        for (size_t file_idx = 0; file_idx < client->wanted_files_count; ++file_idx) {
+            const char *name = client->wanted_files[file_idx].file_name;
+            if (atoi(&name[strlen(name) - 1]) != entry->file_id)
+                continue;
+
+            if (learn_peer(&client->peers[file_idx], entry->file_id, entry->client_id, entry->have, PEX_MAX_PEERS))
+                client->pex->download.sources_learned++;
+            break;
+        }
+    }
+}
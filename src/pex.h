@@ -0,0 +1,69 @@
+#ifndef _PEX_H_
+#define _PEX_H_
+
+#include "utils.h"
+
+// * Peer Exchange (--pex)
+// * Segment requests and their replies carry a few swarm members and what they hold, so
+// * clients learn new sources from each other instead of polling the tracker. A client keeps
+// * one table per worker (download and upload), so no table is shared between threads.
+#define PEX_MAX_ENTRIES 4 // * entries piggybacked on one message
+#define PEX_TABLE_SIZE 64 // * recently seen members a table remembers
+#define PEX_FANOUT 3 // * messages that carry each change before it goes quiet
+#define PEX_PERIOD 2 // * at most one delta every PEX_PERIOD messages
+#define PEX_MAX_PEERS 64 // * peers a wanted file's list may grow to through PEX
+
+// * PEX Entry: a swarm member and the segments of a file it holds
+typedef struct PexEntry_t {
+    int32_t client_id;
+    int32_t file_id;
+    uint64_t have[SEGMENT_WORDS];
+} PexEntry_t;
+
+typedef struct PexDelta_t {
+    uint32_t count;
+    uint32_t reserved;
+    PexEntry_t entries[PEX_MAX_ENTRIES];
+} PexDelta_t;
+
+// * Segment request and reply with a delta behind them (only count entries travel)
+typedef struct PexRequest_t {
+    SegmentRequest_t request;
+    PexDelta_t delta;
+} PexRequest_t;
+
+typedef struct PexReply_t {
+    SegmentReply_t reply;
+    PexDelta_t delta;
+} PexReply_t;
+
+typedef struct PexTable_t {
+    PexEntry_t entries[PEX_TABLE_SIZE];
+    int pending[PEX_TABLE_SIZE]; // * messages that should still carry the entry
+    uint64_t stamps[PEX_TABLE_SIZE]; // * when the entry last changed; the oldest is replaced
+    int count;
+    int cursor; // * where the next delta starts looking, so no entry starves
+    unsigned int messages; // * sent since the last delta
+    uint64_t clock;
+
+    // * Metrics
+    uint64_t entries_sent;
+    uint64_t entries_received;
+    uint64_t sources_learned; // * new peers added to a peer list
+} PexTable_t;
+
+// * A client's tables: one for each of its workers
+typedef struct PexState_t {
+    PexTable_t download;
+    PexTable_t upload;
+} PexState_t;
+
+bool pex_note(PexTable_t *table, int client_id, int file_id, const uint64_t *have);
+
+int pex_fill(PexTable_t *table, PexDelta_t *delta, int receiver_id);
+
+void pex_receive(PexTable_t *table, int self_id, const PexDelta_t *delta, int size);
+
+void pex_apply(ClientFiles_t *client, const PexDelta_t *delta, int size);
+
+#endif
@@ -0,0 +1,111 @@
+#include "ratelimit.h"
+
+UploadLimits_t upload_limits;
+
+static void bucket_init(TokenBucket_t *bucket, double rate, double burst) {
+    bucket->rate = rate;
+    bucket->burst = MAX(burst, 1.0);
+    bucket->tokens = bucket->burst;
+    bucket->refilled_ns = counters_now_ns();
+}
+
+/*
+ * Takes tokens from the bucket at now_ns, reserving the ones it does not hold yet. Returns when
+ * the last of them is due (now_ns if the bucket held them all, or has no limit).
+ */
+static uint64_t bucket_reserve(TokenBucket_t *bucket, double tokens, uint64_t now_ns) {
+    if (bucket->rate <= 0)
+        return now_ns;
+
+    if (now_ns > bucket->refilled_ns) {
+        double refill = (double)(now_ns - bucket->refilled_ns) / 1e9 * bucket->rate;
+        bucket->tokens = MIN(bucket->tokens + refill, bucket->burst);
+        bucket->refilled_ns = now_ns;
+    }
+    bucket->tokens -= tokens;
+    if (bucket->tokens >= 0)
+        return now_ns;
+    return now_ns + (uint64_t)(-bucket->tokens / bucket->rate * 1e9);
+}
+
+// Counts one take that waited from now_ns until due_ns.
+static void record_wait(RateWaits_t *waits, uint64_t now_ns, uint64_t due_ns) {
+    waits->takes++;
+    if (due_ns <= now_ns)
+        return;
+    double wait = (double)(due_ns - now_ns) / 1e9;
+    waits->throttled++;
+    waits->wait_total += wait;
+    waits->wait_max = MAX(waits->wait_max, wait);
+}
+
+// Sets up the rank's upload buckets from the options, for client ids 1 .. client_count.
+void ratelimit_init(int client_count) {
+    memset(&upload_limits, 0, sizeof(upload_limits));
+    bucket_init(&upload_limits.global, options.upload_rate, options.upload_burst);
+    if (options.requester_rate <= 0)
+        return;
+
+    upload_limits.requesters = malloc(sizeof(TokenBucket_t) * MAX(client_count, 1));
+    if (!upload_limits.requesters) {
+        fprintf(stderr, "Memory allocation failed for requester rate limits.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    upload_limits.requester_count = client_count;
+    for (int i = 0; i < client_count; ++i)
+        bucket_init(&upload_limits.requesters[i], options.requester_rate, options.requester_burst);
+}
+
+/*
+ * Spends the tokens of one segment sent to requester_id, from the rank's bucket and the
+ * requester's, sleeping until both are due. Upload thread only.
+ */
+void ratelimit_upload(int requester_id) {
+    uint64_t now_ns = counters_now_ns();
+    uint64_t due_ns = bucket_reserve(&upload_limits.global, 1.0, now_ns);
+    if (upload_limits.requesters && requester_id > 0 && requester_id <= upload_limits.requester_count) {
+        uint64_t requester_due_ns = bucket_reserve(&upload_limits.requesters[requester_id - 1], 1.0, now_ns);
+        if (requester_due_ns > due_ns) {
+            due_ns = requester_due_ns;
+            upload_limits.waits.by_requester++;
+        }
+    }
+
+    record_wait(&upload_limits.waits, now_ns, due_ns);
+    if (due_ns > now_ns) {
+        counters_here()->uploads_throttled++;
+        counters_here()->uploads_throttled_ns += due_ns - now_ns;
+        comm_sleep(COMM_UPLOAD_INBOX, due_ns);
+    }
+}
+
+// Returns a downloader's budget, or NULL without --download-rate.
+DownloadBudget_t *ratelimit_budget_create(void) {
+    if (options.download_rate <= 0)
+        return NULL;
+    DownloadBudget_t *budget = calloc(1, sizeof(DownloadBudget_t));
+    if (!budget) {
+        fprintf(stderr, "Memory allocation failed for a download budget.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    bucket_init(&budget->bucket, options.download_rate, options.download_burst);
+    return budget;
+}
+
+// Spends tokens of the downloader's budget, sleeping until they are due. Download thread only.
+void ratelimit_download(DownloadBudget_t *budget, unsigned int tokens) {
+    uint64_t now_ns = counters_now_ns();
+    uint64_t due_ns = bucket_reserve(&budget->bucket, (double)tokens, now_ns);
+    record_wait(&budget->waits, now_ns, due_ns);
+    if (due_ns > now_ns) {
+        counters_here()->downloads_throttled++;
+        counters_here()->downloads_throttled_ns += due_ns - now_ns;
+        comm_sleep(COMM_DOWNLOAD_INBOX, due_ns);
+    }
+}
+
+void ratelimit_free(void) {
+    free(upload_limits.requesters);
+    upload_limits.requesters = NULL;
+    upload_limits.requester_count = 0;
+}
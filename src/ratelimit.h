@@ -0,0 +1,59 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include "utils.h"
+#include "comm.h"
+
+// * Rate Limits (--upload-rate, --requester-rate, --download-rate <segments/s>[:<burst>])
+// * Token buckets counted in segments. A rank's upload thread spends one token of the rank's
+// * bucket and one of the requester's bucket for every segment it sends; a downloader spends
+// * one token of its own budget for every request it sends (two for a request sent to two
+// * holders). A bucket refills at its rate up to its burst, and a take that finds it empty
+// * reserves the next token and sleeps until it is due, so waiting costs no CPU: the worker
+// * runs its other clients meanwhile, or sleeps on its inbox. Requests an uploader turns away
+// * cost nothing. Waits are counted per thread in the counters and summed in the run report.
+#define RATELIMIT_BURST 4.0 // * default burst of a bucket, in segments
+
+typedef struct TokenBucket_t {
+    double rate; // * tokens per second (0 = unlimited)
+    double burst; // * tokens it holds at most
+    double tokens; // * below 0 once takes reserved tokens that are not due yet
+    uint64_t refilled_ns;
+} TokenBucket_t;
+
+// * One side's throttling: how many takes had to wait, and how long in total and at most
+typedef struct RateWaits_t {
+    uint64_t takes;
+    uint64_t throttled;
+    uint64_t by_requester; // * upload side: waits the requester's bucket made longer
+    double wait_total;
+    double wait_max;
+} RateWaits_t;
+
+// * A rank's upload limits, used by its upload thread only
+typedef struct UploadLimits_t {
+    TokenBucket_t global;
+    TokenBucket_t *requesters; // * by client id (NULL = no per-requester limit)
+    int requester_count;
+    RateWaits_t waits;
+} UploadLimits_t;
+
+// * A downloader's budget, used by its download coroutine only
+typedef struct DownloadBudget_t {
+    TokenBucket_t bucket;
+    RateWaits_t waits;
+} DownloadBudget_t;
+
+extern UploadLimits_t upload_limits;
+
+void ratelimit_init(int client_count);
+
+void ratelimit_upload(int requester_id);
+
+DownloadBudget_t *ratelimit_budget_create(void);
+
+void ratelimit_download(DownloadBudget_t *budget, unsigned int tokens);
+
+void ratelimit_free(void);
+
+#endif
@@ -0,0 +1,262 @@
+#include "snapshot.h"
+#include "download.h"
+#include "digest.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+// Fingerprints one of a client's files as the client does (see fingerprint_file()), with the root
+// of its swarm.
+uint64_t tracker_file_fingerprint(const TrackerDataSet_t *m_tracker, const TrackerFile_t *file) {
+    static const Digest_t no_root;
+    const Digest_t *root = file->file_id > 0 && file->file_id <= m_tracker->swarm_size
+                           ? &m_tracker->swarms[file->file_id - 1].root : &no_root;
+    return fingerprint_file(file->file_id, file->segment_count, file->have, root);
+}
+
+// Fingerprints all of a client's files, adding them up as the client does.
+static uint64_t tracker_fingerprint(const TrackerDataSet_t *m_tracker, const TrackerData_t *client) {
+    uint64_t hash = FINGERPRINT_SEED;
+    for (size_t i = 0; i < client->files_count; ++i)
+        hash += tracker_file_fingerprint(m_tracker, &client->files[i]);
+    return hash;
+}
+
+/**
+ * Writes the whole tracker state as one image. It goes to "<path>.tmp" first and is renamed
+ * over the previous snapshot, so a crash never leaves a half-written snapshot behind.
+ */
+int snapshot_write(const TrackerDataSet_t *m_tracker, const char *path) {
+    static uint64_t generation = 0;
+
+    uint32_t total_files = 0, total_members = 0;
+    for (int i = 0; i < m_tracker->client_count; ++i)
+        total_files += m_tracker->data[i].files_count;
+    for (int i = 0; i < m_tracker->swarm_size && m_tracker->swarms; ++i)
+        total_members += m_tracker->swarms[i].clients_in_swarm_count;
+
+    uint64_t clients_offset = ALIGN8(sizeof(SnapshotHeader_t));
+    uint64_t files_offset = ALIGN8(clients_offset + sizeof(SnapshotClient_t) * m_tracker->client_count);
+    uint64_t swarms_offset = ALIGN8(files_offset + sizeof(TrackerFile_t) * total_files);
+    uint64_t members_offset = ALIGN8(swarms_offset + sizeof(SnapshotSwarm_t) * m_tracker->swarm_size);
+    uint64_t total_size = members_offset + sizeof(int32_t) * total_members;
+
+    uint8_t *image = calloc(1, total_size);
+    if (!image) {
+        fprintf(stderr, "Memory allocation failed for tracker snapshot.\n");
+        return -1;
+    }
+
+    SnapshotHeader_t *header = (SnapshotHeader_t *)image;
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->max_chunks = MAX_CHUNKS;
+    header->client_count = m_tracker->client_count;
+    header->swarm_size = m_tracker->swarm_size;
+    header->file_data_size = sizeof(TrackerFile_t);
+    header->total_files = total_files;
+    header->total_members = total_members;
+    header->generation = ++generation;
+    header->clients_offset = clients_offset;
+    header->files_offset = files_offset;
+    header->swarms_offset = swarms_offset;
+    header->members_offset = members_offset;
+    header->total_size = total_size;
+
+    // Per-client records and their files
+    SnapshotClient_t *clients = (SnapshotClient_t *)(image + clients_offset);
+    TrackerFile_t *files = (TrackerFile_t *)(image + files_offset);
+    uint32_t next_file = 0;
+    for (int i = 0; i < m_tracker->client_count; ++i) {
+        const TrackerData_t *client = &m_tracker->data[i];
+        clients[i].client_id = client->client_id;
+        clients[i].client_type = client->client_type;
+        clients[i].files_count = client->files_count;
+        clients[i].first_file = next_file;
+        clients[i].fingerprint = tracker_fingerprint(m_tracker, client);
+        if (client->files_count > 0)
+            memcpy(&files[next_file], client->files, sizeof(TrackerFile_t) * client->files_count);
+        next_file += client->files_count;
+    }
+
+    // Swarms and their members
+    SnapshotSwarm_t *swarms = (SnapshotSwarm_t *)(image + swarms_offset);
+    int32_t *members = (int32_t *)(image + members_offset);
+    uint32_t next_member = 0;
+    for (int i = 0; i < m_tracker->swarm_size && m_tracker->swarms; ++i) {
+        const Swarm_t *swarm = &m_tracker->swarms[i];
+        swarms[i].version = swarm->version;
+        swarms[i].member_count = swarm->clients_in_swarm_count;
+        swarms[i].first_member = next_member;
+        swarms[i].segment_total = swarm->segment_total;
+        swarms[i].root = swarm->root;
+        for (int k = 0; k < swarm->clients_in_swarm_count; ++k)
+            members[next_member++] = swarm->clients_in_swarm[k];
+    }
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int status = 0;
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out || fwrite(image, 1, total_size, out) != total_size) {
+        status = -1;
+    }
+    if (out && fclose(out) != 0) {
+        status = -1;
+    }
+    if (status == 0 && rename(tmp_path, path) != 0) {
+        status = -1;
+    }
+    if (status < 0) {
+        fprintf(stderr, "Could not write tracker snapshot %s.\n", path);
+        unlink(tmp_path);
+    }
+
+    free(image);
+    return status;
+}
+
+// Checks that count entries of entry_size starting at offset (8-byte aligned) end by limit.
+static bool section_fits(uint64_t offset, uint64_t count, uint64_t entry_size, uint64_t limit) {
+    return offset % 8 == 0 && offset <= limit && count <= (limit - offset) / entry_size;
+}
+
+// Checks every client's and swarm's ranges, and the ids they hold, before anything is copied.
+static bool records_valid(const SnapshotHeader_t *header, const uint8_t *image) {
+    const SnapshotClient_t *clients = (const SnapshotClient_t *)(image + header->clients_offset);
+    const TrackerFile_t *files = (const TrackerFile_t *)(image + header->files_offset);
+    const SnapshotSwarm_t *swarms = (const SnapshotSwarm_t *)(image + header->swarms_offset);
+    const int32_t *members = (const int32_t *)(image + header->members_offset);
+
+    for (int i = 0; i < header->client_count; ++i) {
+        const SnapshotClient_t *client = &clients[i];
+        if (client->client_id != i + 1 || client->first_file > header->total_files ||
+            client->files_count > header->total_files - client->first_file)
+            return false;
+        for (uint32_t j = 0; j < client->files_count; ++j) {
+            const TrackerFile_t *file = &files[client->first_file + j];
+            if (file->file_id <= 0 || file->file_id > header->swarm_size || file->segment_count > MAX_CHUNKS)
+                return false;
+        }
+    }
+
+    for (int i = 0; i < header->swarm_size; ++i) {
+        const SnapshotSwarm_t *swarm = &swarms[i];
+        if (swarm->segment_total > MAX_CHUNKS || swarm->first_member > header->total_members ||
+            swarm->member_count > header->total_members - swarm->first_member || swarm->member_count > INT_MAX)
+            return false;
+        for (uint32_t k = 0; k < swarm->member_count; ++k) {
+            int32_t member = members[swarm->first_member + k];
+            if (member < 1 || member > header->client_count)
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Maps a snapshot and copies it into the tracker. m_tracker->client_count and m_tracker->data
+ * must already be set up; a snapshot taken with another number of clients is ignored.
+ * Returns true if the tracker state now comes from the snapshot.
+ */
+bool snapshot_load(TrackerDataSet_t *m_tracker, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false; // No snapshot yet: a cold start
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader_t)) {
+        close(fd);
+        return false;
+    }
+
+    uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Could not mmap tracker snapshot %s.\n", path);
+        return false;
+    }
+
+    const SnapshotHeader_t *header = (const SnapshotHeader_t *)image;
+    bool valid = header->magic == SNAPSHOT_MAGIC &&
+                 header->version == SNAPSHOT_VERSION &&
+                 header->max_chunks == MAX_CHUNKS &&
+                 header->file_data_size == sizeof(TrackerFile_t) &&
+                 header->client_count == m_tracker->client_count &&
+                 header->total_size == (uint64_t)st.st_size &&
+                 header->swarm_size >= 0 &&
+                 header->clients_offset >= sizeof(SnapshotHeader_t) &&
+                 section_fits(header->clients_offset, (uint64_t)header->client_count, sizeof(SnapshotClient_t), header->files_offset) &&
+                 section_fits(header->files_offset, header->total_files, sizeof(TrackerFile_t), header->swarms_offset) &&
+                 section_fits(header->swarms_offset, (uint64_t)header->swarm_size, sizeof(SnapshotSwarm_t), header->members_offset) &&
+                 section_fits(header->members_offset, header->total_members, sizeof(int32_t), header->total_size);
+    if (!valid) {
+        fprintf(stderr, "Ignoring tracker snapshot %s: it does not match this run.\n", path);
+        munmap(image, st.st_size);
+        return false;
+    }
+    if (!records_valid(header, image)) {
+        fprintf(stderr, "Ignoring tracker snapshot %s: it is corrupt.\n", path);
+        munmap(image, st.st_size);
+        return false;
+    }
+
+    const SnapshotClient_t *clients = (const SnapshotClient_t *)(image + header->clients_offset);
+    const TrackerFile_t *files = (const TrackerFile_t *)(image + header->files_offset);
+    const SnapshotSwarm_t *swarms = (const SnapshotSwarm_t *)(image + header->swarms_offset);
+    const int32_t *members = (const int32_t *)(image + header->members_offset);
+
+    for (int i = 0; i < m_tracker->client_count; ++i) {
+        TrackerData_t *client = &m_tracker->data[i];
+        client->client_id = clients[i].client_id;
+        client->client_type = (Client_Type_t)clients[i].client_type;
+        client->files_count = clients[i].files_count;
+        client->fingerprint = clients[i].fingerprint;
+        client->files = NULL;
+
+        if (client->files_count > 0) {
+            client->files = malloc(sizeof(TrackerFile_t) * client->files_count);
+            if (!client->files) {
+                fprintf(stderr, "Memory allocation failed while loading snapshot.\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            memcpy(client->files, &files[clients[i].first_file], sizeof(TrackerFile_t) * client->files_count);
+        }
+    }
+
+    m_tracker->swarm_size = header->swarm_size;
+    m_tracker->swarms = NULL;
+    if (m_tracker->swarm_size > 0) {
+        m_tracker->swarms = calloc(m_tracker->swarm_size, sizeof(Swarm_t));
+        if (!m_tracker->swarms) {
+            fprintf(stderr, "Memory allocation failed while loading snapshot.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < m_tracker->swarm_size; ++i) {
+        Swarm_t *swarm = &m_tracker->swarms[i];
+        snprintf(swarm->file_name, MAX_FILENAME, "file%d", i + 1);
+        swarm->version = swarms[i].version;
+        swarm->segment_total = swarms[i].segment_total;
+        swarm->root = swarms[i].root;
+        swarm->clients_in_swarm_count = swarms[i].member_count;
+        if (swarm->clients_in_swarm_count > 0) {
+            swarm->clients_in_swarm = malloc(sizeof(int) * swarm->clients_in_swarm_count);
+            if (!swarm->clients_in_swarm) {
+                fprintf(stderr, "Memory allocation failed while loading snapshot.\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            for (int k = 0; k < swarm->clients_in_swarm_count; ++k)
+                swarm->clients_in_swarm[k] = members[swarms[i].first_member + k];
+        }
+    }
+
+    munmap(image, st.st_size);
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "utils.h"
+
+// * Tracker Snapshot Layout (host byte order, every section 8-byte aligned)
+// *   SnapshotHeader_t
+// *   SnapshotClient_t clients[client_count]
+// *   TrackerFile_t    files[total_files]      (each client's files, back to back)
+// *   SnapshotSwarm_t  swarms[swarm_size]
+// *   int32_t          members[total_members] (client ids of each swarm, back to back)
+#define SNAPSHOT_MAGIC 0x504e5354u // * "TSNP"
+#define SNAPSHOT_VERSION 4
+
+typedef struct SnapshotHeader_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t max_chunks;
+    int32_t client_count;
+    int32_t swarm_size;
+    uint32_t file_data_size; // * sizeof(TrackerFile_t) of the writer
+    uint32_t total_files;
+    uint32_t total_members;
+    uint32_t reserved;
+    uint64_t generation;
+    uint64_t clients_offset;
+    uint64_t files_offset;
+    uint64_t swarms_offset;
+    uint64_t members_offset;
+    uint64_t total_size;
+} SnapshotHeader_t;
+
+typedef struct SnapshotClient_t {
+    int32_t client_id;
+    int32_t client_type;
+    uint32_t files_count;
+    uint32_t first_file;
+    uint64_t fingerprint;
+} SnapshotClient_t;
+
+typedef struct SnapshotSwarm_t {
+    uint32_t version;
+    uint32_t member_count;
+    uint32_t first_member;
+    uint32_t segment_total;
+    Digest_t root;
+} SnapshotSwarm_t;
+
+int snapshot_write(const TrackerDataSet_t *m_tracker, const char *path);
+
+bool snapshot_load(TrackerDataSet_t *m_tracker, const char *path);
+
+uint64_t tracker_file_fingerprint(const TrackerDataSet_t *m_tracker, const TrackerFile_t *file);
+
+#endif
@@ -0,0 +1,134 @@
+#include "stream.h"
+#include "comm.h"
+#include "topology.h"
+
+StreamState_t *stream_create(void) {
+    StreamState_t *state = calloc(1, sizeof(StreamState_t));
+    if (!state) {
+        fprintf(stderr, "Memory allocation failed for streaming state.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    return state;
+}
+
+/*
+ * Starts playing a wanted file: playback waits for segment 0, which may be held already (from a
+ * checkpoint, or copied with --dedup).
+ */
+void stream_begin(StreamState_t *state, const FileData_t *file, uint64_t now_ns) {
+    state->cursor = 0;
+    state->started_ns = now_ns;
+    state->playing = false;
+    state->due_ns = now_ns;
+    stream_arrived(state, file, now_ns);
+}
+
+/*
+ * Moves playback over the segments held from the cursor on, after one arrived at now_ns. The
+ * first segment starts playback; playback that reached the cursor before now stalled until now.
+ */
+void stream_arrived(StreamState_t *state, const FileData_t *file, uint64_t now_ns) {
+    if (!state->playing) {
+        if (file->segment_total == 0 || !segment_bit_test(file->have, 0))
+            return;
+        double first = (double)(now_ns - state->started_ns) / 1e9;
+        state->playing = true;
+        state->due_ns = now_ns;
+        state->files_started++;
+        state->first_total += first;
+        state->first_max = MAX(state->first_max, first);
+    }
+
+    uint64_t period_ns = (uint64_t)(options.stream_period_ms * 1e6);
+    while (state->cursor < file->segment_total && segment_bit_test(file->have, state->cursor)) {
+        if (now_ns > state->due_ns) {
+            state->stalls++;
+            state->stall_time += (double)(now_ns - state->due_ns) / 1e9;
+            state->due_ns = now_ns;
+        }
+        state->due_ns += period_ns;
+        state->cursor++;
+    }
+}
+
+// Picks a holder of a segment among the peers, uniformly among the best ones: those that did not
+// turn the client away first, then the closest. Leaves out the peer skip, the peers of skip_rank
+// (if set) and the ones farther than max_distance. Returns -1 if none holds it.
+static int pick_holder(const PeersList_t *peers, size_t segment_idx, int skip, int skip_rank, int max_distance,
+                       bool *insist) {
+    int best_rank = INT32_MAX;
+    int candidates = 0;
+    int chosen = -1;
+    for (int i = 0; i < peers->peers_count; ++i) {
+        const PeerInfo_t *peer = &peers->peers_array[i];
+        int peer_rank = client_rank_of(peer->peer_id);
+        int distance = (int)topology_distance(topology.rank, peer_rank);
+        if (i == skip || (skip_rank > 0 && peer_rank == skip_rank) || distance > max_distance ||
+            !segment_bit_test(peer->have, segment_idx))
+            continue;
+
+        int rank = (int)peer->refused * TOPOLOGY_DISTANCES + distance;
+        if (rank < best_rank) {
+            best_rank = rank;
+            candidates = 0;
+        }
+        if (rank == best_rank && rand() % ++candidates == 0)
+            chosen = i;
+    }
+    if (insist)
+        *insist = chosen >= 0 && peers->peers_array[chosen].refused;
+    return chosen;
+}
+
+/*
+ * Picks the next segment of the file to ask for, and whom to ask: the first urgent one some peer
+ * holds (with a second holder on another rank), or else the missing segment the fewest peers
+ * hold. Returns false if no peer holds a missing segment.
+ */
+bool stream_pick(StreamState_t *state, const PeersList_t *peers, const FileData_t *file, StreamPick_t *pick) {
+    size_t total = file->segment_total;
+    size_t window_end = MIN(state->cursor + (size_t)options.stream_window, total);
+
+    for (size_t idx = state->cursor; idx < window_end; ++idx) {
+        if (segment_bit_test(file->have, idx))
+            continue;
+        int peer = pick_holder(peers, idx, -1, 0, TOPOLOGY_REMOTE, &pick->insist);
+        if (peer < 0)
+            continue;
+
+        // When the node shares its segments, only a copy within the node is fetched twice
+        pick->segment_idx = idx;
+        pick->peer = peer;
+        pick->duplicate = pick_holder(peers, idx, peer, client_rank_of(peers->peers_array[peer].peer_id),
+                                      topology.share ? TOPOLOGY_SAME_NODE : TOPOLOGY_REMOTE, NULL);
+        pick->urgent = true;
+        return true;
+    }
+
+    // Rarest first: how many peers hold each missing segment
+    uint32_t holders[MAX_CHUNKS] = {0};
+    for (int i = 0; i < peers->peers_count; ++i) {
+        const PeerInfo_t *peer = &peers->peers_array[i];
+        for (int word = 0; word < SEGMENT_WORDS; ++word) {
+            uint64_t bits = peer->have[word] & ~file->have[word];
+            while (bits) {
+                holders[word * 64 + __builtin_ctzll(bits)]++;
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    size_t rarest = total;
+    for (size_t idx = window_end; idx < total; ++idx) {
+        if (holders[idx] > 0 && (rarest == total || holders[idx] < holders[rarest]))
+            rarest = idx;
+    }
+    if (rarest == total)
+        return false;
+
+    pick->segment_idx = rarest;
+    pick->peer = pick_holder(peers, rarest, -1, 0, TOPOLOGY_REMOTE, &pick->insist);
+    pick->duplicate = -1;
+    pick->urgent = false;
+    return true;
+}
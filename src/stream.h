@@ -0,0 +1,52 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "utils.h"
+
+// * Streaming (--stream <window>[:<ms per segment>])
+// * Each wanted file is played front to back while it downloads: playback starts once segment 0
+// * is held and then takes one segment every period, up to the first segment not held (the
+// * cursor). The window segments from the cursor on are urgent: the lowest one any peer holds
+// * goes first, to two holders on different ranks at once under one request id (the second one
+// * on the client's node when the node shares its segments), and the first reply that carries it
+// * wins. With nothing urgent to fetch, the rarest missing segment among the peers goes next.
+// * Playback reaching the cursor before its segment arrived is a stall; it resumes when the
+// * segment comes.
+#define STREAM_PERIOD_MS 1.0 // * default playback time of a segment
+
+// * What to ask for next
+typedef struct StreamPick_t {
+    size_t segment_idx;
+    int peer; // * index in the peer list
+    int duplicate; // * second holder of an urgent segment (-1 = none)
+    bool urgent; // * in the window
+    bool insist; // * only peers that turned the client away hold it
+} StreamPick_t;
+
+// * One downloader's playback, used by its download coroutine only
+typedef struct StreamState_t {
+    size_t cursor; // * first segment of the current file not held
+    uint64_t started_ns; // * when the client started the current file
+    bool playing;
+    uint64_t due_ns; // * when playback reaches the cursor
+
+    // * Metrics
+    uint32_t files_started; // * files whose first segment arrived, and how long it took them
+    double first_total;
+    double first_max;
+    uint64_t stalls;
+    double stall_time;
+    uint64_t urgent; // * urgent requests, those sent twice and those the second holder answered first
+    uint64_t duplicates;
+    uint64_t duplicate_wins;
+} StreamState_t;
+
+StreamState_t *stream_create(void);
+
+void stream_begin(StreamState_t *state, const FileData_t *file, uint64_t now_ns);
+
+void stream_arrived(StreamState_t *state, const FileData_t *file, uint64_t now_ns);
+
+bool stream_pick(StreamState_t *state, const PeersList_t *peers, const FileData_t *file, StreamPick_t *pick);
+
+#endif
@@ -0,0 +1,341 @@
+#include "subscribe.h"
+#include "tracker.h"
+#include "comm.h"
+#include "dedup.h"
+
+Subscriptions_t subscriptions;
+
+static void *subscribe_alloc(size_t count, size_t size) {
+    void *data = calloc(count ? count : 1, size);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed for swarm subscriptions.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    return data;
+}
+
+// Sets up an empty subscription for every client of the tracker.
+void subscribe_start(const TrackerDataSet_t *m_tracker) {
+    memset(&subscriptions, 0, sizeof(subscriptions));
+    subscriptions.client_count = m_tracker->client_count;
+    subscriptions.swarm_size = m_tracker->swarm_size;
+    subscriptions.active = subscribe_alloc(m_tracker->client_count, sizeof(bool));
+    subscriptions.marks = subscribe_alloc(m_tracker->client_count, sizeof(SubscriberMarks_t));
+    subscriptions.pending = subscribe_alloc(m_tracker->client_count, sizeof(int32_t));
+    subscriptions.files = subscribe_alloc(m_tracker->swarm_size, sizeof(FileSubscribers_t));
+}
+
+// Subscribes a client to the swarms of its wanted files (already in its tracker data).
+void subscribe_add(const TrackerDataSet_t *m_tracker, int client_id) {
+    if (client_id <= 0 || client_id > m_tracker->client_count || subscriptions.active[client_id - 1])
+        return;
+    subscriptions.active[client_id - 1] = true;
+    subscriptions.subscribers++;
+
+    const TrackerData_t *subscriber = &m_tracker->data[client_id - 1];
+    for (uint32_t slot = 0; slot < subscriber->wanted_count; ++slot) {
+        int file_id = subscriber->wanted_files[slot];
+        if (file_id <= 0 || file_id > subscriptions.swarm_size)
+            continue;
+        FileSubscribers_t *file = &subscriptions.files[file_id - 1];
+        if (file->count == file->capacity) {
+            file->capacity = file->capacity ? file->capacity * 2 : SUBSCRIBE_BATCH;
+            file->client_ids = realloc(file->client_ids, sizeof(int32_t) * file->capacity);
+            if (!file->client_ids) {
+                fprintf(stderr, "Memory allocation failed for swarm subscriptions.\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+        file->client_ids[file->count++] = client_id;
+    }
+}
+
+static uint32_t mark_hash(int file_id, int peer_id) {
+    return ((uint32_t)peer_id * 0x9e3779b1u) ^ ((uint32_t)file_id * 0x85ebca6bu);
+}
+
+// Slot of the set of marks that holds (file_id, peer_id), or the free slot where it would go.
+static uint32_t *mark_slot(SubscriberMarks_t *marks, int file_id, int peer_id) {
+    uint32_t mask = 2 * marks->capacity - 1;
+    for (uint32_t slot = mark_hash(file_id, peer_id) & mask;; slot = (slot + 1) & mask) {
+        uint32_t index = marks->slots[slot];
+        if (index == 0 || (marks->marks[index - 1].file_id == file_id && marks->marks[index - 1].peer_id == peer_id))
+            return &marks->slots[slot];
+    }
+}
+
+// Doubles the room for a subscriber's marks and rebuilds their set.
+static void grow_marks(SubscriberMarks_t *marks) {
+    marks->capacity = marks->capacity ? marks->capacity * 2 : SUBSCRIBE_BATCH;
+    free(marks->slots);
+    marks->marks = realloc(marks->marks, sizeof(SwarmMark_t) * marks->capacity);
+    marks->slots = calloc(2 * (size_t)marks->capacity, sizeof(uint32_t));
+    if (!marks->marks || !marks->slots) {
+        fprintf(stderr, "Memory allocation failed for swarm subscriptions.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < marks->count; ++i)
+        *mark_slot(marks, marks->marks[i].file_id, marks->marks[i].peer_id) = i + 1;
+}
+
+// Marks peer_id for a push of wanted file file_id to a subscriber, unless it is marked already.
+static void mark(int subscriber_id, int file_id, int peer_id) {
+    SubscriberMarks_t *marks = &subscriptions.marks[subscriber_id - 1];
+    if (marks->count > 0 && *mark_slot(marks, file_id, peer_id) != 0) {
+        subscriptions.coalesced++;
+        return;
+    }
+
+    if (marks->count == marks->capacity)
+        grow_marks(marks);
+    marks->marks[marks->count] = (SwarmMark_t){.file_id = file_id, .peer_id = peer_id};
+    *mark_slot(marks, file_id, peer_id) = ++marks->count;
+    if (marks->count == 1)
+        subscriptions.pending[subscriptions.pending_count++] = subscriber_id;
+}
+
+// Drops a subscriber's marks, freeing their slots only.
+static void clear_marks(SubscriberMarks_t *marks) {
+    for (uint32_t i = 0; i < marks->count; ++i)
+        *mark_slot(marks, marks->marks[i].file_id, marks->marks[i].peer_id) = 0;
+    marks->count = 0;
+}
+
+// Marks client_id for a push to the subscribers of wanted file file_id, dropping the ended
+// subscriptions from the file's list on the way.
+static void mark_subscribers(int file_id, int client_id) {
+    FileSubscribers_t *file = &subscriptions.files[file_id - 1];
+    int kept = 0;
+    for (int i = 0; i < file->count; ++i) {
+        int32_t subscriber_id = file->client_ids[i];
+        if (!subscriptions.active[subscriber_id - 1])
+            continue;
+        file->client_ids[kept++] = subscriber_id;
+        if (subscriber_id != client_id)
+            mark(subscriber_id, file_id, client_id);
+    }
+    file->count = kept;
+}
+
+/*
+ * Marks the client that announced records for a push to every other subscriber of the files
+ * they are of. With --dedup, every subscriber of a file whose contents are known may hold the
+ * same contents: it is marked too, and learns at the push whether any came in. A leech serves
+ * nobody, so its segments are not pushed.
+ */
+void subscribe_note(const TrackerDataSet_t *m_tracker, int client_id, const SegmentRecord_t *records,
+                    int record_count) {
+    if (client_id <= 0 || client_id > m_tracker->client_count || m_tracker->data[client_id - 1].client_type == LEECHER)
+        return;
+
+    int last_file = 0;
+    for (int i = 0; i < record_count; ++i) {
+        int file_id = records[i].file_id;
+        if (file_id == last_file || file_id <= 0 || file_id > subscriptions.swarm_size)
+            continue;
+        last_file = file_id;
+
+        if (!options.dedup || !m_tracker->swarms[file_id - 1].content) {
+            mark_subscribers(file_id, client_id);
+            continue;
+        }
+        for (int wanted_id = 1; wanted_id <= subscriptions.swarm_size; ++wanted_id) {
+            if (m_tracker->swarms[wanted_id - 1].content)
+                mark_subscribers(wanted_id, client_id);
+        }
+    }
+}
+
+// Ends a client's subscription, dropping its pending marks. The file lists drop it when next
+// walked, and the pending list at the next flush.
+void subscribe_end(int client_id) {
+    if (client_id <= 0 || client_id > subscriptions.client_count || !subscriptions.active[client_id - 1])
+        return;
+    subscriptions.active[client_id - 1] = false;
+    clear_marks(&subscriptions.marks[client_id - 1]);
+}
+
+// Frees the buffers of the pushes whose sends completed.
+static void reap_pushes(void) {
+    int kept = 0;
+    for (int i = 0; i < subscriptions.in_flight; ++i) {
+        int done = 0;
+        if (MPI_Test(&subscriptions.requests[i], &done, MPI_STATUS_IGNORE) != MPI_SUCCESS || done) {
+            free(subscriptions.buffers[i]);
+            continue;
+        }
+        subscriptions.requests[kept] = subscriptions.requests[i];
+        subscriptions.buffers[kept] = subscriptions.buffers[i];
+        kept++;
+    }
+    subscriptions.in_flight = kept;
+}
+
+// Sends count entries to a subscriber without waiting; the buffer is freed once the send completed.
+static void post_push(int client_id, SwarmPush_t *entries, int count) {
+    if (subscriptions.in_flight == subscriptions.capacity) {
+        int capacity = subscriptions.capacity ? subscriptions.capacity * 2 : SUBSCRIBE_BATCH;
+        MPI_Request *requests = realloc(subscriptions.requests, sizeof(MPI_Request) * capacity);
+        SwarmPush_t **buffers = realloc(subscriptions.buffers, sizeof(SwarmPush_t *) * capacity);
+        if (!requests || !buffers) {
+            fprintf(stderr, "Memory allocation failed for pending pushes.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        subscriptions.requests = requests;
+        subscriptions.buffers = buffers;
+        subscriptions.capacity = capacity;
+    }
+
+    int size = count * (int)sizeof(SwarmPush_t);
+    counters_sent(PEERS_SEEDERS_TRANSFER_TAG, size);
+    if (MPI_Isend(entries, size, MPI_BYTE, client_rank_of(client_id),
+                  COMM_WIRE_TAG(PEERS_SEEDERS_TRANSFER_TAG, client_local_of(client_id)), CONTROL_COMM,
+                  &subscriptions.requests[subscriptions.in_flight]) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Isend failed while pushing swarm updates to client %d.\n", client_id);
+        free(entries);
+        return;
+    }
+    subscriptions.buffers[subscriptions.in_flight++] = entries;
+    subscriptions.pushes++;
+    subscriptions.entries += count;
+}
+
+// Fills entry with what client peer_id holds of file_id now. Returns false if it holds nothing of it.
+static bool fill_entry(TrackerDataSet_t *m_tracker, int file_id, int peer_id, uint64_t *held, SwarmPush_t *entry) {
+    entry->file_id = file_id;
+    entry->peer_id = peer_id;
+    const Swarm_t *swarm = file_id > 0 && file_id <= m_tracker->swarm_size ? &m_tracker->swarms[file_id - 1] : NULL;
+    if (options.dedup && swarm && swarm->content) {
+        dedup_content_held(m_tracker, &m_tracker->data[peer_id - 1], held);
+        return dedup_have(swarm, held, entry->have) > 0;
+    }
+
+    const TrackerFile_t *file = tracker_find_file(&m_tracker->data[peer_id - 1], file_id);
+    if (!file || file->segment_count == 0)
+        return false;
+    memcpy(entry->have, file->have, sizeof(entry->have));
+    return true;
+}
+
+// Pushes everything marked for one subscriber, in messages of up to SUBSCRIBE_BATCH entries.
+static void push_to(TrackerDataSet_t *m_tracker, int client_id, uint64_t *held) {
+    SubscriberMarks_t *marks = &subscriptions.marks[client_id - 1];
+    SwarmPush_t *entries = NULL;
+    int count = 0;
+
+    for (uint32_t i = 0; i < marks->count; ++i) {
+        if (!entries && !(entries = malloc(sizeof(SwarmPush_t) * SUBSCRIBE_BATCH))) {
+            fprintf(stderr, "Memory allocation failed for a push.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        if (!fill_entry(m_tracker, marks->marks[i].file_id, marks->marks[i].peer_id, held, &entries[count]))
+            continue;
+        if (++count == SUBSCRIBE_BATCH) {
+            post_push(client_id, entries, count);
+            entries = NULL;
+            count = 0;
+        }
+    }
+    if (count > 0)
+        post_push(client_id, entries, count);
+    else
+        free(entries);
+    clear_marks(marks);
+}
+
+/*
+ * Frees the pushes that went out and, once the interval since the last pushes is over, pushes
+ * their marks to the subscribers. The tracker calls it once it handled the client messages
+ * waiting.
+ */
+void subscribe_flush(TrackerDataSet_t *m_tracker) {
+    if (subscriptions.in_flight > 0)
+        reap_pushes();
+    if (subscriptions.pending_count == 0)
+        return;
+
+    uint64_t now_ns = counters_now_ns();
+    if (subscriptions.due_ns > now_ns)
+        return;
+    subscriptions.due_ns = now_ns + (uint64_t)(options.subscribe_interval_ms * 1e6);
+    uint64_t *held = options.dedup ? malloc(sizeof(uint64_t) * dedup_content_words(m_tracker)) : NULL;
+    if (options.dedup && !held) {
+        fprintf(stderr, "Memory allocation failed for a push.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // Only the subscribers with marks are looked at
+    for (int i = 0; i < subscriptions.pending_count; ++i) {
+        int32_t client_id = subscriptions.pending[i];
+        if (subscriptions.marks[client_id - 1].count > 0)
+            push_to(m_tracker, client_id, held);
+    }
+    subscriptions.pending_count = 0;
+    free(held);
+}
+
+// Completes the pushes still in flight and frees the subscriptions. The metrics stay.
+void subscribe_stop(void) {
+    for (int i = 0; i < subscriptions.in_flight; ++i) {
+        MPI_Wait(&subscriptions.requests[i], MPI_STATUS_IGNORE);
+        free(subscriptions.buffers[i]);
+    }
+    subscriptions.in_flight = 0;
+    free(subscriptions.requests);
+    free(subscriptions.buffers);
+    for (int i = 0; i < subscriptions.client_count; ++i) {
+        free(subscriptions.marks[i].marks);
+        free(subscriptions.marks[i].slots);
+    }
+    for (int i = 0; i < subscriptions.swarm_size; ++i)
+        free(subscriptions.files[i].client_ids);
+    free(subscriptions.active);
+    free(subscriptions.marks);
+    free(subscriptions.files);
+    free(subscriptions.pending);
+    subscriptions.requests = NULL;
+    subscriptions.buffers = NULL;
+    subscriptions.active = NULL;
+    subscriptions.marks = NULL;
+    subscriptions.files = NULL;
+    subscriptions.pending = NULL;
+    subscriptions.capacity = 0;
+    subscriptions.pending_count = 0;
+}
+
+/*
+ * Takes in every push that reached the client, without waiting for any: each entry's client
+ * joins the peer list of the wanted file, or gets its new segments there. The peer arrays may
+ * move. Download thread only. Returns how many new sources joined.
+ */
+int subscribe_apply(ClientFiles_t *client) {
+    SwarmPush_t entries[SUBSCRIBE_BATCH];
+    CommStatus_t status;
+    int result;
+    int learned = 0;
+
+    while (comm_poll(COMM_DOWNLOAD_INBOX, client_local_of(client->client_id), COMM_CONTROL, TRACKER_RANK,
+                     PEERS_SEEDERS_TRANSFER_TAG, entries, sizeof(entries), &status, &result)) {
+        if (result != MPI_SUCCESS) {
+            fprintf(stderr, "Client %d: dropping a push that does not fit.\n", client->client_id);
+            continue;
+        }
+        int count = status.size / (int)sizeof(SwarmPush_t);
+        for (int i = 0; i < count; ++i) {
+            const SwarmPush_t *entry = &entries[i];
+            if (entry->peer_id == client->client_id)
+                continue;
+            client->pushed_entries++;
+            for (size_t file_idx = 0; file_idx < client->wanted_files_count; ++file_idx) {
+                const char *name = client->wanted_files[file_idx].file_name;
+                if (atoi(&name[strlen(name) - 1]) != entry->file_id)
+                    continue;
+                if (learn_peer(&client->peers[file_idx], entry->file_id, entry->peer_id, entry->have, INT32_MAX))
+                    learned++;
+                break;
+            }
+        }
+    }
+    client->sources_pushed += learned;
+    return learned;
+}
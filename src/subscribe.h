@@ -0,0 +1,92 @@
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+#include "utils.h"
+
+// * Swarm Subscriptions (--subscribe <ms>)
+// * A downloader subscribes to its wanted files in its wanted-files message, and the tracker keeps
+// * the subscribers of each file. Whenever update_tracker_swarm() records segments a client
+// * announced, that client is marked for a push to every other subscriber of the file. Marks
+// * coalesce: a client that announces again before the push goes out is pushed once, with its have
+// * bits as of the push. When no client message is waiting and the last pushes are at least an
+// * interval old, the tracker pushes every subscriber with marks, with nonblocking sends; until
+// * then the marks wait for a later message. The downloader takes its pushes between requests and
+// * adds the sources to its peer lists, like PEX entries. A subscription ends with the client's
+// * FINISHED_DOWN_ALL. With --dedup a push carries what the client holds of the file's contents,
+// * in any file. Needs the tracker: with --dht the option is ignored.
+#define SUBSCRIBE_INTERVAL_MS 2.0 // * default least time between two pushes to a subscriber
+#define SUBSCRIBE_BATCH 64 // * entries per push message
+#define WANTED_SUBSCRIBE 1u // * WantedFiles_t flag: push swarm updates of the wanted files
+
+// * One pushed entry: what a client holds of a file the subscriber wants
+typedef struct SwarmPush_t {
+    int32_t file_id;
+    int32_t peer_id;
+    uint64_t have[SEGMENT_WORDS];
+} SwarmPush_t;
+
+// * One client marked for a push, and the wanted file it is pushed for
+typedef struct SwarmMark_t {
+    int32_t file_id;
+    int32_t peer_id;
+} SwarmMark_t;
+
+// * The marks pending for one subscriber, and an open-addressing set over them
+typedef struct SubscriberMarks_t {
+    SwarmMark_t *marks;
+    uint32_t count;
+    uint32_t capacity; // * a power of two
+    uint32_t *slots; // * 2 * capacity of them: mark index + 1 (0 = free)
+} SubscriberMarks_t;
+
+// * The subscribers of one file
+typedef struct FileSubscribers_t {
+    int32_t *client_ids; // * may hold ended subscriptions, dropped when next walked
+    int count;
+    int capacity;
+} FileSubscribers_t;
+
+// * The tracker's subscriptions
+typedef struct Subscriptions_t {
+    int client_count;
+    int swarm_size;
+    bool *active; // * by client id - 1
+    uint64_t due_ns; // * no push before then
+    FileSubscribers_t *files; // * by file id - 1
+    SubscriberMarks_t *marks; // * by client id - 1
+    int32_t *pending; // * the subscribers with marks
+    int pending_count;
+
+    // * Pushes whose nonblocking sends are in flight
+    MPI_Request *requests;
+    SwarmPush_t **buffers;
+    int in_flight;
+    int capacity;
+
+    // * Metrics
+    uint64_t subscribers;
+    uint64_t pushes; // * push messages, the entries they carried, and marks merged into a pending one
+    uint64_t entries;
+    uint64_t coalesced;
+} Subscriptions_t;
+
+extern Subscriptions_t subscriptions;
+
+// * Tracker side
+void subscribe_start(const TrackerDataSet_t *m_tracker);
+
+void subscribe_add(const TrackerDataSet_t *m_tracker, int client_id);
+
+void subscribe_note(const TrackerDataSet_t *m_tracker, int client_id, const SegmentRecord_t *records,
+                    int record_count);
+
+void subscribe_end(int client_id);
+
+void subscribe_flush(TrackerDataSet_t *m_tracker);
+
+void subscribe_stop(void);
+
+// * Client side
+int subscribe_apply(ClientFiles_t *client);
+
+#endif
@@ -0,0 +1,127 @@
+#include "superseed.h"
+#include "pex.h"
+
+// Builds the super-seeding state of an initial seeder over the files it holds.
+SuperSeed_t *superseed_create(const ClientFiles_t *client, int client_count) {
+    SuperSeed_t *state = calloc(1, sizeof(SuperSeed_t));
+    if (!state) {
+        fprintf(stderr, "Error: Memory allocation failed for the super-seeding state.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    state->files_count = client->owned_files_count;
+    state->client_count = client_count;
+    state->files = calloc(MAX(state->files_count, 1), sizeof(SuperSeedFile_t));
+    state->last_served = calloc(client_count + 1, sizeof(int32_t));
+    if (!state->files || !state->last_served) {
+        fprintf(stderr, "Error: Memory allocation failed for the super-seeding state.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (size_t i = 0; i < state->files_count; ++i) {
+        const FileData_t *data = &client->owned_files[i];
+        SuperSeedFile_t *file = &state->files[i];
+        file->file_id = data->file_id;
+        file->segment_count = data->segment_count;
+        file->behind = data->segment_count;
+    }
+    return state;
+}
+
+void superseed_free(SuperSeed_t *state) {
+    if (!state)
+        return;
+    free(state->files);
+    free(state->last_served);
+    free(state);
+}
+
+// Returns true if a client other than requester_id and the seeder is known to hold the segment.
+static bool seen_elsewhere(const ClientFiles_t *client, const SuperSeedFile_t *file, size_t segment_idx,
+                           int requester_id) {
+    // A second copy handed out by the seeder itself
+    if (file->served[segment_idx] > 1)
+        return true;
+
+    const PexTable_t *table = &client->pex->upload;
+    for (int i = 0; i < table->count; ++i) {
+        const PexEntry_t *entry = &table->entries[i];
+        if (entry->client_id != requester_id && entry->client_id != client->client_id &&
+            entry->file_id == file->file_id && segment_bit_test(entry->have, segment_idx))
+            return true;
+    }
+    return false;
+}
+
+// Counts a copy of a segment handed out, and moves the file to the next round once every
+// segment has had one more copy.
+static void count_copy(SuperSeedFile_t *file, size_t segment_idx) {
+    if (file->served[segment_idx]++ != file->round || --file->behind > 0)
+        return;
+
+    file->round = UINT32_MAX;
+    for (size_t idx = 0; idx < file->segment_count; ++idx)
+        file->round = MIN(file->round, file->served[idx]);
+    for (size_t idx = 0; idx < file->segment_count; ++idx)
+        file->behind += file->served[idx] == file->round;
+}
+
+/*
+ * Splits what a super-seeder holds of a file into what the tracker shows one downloader (every
+ * slices-th segment, from slice on) and what it withholds from that downloader. Tracker only.
+ */
+void superseed_slice(const uint64_t *have, size_t segment_total, int slice, int slices, uint64_t *advertised,
+                     uint64_t *withheld) {
+    memset(advertised, 0, sizeof(uint64_t) * SEGMENT_WORDS);
+    memset(withheld, 0, sizeof(uint64_t) * SEGMENT_WORDS);
+    for (size_t idx = 0; idx < segment_total && idx < MAX_CHUNKS; ++idx) {
+        if (!segment_bit_test(have, idx))
+            continue;
+        if (slices <= 1 || (int)(idx % slices) == slice)
+            segment_bit_set(advertised, idx);
+        else
+            segment_bit_set(withheld, idx);
+    }
+}
+
+/*
+ * Decides whether the seeder serves the requested segment. Turns the request away if the
+ * segment already has more copies than another segment of its file, or (with PEX) if the
+ * requester's last segment was not seen elsewhere yet, unless the requester insists. Upload
+ * coroutine only.
+ */
+bool superseed_grant(ClientFiles_t *client, const SegmentRequest_t *request) {
+    SuperSeed_t *state = client->superseed;
+    int requester_id = request->client_id;
+    if (requester_id <= 0 || requester_id > state->client_count)
+        return true;
+
+    SuperSeedFile_t *file = NULL;
+    size_t segment_idx = request->segment_idx;
+    for (size_t i = 0; i < state->files_count && !file; ++i) {
+        if (state->files[i].file_id == request->file_id)
+            file = &state->files[i];
+    }
+    if (!file || segment_idx >= file->segment_count)
+        return true;
+
+    bool grant = (request->flags & SEGMENT_REQUEST_INSIST) != 0;
+    if (!grant) {
+        grant = file->served[segment_idx] <= file->round;
+
+        int32_t last = state->last_served[requester_id];
+        if (grant && client->pex && last > 0) {
+            const SuperSeedFile_t *last_file = &state->files[(last - 1) / MAX_CHUNKS];
+            grant = seen_elsewhere(client, last_file, (last - 1) % MAX_CHUNKS, requester_id);
+        }
+    }
+    if (!grant) {
+        state->refusals++;
+        return false;
+    }
+
+    count_copy(file, segment_idx);
+    state->last_served[requester_id] = (int32_t)((file - state->files) * MAX_CHUNKS + segment_idx + 1);
+    state->granted++;
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _SUPERSEED_H_
+#define _SUPERSEED_H_
+
+#include "utils.h"
+
+// * Super-seeding (--super-seed)
+// * An initial seeder serves a segment only while no segment of its file has been handed out
+// * fewer times, so one copy of every segment goes out before any segment goes out twice and
+// * further copies come from the peers that got the first ones. The seeder also waits to see a
+// * requester's last segment held by another client (through PEX, which the mode needs) before
+// * it serves the requester again. Requests it turns away get SUPERSEED_REFUSED; a downloader
+// * turned away SUPERSEED_PATIENCE times in a row, or left with no other source, insists and is
+// * served. The tracker shows each downloader only a slice of a super-seeder's segments (see
+// * superseed_slice()); the rest stays withheld until the downloader finds no other source.
+#define SUPERSEED_REFUSED "NO" // * reply status of a request left to the swarm
+#define SUPERSEED_PATIENCE 4
+
+typedef struct SuperSeedFile_t {
+    int file_id;
+    size_t segment_count;
+    uint32_t round; // * copies every segment has had at least
+    size_t behind; // * segments with only round copies
+    uint32_t served[MAX_CHUNKS]; // * copies of each segment handed out
+} SuperSeedFile_t;
+
+// * One initial seeder's state, used by its upload coroutine only
+typedef struct SuperSeed_t {
+    SuperSeedFile_t *files;
+    size_t files_count;
+    int client_count;
+    int32_t *last_served; // * per requester id: file index * MAX_CHUNKS + segment + 1, 0 for none
+
+    // * Metrics
+    uint64_t granted;
+    uint64_t refusals;
+} SuperSeed_t;
+
+SuperSeed_t *superseed_create(const ClientFiles_t *client, int client_count);
+
+void superseed_free(SuperSeed_t *state);
+
+bool superseed_grant(ClientFiles_t *client, const SegmentRequest_t *request);
+
+void superseed_slice(const uint64_t *have, size_t segment_total, int slice, int slices, uint64_t *advertised,
+                     uint64_t *withheld);
+
+#endif
@@ -2,24 +2,165 @@
 #include "tracker.h"
 #include "peer.h"
 #include "download.h"
+#include "digest.h"
+#include "options.h"
+#include "snapshot.h"
+#include "writer.h"
+#include "checkpoint.h"
+#include "comm.h"
+#include "dht.h"
+#include "pex.h"
+#include "superseed.h"
+#include "topology.h"
+#include "merkle.h"
+#include "counters.h"
+#include "trace.h"
+#include "netem.h"
+#include "fairness.h"
+#include "dedup.h"
+#include "stream.h"
+#include "ratelimit.h"
+#include "subscribe.h"
 
-void *download_thread_func(void *arg)
+#include <stddef.h>
+#include <time.h>
+
+// * The logical clients hosted by this rank (options.clients_per_rank of them)
+typedef struct LocalClients_t {
+    ClientFiles_t *clients;
+    int count;
+} LocalClients_t;
+
+// * What every rank reports at the end of the run (gathered on the tracker as doubles)
+typedef struct RunReport_t {
+    double idle_time; // * client ranks: waiting for the others once their clients stopped
+    double lookups; // * peer-list discoveries, with their total and longest time
+    double discovery_total;
+    double discovery_max;
+    double nodes; // * who served the discoveries: the tracker, or every DHT node
+    double requests_total; // * requests they served
+    double requests_max;
+    double pex_sent; // * PEX entries sent and received, and sources clients learned from them
+    double pex_received;
+    double pex_learned;
+    double origin_uploads; // * segments the initial seeders sent, in total and at most per seeder
+    double origin_max;
+    double refusals; // * requests super-seeders turned away
+    double first_copy; // * earliest first complete file of a downloader, in seconds
+    double copies; // * downloaders that completed a file, and the sum of their first times
+    double copy_total;
+    double internode_segments; // * segments and bytes downloaded from another node, and files completed
+    double internode_bytes;
+    double files_completed;
+    double completions; // * downloaders that finished every wanted file, with their total and longest time
+    double completion_total;
+    double completion_max;
+    double reused; // * segments copied from held ones, and served by content (--dedup)
+    double by_content;
+    double stream_files; // * streamed files, their time to the first segment, total and longest (--stream)
+    double stream_first_total;
+    double stream_first_max;
+    double stalls; // * playback stalls and their time
+    double stall_time;
+    double urgent; // * urgent requests, sent twice, and answered first by the second holder
+    double duplicates;
+    double duplicate_wins;
+    double upload_takes; // * segments sent under upload limits, held back, and by a requester's limit
+    double upload_throttled;
+    double upload_by_requester;
+    double upload_wait_total; // * time they were held back, in total and at most
+    double upload_wait_max;
+    double upload_rate_max; // * rank 0 only: segments per second the busiest rank sent
+    double download_takes; // * requests sent under download budgets, and held back
+    double download_throttled;
+    double download_wait_total;
+    double download_wait_max;
+    double subscribers; // * tracker: downloaders subscribed, pushes sent, their entries and marks coalesced
+    double pushes;
+    double push_entries;
+    double push_coalesced;
+    double pushed_entries; // * clients: pushed entries taken in, and the new sources they brought
+    double sources_pushed;
+} RunReport_t;
+
+#define RUN_REPORT_FIELDS ((int)(sizeof(RunReport_t) / sizeof(double)))
+
+// Copies the segments of a wanted file the client already holds (in another file, or at another
+// index of this one) instead of downloading them, and queues their records for the next announce.
+// With only, just the missing segments with that digest are looked at. --dedup only.
+static void reuse_held_copies(ClientFiles_t* client, size_t file_idx, const Digest_t* only, SegmentRecord_t* records,
+                              int* record_count)
+{
+    PeersList_t* peers = &client->peers[file_idx];
+    FileData_t* file_data = wanted_file_data(client, file_idx);
+    uint32_t matches[MAX_CHUNKS];
+    size_t count = dedup_matches(client, peers, file_data, only, matches);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t segment_idx = matches[i];
+        const FileSegment_t segment = peers->catalog->segments[segment_idx];
+        const MerkleProof_t no_proof = {0};
+        if (!dedup_verify(peers, file_data, segment_idx, &segment.digest, &no_proof))
+            continue;
+
+        store_segment(file_data, segment_idx, segment);
+        topology_publish(client, file_data->file_id, segment_idx);
+        writer_segment(client->writer, client->client_id, file_data->file_id, segment_idx, &segment.digest);
+        if (client->checkpoint)
+            checkpoint_mark(client->checkpoint, file_data, segment_idx, peers->swarm_version);
+        client->segments_reused++;
+
+        SegmentRecord_t* record = &records[(*record_count)++];
+        record->file_id = file_data->file_id;
+        record->segment_idx = (uint32_t)segment_idx;
+    }
+}
+
+// Downloads everything one client wants. Runs as a coroutine of the download thread.
+void download_client_func(void *arg)
 {
-    char buffer[BUFF_SIZE];
     int downloaded_segments = 0;
-    MPI_Status mpi_status;
+    SegmentRecord_t announce_records[MAX_CHUNKS]; // Segments not yet announced to the tracker
     size_t current_file_idx = 0;
+    size_t reuse_checked = 0; // Wanted files whose held copies were taken (--dedup)
+    size_t stream_started = 0; // Wanted files whose playback started (--stream)
     bool continue_downloading = true;
-    srand(time(NULL)); // Seed the random number generator
+    int refusals = 0; // Requests turned away since the last segment downloaded
+    unsigned int pauses = 0; // Rounds in a row spent waiting for the node's other clients
 
     ClientFiles_t* client = (ClientFiles_t*)arg;
+    int local = client_local_of(client->client_id);
     size_t total_wanted_files = client->wanted_files_count;
 
     // Get the list of peers that have the files we want
+    struct timespec discovery_start, discovery_end;
+    clock_gettime(CLOCK_MONOTONIC, &discovery_start);
     request_seeders_peers_list(client);
+    clock_gettime(CLOCK_MONOTONIC, &discovery_end);
+    client->discovery_time = (discovery_end.tv_sec - discovery_start.tv_sec) +
+                             (discovery_end.tv_nsec - discovery_start.tv_nsec) / 1e9;
+
+    // Pick up where an interrupted run left off
+    if (client->checkpoint) {
+        restore_from_checkpoint(client);
+    }
 
     // Keep downloading until all desired files are obtained
     while (continue_downloading && current_file_idx < total_wanted_files) {
+        // Take in what the tracker pushed about the swarms (the peer lists may move)
+        if (options.subscribe)
+            subscribe_apply(client);
+
+        // Take what the client holds of the file elsewhere before asking anybody for it
+        if (client->peers[current_file_idx].catalog && reuse_checked <= current_file_idx) {
+            reuse_checked = current_file_idx + 1;
+            reuse_held_copies(client, current_file_idx, NULL, announce_records, &downloaded_segments);
+        }
+        if (client->stream && stream_started <= current_file_idx) {
+            stream_started = current_file_idx + 1;
+            stream_begin(client->stream, wanted_file_data(client, current_file_idx), counters_now_ns());
+        }
+
         int available_peers = client->peers[current_file_idx].peers_count;
 
         // Move to the next file if no peers are available for the current one
@@ -38,153 +179,514 @@ void *download_thread_func(void *arg)
 
         bool segment_downloaded = false;
 
-        // If the file isn't already owned, add it to our owned files
-        if (!file_is_owned(client, file_id)) {
-            add_file_to_owned(client, file_id);
+        // If the file isn't already owned, add it to our owned files (known by its swarm's root)
+        FileData_t* current_file_data = wanted_file_data(client, current_file_idx);
+        assert(current_file_data != NULL); // Ensure we have the file data
+
+        // Prefer a source that has not turned us away since our last segment; insist if there is
+        // none, or if we were turned away too often
+        uint32_t request_flags = refusals >= SUPERSEED_PATIENCE ? SEGMENT_REQUEST_INSIST : 0;
+        if (selected_peer->refused) {
+            int other_idx = peer_holding_missing(&client->peers[current_file_idx], current_file_data, true);
+            if (other_idx >= 0)
+                selected_peer = &client->peers[current_file_idx].peers_array[other_idx];
+            else
+                request_flags = SEGMENT_REQUEST_INSIST;
         }
 
-        FileData_t* current_file_data = find_file_data(client->owned_files, client->owned_files_count, file_id);
-        assert(current_file_data != NULL); // Ensure we have the file data
+        // On runs over several nodes, fetch from the closest source, and across the node
+        // boundary only what no other client of the node holds or fetches
+        if (topology.share && !client->stream) {
+            topology_learn_holders(client, current_file_idx, current_file_data, file_id);
+            int closest_idx = topology_select_peer(client, &client->peers[current_file_idx], current_file_data, file_id);
+            if (closest_idx < 0 && peer_holding_missing(&client->peers[current_file_idx], current_file_data, false) >= 0) {
+                // The node's other clients are fetching what we miss: wait for their copies
+                comm_pause(COMM_DOWNLOAD_INBOX, pauses++);
+                continue;
+            }
+            if (closest_idx >= 0) {
+                selected_peer = &client->peers[current_file_idx].peers_array[closest_idx];
+                request_flags = refusals >= SUPERSEED_PATIENCE || selected_peer->refused ? SEGMENT_REQUEST_INSIST : 0;
+            }
+            pauses = 0;
+        }
 
-        // Look for missing segments and attempt to download them
-        for (size_t segment_idx = current_file_data->segment_count; segment_idx < selected_peer->segment_count; ++segment_idx) {
-            FileSegment_t segment = selected_peer->segments[segment_idx];
+        // Streaming asks for one segment by its deadline, an urgent one from two holders at once
+        size_t first_segment = 0;
+        size_t end_segment = selected_peer->segment_count;
+        PeerInfo_t* duplicate_peer = NULL;
+        bool urgent = false;
+        if (client->stream) {
+            StreamPick_t pick;
+            end_segment = 0;
+            if (topology.share)
+                topology_learn_holders(client, current_file_idx, current_file_data, file_id);
+            if (stream_pick(client->stream, &client->peers[current_file_idx], current_file_data, &pick)) {
+                selected_peer = &client->peers[current_file_idx].peers_array[pick.peer];
+                if (pick.duplicate >= 0)
+                    duplicate_peer = &client->peers[current_file_idx].peers_array[pick.duplicate];
+                request_flags = refusals >= SUPERSEED_PATIENCE || pick.insist ? SEGMENT_REQUEST_INSIST : 0;
+                first_segment = pick.segment_idx;
+                end_segment = pick.segment_idx + 1;
+                urgent = pick.urgent;
+            }
+        }
+
+        // Look for segments the peer holds and we are missing, and attempt to download them
+        for (size_t segment_idx = first_segment; segment_idx < end_segment; ++segment_idx) {
+            if (segment_bit_test(selected_peer->have, segment_idx) &&
+                !segment_bit_test(current_file_data->have, segment_idx) &&
+                topology_claim(client, selected_peer->peer_id, file_id, segment_idx)) {
+                // Request the missing segment from the selected peer by its index in the file
+                PexRequest_t message;
+                SegmentRequest_t* request = &message.request;
+                request->request_id = next_request_id(client);
+                request->client_id = client->client_id;
+                request->flags = request_flags;
+                request->file_id = file_id;
+                request->segment_idx = (uint32_t)segment_idx;
+                memset(&request->digest, 0, sizeof(request->digest));
+                int request_size = offsetof(PexRequest_t, delta);
+
+                // With the file's digests, any copy of the segment the peer holds will do
+                const FileData_t* catalog = client->peers[current_file_idx].catalog;
+                if (catalog) {
+                    request->flags |= SEGMENT_REQUEST_BY_CONTENT;
+                    request->digest = catalog->segments[segment_idx].digest;
+                }
+
+                // With PEX, the request also tells the peer about the swarm (this client included, if it uploads)
+                if (client->pex) {
+                    if (client->client_type == PEER)
+                        pex_note(&client->pex->download, client->client_id, file_id, current_file_data->have);
+                    request_size += pex_fill(&client->pex->download, &message.delta, selected_peer->peer_id);
+                }
+
+                // Spend the download budget, a token per holder asked
+                if (client->budget)
+                    ratelimit_download(client->budget, duplicate_peer ? 2 : 1);
 
-            if (!has_segment(current_file_data, segment)) {
-                // Request the missing segment from the selected peer
-                if (MPI_Send(segment.hash, HASH_SIZE - 1, MPI_CHAR, selected_peer->peer_rank, REQUEST_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
+                int peer_rank = client_rank_of(selected_peer->peer_id);
+                uint64_t requested_at = trace_start();
+                if (comm_send(COMM_PEER, peer_rank, client_local_of(selected_peer->peer_id), REQUEST_TAG,
+                              &message, request_size) != MPI_SUCCESS) {
                     fprintf(stderr, "MPI_Send failed while requesting segment.\n");
+                    topology_release(client, file_id, segment_idx);
                     continue;
                 }
 
-                // Wait for the peer's acknowledgment
-                if (MPI_Recv(buffer, BUFF_SIZE, MPI_CHAR, selected_peer->peer_rank, ACK_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS) {
+                // The second holder gets the same request (without the PEX delta)
+                if (urgent)
+                    client->stream->urgent++;
+                if (duplicate_peer) {
+                    if (comm_send(COMM_PEER, client_rank_of(duplicate_peer->peer_id), client_local_of(duplicate_peer->peer_id),
+                                  REQUEST_TAG, &message, offsetof(PexRequest_t, delta)) == MPI_SUCCESS)
+                        client->stream->duplicates++;
+                    else
+                        duplicate_peer = NULL;
+                }
+
+                // Wait for the peer's reply to this request; with a second holder, for the first
+                // reply that carries the segment (the other one is dropped when it arrives)
+                PexReply_t reply;
+                CommStatus_t reply_status;
+                int awaited = duplicate_peer ? 2 : 1;
+                int reply_result;
+                do {
+                    reply_result = comm_recv_reply(COMM_DOWNLOAD_INBOX, local, COMM_DATA,
+                                                   duplicate_peer ? MPI_ANY_SOURCE : peer_rank, ACK_TAG,
+                                                   request->request_id, &reply, sizeof(reply), &reply_status,
+                                                   COUNTER_SITE_SEGMENT);
+                } while (reply_result == MPI_SUCCESS && --awaited > 0 && strcmp(reply.reply.status, "OK") != 0);
+                if (duplicate_peer && reply_result == MPI_SUCCESS) {
+                    if (awaited > 0)
+                        comm_discard_reply(COMM_DOWNLOAD_INBOX, local, COMM_DATA, ACK_TAG, request->request_id);
+                    if (reply.reply.uploader_id == duplicate_peer->peer_id) {
+                        selected_peer = duplicate_peer;
+                        peer_rank = reply_status.source;
+                        client->stream->duplicate_wins++;
+                    }
+                }
+                if (reply_result != MPI_SUCCESS) {
                     fprintf(stderr, "MPI_Recv failed while receiving acknowledgment.\n");
+                    trace_record(TRACE_SEGMENT, requested_at, false, client->client_id, file_id, (int)segment_idx,
+                                 selected_peer->peer_id, TRACE_FAILED);
+                    topology_release(client, file_id, segment_idx);
+                    continue;
+                }
+                int delta_size = reply_status.size - (int)offsetof(PexReply_t, delta);
+                if (client->pex && delta_size > 0)
+                    pex_receive(&client->pex->download, client->client_id, &reply.delta, delta_size);
+
+                // A segment that does not lead to the file's root is dropped and fetched again
+                bool sent = strcmp(reply.reply.status, "OK") == 0;
+                bool verified = !sent || dedup_verify(&client->peers[current_file_idx], current_file_data, segment_idx,
+                                                      &reply.reply.segment, &reply.reply.proof);
+                trace_record(TRACE_SEGMENT, requested_at, false, client->client_id, file_id, (int)segment_idx,
+                             selected_peer->peer_id, verified ? trace_status(reply.reply.status) : TRACE_FAILED);
+                if (!verified) {
+                    fprintf(stderr, "Client %d: segment %zu of file%d from client %d failed verification.\n",
+                            client->client_id, segment_idx, file_id, selected_peer->peer_id);
+                    topology_release(client, file_id, segment_idx);
                     continue;
                 }
 
                 // If the peer is okay with sending the segment, add it to our data
-                if (strcmp(buffer, "OK") == 0) {
-                    add_segment_to_file_data(current_file_data, segment);
+                if (sent) {
+                    const FileSegment_t segment = {.digest = reply.reply.segment};
+                    store_segment(current_file_data, segment_idx, segment);
+                    topology_publish(client, file_id, segment_idx);
+                    counters_segment_from(peer_rank);
+                    if (topology_distance(topology.rank, peer_rank) != TOPOLOGY_SAME_NODE) {
+                        client->internode_segments++;
+                        client->internode_bytes += request_size + reply_status.size;
+                    }
+                    writer_segment(client->writer, client->client_id, file_id, segment_idx, &segment.digest);
+                    if (client->checkpoint) {
+                        checkpoint_mark(client->checkpoint, current_file_data, segment_idx,
+                                        client->peers[current_file_idx].swarm_version);
+                    }
+
+                    SegmentRecord_t* record = &announce_records[downloaded_segments];
+                    record->file_id = file_id;
+                    record->segment_idx = (uint32_t)segment_idx;
                     downloaded_segments++;
                     segment_downloaded = true;
 
+                    // The same content may be missing elsewhere in the file
+                    if (catalog)
+                        reuse_held_copies(client, current_file_idx, &segment.digest, announce_records,
+                                          &downloaded_segments);
+                    if (client->stream) {
+                        stream_arrived(client->stream, current_file_data, counters_now_ns());
+                        pauses = 0;
+                    }
+                    if (refusals > 0) {
+                        for (int i = 0; i < client->peers[current_file_idx].peers_count; ++i)
+                            client->peers[current_file_idx].peers_array[i].refused = false;
+                        refusals = 0;
+                    }
+
+                    // Take in the sources the peer told about (the peer list may move)
+                    if (client->pex && delta_size > 0)
+                        pex_apply(client, &reply.delta, delta_size);
+
                     // Switch to another peer to balance the load
                     break;
                 }
+
+                // A super-seeder wants this segment to come from elsewhere: try another peer
+                topology_release(client, file_id, segment_idx);
+                if (strcmp(reply.reply.status, SUPERSEED_REFUSED) == 0) {
+                    selected_peer->refused = true;
+                    refusals++;
+                    break;
+                }
             }
         }
 
+        // Another peer may still hold what this one lacks (PEX sources hold parts of the file)
+        if (!segment_downloaded && peer_holding_missing(&client->peers[current_file_idx], current_file_data, false) >= 0) {
+            // Streaming asks for one segment at a time: back off if it did not get it
+            if (client->stream)
+                comm_pause(COMM_DOWNLOAD_INBOX, pauses++);
+            continue;
+        }
+
+        // Super-seeders withheld the rest of the file from us: take it from them now
+        if (!segment_downloaded && options.super_seed &&
+            reveal_withheld(&client->peers[current_file_idx], current_file_data))
+            continue;
+
         // If no segment was downloaded from the current peer, handle accordingly
         if (!segment_downloaded) {
             if (downloaded_segments > 0) {
                 // Inform the tracker about the newly downloaded segments
-                if (MPI_Send("DOWN_X", 8, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS ||
-                    MPI_Send(&current_file_data->file_id, 1, MPI_INT, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
+                if (!options.dht && announce_segments(client, "DOWN_X", announce_records, downloaded_segments, NULL) != MPI_SUCCESS) {
                     fprintf(stderr, "MPI_Send failed while informing tracker.\n");
                     // Consider adding more robust error handling here
                 }
 
-                // Send the hashes of the latest segments to the tracker
-                for (size_t i = current_file_data->segment_count - 10; i < current_file_data->segment_count; ++i) {
-                    if (MPI_Send(current_file_data->segments[i].hash, HASH_SIZE, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
-                        fprintf(stderr, "MPI_Send failed while sending segment hashes.\n");
-                        // Consider adding more robust error handling here
-                    }
-                }
-
                 downloaded_segments = 0;
             }
 
-            // Save the downloaded file and move to the next one
-            char output_file_name[18];
-            sprintf(output_file_name, "client%d_file%d", client->client_rank, file_id);
-            write_to_file(output_file_name, current_file_data);
+            if (client->first_copy_time == 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                client->first_copy_time = (now.tv_sec - discovery_start.tv_sec) +
+                                          (now.tv_nsec - discovery_start.tv_nsec) / 1e9;
+            }
+
+            client->files_completed++;
+
+            // Let the writer publish the finished file and move to the next one; second holders
+            // that did not answer its requests yet are not waited for
+            writer_finish(client->writer, client->client_id, file_id, current_file_data->segment_count);
+            comm_forget_discards(COMM_DOWNLOAD_INBOX, local);
+            if (options.dht && current_file_data->segment_count > 0)
+                dht_refresh(client, current_file_idx, file_id, false);
             current_file_idx++;
+
+            if (current_file_idx == total_wanted_files) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                client->completion_time = (now.tv_sec - discovery_start.tv_sec) +
+                                          (now.tv_nsec - discovery_start.tv_nsec) / 1e9;
+            }
         }
 
-        // Periodically update the tracker after downloading every 10 segments
-        if (downloaded_segments > 0 && downloaded_segments % 10 == 0) {
-            if (MPI_Send("DOWN_10", 8, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS ||
-                MPI_Send(&current_file_data->file_id, 1, MPI_INT, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
-                fprintf(stderr, "MPI_Send failed while sending DOWN_10 message.\n");
-                // Consider adding more robust error handling here
+        // Periodically update the tracker after downloading every 10 segments; with PEX the
+        // peers spread the news instead, and the tracker hears of them when the file is done
+        if (downloaded_segments > 0 && downloaded_segments % 10 == 0 && !options.pex) {
+            // Without a tracker, publish the client as a source and look for new ones in the DHT
+            if (options.dht) {
+                dht_refresh(client, current_file_idx, file_id, true);
+                downloaded_segments = 0;
+                continue;
             }
 
-            // Send the hashes of the latest 10 segments to the tracker
-            for (size_t i = current_file_data->segment_count - 10; i < current_file_data->segment_count; ++i) {
-                if (MPI_Send(current_file_data->segments[i].hash, HASH_SIZE, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
-                    fprintf(stderr, "MPI_Send failed while sending segment hashes for DOWN_10.\n");
-                    // Consider adding more robust error handling here
-                }
+            uint32_t announce_id = 0;
+            if (announce_segments(client, "DOWN_10", announce_records, downloaded_segments, &announce_id) != MPI_SUCCESS) {
+                fprintf(stderr, "MPI_Send failed while sending DOWN_10 message.\n");
+                // Consider adding more robust error handling here
             }
 
             downloaded_segments = 0;
 
-            // Ask the tracker for an updated list of peers
-            if (MPI_Send("GIVE_PEERS", 11, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
+            // Ask the tracker for an updated list of peers, unless it pushes the updates
+            if (!options.subscribe && send_control(client, "GIVE_PEERS", NULL) != MPI_SUCCESS) {
                 fprintf(stderr, "MPI_Send failed while requesting peers.\n");
                 // Consider adding more robust error handling here
             }
 
-            // Wait for the tracker to acknowledge the peer list request
-            if (MPI_Recv(buffer, BUFF_SIZE, MPI_CHAR, TRACKER_RANK, ACK_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS) {
-                fprintf(stderr, "MPI_Recv failed while receiving peer list acknowledgment.\n");
-                // Consider adding more robust error handling here
-            }
-
-            if (strcmp(buffer, "OK") == 0) {
-                printf("Requested peers, client %d\n", client->client_rank);
+            // Wait for the tracker to acknowledge the announce
+            if (wait_for_ack(client, announce_id) && !options.subscribe) {
+                printf("Requested peers, client %d\n", client->client_id);
             }
         }
     }
 
+    comm_forget_discards(COMM_DOWNLOAD_INBOX, local);
+
     // Let the tracker know that all downloads are complete
-    if (MPI_Send("FINISHED_DOWN_ALL", 18, MPI_CHAR, TRACKER_RANK, INFORM_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    if (!options.dht && send_control(client, "FINISHED_DOWN_ALL", NULL) != MPI_SUCCESS) {
         fprintf(stderr, "MPI_Send failed while sending FINISHED_DOWN_ALL.\n");
         // Consider adding more robust error handling here
     }
+}
 
-    return NULL;
+// Copies a segment the client holds and the proof that takes it to its file's root into a reply.
+// A segment asked for by content may come from any held copy, without a proof (the requester
+// proves it from the file's digests). Returns false if the client does not hold it. The upload
+// thread sees a file and a segment only once the download thread published them, with
+// everything stored before.
+static bool fill_segment_reply(ClientFiles_t* client, const SegmentRequest_t* request, SegmentReply_t* reply)
+{
+    size_t owned_count = __atomic_load_n(&client->owned_files_count, __ATOMIC_ACQUIRE);
+    const FileData_t* file = find_file_data(client->owned_files, owned_count, request->file_id);
+    if (!file || request->segment_idx >= MAX_CHUNKS || !segment_bit_acquire(file->have, request->segment_idx)) {
+        size_t copy_idx;
+        const FileData_t* copy = (request->flags & SEGMENT_REQUEST_BY_CONTENT) ?
+                                 dedup_find(client, &request->digest, &copy_idx) : NULL;
+        if (!copy)
+            return false;
+        reply->segment = copy->segments[copy_idx].digest;
+        client->segments_by_content++;
+        return true;
+    }
+
+    reply->segment = file->segments[request->segment_idx].digest;
+    return merkle_proof(file, request->segment_idx, &reply->proof);
 }
 
-void *upload_thread_func(void *arg)
+// Serves one client's uploads until the tracker releases it or the run terminates. Runs as a
+// coroutine of the upload thread.
+void upload_client_func(void *arg)
 {
-    char buffer[BUFF_SIZE];
-    MPI_Status mpi_status;
+    union {
+        char bytes[BUFF_SIZE];
+        PexRequest_t pex; // * a segment request, with a PEX delta behind it
+    } buffer;
+    CommStatus_t status;
+    ClientFiles_t* client = (ClientFiles_t*)arg;
+    int local = client_local_of(client->client_id);
 
     while (true) {
-        // Wait for any upload requests from peers
-        if (MPI_Recv(buffer, BUFF_SIZE, MPI_CHAR, MPI_ANY_SOURCE, REQUEST_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS) {
+        // Wait for upload requests from peers (peer channel), the tracker's early release or
+        // the end of the run (control channel)
+        if (comm_recv(COMM_UPLOAD_INBOX, local, COMM_ANY_CHANNEL, MPI_ANY_SOURCE, MPI_ANY_TAG, &buffer, sizeof(buffer), &status,
+                      COUNTER_SITE_UPLOAD) != MPI_SUCCESS) {
             fprintf(stderr, "MPI_Recv failed in upload thread.\n");
             continue;
         }
 
-        // Check if the signal to stop uploading has been received
-        if (strcmp(buffer, "STOP_UPLOADING") == 0) {
+        // Every rank is done downloading
+        if (status.tag == COMM_TERMINATE_TAG) {
             break;
         }
 
-        // Acknowledge the upload request
-        if (MPI_Send("OK", 2, MPI_CHAR, mpi_status.MPI_SOURCE, ACK_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        // Lookups of the trackerless DHT
+        if (status.tag == DHT_TAG) {
+            dht_serve(client, status.source, (const DhtRequest_t*)&buffer);
+            continue;
+        }
+
+        // Check if the signal to stop uploading has been received
+        if (status.channel == COMM_CONTROL) {
+            const ControlMessage_t* message = (const ControlMessage_t*)&buffer;
+            if (strcmp(message->opcode, "STOP_UPLOADING") == 0) {
+                break;
+            }
+            continue;
+        }
+
+        // Acknowledge the upload request under its id, to the client that sent it
+        const SegmentRequest_t* request = &buffer.pex.request;
+        PexReply_t reply;
+        memset(&reply.reply, 0, sizeof(reply.reply));
+        reply.reply.request_id = request->request_id;
+        reply.reply.uploader_id = client->client_id;
+        strcpy(reply.reply.status, "OK");
+        int reply_size = offsetof(PexReply_t, delta);
+
+        // With PEX, hear what the requester knows of the swarm and pass on what others said
+        if (client->pex) {
+            int delta_size = status.size - (int)offsetof(PexRequest_t, delta);
+            if (delta_size > 0)
+                pex_receive(&client->pex->upload, client->client_id, &buffer.pex.delta, delta_size);
+            reply_size += pex_fill(&client->pex->upload, &reply.delta, request->client_id);
+        }
+
+        // Send the segment with its proof; a super-seeder may leave it to the swarm
+        bool served = false;
+        if (!fill_segment_reply(client, request, &reply.reply)) {
+            strcpy(reply.reply.status, SEGMENT_NOT_HELD);
+            counters_here()->uploads_refused++;
+        } else if (client->superseed && !superseed_grant(client, request)) {
+            strcpy(reply.reply.status, SUPERSEED_REFUSED);
+            counters_here()->uploads_refused++;
+        } else {
+            client->segments_uploaded++;
+            counters_here()->uploads_served++;
+            served = true;
+        }
+        if (client->load)
+            fairness_record(client->load, request, served);
+
+        // Hold the segment back until the rank's and the requester's limits let it go
+        if (served && (options.upload_rate > 0 || options.requester_rate > 0))
+            ratelimit_upload(request->client_id);
+        trace_record(TRACE_UPLOAD, 0, true, client->client_id, request->file_id, (int)request->segment_idx,
+                     request->client_id, trace_status(reply.reply.status));
+
+        if (comm_send(COMM_DATA, status.source, client_local_of(request->client_id), ACK_TAG, &reply, reply_size) != MPI_SUCCESS) {
             fprintf(stderr, "MPI_Send failed while sending ACK in upload thread.\n");
             // Consider adding more robust error handling here
         }
     }
+}
+
+// Runs func for every local client that is not of the skipped type (-1 runs all of them).
+static void run_local_clients(LocalClients_t *local_clients, CommInbox_t inbox, CommClientFunc_t func, int skipped)
+{
+    void **args = malloc(sizeof(void *) * local_clients->count);
+    int *locals = malloc(sizeof(int) * local_clients->count);
+    if (!args || !locals) {
+        fprintf(stderr, "Memory allocation failed for local clients.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    int count = 0;
+    for (int local = 0; local < local_clients->count; ++local) {
+        if (local_clients->clients[local].client_type == skipped)
+            continue;
+        args[count] = &local_clients->clients[local];
+        locals[count] = local;
+        count++;
+    }
+
+    comm_run_clients(inbox, func, args, locals, count);
+
+    free(locals);
+    free(args);
+}
+
+// Fills one client's DHT routing table. Runs as a coroutine of the download thread.
+void join_client_func(void *arg)
+{
+    dht_join((ClientFiles_t*)arg);
+}
+
+// Publishes one client's files in the DHT. Runs as a coroutine of the download thread.
+void publish_client_func(void *arg)
+{
+    dht_publish((ClientFiles_t*)arg);
+}
+
+void *download_thread_func(void *arg)
+{
+    srand(time(NULL)); // Seed the random number generator
+    counters_attach(COUNTER_DOWNLOAD);
+    trace_attach(TRACE_THREAD_DOWNLOAD);
+
+    // Without a tracker, every client joins the DHT from the bootstrap nodes, then publishes
+    // what it holds before anybody looks it up
+    if (options.dht) {
+        for (int round = 0; round < DHT_JOIN_ROUNDS; ++round) {
+            run_local_clients((LocalClients_t *)arg, COMM_DOWNLOAD_INBOX, join_client_func, -1);
+            comm_barrier(COMM_DOWNLOAD_INBOX);
+        }
+        run_local_clients((LocalClients_t *)arg, COMM_DOWNLOAD_INBOX, publish_client_func, -1);
+        comm_barrier(COMM_DOWNLOAD_INBOX);
+    }
+    run_local_clients((LocalClients_t *)arg, COMM_DOWNLOAD_INBOX, download_client_func, SEEDER);
+
+    // The rank's part of the run is done once its uploaders are no longer needed
+    comm_enter_termination();
+    comm_worker_exit();
+    return NULL;
+}
 
+void *upload_thread_func(void *arg)
+{
+    counters_attach(COUNTER_UPLOAD);
+    trace_attach(TRACE_THREAD_UPLOAD);
+
+    // Every DHT node answers lookups, leeches included
+    run_local_clients((LocalClients_t *)arg, COMM_UPLOAD_INBOX, upload_client_func, options.dht ? -1 : LEECHER);
+    comm_worker_exit();
     return NULL;
 }
 
-void tracker(TrackerDataSet_t* tracker_data) {
+// Joins a barrier of the clients' progress loops on the control channel, sleeping while it waits.
+static void join_client_barrier(void) {
+    MPI_Request barrier;
+    if (MPI_Ibarrier(CONTROL_COMM, &barrier) != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Ibarrier failed in tracker.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    comm_wait(&barrier);
+}
+
+// Tracks the swarms until every client has downloaded everything. Returns how many client
+// requests the tracker handled.
+uint64_t tracker(TrackerDataSet_t* tracker_data) {
     int total_downloading_clients = 0;
+    uint64_t requests = 0;
 
     MPI_Status mpi_status;
-    char buffer[BUFF_SIZE];
+    ControlMessage_t message;
     int finished_clients = 0;
+    int released_clients = 0;
+    unsigned int updates_since_snapshot = 0;
     bool continue_tracking = true;
 
-    // Share file information with all clients
+    // Share file information with all clients, who may subscribe to their swarms' updates
+    if (options.subscribe)
+        subscribe_start(tracker_data);
     send_peers_to_clients(tracker_data);
+    if (options.fairness_path)
+        fairness_start(tracker_data);
 
     // Count how many clients are actively downloading (not seeders)
     for (int i = 0; i < tracker_data->client_count; ++i) {
@@ -192,86 +694,373 @@ void tracker(TrackerDataSet_t* tracker_data) {
             continue;
         total_downloading_clients++;
     }
+    requests += total_downloading_clients; // * their wanted files
+
+    // With only seeders there is nothing to track
+    continue_tracking = total_downloading_clients > 0;
 
     // Keep tracking until all downloading clients have finished
     while (continue_tracking) {
         // Listen for messages from any client
-        if (MPI_Recv(buffer, BUFF_SIZE, MPI_CHAR, MPI_ANY_SOURCE, INFORM_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS) {
+        uint64_t waiting_since = counters_now_ns();
+        int received = MPI_Recv(&message, sizeof(message), MPI_BYTE, MPI_ANY_SOURCE, INFORM_TAG, CONTROL_COMM, &mpi_status);
+        if (received != MPI_SUCCESS) {
             fprintf(stderr, "MPI_Recv failed in tracker.\n");
             continue;
         }
+        uint64_t handling_since = counters_now_ns();
+        counters_receive(COUNTER_SITE_TRACKER_INFORM, waiting_since);
+        counters_received(INFORM_TAG, sizeof(message));
+        requests++;
+
+        // The sender is one of the clients hosted by the source rank
+        int client_id = message.client_id;
+        if (client_id <= 0 || client_id > tracker_data->client_count || client_rank_of(client_id) != mpi_status.MPI_SOURCE) {
+            fprintf(stderr, "Message from unknown client %d (rank %d).\n", client_id, mpi_status.MPI_SOURCE);
+            continue;
+        }
 
         // Handle different types of messages
+        const char* buffer = message.opcode;
         if (strcmp(buffer, "FINISHED_DOWN_ALL") == 0) {
             // Mark the client as a seeder now that it's finished downloading
-            Client_Type_t* client_type = &tracker_data->data[mpi_status.MPI_SOURCE - 1].client_type;
-            if (*client_type == PEER)
-                *client_type = SEEDER;
+            TrackerData_t* client_data = &tracker_data->data[client_id - 1];
+            if (client_data->client_type == PEER)
+                client_data->client_type = SEEDER;
+            client_data->finished = true;
+            if (options.subscribe)
+                subscribe_end(client_id);
 
             finished_clients++;
+
+            // Release the uploaders nobody still downloading needs; the last one to finish
+            // ends the run for everybody anyway
+            if (finished_clients < total_downloading_clients)
+                released_clients += release_idle_uploaders(tracker_data);
         }
-        else if (strcmp(buffer, "DOWN_10") == 0 || strcmp(buffer, "DOWN_X") == 0) {
-            int client_rank = mpi_status.MPI_SOURCE;
-            update_tracker_swarm(tracker_data, client_rank, buffer);
+        else if (strcmp(buffer, "DOWN_10") == 0 || strcmp(buffer, "DOWN_X") == 0 || strcmp(buffer, "RESTORED") == 0) {
+            update_tracker_swarm(tracker_data, client_id, mpi_status.MPI_SOURCE, message.opcode);
 
             // Let the client know the tracker has processed their update
-            if (MPI_Send("OK", 2, MPI_CHAR, client_rank, ACK_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
-                fprintf(stderr, "MPI_Send failed while sending ACK to client %d.\n", client_rank);
+            Reply_t reply = {.request_id = message.request_id, .status = "OK"};
+            if (send_to_client(client_id, ACK_TAG, &reply, sizeof(reply)) != MPI_SUCCESS) {
+                fprintf(stderr, "MPI_Send failed while sending ACK to client %d.\n", client_id);
                 // Consider adding more robust error handling here
             }
+
+            // Persist the swarms every few updates so a restarted tracker loses little
+            if (options.snapshot_path && ++updates_since_snapshot >= options.snapshot_interval) {
+                snapshot_write(tracker_data, options.snapshot_path);
+                updates_since_snapshot = 0;
+            }
         }
         else if (strcmp(buffer, "GIVE_PEERS") == 0) {
             printf("Updated peers requested.\n");
             // You might want to handle peer list sending here
         }
         else {
-            printf("Received unknown message: %s from client %d\n", buffer, mpi_status.MPI_SOURCE);
+            printf("Received unknown message: %s from client %d\n", buffer, client_id);
+        }
+        CounterOpcode_t opcode = counters_opcode(buffer);
+        counters_handled(opcode, handling_since);
+        trace_record(TRACE_DISPATCH, handling_since, false, client_id, 0, 0, 0, opcode);
+        fairness_sample(tracker_data, false);
+
+        // Push the swarm updates that fell due to the subscribers, once the messages that came
+        // in meanwhile are handled: their marks coalesce into the same pushes
+        if (options.subscribe) {
+            int queued = 0;
+            if (MPI_Iprobe(MPI_ANY_SOURCE, INFORM_TAG, CONTROL_COMM, &queued, MPI_STATUS_IGNORE) == MPI_SUCCESS && !queued)
+                subscribe_flush(tracker_data);
         }
 
         // If all clients have finished downloading, stop tracking
         if (finished_clients == total_downloading_clients) {
             printf("All downloading clients have finished. Ending tracking.\n");
             continue_tracking = false;
+            fairness_sample(tracker_data, true);
+            if (options.snapshot_path)
+                snapshot_write(tracker_data, options.snapshot_path);
         }
     }
 
-    // Instruct all non-leeching clients to stop uploading
-    for (int rank = 1; rank <= tracker_data->client_count; ++rank) {
-        if (tracker_data->data[rank - 1].client_type != LEECHER) {
-            if (MPI_Send("STOP_UPLOADING", 15, MPI_CHAR, rank, REQUEST_TAG, MPI_COMM_WORLD) != MPI_SUCCESS) {
-                fprintf(stderr, "MPI_Send failed while sending STOP_UPLOADING to client %d.\n", rank);
-                // Consider adding more robust error handling here
+    if (released_clients > 0)
+        printf("Released %d clients before the end of the run.\n", released_clients);
+    if (options.subscribe)
+        subscribe_stop();
+
+    // Join the termination barrier: once every rank is in it, the clients stop uploading
+    join_client_barrier();
+    return requests;
+}
+
+// Writes the completion time of every downloader that finished, one "<client id> <seconds>" line
+// each, to options.completion_log. Collective: every rank passes its own clients.
+static void log_completions(const LocalClients_t *local_clients, int numtasks, int rank) {
+    int count = local_clients->count;
+    double *times = calloc(count, sizeof(double));
+    double *all_times = rank == TRACKER_RANK ? calloc((size_t)numtasks * count, sizeof(double)) : NULL;
+    if (!times || (rank == TRACKER_RANK && !all_times)) {
+        fprintf(stderr, "Memory allocation failed for completion times.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    for (int local = 0; local < count; ++local)
+        times[local] = local_clients->clients[local].completion_time;
+
+    MPI_Gather(times, count, MPI_DOUBLE, all_times, count, MPI_DOUBLE, TRACKER_RANK, CONTROL_COMM);
+    free(times);
+    if (rank != TRACKER_RANK)
+        return;
+
+    FILE *log = fopen(options.completion_log, "w");
+    if (!log) {
+        fprintf(stderr, "Error: cannot write completion times to %s.\n", options.completion_log);
+    } else {
+        for (int r = 1; r < numtasks; ++r) {
+            for (int local = 0; local < count; ++local) {
+                if (all_times[r * count + local] > 0)
+                    fprintf(log, "%d %.6f\n", client_id_of(r, local), all_times[r * count + local]);
             }
         }
+        fclose(log);
+    }
+    free(all_times);
+}
+
+// Prints the run time, how long client ranks sat idle waiting for the others to finish, and
+// what peer discovery cost. Collective: every rank passes its own report.
+static void report_run(double run_time, const RunReport_t *report, int numtasks, int rank) {
+    RunReport_t *reports = rank == TRACKER_RANK ? calloc(numtasks, sizeof(RunReport_t)) : NULL;
+    if (rank == TRACKER_RANK && !reports) {
+        fprintf(stderr, "Memory allocation failed for run reports.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Gather(report, RUN_REPORT_FIELDS, MPI_DOUBLE, reports, RUN_REPORT_FIELDS, MPI_DOUBLE, TRACKER_RANK,
+               CONTROL_COMM);
+    if (rank != TRACKER_RANK)
+        return;
+
+    RunReport_t total = {0};
+    double max_idle = 0;
+    int idle_ranks = 0;
+    for (int r = 0; r < numtasks; ++r) {
+        total.idle_time += reports[r].idle_time;
+        max_idle = MAX(max_idle, reports[r].idle_time);
+        idle_ranks += reports[r].idle_time > 0;
+        total.lookups += reports[r].lookups;
+        total.discovery_total += reports[r].discovery_total;
+        total.discovery_max = MAX(total.discovery_max, reports[r].discovery_max);
+        total.nodes += reports[r].nodes;
+        total.requests_total += reports[r].requests_total;
+        total.requests_max = MAX(total.requests_max, reports[r].requests_max);
+        total.pex_sent += reports[r].pex_sent;
+        total.pex_received += reports[r].pex_received;
+        total.pex_learned += reports[r].pex_learned;
+        total.origin_uploads += reports[r].origin_uploads;
+        total.origin_max = MAX(total.origin_max, reports[r].origin_max);
+        total.refusals += reports[r].refusals;
+        if (reports[r].copies > 0 && (total.copies == 0 || reports[r].first_copy < total.first_copy))
+            total.first_copy = reports[r].first_copy;
+        total.copies += reports[r].copies;
+        total.copy_total += reports[r].copy_total;
+        total.internode_segments += reports[r].internode_segments;
+        total.internode_bytes += reports[r].internode_bytes;
+        total.files_completed += reports[r].files_completed;
+        total.completions += reports[r].completions;
+        total.completion_total += reports[r].completion_total;
+        total.completion_max = MAX(total.completion_max, reports[r].completion_max);
+        total.reused += reports[r].reused;
+        total.by_content += reports[r].by_content;
+        total.stream_files += reports[r].stream_files;
+        total.stream_first_total += reports[r].stream_first_total;
+        total.stream_first_max = MAX(total.stream_first_max, reports[r].stream_first_max);
+        total.stalls += reports[r].stalls;
+        total.stall_time += reports[r].stall_time;
+        total.urgent += reports[r].urgent;
+        total.duplicates += reports[r].duplicates;
+        total.duplicate_wins += reports[r].duplicate_wins;
+        total.upload_takes += reports[r].upload_takes;
+        total.upload_throttled += reports[r].upload_throttled;
+        total.upload_by_requester += reports[r].upload_by_requester;
+        total.upload_wait_total += reports[r].upload_wait_total;
+        total.upload_wait_max = MAX(total.upload_wait_max, reports[r].upload_wait_max);
+        if (run_time > 0)
+            total.upload_rate_max = MAX(total.upload_rate_max, reports[r].upload_takes / run_time);
+        total.download_takes += reports[r].download_takes;
+        total.download_throttled += reports[r].download_throttled;
+        total.download_wait_total += reports[r].download_wait_total;
+        total.download_wait_max = MAX(total.download_wait_max, reports[r].download_wait_max);
+        total.subscribers += reports[r].subscribers;
+        total.pushes += reports[r].pushes;
+        total.push_entries += reports[r].push_entries;
+        total.push_coalesced += reports[r].push_coalesced;
+        total.pushed_entries += reports[r].pushed_entries;
+        total.sources_pushed += reports[r].sources_pushed;
+    }
+
+    printf("Run time: %.3f s; idle client ranks: %d, idle rank time %.3f s in total, %.3f s at most\n",
+           run_time, idle_ranks, total.idle_time, max_idle);
+
+    if (total.completions > 0) {
+        printf("Completion: %.0f downloaders finished, %.3f ms on average, %.3f ms at most\n",
+               total.completions, total.completion_total / total.completions * 1000.0,
+               total.completion_max * 1000.0);
+    }
+
+    if (total.lookups > 0) {
+        printf("Peer discovery (%s): %.0f lookups, %.3f ms on average, %.3f ms at most; "
+               "%.0f requests served, %.1f per node on average, %.0f at most (%.0f nodes)\n",
+               options.dht ? "DHT" : "tracker", total.lookups, total.discovery_total / total.lookups * 1000.0,
+               total.discovery_max * 1000.0, total.requests_total,
+               total.nodes > 0 ? total.requests_total / total.nodes : 0.0, total.requests_max, total.nodes);
+    }
+    if (options.pex) {
+        printf("PEX: %.0f entries sent, %.0f received, %.0f new sources learned\n",
+               total.pex_sent, total.pex_received, total.pex_learned);
+    }
+    if (total.copies > 0) {
+        printf("Seeding: initial seeders sent %.0f segments, %.0f at most; first full copy after %.3f ms, "
+               "%.3f ms on average", total.origin_uploads, total.origin_max, total.first_copy * 1000.0,
+               total.copy_total / total.copies * 1000.0);
+        if (options.super_seed)
+            printf("; %.0f requests left to the swarm", total.refusals);
+        printf("\n");
+    }
+    if (options.dedup) {
+        printf("Dedup: %.0f segments reused without a transfer, %.0f served by content\n",
+               total.reused, total.by_content);
     }
+    if (options.stream_window > 0 && total.stream_files > 0) {
+        printf("Streaming: %.0f files, first segment after %.3f ms on average, %.3f ms at most; %.0f stalls, "
+               "%.3f ms stalled; %.0f urgent requests, %.0f sent twice, %.0f answered first by the second holder\n",
+               total.stream_files, total.stream_first_total / total.stream_files * 1000.0,
+               total.stream_first_max * 1000.0, total.stalls, total.stall_time * 1000.0, total.urgent,
+               total.duplicates, total.duplicate_wins);
+    }
+    if (options.upload_rate > 0 || options.requester_rate > 0) {
+        printf("Upload limits: %.0f segments sent, %.1f per second on the busiest rank; %.0f held back "
+               "(%.0f by a requester's limit), %.3f ms in total, %.3f ms at most\n", total.upload_takes,
+               total.upload_rate_max, total.upload_throttled, total.upload_by_requester,
+               total.upload_wait_total * 1000.0, total.upload_wait_max * 1000.0);
+    }
+    if (options.download_rate > 0) {
+        printf("Download budgets: %.0f requests, %.0f held back, %.3f ms in total, %.3f ms at most\n",
+               total.download_takes, total.download_throttled, total.download_wait_total * 1000.0,
+               total.download_wait_max * 1000.0);
+    }
+    if (options.subscribe) {
+        printf("Subscriptions: %.0f downloaders, %.0f pushes with %.0f entries, %.0f updates coalesced; "
+               "%.0f entries taken in, %.0f new sources\n", total.subscribers, total.pushes, total.push_entries,
+               total.push_coalesced, total.pushed_entries, total.sources_pushed);
+    }
+    if (topology.nodes > 1 && total.files_completed > 0) {
+        printf("Topology: %d nodes, %d racks; %.1f inter-node segments and %.0f inter-node bytes per completed file "
+               "(%.0f files)\n", topology.nodes, topology.racks, total.internode_segments / total.files_completed,
+               total.internode_bytes / total.files_completed, total.files_completed);
+    }
+    free(reports);
+}
+
+// Returns true if any of the rank's clients is not of the given type.
+static bool any_client_besides(const LocalClients_t *local_clients, Client_Type_t client_type) {
+    for (int local = 0; local < local_clients->count; ++local) {
+        if (local_clients->clients[local].client_type != client_type)
+            return true;
+    }
+    return false;
 }
 
-void peer(int numtasks, int rank, ClientFiles_t* client) {
+// Runs the rank's clients and fills the rank's part of the run report.
+void peer(int numtasks, int rank, LocalClients_t* local_clients, RunReport_t* report) {
     void *thread_status;
     int thread_result;
     pthread_t download_thread;
     pthread_t upload_thread;
+    int workers = 0;
+    bool uploading = any_client_besides(local_clients, LEECHER);
+    bool downloading = any_client_besides(local_clients, SEEDER);
+    OutputWriter_t *writer = NULL;
+
+    // Every client is a DHT node, and publishes its files from the download thread
+    if (options.dht) {
+        int client_count = options.clients_per_rank * (numtasks - 1);
+        for (int local = 0; local < local_clients->count; ++local)
+            local_clients->clients[local].dht = dht_node_create(&local_clients->clients[local], client_count);
+        uploading = downloading = true;
+    }
+
+    // Every client keeps a PEX table for each of its workers
+    for (int local = 0; local < local_clients->count && options.pex; ++local) {
+        local_clients->clients[local].pex = calloc(1, sizeof(PexState_t));
+        if (!local_clients->clients[local].pex) {
+            fprintf(stderr, "Memory allocation failed for PEX tables.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
 
-    // Start the upload thread if the client is not a leech
-    if (client->client_type != LEECHER) {
-        thread_result = pthread_create(&upload_thread, NULL, upload_thread_func, NULL);
+    // Every client counts whom it serves which segments
+    for (int local = 0; local < local_clients->count && options.fairness_path; ++local)
+        local_clients->clients[local].load = fairness_create(options.clients_per_rank * (numtasks - 1));
+
+    // Every downloader plays its files while they stream in
+    for (int local = 0; local < local_clients->count && options.stream_window > 0; ++local) {
+        if (local_clients->clients[local].client_type != SEEDER)
+            local_clients->clients[local].stream = stream_create();
+    }
+
+    // The upload thread keeps the rank's rate limits, and every downloader its own budget
+    ratelimit_init(options.clients_per_rank * (numtasks - 1));
+    for (int local = 0; local < local_clients->count; ++local) {
+        if (local_clients->clients[local].client_type != SEEDER)
+            local_clients->clients[local].budget = ratelimit_budget_create();
+    }
+
+    // Initial seeders hand their segments out one copy at a time
+    for (int local = 0; local < local_clients->count && options.super_seed; ++local) {
+        if (local_clients->clients[local].client_type == SEEDER)
+            local_clients->clients[local].superseed = superseed_create(&local_clients->clients[local],
+                                                                       options.clients_per_rank * (numtasks - 1));
+    }
+
+    // The workers talk to MPI only through the communication engine
+    comm_start();
+
+    // Start the upload thread if any client is not a leech; it serves all of them
+    if (uploading) {
+        thread_result = pthread_create(&upload_thread, NULL, upload_thread_func, local_clients);
         if (thread_result) {
             fprintf(stderr, "Error creating upload thread.\n");
             exit(EXIT_FAILURE);
         }
+        workers++;
     }
 
-    // Start the download thread if the client is not a seeder
-    if (client->client_type != SEEDER) {
-        thread_result = pthread_create(&download_thread, NULL, download_thread_func, (void *) client);
+    // Start the download thread (and the rank's output writer) if any client is not a seeder
+    if (downloading) {
+        writer = writer_start();
+        for (int local = 0; local < local_clients->count; ++local) {
+            ClientFiles_t *client = &local_clients->clients[local];
+            if (client->client_type == SEEDER)
+                continue;
+            client->writer = writer;
+        }
+        thread_result = pthread_create(&download_thread, NULL, download_thread_func, local_clients);
         if (thread_result) {
             fprintf(stderr, "Error creating download thread.\n");
             exit(EXIT_FAILURE);
         }
+        workers++;
     }
 
+    // A rank with nothing to download is ready for termination right away
+    if (!downloading)
+        comm_enter_termination();
+
+    // The main thread makes every MPI call until both workers are done and the run terminated
+    report->idle_time = comm_progress(workers);
+
     // Wait for the upload thread to finish if it was started
-    if (client->client_type != LEECHER) {
+    if (uploading) {
         thread_result = pthread_join(upload_thread, &thread_status);
         if (thread_result) {
             fprintf(stderr, "Error joining upload thread.\n");
@@ -280,22 +1069,114 @@ void peer(int numtasks, int rank, ClientFiles_t* client) {
     }
 
     // Wait for the download thread to finish if it was started
-    if (client->client_type != SEEDER) {
+    if (downloading) {
         thread_result = pthread_join(download_thread, &thread_status);
         if (thread_result) {
             fprintf(stderr, "Error joining download thread.\n");
             exit(EXIT_FAILURE);
         }
+
+        // Flush whatever the writer still has queued
+        writer_stop(writer);
+
+        for (int local = 0; local < local_clients->count; ++local) {
+            ClientFiles_t *client = &local_clients->clients[local];
+            client->writer = NULL;
+            if (client->checkpoint) {
+                checkpoint_close(client->checkpoint);
+                client->checkpoint = NULL;
+            }
+        }
+    }
+
+    comm_stop();
+
+    for (int local = 0; local < local_clients->count; ++local) {
+        ClientFiles_t *client = &local_clients->clients[local];
+        if (client->client_type != SEEDER) {
+            report->lookups++;
+            report->discovery_total += client->discovery_time;
+            report->discovery_max = MAX(report->discovery_max, client->discovery_time);
+        }
+        if (client->dht) {
+            double served = (double)client->dht->requests_served;
+            report->nodes++;
+            report->requests_total += served;
+            report->requests_max = MAX(report->requests_max, served);
+            dht_node_free(client->dht);
+            client->dht = NULL;
+        }
+        if (client->pex) {
+            report->pex_sent += client->pex->download.entries_sent + client->pex->upload.entries_sent;
+            report->pex_received += client->pex->download.entries_received + client->pex->upload.entries_received;
+            report->pex_learned += client->pex->download.sources_learned;
+            free(client->pex);
+            client->pex = NULL;
+        }
+        if (client->client_type == SEEDER) {
+            report->origin_uploads += client->segments_uploaded;
+            report->origin_max = MAX(report->origin_max, (double)client->segments_uploaded);
+        }
+        report->reused += client->segments_reused;
+        report->by_content += client->segments_by_content;
+        report->pushed_entries += client->pushed_entries;
+        report->sources_pushed += client->sources_pushed;
+        report->internode_segments += client->internode_segments;
+        report->internode_bytes += client->internode_bytes;
+        report->files_completed += client->files_completed;
+        if (client->completion_time > 0) {
+            report->completions++;
+            report->completion_total += client->completion_time;
+            report->completion_max = MAX(report->completion_max, client->completion_time);
+        }
+        if (client->first_copy_time > 0) {
+            if (report->copies == 0 || client->first_copy_time < report->first_copy)
+                report->first_copy = client->first_copy_time;
+            report->copies++;
+            report->copy_total += client->first_copy_time;
+        }
+        if (client->stream) {
+            report->stream_files += client->stream->files_started;
+            report->stream_first_total += client->stream->first_total;
+            report->stream_first_max = MAX(report->stream_first_max, client->stream->first_max);
+            report->stalls += client->stream->stalls;
+            report->stall_time += client->stream->stall_time;
+            report->urgent += client->stream->urgent;
+            report->duplicates += client->stream->duplicates;
+            report->duplicate_wins += client->stream->duplicate_wins;
+            free(client->stream);
+            client->stream = NULL;
+        }
+        if (client->budget) {
+            report->download_takes += client->budget->waits.takes;
+            report->download_throttled += client->budget->waits.throttled;
+            report->download_wait_total += client->budget->waits.wait_total;
+            report->download_wait_max = MAX(report->download_wait_max, client->budget->waits.wait_max);
+            free(client->budget);
+            client->budget = NULL;
+        }
+        if (client->superseed) {
+            report->refusals += client->superseed->refusals;
+            superseed_free(client->superseed);
+            client->superseed = NULL;
+        }
     }
+
+    report->upload_takes = (double)upload_limits.waits.takes;
+    report->upload_throttled = (double)upload_limits.waits.throttled;
+    report->upload_by_requester = (double)upload_limits.waits.by_requester;
+    report->upload_wait_total = upload_limits.waits.wait_total;
+    report->upload_wait_max = upload_limits.waits.wait_max;
+    ratelimit_free();
 }
 
 int main(int argc, char *argv[]) {
     int numtasks, rank;
     int mpi_provided;
 
-    // Initialize MPI with support for multiple threads
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_provided);
-    if (mpi_provided < MPI_THREAD_MULTIPLE) {
+    // Only the main thread calls MPI: the clients' workers go through the communication engine
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_provided);
+    if (mpi_provided < MPI_THREAD_FUNNELED) {
         fprintf(stderr, "MPI does not support required threading level.\n");
         exit(EXIT_FAILURE);
     }
@@ -304,46 +1185,109 @@ int main(int argc, char *argv[]) {
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    // One duplicated communicator per protocol role
+    comm_create_channels();
+
+    // Every rank parses the same command line
+    parse_options(argc, argv);
+    counters_init(numtasks, rank);
+    netem_init(numtasks, rank);
+
+    // Find out which ranks share a node
+    topology_init(numtasks, rank);
+
+    // Align the ranks' clocks before anything gets traced
+    if (options.trace_path)
+        trace_init(numtasks, rank);
+
+    // The local id of the receiving client travels in the MPI tag
+    int *tag_ub = NULL;
+    int tag_ub_set = 0;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_ub, &tag_ub_set);
+    if (tag_ub_set && COMM_WIRE_TAG(COMM_TAG_STRIDE - 1, (long)options.clients_per_rank - 1) > *tag_ub) {
+        if (rank == TRACKER_RANK)
+            fprintf(stderr, "Error: %d clients per rank do not fit the MPI tag space.\n", options.clients_per_rank);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
     // Allocate memory for client and tracker data structures
-    ClientFiles_t *client_file = (ClientFiles_t *)calloc(1, sizeof(ClientFiles_t));
+    LocalClients_t local_clients = {.count = options.clients_per_rank};
+    local_clients.clients = (ClientFiles_t *)calloc(local_clients.count, sizeof(ClientFiles_t));
     TrackerDataSet_t *tracker_data = (TrackerDataSet_t *)calloc(1, sizeof(TrackerDataSet_t));
 
-    if (!client_file || !tracker_data) {
+    if (!local_clients.clients || !tracker_data) {
         fprintf(stderr, "Memory allocation failed.\n");
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
 
-    if (rank == TRACKER_RANK) {
+    double start_time = 0;
+    RunReport_t report = {0};
+    if (rank == TRACKER_RANK && options.dht) {
+        // Without a tracker, rank 0 only joins the clients' barriers: the end of the DHT joins,
+        // the end of DHT publishing and termination
+        start_time = MPI_Wtime();
+        for (int round = 0; round < DHT_JOIN_ROUNDS; ++round)
+            join_client_barrier();
+        join_client_barrier();
+        join_client_barrier();
+    } else if (rank == TRACKER_RANK) {
         // If this process is the tracker, handle tracking operations
         receive_data_from_clients(tracker_data, numtasks);
-        tracker(tracker_data);
+        start_time = MPI_Wtime();
+        report.requests_total = report.requests_max = (double)tracker(tracker_data);
+        report.nodes = 1;
+        report.subscribers = (double)subscriptions.subscribers;
+        report.pushes = (double)subscriptions.pushes;
+        report.push_entries = (double)subscriptions.entries;
+        report.push_coalesced = (double)subscriptions.coalesced;
         free_tracker(tracker_data);
     } else {
         // For peer clients, handle downloading and uploading
-        read_from_file(client_file, rank);
-        send_data_to_tracker(client_file);
-
-        // Wait for acknowledgment from the tracker before proceeding
-        char ack_buffer[3] = {0};
-        MPI_Status mpi_status;
-        if (MPI_Recv(ack_buffer, 2, MPI_CHAR, TRACKER_RANK, ACK_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS) {
-            fprintf(stderr, "Failed to receive acknowledgment from tracker.\n");
-            free_client_files(client_file);
-            free(client_file);
-            free(tracker_data);
-            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        // Checkpoints are opened before registering, so the tracker hears what they hold
+        for (int local = 0; local < local_clients.count; ++local) {
+            ClientFiles_t *client = &local_clients.clients[local];
+            read_from_file(client, client_id_of(rank, local));
+            if (options.checkpoint_dir && client->client_type != SEEDER)
+                client->checkpoint = checkpoint_open(client, options.checkpoint_dir);
+        }
+
+        if (!options.dht) {
+            send_data_to_tracker(local_clients.clients, local_clients.count);
+
+            // Wait for the tracker to broadcast that registration is complete
+            char ack_buffer[3] = {0};
+            if (MPI_Bcast(ack_buffer, 2, MPI_CHAR, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS) {
+                fprintf(stderr, "Failed to receive acknowledgment from tracker.\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
         }
 
         // Start peer operations
-        peer(numtasks, rank, client_file);
-        free_client_files(client_file);
+        peer(numtasks, rank, &local_clients, &report);
+        for (int local = 0; local < local_clients.count; ++local)
+            free_client_files(&local_clients.clients[local]);
+    }
+    report_run(MPI_Wtime() - start_time, &report, numtasks, rank);
+    if (options.completion_log)
+        log_completions(&local_clients, numtasks, rank);
+    if (options.counters_path)
+        counters_report(options.counters_path);
+    if (options.fairness_path)
+        fairness_report(local_clients.clients, local_clients.count, numtasks, rank, options.fairness_path);
+    if (options.trace_path) {
+        trace_write(options.trace_path);
+        trace_free();
     }
 
     // Clean up allocated memory
-    free(client_file);
+    free(local_clients.clients);
     free(tracker_data);
 
     // Finalize the MPI environment
+    topology_free();
+    netem_free();
+    counters_free();
+    comm_free_channels();
     MPI_Finalize();
 
     return 0;
@@ -0,0 +1,246 @@
+#include "topology.h"
+#include "comm.h"
+#include "digest.h"
+#include "download.h"
+
+Topology_t topology = {.node_comm = MPI_COMM_NULL, .window = MPI_WIN_NULL};
+
+// Numbers the distinct keys of every rank from 0, in order of first appearance.
+static int number_keys(const uint64_t *keys, int *numbers, int count) {
+    int distinct = 0;
+    for (int i = 0; i < count; ++i) {
+        numbers[i] = -1;
+        for (int j = 0; j < i && numbers[i] < 0; ++j) {
+            if (keys[j] == keys[i])
+                numbers[i] = numbers[j];
+        }
+        if (numbers[i] < 0)
+            numbers[i] = distinct++;
+    }
+    return distinct;
+}
+
+// Looks this rank's host (or "node<n>", n being its node) up in the rack map. Returns the key
+// of its rack; a node missing from the map is a rack of its own.
+static uint64_t rack_key(const char *path, int node) {
+    char host[MPI_MAX_PROCESSOR_NAME];
+    char node_name[32];
+    int length = 0;
+    MPI_Get_processor_name(host, &length);
+    snprintf(node_name, sizeof(node_name), "node%d", node);
+
+    uint64_t key = fingerprint_bytes(node_name, strlen(node_name), FINGERPRINT_SEED);
+    FILE *file = path ? fopen(path, "r") : NULL;
+    if (path && !file) {
+        fprintf(stderr, "Warning: cannot open rack map %s.\n", path);
+        return key;
+    }
+
+    char name[MPI_MAX_PROCESSOR_NAME];
+    char rack[64];
+    while (file && fscanf(file, "%255s %63s", name, rack) == 2) {
+        if (strcmp(name, host) == 0 || strcmp(name, node_name) == 0) {
+            key = fingerprint_bytes(rack, strlen(rack), FINGERPRINT_SEED) ^ 1;
+            break;
+        }
+    }
+    if (file)
+        fclose(file);
+    return key;
+}
+
+/*
+ * Finds the node and rack of every rank and, on runs over several nodes, sets up the node's
+ * shared map. Collective: every rank calls it after parsing the options.
+ */
+void topology_init(int numtasks, int rank) {
+    topology.ranks = numtasks;
+    topology.rank = rank;
+    topology.node_of = malloc(sizeof(int) * numtasks);
+    topology.rack_of = malloc(sizeof(int) * numtasks);
+    uint64_t *keys = malloc(sizeof(uint64_t) * numtasks);
+    if (!topology.node_of || !topology.rack_of || !keys) {
+        fprintf(stderr, "Error: Memory allocation failed for the topology.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Ranks sharing memory, cut into simulated nodes if asked (the tracker joins the first)
+    MPI_Comm shared;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shared);
+    int simulated = options.node_size > 0 ? MAX(rank - 1, 0) / options.node_size : 0;
+    MPI_Comm_split(shared, simulated, rank, &topology.node_comm);
+    MPI_Comm_free(&shared);
+
+    // A node is known by the world rank of its first member
+    int leader = rank;
+    MPI_Allreduce(MPI_IN_PLACE, &leader, 1, MPI_INT, MPI_MIN, topology.node_comm);
+    uint64_t key = (uint64_t)leader;
+    MPI_Allgather(&key, 1, MPI_UINT64_T, keys, 1, MPI_UINT64_T, MPI_COMM_WORLD);
+    topology.nodes = number_keys(keys, topology.node_of, numtasks);
+
+    key = rack_key(options.rack_map, topology.node_of[rank]);
+    MPI_Allgather(&key, 1, MPI_UINT64_T, keys, 1, MPI_UINT64_T, MPI_COMM_WORLD);
+    topology.racks = number_keys(keys, topology.rack_of, numtasks);
+    free(keys);
+
+    if (topology.nodes < 2 || !options.locality)
+        return;
+
+    // The node's first member holds the map; everybody maps it
+    int node_rank;
+    MPI_Comm_rank(topology.node_comm, &node_rank);
+    void *base = NULL;
+    MPI_Aint size = node_rank == 0 ? sizeof(NodeShare_t) : 0;
+    if (MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, topology.node_comm, &base, &topology.window) != MPI_SUCCESS) {
+        fprintf(stderr, "Error: MPI_Win_allocate_shared failed for the node map.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int disp_unit;
+    MPI_Win_shared_query(topology.window, 0, &size, &disp_unit, &base);
+    topology.share = base;
+    if (node_rank == 0)
+        memset(topology.share, 0, sizeof(NodeShare_t));
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, topology.window);
+    MPI_Win_sync(topology.window);
+    MPI_Barrier(topology.node_comm);
+}
+
+// Releases the node's map. Collective, like topology_init.
+void topology_free(void) {
+    if (topology.window != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(topology.window);
+        MPI_Win_free(&topology.window);
+        topology.share = NULL;
+    }
+    if (topology.node_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&topology.node_comm);
+    free(topology.node_of);
+    free(topology.rack_of);
+    topology.node_of = topology.rack_of = NULL;
+}
+
+TopologyDistance_t topology_distance(int rank_a, int rank_b) {
+    if (!topology.node_of || rank_a < 0 || rank_b < 0 || rank_a >= topology.ranks || rank_b >= topology.ranks)
+        return TOPOLOGY_REMOTE;
+    if (topology.node_of[rank_a] == topology.node_of[rank_b])
+        return TOPOLOGY_SAME_NODE;
+    if (topology.rack_of[rank_a] == topology.rack_of[rank_b])
+        return TOPOLOGY_SAME_RACK;
+    return TOPOLOGY_REMOTE;
+}
+
+// Only clients that run an upload coroutine may serve the node.
+static bool uploads(const ClientFiles_t *client) {
+    return options.dht || client->client_type != LEECHER;
+}
+
+static bool tracked(int file_id) {
+    return topology.share && file_id >= 0 && file_id < MAX_FILES;
+}
+
+// Adds the clients of the node holding segments the client misses to the file's peer list.
+// They join however long the list is: the client fetches those segments from them only, and
+// the node's clients bound their number.
+void topology_learn_holders(ClientFiles_t *client, size_t file_idx, const FileData_t *data, int file_id) {
+    if (!tracked(file_id))
+        return;
+
+    for (size_t idx = 0; idx < MAX_CHUNKS; ++idx) {
+        if (segment_bit_test(data->have, idx))
+            continue;
+        int holder = __atomic_load_n(&topology.share->holder[file_id][idx], __ATOMIC_ACQUIRE);
+        if (holder <= 0 || holder == client->client_id)
+            continue;
+
+        // Everything the holder has of what the client misses, in one go
+        uint64_t have[SEGMENT_WORDS] = {0};
+        for (size_t other = idx; other < MAX_CHUNKS; ++other) {
+            if (!segment_bit_test(data->have, other) &&
+                __atomic_load_n(&topology.share->holder[file_id][other], __ATOMIC_ACQUIRE) == holder)
+                segment_bit_set(have, other);
+        }
+        learn_peer(&client->peers[file_idx], file_id, holder, have, INT32_MAX);
+    }
+}
+
+// Returns true if the client may fetch the segment from source_id, without claiming it.
+static bool fetchable(const ClientFiles_t *client, int source_id, int file_id, size_t idx) {
+    if (!tracked(file_id) || topology_distance(topology.rank, client_rank_of(source_id)) == TOPOLOGY_SAME_NODE)
+        return true;
+
+    int holder = __atomic_load_n(&topology.share->holder[file_id][idx], __ATOMIC_ACQUIRE);
+    if (holder > 0 && holder != client->client_id)
+        return false; // * copy it within the node instead
+    int claim = __atomic_load_n(&topology.share->claim[file_id][idx], __ATOMIC_ACQUIRE);
+    return claim == 0 || claim == client->client_id;
+}
+
+/*
+ * Picks the source to download from next: one of the closest peers holding a missing segment
+ * the client may fetch from it, preferring peers that have not turned the client away. Returns
+ * its index, or -1 if the client may fetch nothing now (the node's clients fetch what it misses).
+ */
+int topology_select_peer(const ClientFiles_t *client, const PeersList_t *peers, const FileData_t *data,
+                         int file_id) {
+    int best_rank = INT32_MAX;
+    int candidates = 0;
+    int chosen = -1;
+
+    for (int i = 0; i < peers->peers_count; ++i) {
+        const PeerInfo_t *peer = &peers->peers_array[i];
+        bool usable = false;
+        for (size_t idx = 0; idx < peer->segment_count && !usable; ++idx) {
+            usable = segment_bit_test(peer->have, idx) && !segment_bit_test(data->have, idx) &&
+                     fetchable(client, peer->peer_id, file_id, idx);
+        }
+        if (!usable)
+            continue;
+
+        // Rank candidates by refusal first, distance second; pick uniformly among the best
+        int rank = (int)peer->refused * TOPOLOGY_DISTANCES +
+                   (int)topology_distance(topology.rank, client_rank_of(peer->peer_id));
+        if (rank < best_rank) {
+            best_rank = rank;
+            candidates = 0;
+        }
+        if (rank == best_rank && rand() % ++candidates == 0)
+            chosen = i;
+    }
+    return chosen;
+}
+
+/*
+ * Returns true if the client may fetch the segment from source_id now. A fetch from another
+ * node is claimed first, so the node's other clients wait for the copy instead of fetching it
+ * too; leeches, which cannot serve the copy, fetch without claiming.
+ */
+bool topology_claim(const ClientFiles_t *client, int source_id, int file_id, size_t segment_idx) {
+    if (!fetchable(client, source_id, file_id, segment_idx))
+        return false;
+    if (!tracked(file_id) || !uploads(client) ||
+        topology_distance(topology.rank, client_rank_of(source_id)) == TOPOLOGY_SAME_NODE)
+        return true;
+
+    int32_t expected = 0;
+    int32_t *claim = &topology.share->claim[file_id][segment_idx];
+    return __atomic_compare_exchange_n(claim, &expected, client->client_id, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE) || expected == client->client_id;
+}
+
+// Drops the client's claim on a segment it failed to fetch.
+void topology_release(const ClientFiles_t *client, int file_id, size_t segment_idx) {
+    if (!tracked(file_id))
+        return;
+    int32_t expected = client->client_id;
+    __atomic_compare_exchange_n(&topology.share->claim[file_id][segment_idx], &expected, 0, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Tells the node the client holds a segment it fetched, and drops its claim on it.
+void topology_publish(const ClientFiles_t *client, int file_id, size_t segment_idx) {
+    if (!tracked(file_id))
+        return;
+    if (uploads(client))
+        __atomic_store_n(&topology.share->holder[file_id][segment_idx], client->client_id, __ATOMIC_RELEASE);
+    topology_release(client, file_id, segment_idx);
+}
@@ -0,0 +1,58 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include "utils.h"
+
+// * Node Topology
+// * Ranks that share memory form a node (MPI_Comm_split_type); --node-size cuts a machine into
+// * simulated nodes of that many client ranks, and --rack-map groups nodes into racks. The
+// * tracker hands out swarms closest first, and a downloader fetches from the closest source.
+// * On runs over several nodes, the clients of a node also share a map of who on the node
+// * holds or is fetching each segment (an MPI shared-memory window): a segment crosses into a
+// * node once, and the node's clients copy it from each other afterwards.
+
+typedef enum TopologyDistance_t {
+    TOPOLOGY_SAME_NODE = 0,
+    TOPOLOGY_SAME_RACK,
+    TOPOLOGY_REMOTE,
+    TOPOLOGY_DISTANCES
+} TopologyDistance_t;
+
+// * Segments of the node's clients, indexed by file id and segment index
+typedef struct NodeShare_t {
+    int32_t holder[MAX_FILES][MAX_CHUNKS]; // * uploading client of the node that holds the segment (0 = none)
+    int32_t claim[MAX_FILES][MAX_CHUNKS]; // * client of the node fetching it from another node (0 = none)
+} NodeShare_t;
+
+typedef struct Topology_t {
+    int ranks;
+    int rank;
+    int nodes;
+    int racks;
+    int *node_of; // * node of every rank, numbered from 0
+    int *rack_of; // * rack of every rank, numbered from 0
+    MPI_Comm node_comm;
+    MPI_Win window;
+    NodeShare_t *share; // * the node's map (NULL on one node, or with --no-locality)
+} Topology_t;
+
+extern Topology_t topology;
+
+void topology_init(int numtasks, int rank);
+
+void topology_free(void);
+
+TopologyDistance_t topology_distance(int rank_a, int rank_b);
+
+void topology_learn_holders(ClientFiles_t *client, size_t file_idx, const FileData_t *data, int file_id);
+
+int topology_select_peer(const ClientFiles_t *client, const PeersList_t *peers, const FileData_t *data,
+                         int file_id);
+
+bool topology_claim(const ClientFiles_t *client, int source_id, int file_id, size_t segment_idx);
+
+void topology_release(const ClientFiles_t *client, int file_id, size_t segment_idx);
+
+void topology_publish(const ClientFiles_t *client, int file_id, size_t segment_idx);
+
+#endif
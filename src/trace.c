@@ -0,0 +1,245 @@
+#include "trace.h"
+#include "comm.h"
+
+Tracer_t tracer;
+__thread TraceRing_t *trace_ring = NULL;
+
+static const char *thread_names[TRACE_THREADS] = {"main", "download", "upload", "writer"};
+static const char *status_names[] = {"OK", "NH", "NO", "FAILED"};
+
+// * An event on its way to rank 0, on rank 0's clock
+typedef struct TraceRecord_t {
+    double ts_us;
+    double duration_us;
+    int32_t thread;
+    int32_t type;
+    int32_t client_id;
+    int32_t file_id;
+    int32_t segment;
+    int32_t peer_id;
+    int32_t value;
+    int32_t reserved;
+} TraceRecord_t;
+
+/*
+ * Measures the offset of this rank's MPI_Wtime from rank 0's. Each client rank in turn sends
+ * TRACE_SYNC_ROUNDS pings; rank 0 answers each with its MPI_Wtime, which is taken to be read
+ * halfway through the round trip. The round with the shortest round trip counts.
+ */
+static double wtime_offset(int numtasks, int rank) {
+    double best_offset = 0;
+    double best_round_trip = -1;
+
+    for (int r = 1; r < numtasks; ++r) {
+        for (int round = 0; round < TRACE_SYNC_ROUNDS; ++round) {
+            double remote = 0;
+            if (rank == TRACKER_RANK) {
+                MPI_Recv(NULL, 0, MPI_BYTE, r, SYNC_TAG, CONTROL_COMM, MPI_STATUS_IGNORE);
+                remote = MPI_Wtime();
+                MPI_Send(&remote, 1, MPI_DOUBLE, r, SYNC_TAG, CONTROL_COMM);
+            } else if (rank == r) {
+                double sent = MPI_Wtime();
+                MPI_Send(NULL, 0, MPI_BYTE, TRACKER_RANK, SYNC_TAG, CONTROL_COMM);
+                MPI_Recv(&remote, 1, MPI_DOUBLE, TRACKER_RANK, SYNC_TAG, CONTROL_COMM, MPI_STATUS_IGNORE);
+                double received = MPI_Wtime();
+                if (best_round_trip < 0 || received - sent < best_round_trip) {
+                    best_round_trip = received - sent;
+                    best_offset = remote - (sent + received) / 2;
+                }
+            }
+        }
+    }
+    return best_offset;
+}
+
+// Allocates the rings and aligns this rank's clock with rank 0's. Collective.
+void trace_init(int numtasks, int rank) {
+    memset(&tracer, 0, sizeof(tracer));
+    tracer.ranks = numtasks;
+    tracer.rank = rank;
+    for (int thread = 0; thread < TRACE_THREADS; ++thread) {
+        tracer.rings[thread].events = malloc(TRACE_RING_EVENTS * sizeof(TraceEvent_t));
+        if (!tracer.rings[thread].events) {
+            fprintf(stderr, "Memory allocation failed for trace rings.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    // Times are kept from rank 0's startup, which every rank learns
+    double offset = wtime_offset(numtasks, rank);
+    tracer.origin_ns = counters_now_ns();
+    tracer.origin_wtime = MPI_Wtime() + offset;
+    double tracker_origin = tracer.origin_wtime;
+    MPI_Bcast(&tracker_origin, 1, MPI_DOUBLE, TRACKER_RANK, CONTROL_COMM);
+    tracer.origin_wtime -= tracker_origin;
+    trace_attach(TRACE_THREAD_MAIN);
+}
+
+// Maps a reply status to the traced one.
+TraceStatus_t trace_status(const char *status) {
+    for (int i = TRACE_OK; i < TRACE_FAILED; ++i) {
+        if (strcmp(status, status_names[i]) == 0)
+            return (TraceStatus_t)i;
+    }
+    return TRACE_FAILED;
+}
+
+// Makes the calling thread record into its own ring, if tracing is on.
+void trace_attach(TraceThread_t thread) {
+    if (tracer.rings[thread].events)
+        trace_ring = &tracer.rings[thread];
+}
+
+// Converts what the rings still hold to records on rank 0's clock. Returns how many.
+static int collect_records(TraceRecord_t **records) {
+    int count = 0;
+    for (int thread = 0; thread < TRACE_THREADS; ++thread) {
+        uint64_t head = __atomic_load_n(&tracer.rings[thread].head, __ATOMIC_ACQUIRE);
+        count += (int)MIN(head, (uint64_t)TRACE_RING_EVENTS);
+    }
+
+    *records = calloc(count ? count : 1, sizeof(TraceRecord_t));
+    if (!*records) {
+        fprintf(stderr, "Memory allocation failed for trace records.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    int filled = 0;
+    for (int thread = 0; thread < TRACE_THREADS; ++thread) {
+        const TraceRing_t *ring = &tracer.rings[thread];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            const TraceEvent_t *event = &ring->events[i % TRACE_RING_EVENTS];
+            TraceRecord_t *record = &(*records)[filled++];
+            record->ts_us = tracer.origin_wtime * 1e6 + ((double)event->start_ns - (double)tracer.origin_ns) / 1e3;
+            record->duration_us = event->duration_ns / 1e3;
+            record->thread = thread;
+            record->type = event->type;
+            record->client_id = event->client_id;
+            record->file_id = event->file_id;
+            record->segment = event->segment;
+            record->peer_id = event->peer_id;
+            record->value = event->value;
+        }
+    }
+    return filled;
+}
+
+static void write_record(FILE *out, int rank, const TraceRecord_t *record) {
+    double ts = record->ts_us;
+    const char *status = record->value >= 0 && record->value <= TRACE_FAILED ? status_names[record->value] : "?";
+
+    switch (record->type) {
+        case TRACE_SEGMENT:
+            fprintf(out, "{\"name\": \"segment\", \"cat\": \"download\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                         "\"pid\": %d, \"tid\": %d, \"args\": {\"client\": %d, \"file\": %d, \"segment\": %d, "
+                         "\"peer\": %d, \"status\": \"%s\"}}", ts, record->duration_us, rank, record->thread,
+                    record->client_id, record->file_id, record->segment, record->peer_id, status);
+            break;
+        case TRACE_UPLOAD:
+            fprintf(out, "{\"name\": \"upload\", \"cat\": \"upload\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+                         "\"pid\": %d, \"tid\": %d, \"args\": {\"client\": %d, \"file\": %d, \"segment\": %d, "
+                         "\"requester\": %d, \"status\": \"%s\"}}", ts, rank, record->thread, record->client_id,
+                    record->file_id, record->segment, record->peer_id, status);
+            break;
+        case TRACE_ANNOUNCE:
+            fprintf(out, "{\"name\": \"%s\", \"cat\": \"announce\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+                         "\"pid\": %d, \"tid\": %d, \"args\": {\"client\": %d, \"records\": %d}}",
+                    counters_opcode_name(record->value), ts, rank, record->thread, record->client_id, record->segment);
+            break;
+        case TRACE_DISPATCH:
+            fprintf(out, "{\"name\": \"%s\", \"cat\": \"tracker\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                         "\"pid\": %d, \"tid\": %d, \"args\": {\"client\": %d}}", counters_opcode_name(record->value),
+                    ts, record->duration_us, rank, record->thread, record->client_id);
+            break;
+        case TRACE_FILE_WRITTEN:
+            fprintf(out, "{\"name\": \"file written\", \"cat\": \"writer\", \"ph\": \"X\", \"ts\": %.3f, "
+                         "\"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {\"client\": %d, \"file\": %d, "
+                         "\"segments\": %d}}", ts, record->duration_us, rank, record->thread, record->client_id,
+                    record->file_id, record->segment);
+            break;
+        default:
+            fprintf(out, "{\"name\": \"unknown\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": %d, "
+                         "\"tid\": %d}", ts, rank, record->thread);
+            break;
+    }
+}
+
+/*
+ * Gathers every rank's events on rank 0, which writes them to path as a Chrome trace, with
+ * times in microseconds from rank 0's startup. Collective; call it once the workers have joined.
+ */
+void trace_write(const char *path) {
+    TraceRecord_t *records = NULL;
+    int count = collect_records(&records);
+    int bytes = count * (int)sizeof(TraceRecord_t);
+
+    int *sizes = NULL;
+    int *displs = NULL;
+    char *all = NULL;
+    if (tracer.rank == TRACKER_RANK) {
+        sizes = calloc(tracer.ranks, sizeof(int));
+        displs = calloc(tracer.ranks, sizeof(int));
+        if (!sizes || !displs) {
+            fprintf(stderr, "Memory allocation failed for trace records.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Gather(&bytes, 1, MPI_INT, sizes, 1, MPI_INT, TRACKER_RANK, CONTROL_COMM);
+
+    size_t total = 0;
+    if (tracer.rank == TRACKER_RANK) {
+        for (int r = 0; r < tracer.ranks; ++r) {
+            displs[r] = (int)total;
+            total += sizes[r];
+        }
+        all = malloc(total ? total : 1);
+        if (!all) {
+            fprintf(stderr, "Memory allocation failed for trace records.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Gatherv(records, bytes, MPI_BYTE, all, sizes, displs, MPI_BYTE, TRACKER_RANK, CONTROL_COMM);
+    free(records);
+    if (tracer.rank != TRACKER_RANK)
+        return;
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: cannot write the trace to %s.\n", path);
+    } else {
+        // Name every process and track first
+        fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (int r = 0; r < tracer.ranks; ++r) {
+            fprintf(out, "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                    r ? ",\n" : "", r, r == TRACKER_RANK ? "tracker" : "rank", r);
+            for (int thread = 0; thread < TRACE_THREADS; ++thread) {
+                fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                             "\"args\": {\"name\": \"%s\"}}", r, thread, thread_names[thread]);
+            }
+        }
+
+        for (int r = 0; r < tracer.ranks; ++r) {
+            const TraceRecord_t *ranks_records = (const TraceRecord_t *)(all + displs[r]);
+            for (int i = 0; i < sizes[r] / (int)sizeof(TraceRecord_t); ++i) {
+                fprintf(out, ",\n");
+                write_record(out, r, &ranks_records[i]);
+            }
+        }
+        fprintf(out, "\n]}\n");
+        fclose(out);
+    }
+
+    free(all);
+    free(sizes);
+    free(displs);
+}
+
+void trace_free(void) {
+    for (int thread = 0; thread < TRACE_THREADS; ++thread) {
+        free(tracer.rings[thread].events);
+        tracer.rings[thread].events = NULL;
+    }
+    trace_ring = NULL;
+}
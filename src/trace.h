@@ -0,0 +1,105 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "utils.h"
+#include "counters.h"
+
+// * Event Tracing (--trace)
+// * Every thread of a rank (main or tracker, download, upload, writer) records its events in
+// * its own ring; only that thread writes it, so recording takes no lock. A full ring overwrites
+// * its oldest events. Timestamps are CLOCK_MONOTONIC nanoseconds, turned into rank 0's
+// * MPI_Wtime at the end: at startup every rank measures the offset of its MPI_Wtime from rank
+// * 0's in a few ping-pongs. The ranks' events are then gathered on rank 0, which writes one
+// * Chrome trace (chrome://tracing, ui.perfetto.dev): a process per rank, a track per thread.
+#define TRACE_RING_EVENTS (1 << 15) // * events a thread's ring keeps
+#define TRACE_SYNC_ROUNDS 8 // * ping-pongs per rank; the one with the shortest round trip counts
+
+typedef enum TraceThread_t {
+    TRACE_THREAD_MAIN = 0,
+    TRACE_THREAD_DOWNLOAD,
+    TRACE_THREAD_UPLOAD,
+    TRACE_THREAD_WRITER,
+    TRACE_THREADS
+} TraceThread_t;
+
+typedef enum TraceType_t {
+    TRACE_SEGMENT = 0, // * download: from a segment request to its reply (value: reply status)
+    TRACE_UPLOAD, // * upload: a request answered (value: reply status)
+    TRACE_ANNOUNCE, // * download: a message sent to the tracker (value: opcode, segment: records)
+    TRACE_DISPATCH, // * tracker: handling a client message (value: opcode)
+    TRACE_FILE_WRITTEN, // * writer: a finished output truncated and renamed into place
+    TRACE_TYPES
+} TraceType_t;
+
+// * Reply status of a segment request or an upload
+typedef enum TraceStatus_t {
+    TRACE_OK = 0,
+    TRACE_NOT_HELD,
+    TRACE_REFUSED,
+    TRACE_FAILED // * the reply did not verify, or never came
+} TraceStatus_t;
+
+typedef struct TraceEvent_t {
+    uint64_t start_ns;
+    uint64_t duration_ns; // * 0 for an instant event
+    int32_t type;
+    int32_t client_id;
+    int32_t file_id;
+    int32_t segment; // * segment index, or record count
+    int32_t peer_id; // * the other client
+    int32_t value;
+} TraceEvent_t;
+
+typedef struct TraceRing_t {
+    TraceEvent_t *events;
+    uint64_t head; // * events ever recorded; the newest sits at (head - 1) % TRACE_RING_EVENTS
+} TraceRing_t;
+
+typedef struct Tracer_t {
+    int ranks;
+    int rank;
+    TraceRing_t rings[TRACE_THREADS];
+    uint64_t origin_ns; // * CLOCK_MONOTONIC at origin_wtime
+    double origin_wtime; // * seconds from rank 0's startup to origin_ns, on rank 0's clock
+} Tracer_t;
+
+extern Tracer_t tracer;
+extern __thread TraceRing_t *trace_ring; // * the calling thread's ring (NULL = tracing off)
+
+// Records an event of the calling thread that started at start_ns and lasted until now
+// (instant: start_ns is now).
+static inline void trace_record(TraceType_t type, uint64_t start_ns, bool instant, int client_id, int file_id,
+                                int segment, int peer_id, int value) {
+    TraceRing_t *ring = trace_ring;
+    if (!ring)
+        return;
+
+    uint64_t now = counters_now_ns();
+    TraceEvent_t *event = &ring->events[ring->head % TRACE_RING_EVENTS];
+    event->start_ns = instant ? now : start_ns;
+    event->duration_ns = instant ? 0 : now - start_ns;
+    event->type = type;
+    event->client_id = client_id;
+    event->file_id = file_id;
+    event->segment = segment;
+    event->peer_id = peer_id;
+    event->value = value;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Start time of an event to record later; 0 (and no clock read) while tracing is off.
+static inline uint64_t trace_start(void) {
+    return trace_ring ? counters_now_ns() : 0;
+}
+
+TraceStatus_t trace_status(const char *status);
+
+void trace_init(int numtasks, int rank);
+
+void trace_attach(TraceThread_t thread);
+
+void trace_write(const char *path);
+
+void trace_free(void);
+
+#endif
@@ -1,11 +1,114 @@
 #include "tracker.h"
+#include "digest.h"
+#include "options.h"
+#include "snapshot.h"
+#include "comm.h"
+#include "topology.h"
+#include "dedup.h"
+#include "subscribe.h"
+#include "superseed.h"
+
+#include <limits.h>
+
+/**
+ * Sends a message to a logical client: to its rank, with its local id in the tag.
+ */
+int send_to_client(int client_id, int tag, const void* data, int size) {
+    counters_sent(tag, size);
+    return MPI_Send(data, size, MPI_BYTE, client_rank_of(client_id), COMM_WIRE_TAG(tag, client_local_of(client_id)),
+                    CONTROL_COMM);
+}
+
+/**
+ * Copies a swarm into ordered, closest members to the client first (same node, same rack,
+ * then the rest), keeping the swarm's order within each distance.
+ */
+static void order_by_locality(const int* swarm, int count, int client_id, int* ordered) {
+    int starts[TOPOLOGY_DISTANCES + 1] = {0};
+    int client_rank = client_rank_of(client_id);
+
+    for(int k = 0; k < count; ++k)
+        starts[topology_distance(client_rank, client_rank_of(swarm[k])) + 1]++;
+    for(int d = 0; d < TOPOLOGY_DISTANCES; ++d)
+        starts[d + 1] += starts[d];
+    for(int k = 0; k < count; ++k)
+        ordered[starts[topology_distance(client_rank, client_rank_of(swarm[k]))]++] = swarm[k];
+}
+
+// * What the swarm lists go by with --dedup: the contents every client holds, and the ones
+// * every file is made of (dedup_content_words() words each)
+typedef struct ContentView_t {
+    size_t words;
+    uint64_t* held; // * by client id - 1
+    uint64_t* files; // * by file id - 1
+} ContentView_t;
+
+static void build_content_view(const TrackerDataSet_t* m_tracker, ContentView_t* view) {
+    view->words = dedup_content_words(m_tracker);
+    view->held = (uint64_t*)calloc((size_t)m_tracker->client_count * view->words, sizeof(uint64_t));
+    view->files = (uint64_t*)calloc((size_t)m_tracker->swarm_size * view->words, sizeof(uint64_t));
+    if(!view->held || !view->files){
+        fprintf(stderr, "Memory allocation failed for the content view.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < m_tracker->client_count; ++i)
+        dedup_content_held(m_tracker, &m_tracker->data[i], &view->held[i * view->words]);
+    for(int i = 0; i < m_tracker->swarm_size; ++i){
+        const Swarm_t* swarm = &m_tracker->swarms[i];
+        for(uint32_t idx = 0; idx < swarm->segment_total && swarm->content; ++idx)
+            segment_bit_set(&view->files[i * view->words], swarm->content[idx]);
+    }
+}
+
+/**
+ * Collects into holders every client but the requester that holds some content of a file, in
+ * any of its files. Returns how many there are.
+ */
+static int content_holders(const TrackerDataSet_t* m_tracker, const ContentView_t* view, int file_id, int client_id,
+                           int* holders) {
+    const uint64_t* file = &view->files[(file_id - 1) * view->words];
+    int count = 0;
+    for(int i = 0; i < m_tracker->client_count; ++i){
+        if(i + 1 == client_id)
+            continue;
+        const uint64_t* held = &view->held[i * view->words];
+        for(size_t word = 0; word < view->words; ++word){
+            if(held[word] & file[word]){
+                holders[count++] = i + 1;
+                break;
+            }
+        }
+    }
+    return count;
+}
 
 /**
  * Sends the list of peers and seeders to all clients at startup.
+ * With --dedup, a file whose segment digests are known comes with them, and its list holds
+ * every client holding any of its contents, with what it holds mapped onto the file.
+ * Everything exchanged with clients is typed MPI_BYTE, since their side goes through the
+ * communication engine, which moves raw bytes.
  */
 void send_peers_to_clients(TrackerDataSet_t* m_tracker) {
     MPI_Status mpi_status;
     Swarm_t* swarms = m_tracker->swarms;
+    int* ordered_swarm = NULL;
+    ContentView_t view = {0};
+    int* holders = NULL;
+    if(options.dedup){
+        build_content_view(m_tracker, &view);
+        holders = (int*)malloc(sizeof(int) * MAX(m_tracker->client_count, 1));
+        if(!holders){
+            fprintf(stderr, "Memory allocation failed for content holders.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    // Super-seeders show each downloader its own slice of a file, one per downloader at most
+    int downloaders = 0;
+    for(int i = 0; i < m_tracker->client_count && options.super_seed; ++i)
+        downloaders += m_tracker->data[i].client_type != SEEDER;
 
     // Iterate through all clients
     for(int i = 0; i < m_tracker->client_count; ++i){
@@ -13,274 +116,556 @@ void send_peers_to_clients(TrackerDataSet_t* m_tracker) {
         if(m_tracker->data[i].client_type == SEEDER)
             continue;
 
-        Client_Type_t client_type;
-        // Receive the client type from any source
-        if(MPI_Recv(&client_type, 1, MPI_INT, MPI_ANY_SOURCE, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving client type.\n");
-            continue;
-        }
-
-        int client_rank = mpi_status.MPI_SOURCE;
-        m_tracker->data[client_rank - 1].client_type = client_type;
-
-        // Receive the number of files the client wants
-        size_t wanted_file_count;
-        if(MPI_Recv(&wanted_file_count, 1, MPI_UNSIGNED, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving wanted file count.\n");
-            continue;
-        }
-
-        // Allocate memory for the file IDs the client is interested in
-        int* files_id = (int*)malloc(wanted_file_count * sizeof(int));
-        if(!files_id){
-            fprintf(stderr, "Memory allocation failed for files_id.\n");
+        // Receive the client id, type and wanted files from any source
+        WantedFiles_t wanted;
+        uint64_t waiting_since = counters_now_ns();
+        if(MPI_Recv(&wanted, sizeof(wanted), MPI_BYTE, MPI_ANY_SOURCE, PEERS_SEEDERS_TRANSFER_TAG, CONTROL_COMM, &mpi_status) != MPI_SUCCESS){
+            fprintf(stderr, "MPI_Recv failed while receiving wanted files.\n");
             continue;
         }
+        counters_receive(COUNTER_SITE_TRACKER_WANTED, waiting_since);
+        counters_received(PEERS_SEEDERS_TRANSFER_TAG, sizeof(wanted));
 
-        // Receive the actual file IDs
-        if(MPI_Recv(files_id, wanted_file_count, MPI_INT, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD, &mpi_status) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving file IDs.\n");
-            free(files_id);
+        int client_id = wanted.client_id;
+        if(client_id <= 0 || client_id > m_tracker->client_count || client_rank_of(client_id) != mpi_status.MPI_SOURCE){
+            fprintf(stderr, "Wanted files from unknown client %d (rank %d).\n", client_id, mpi_status.MPI_SOURCE);
             continue;
         }
+        TrackerData_t* client_data = &m_tracker->data[client_id - 1];
+        client_data->client_type = (Client_Type_t)wanted.client_type;
+        client_data->wanted_count = MIN(wanted.count, MAX_FILES);
+        memcpy(client_data->wanted_files, wanted.file_ids, sizeof(wanted.file_ids));
+        if(options.subscribe && (wanted.flags & WANTED_SUBSCRIBE))
+            subscribe_add(m_tracker, client_id);
 
         // For each wanted file, send the relevant swarm information
-        for(size_t j = 0; j < wanted_file_count; ++j){
-            int wanted_swarm_id = files_id[j];
+        for(unsigned int j = 0; j < wanted.count && j < MAX_FILES; ++j){
+            int wanted_swarm_id = wanted.file_ids[j];
 
             // Validate the swarm ID
             if(wanted_swarm_id <= 0 || wanted_swarm_id > m_tracker->swarm_size){
-                fprintf(stderr, "Invalid Swarm_t ID %d for client %d.\n", wanted_swarm_id, client_rank);
+                fprintf(stderr, "Invalid Swarm_t ID %d for client %d.\n", wanted_swarm_id, client_id);
                 continue;
             }
 
             Swarm_t* current_swarm = &swarms[wanted_swarm_id - 1];
+            bool by_content = options.dedup && current_swarm->content;
+            const int* members = current_swarm->clients_in_swarm;
             int in_swarm_count = current_swarm->clients_in_swarm_count;
-            int* file_swarm = current_swarm->clients_in_swarm;
-
-            // Send the number of clients in the swarm
-            if(MPI_Send(&in_swarm_count, 1, MPI_INT, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD) != MPI_SUCCESS ||
-               MPI_Send(file_swarm, in_swarm_count, MPI_INT, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD) != MPI_SUCCESS){
-                fprintf(stderr, "MPI_Send failed while sending Swarm_t info for Swarm_t ID %d to client %d.\n", wanted_swarm_id, client_rank);
+            if(by_content){
+                in_swarm_count = content_holders(m_tracker, &view, wanted_swarm_id, client_id, holders);
+                members = holders;
+            }
+            int* file_swarm = realloc(ordered_swarm, sizeof(int) * MAX(in_swarm_count, 1));
+            if(!file_swarm){
+                fprintf(stderr, "Memory allocation failed while ordering Swarm_t ID %d.\n", wanted_swarm_id);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            ordered_swarm = file_swarm;
+            order_by_locality(members, in_swarm_count, client_id, file_swarm);
+
+            // Send the number of clients in the swarm, the swarm version and the file's identity
+            // (with its segment digests, by content)
+            SwarmHeader_t swarm_header = {
+                .member_count = in_swarm_count,
+                .version = current_swarm->version,
+                .segment_total = current_swarm->segment_total,
+                .leaves = by_content,
+                .root = current_swarm->root
+            };
+            if(send_to_client(client_id, PEERS_SEEDERS_TRANSFER_TAG, &swarm_header, sizeof(swarm_header)) != MPI_SUCCESS ||
+               (by_content && send_to_client(client_id, PEERS_SEEDERS_TRANSFER_TAG, current_swarm->leaves,
+                                             current_swarm->segment_total * sizeof(Digest_t)) != MPI_SUCCESS) ||
+               send_to_client(client_id, PEERS_SEEDERS_TRANSFER_TAG, file_swarm, in_swarm_count * sizeof(int)) != MPI_SUCCESS){
+                fprintf(stderr, "MPI_Send failed while sending Swarm_t info for Swarm_t ID %d to client %d.\n", wanted_swarm_id, client_id);
                 continue;
             }
 
             // Send segment information for each client in the swarm
             for(int k = 0; k < in_swarm_count; ++k){
-                int peer_rank = file_swarm[k];
-                TrackerData_t* peer_data = &m_tracker->data[peer_rank - 1];
-
-                // Find the file data corresponding to the wanted swarm ID
-                FileData_t* peer_file = find_file_data(peer_data->files, peer_data->files_count, wanted_swarm_id);
+                int peer_id = file_swarm[k];
+                TrackerData_t* peer_data = &m_tracker->data[peer_id - 1];
+
+                // Find the file data corresponding to the wanted swarm ID; by content, what the
+                // peer holds of the file's contents, in any file
+                TrackerFile_t by_content_file = {.file_id = wanted_swarm_id};
+                TrackerFile_t* peer_file = &by_content_file;
+                if(by_content)
+                    by_content_file.segment_count = dedup_have(current_swarm, &view.held[(peer_id - 1) * view.words],
+                                                               by_content_file.have);
+                else
+                    peer_file = tracker_find_file(peer_data, wanted_swarm_id);
                 if(!peer_file){
-                    fprintf(stderr, "Peer %d does not have file ID %d.\n", peer_rank, wanted_swarm_id);
+                    fprintf(stderr, "Peer %d does not have file ID %d.\n", peer_id, wanted_swarm_id);
                     continue;
                 }
 
-                // Send the number of segments and the peer's rank
-                if(MPI_Send(&peer_file->segment_count, 1, MPI_UNSIGNED, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD) != MPI_SUCCESS ||
-                   MPI_Send(&peer_rank, 1, MPI_INT, client_rank, PEERS_SEEDERS_TRANSFER_TAG, MPI_COMM_WORLD) != MPI_SUCCESS){
-                    fprintf(stderr, "MPI_Send failed while sending segment count and rank for peer %d.\n", peer_rank);
+                // Send the number of segments and the peer's id
+                unsigned int segment_count = (unsigned int)peer_file->segment_count;
+                if(send_to_client(client_id, PEERS_SEEDERS_TRANSFER_TAG, &segment_count, sizeof(segment_count)) != MPI_SUCCESS ||
+                   send_to_client(client_id, PEERS_SEEDERS_TRANSFER_TAG, &peer_id, sizeof(peer_id)) != MPI_SUCCESS){
+                    fprintf(stderr, "MPI_Send failed while sending segment count and id for peer %d.\n", peer_id);
                     continue;
                 }
 
-                // Send each segment's hash
-                for(int l = 0; l < peer_file->segment_count; ++l){
-                    if(MPI_Send(peer_file->segments[l].hash, HASH_SIZE, MPI_CHAR, client_rank, HASH_TAG, MPI_COMM_WORLD) != MPI_SUCCESS){
-                        fprintf(stderr, "MPI_Send failed while sending segment hash for peer %d.\n", peer_rank);
-                    }
+                // Send the bitfield saying which segments of the file the peer holds; the digests
+                // come from the peers, proven against the root. With --super-seed, the segments an
+                // initial seeder withholds from this client follow
+                if(!options.super_seed){
+                    if(send_to_client(client_id, HASH_TAG, peer_file->have, sizeof(peer_file->have)) != MPI_SUCCESS)
+                        fprintf(stderr, "MPI_Send failed while sending segment bitfield for peer %d.\n", peer_id);
+                    continue;
+                }
+                uint64_t advertised[SEGMENT_WORDS];
+                uint64_t withheld[SEGMENT_WORDS];
+                int slices = peer_data->client_type == SEEDER && !by_content ?
+                             MIN(downloaders, (int)current_swarm->segment_total) : 1;
+                superseed_slice(peer_file->have, current_swarm->segment_total, client_id % MAX(slices, 1), slices,
+                                advertised, withheld);
+                if(send_to_client(client_id, HASH_TAG, advertised, sizeof(advertised)) != MPI_SUCCESS ||
+                   send_to_client(client_id, HASH_TAG, withheld, sizeof(withheld)) != MPI_SUCCESS){
+                    fprintf(stderr, "MPI_Send failed while sending segment bitfield for peer %d.\n", peer_id);
                 }
             }
         }
+    }
+    free(ordered_swarm);
+    free(holders);
+    free(view.held);
+    free(view.files);
+}
+
+/**
+ * Appends a client to the swarm of a file.
+ */
+static void add_swarm_member(TrackerDataSet_t* m_tracker, int file_id, int client_id){
+    Swarm_t* swarm = &m_tracker->swarms[file_id - 1];
+    int* members = (int*)realloc(swarm->clients_in_swarm, (swarm->clients_in_swarm_count + 1) * sizeof(int));
+    if(!members){
+        fprintf(stderr, "Realloc failed for Swarm_t %d.\n", file_id);
+        return;
+    }
+    swarm->clients_in_swarm = members;
+    swarm->clients_in_swarm[swarm->clients_in_swarm_count++] = client_id;
+}
+
+/**
+ * Records the segments a client announced: joins the client to the swarm of every file it did
+ * not hold yet, marks the segments held and bumps the swarms' versions.
+ */
+void apply_segment_records(TrackerDataSet_t* m_tracker, int client_id, const SegmentRecord_t* records, int record_count){
+    for(int i = 0; i < record_count; ++i){
+        int file_id = records[i].file_id;
+        size_t segment_idx = records[i].segment_idx;
+
+        if(file_id <= 0 || file_id > m_tracker->swarm_size || segment_idx >= m_tracker->swarms[file_id - 1].segment_total){
+            fprintf(stderr, "Invalid segment record (file %d, segment %zu) from client %d.\n", file_id, segment_idx, client_id);
+            continue;
+        }
+
+        // Check if the client already has the file; if not, add it and join the file's swarm
+        // (only a new file changes swarm membership, so no swarm is rebuilt)
+        if(!tracker_client_has_file(m_tracker, file_id, client_id - 1)){
+            tracker_add_file_to_owned(m_tracker, file_id, client_id - 1);
+            add_swarm_member(m_tracker, file_id, client_id);
+        }
+
+        // Retrieve the file data for the client
+        TrackerFile_t* client_file_data = tracker_find_file(&m_tracker->data[client_id - 1], file_id);
+        if(!client_file_data){
+            fprintf(stderr, "File ID %d not found for client %d after adding.\n", file_id, client_id);
+            continue;
+        }
+
+        // Mark the segment held; re-announcing a held segment is harmless
+        segment_bit_set(client_file_data->have, segment_idx);
+        client_file_data->segment_count = MAX(client_file_data->segment_count, segment_idx + 1);
 
-        // Free the allocated memory for file IDs
-        free(files_id);
+        m_tracker->swarms[file_id - 1].version++;
     }
 }
 
 /**
  * Updates the tracker Swarm_t information based on client messages.
+ * The announce is one message of SegmentRecord_t entries (file id, segment index),
+ * so a single DOWN_10, DOWN_X or RESTORED batch may cover several files. It is the next
+ * INFORM_TAG message from the rank hosting the client.
  */
-void update_tracker_swarm(TrackerDataSet_t* m_tracker, int rank, char* buff){
-    int file_id = 0;
-    // Receive the file ID from the client
-    if(MPI_Recv(&file_id, 1, MPI_INT, rank, INFORM_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-        fprintf(stderr, "MPI_Recv failed while receiving file ID from client %d.\n", rank);
+void update_tracker_swarm(TrackerDataSet_t* m_tracker, int client_id, int source_rank, char* buff){
+    SegmentRecord_t records[MAX_FILES * MAX_CHUNKS];
+    MPI_Status mpi_status;
+    int received_bytes = 0;
+
+    // Receive the announced segments in one message
+    uint64_t waiting_since = counters_now_ns();
+    if(MPI_Recv(records, sizeof(records), MPI_BYTE, source_rank, INFORM_TAG, CONTROL_COMM, &mpi_status) != MPI_SUCCESS){
+        fprintf(stderr, "MPI_Recv failed while receiving segment records from client %d.\n", client_id);
         return;
     }
+    MPI_Get_count(&mpi_status, MPI_BYTE, &received_bytes);
+    counters_receive(COUNTER_SITE_TRACKER_RECORDS, waiting_since);
+    counters_received(INFORM_TAG, received_bytes);
+
+    int record_count = received_bytes / (int)sizeof(SegmentRecord_t);
+    apply_segment_records(m_tracker, client_id, records, record_count);
+
+    // Mark the client's new availability for the subscribers of the files
+    if(options.subscribe)
+        subscribe_note(m_tracker, client_id, records, record_count);
+}
+
+/**
+ * Sets the number of swarms, keeping the versions of the swarms that already exist
+ * (e.g., the ones loaded from a snapshot).
+ */
+static void resize_swarms(TrackerDataSet_t* m_tracker, int swarm_size) {
+    if(swarm_size == m_tracker->swarm_size && (m_tracker->swarms || swarm_size == 0))
+        return;
 
-    // Check if the client already has the file; if not, add it
-    if(!tracker_client_has_file(m_tracker, file_id, rank - 1))
-        tracker_add_file_to_owned(m_tracker, file_id, rank - 1);
+    for(int i = swarm_size; i < m_tracker->swarm_size; ++i){
+        free(m_tracker->swarms[i].clients_in_swarm);
+        free(m_tracker->swarms[i].leaves);
+        free(m_tracker->swarms[i].content);
+    }
 
-    // Retrieve the file data for the client
-    FileData_t* client_file_data = find_file_data(m_tracker->data[rank - 1].files,
-                                                  m_tracker->data[rank - 1].files_count,
-                                                  file_id);
-    if(!client_file_data){
-        fprintf(stderr, "File ID %d not found for client %d after adding.\n", file_id, rank);
+    if(swarm_size == 0){
+        free(m_tracker->swarms);
+        m_tracker->swarms = NULL;
+        m_tracker->swarm_size = 0;
         return;
     }
 
-    // Receive 10 segment hashes from the client
-    for(size_t i = 0; i < 10; ++i){
-        if(MPI_Recv(buff, BUFF_SIZE, MPI_CHAR, rank, INFORM_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving segment hash from client %d.\n", rank);
+    Swarm_t* swarms = (Swarm_t*)realloc(m_tracker->swarms, sizeof(Swarm_t) * swarm_size);
+    if(!swarms){
+        fprintf(stderr, "Memory allocation failed for swarms.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    int old_size = m_tracker->swarms ? m_tracker->swarm_size : 0;
+    if(swarm_size > old_size)
+        memset(&swarms[old_size], 0, sizeof(Swarm_t) * (swarm_size - old_size));
+
+    m_tracker->swarms = swarms;
+    m_tracker->swarm_size = swarm_size;
+}
+
+/**
+ * Takes a registered file as the identity of its swarm, or checks it against the root the swarm
+ * already has (a swarm is one file: a different root is another file under the same id).
+ * Returns false if the file does not belong to the swarm.
+ */
+static bool claim_file(TrackerDataSet_t* m_tracker, const RegisteredFile_t* entry){
+    if(entry->file_id <= 0 || entry->segment_count == 0)
+        return false;
+    if(entry->file_id > m_tracker->swarm_size)
+        resize_swarms(m_tracker, entry->file_id);
+
+    Swarm_t* swarm = &m_tracker->swarms[entry->file_id - 1];
+    if(swarm->segment_total == 0){
+        swarm->segment_total = entry->segment_count;
+        swarm->root = entry->root;
+        return true;
+    }
+    return swarm->segment_total == entry->segment_count && digest_equal(&swarm->root, &entry->root);
+}
+
+/**
+ * Compares the files a client holds with what the snapshot has of it. Returns the held files the
+ * tracker keeps as they are (HELD_FILES_ALL if nothing changed), and shrinks the header to the
+ * owned files the client still sends.
+ */
+static uint32_t keep_snapshot_files(const TrackerDataSet_t* m_tracker, TrackerData_t* client_data,
+                                    RegistrationHeader_t* header, const HeldFiles_t* held){
+    if(client_data->fingerprint == header->fingerprint){
+        header->files_count = 0;
+        header->packed_size = 0;
+        return HELD_FILES_ALL;
+    }
+
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < held->count && i < HELD_FILES_MAX; ++i){
+        const HeldFile_t* file = &held->files[i];
+        const TrackerFile_t* known = tracker_find_file(client_data, file->file_id);
+        if(!known || tracker_file_fingerprint(m_tracker, known) != file->fingerprint)
             continue;
+
+        // A kept owned file is left out of the client's packed files
+        if(file->packed_size > 0){
+            if(header->files_count == 0 || file->packed_size > header->packed_size)
+                continue;
+            header->files_count--;
+            header->packed_size -= file->packed_size;
         }
-        // Copy the received hash into the client's file data
-        strncpy(client_file_data->segments[client_file_data->segment_count].hash, buff, HASH_SIZE - 1);
-        client_file_data->segments[client_file_data->segment_count].hash[HASH_SIZE - 1] = '\0'; // Ensure null-termination
-        ++client_file_data->segment_count;
+        kept |= 1u << i;
     }
+    return kept;
+}
 
-    // Update the swarm information based on the new segments
-    // The second parameter seems to indicate the total number of clients plus one
-    create_file_swarms(m_tracker, m_tracker->client_count + 1);
+// Drops the files the snapshot had of a client that are not among the held files kept.
+static void drop_stale_files(TrackerData_t* client_data, const HeldFiles_t* held, uint32_t kept){
+    size_t count = 0;
+    for(size_t j = 0; j < client_data->files_count; ++j){
+        bool keep = false;
+        for(uint32_t i = 0; kept && i < held->count && !keep; ++i)
+            keep = held_file_kept(kept, i) && held->files[i].file_id == client_data->files[j].file_id;
+        if(keep)
+            client_data->files[count++] = client_data->files[j];
+    }
+    client_data->files_count = count;
+}
+
+/**
+ * Unpacks the owned files a client registered with into its tracker entry, after the files it
+ * already has: the tracker keeps which segments the client holds, and the file's root once per
+ * swarm. Returns false if the buffer does not hold what the header announced.
+ */
+static bool unpack_registration(TrackerDataSet_t* m_tracker, TrackerData_t* client_data, const RegistrationHeader_t* header,
+                                const uint8_t* packed) {
+    if(header->files_count == 0)
+        return true;
+
+    TrackerFile_t* files = (TrackerFile_t*)realloc(client_data->files,
+                                                   sizeof(TrackerFile_t) * (client_data->files_count + header->files_count));
+    if(!files){
+        fprintf(stderr, "Memory allocation failed for client %d's files.\n", client_data->client_id);
+        return false;
+    }
+    client_data->files = files;
+
+    const uint8_t* cursor = packed;
+    const uint8_t* end = packed + header->packed_size;
+    for(uint32_t j = 0; j < header->files_count; ++j){
+        RegisteredFile_t entry;
+        if(cursor + sizeof(entry) > end)
+            return false;
+        memcpy(&entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+
+        if(entry.segment_count > MAX_CHUNKS)
+            return false;
+
+        // With --dedup the segment digests follow
+        const Digest_t* leaves = (const Digest_t*)cursor;
+        if(options.dedup){
+            if(cursor + sizeof(Digest_t) * entry.segment_count > end)
+                return false;
+            cursor += sizeof(Digest_t) * entry.segment_count;
+        }
+
+        if(!claim_file(m_tracker, &entry)){
+            fprintf(stderr, "Client %d registered a file%d that is not the swarm's; ignoring it.\n",
+                    client_data->client_id, entry.file_id);
+            continue;
+        }
+        if(options.dedup){
+            if(!dedup_take_leaves(&m_tracker->swarms[entry.file_id - 1], leaves, entry.segment_count)){
+                fprintf(stderr, "Client %d registered segment digests that are not file%d's; ignoring them.\n",
+                        client_data->client_id, entry.file_id);
+            }
+        }
+
+        TrackerFile_t* file = &client_data->files[client_data->files_count++];
+        memset(file, 0, sizeof(*file));
+        file->file_id = entry.file_id;
+        file->segment_count = entry.segment_count;
+        segment_bits_fill(file->have, entry.segment_count);
+    }
+    return true;
 }
 
 /**
  * Receives data from all clients and initializes the tracker state.
+ * Registration takes three collectives: a gather of the fixed-size headers (one per logical
+ * client, clients_per_rank per rank), a gather of the packed owned files (sized from the
+ * headers) and a broadcast of the final "OK".
  */
 void receive_data_from_clients(TrackerDataSet_t* m_tracker, int numtasks) {
-    m_tracker->client_count = numtasks - 1;
+    double start_time = MPI_Wtime();
+    int per_rank = options.clients_per_rank;
+
+    m_tracker->client_count = per_rank * (numtasks - 1);
     // Allocate memory for tracker data based on the number of clients
-    m_tracker->data = (TrackerData_t*)malloc(sizeof(TrackerData_t) * m_tracker->client_count);
-    if(!m_tracker->data){
+    m_tracker->data = (TrackerData_t*)calloc(m_tracker->client_count, sizeof(TrackerData_t));
+    // Headers and known flags are laid out per rank: rank r, local l at r * per_rank + l
+    RegistrationHeader_t* headers = (RegistrationHeader_t*)calloc((size_t)numtasks * per_rank, sizeof(RegistrationHeader_t));
+    HeldFiles_t* held = (HeldFiles_t*)calloc(options.snapshot_path ? (size_t)numtasks * per_rank : 1, sizeof(HeldFiles_t));
+    uint32_t* kept = (uint32_t*)calloc((size_t)numtasks * per_rank, sizeof(uint32_t));
+    int* counts = (int*)calloc(numtasks, sizeof(int));
+    int* displs = (int*)calloc(numtasks, sizeof(int));
+    if(!m_tracker->data || !headers || !held || !kept || !counts || !displs){
         fprintf(stderr, "Memory allocation failed for tracker data.\n");
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
 
-    int max_file_id = 0; // To determine the number of swarms
+    // A restarted tracker starts from its last snapshot and only takes the files that changed
+    bool from_snapshot = options.snapshot_path && snapshot_load(m_tracker, options.snapshot_path);
+    int known_clients = 0;
+    int kept_files = 0;
 
-    // Iterate through each client to receive their data
-    for(int rank = 1; rank < numtasks; ++rank) {
-        int owned_files_count;
+    // Gather every client's header (the tracker contributes empty ones)
+    if(MPI_Gather(MPI_IN_PLACE, per_rank * sizeof(RegistrationHeader_t), MPI_BYTE, headers, per_rank * sizeof(RegistrationHeader_t),
+                  MPI_BYTE, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS){
+        fprintf(stderr, "MPI_Gather failed while receiving registration headers.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
 
-        // Receive the number of files owned by the client
-        if(MPI_Recv(&owned_files_count, 1, MPI_INT, rank, HASH_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving owned file count from client %d.\n", rank);
-            owned_files_count = 0; // Assume no files on failure
+    // Clients the snapshot already knows exactly send no files; the others leave out the owned
+    // files the snapshot holds as they are
+    if(options.snapshot_path){
+        if(MPI_Gather(MPI_IN_PLACE, per_rank * sizeof(HeldFiles_t), MPI_BYTE, held, per_rank * sizeof(HeldFiles_t),
+                      MPI_BYTE, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS){
+            fprintf(stderr, "MPI_Gather failed while receiving held files.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
         }
-        m_tracker->data[rank - 1].files_count = owned_files_count;
-        m_tracker->data[rank - 1].rank = rank;
-
-        // Receive the client type (seeder or leecher)
-        if(MPI_Recv(&m_tracker->data[rank-1].client_type, 1, MPI_INT, rank, CLIENT_TYPE_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Recv failed while receiving client type from client %d.\n", rank);
-            m_tracker->data[rank - 1].client_type = LEECHER; // Default to LEECHER on failure
+    }
+    for(int client_id = 1; client_id <= m_tracker->client_count && from_snapshot; ++client_id){
+        int slot = client_rank_of(client_id) * per_rank + client_local_of(client_id);
+        kept[slot] = keep_snapshot_files(m_tracker, &m_tracker->data[client_id - 1], &headers[slot], &held[slot]);
+        if(kept[slot] == HELD_FILES_ALL)
+            known_clients++;
+        else
+            kept_files += __builtin_popcount(kept[slot]);
+    }
+    if(options.snapshot_path){
+        if(MPI_Scatter(kept, per_rank, MPI_UINT32_T, MPI_IN_PLACE, per_rank, MPI_UINT32_T, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS){
+            fprintf(stderr, "MPI_Scatter failed while answering registrations.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
         }
+    }
 
-        // If the client owns no files, skip to the next client
-        if(owned_files_count == 0){
-            m_tracker->data[rank - 1].files = NULL;
-            continue;
+    // Lay the packed files out back to back (each rank's clients in local id order) and
+    // gather them in one go
+    size_t total_size = 0;
+    for(int rank = 1; rank < numtasks; ++rank){
+        size_t rank_size = 0;
+        for(int local = 0; local < per_rank; ++local){
+            int slot = rank * per_rank + local;
+            rank_size += headers[slot].packed_size;
         }
-
-        // Allocate memory for the client's files
-        m_tracker->data[rank - 1].files = (FileData_t*)malloc(sizeof(FileData_t) * owned_files_count);
-        if(!m_tracker->data[rank - 1].files){
-            fprintf(stderr, "Memory allocation failed for client %d's files.\n", rank);
-            m_tracker->data[rank - 1].files_count = 0;
-            continue;
+        if(rank_size > INT_MAX){
+            fprintf(stderr, "Registration of rank %d (%zu bytes) does not fit a single gather.\n", rank, rank_size);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
         }
+        counts[rank] = (int)rank_size;
+        displs[rank] = (int)total_size;
+        total_size += rank_size;
+    }
+    if(total_size > INT_MAX){
+        fprintf(stderr, "Registration of %zu bytes does not fit a single gather.\n", total_size);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
 
-        // Receive each file's data from the client
-        for(int j = 0; j < owned_files_count; ++j) {
-            FileData_t temp_file;
-            memset(&temp_file, 0, sizeof(FileData_t));
-
-            // Receive the file name
-            if(MPI_Recv(temp_file.file_name, MAX_FILENAME, MPI_CHAR, rank, HASH_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-                fprintf(stderr, "MPI_Recv failed while receiving file name from client %d.\n", rank);
-                continue;
-            }
-            // Copy the file name to the tracker's data
-            strncpy(m_tracker->data[rank - 1].files[j].file_name, temp_file.file_name, MAX_FILENAME - 1);
-            m_tracker->data[rank - 1].files[j].file_name[MAX_FILENAME - 1] = '\0'; // Ensure null-termination
-
-            // Extract and set the file ID based on the file name's last character
-            m_tracker->data[rank - 1].files[j].file_id = atoi(&temp_file.file_name[strlen(temp_file.file_name) - 1]);
-
-            char* file_digit = &temp_file.file_name[strlen(temp_file.file_name) - 1];
-            max_file_id = MAX(max_file_id, atoi(file_digit));
+    uint8_t* packed = (uint8_t*)malloc(total_size ? total_size : 1);
+    if(!packed){
+        fprintf(stderr, "Memory allocation failed for registration buffer.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    if(MPI_Gatherv(MPI_IN_PLACE, 0, MPI_BYTE, packed, counts, displs, MPI_BYTE, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS){
+        fprintf(stderr, "MPI_Gatherv failed while receiving owned files.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
 
-            // Receive the number of segments for this file
-            if(MPI_Recv(&temp_file.segment_count, 1, MPI_UNSIGNED, rank, HASH_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-                fprintf(stderr, "MPI_Recv failed while receiving segment count from client %d.\n", rank);
-                m_tracker->data[rank - 1].files[j].segment_count = 0;
-                continue;
-            }
-            m_tracker->data[rank - 1].files[j].segment_count = temp_file.segment_count;
+    int max_file_id = 0; // To determine the number of swarms
 
-            // Receive each segment's hash
-            for(int k = 0; k < temp_file.segment_count; ++k) {
-                if(MPI_Recv(m_tracker->data[rank - 1].files[j].segments[k].hash, HASH_SIZE, MPI_CHAR, rank, HASH_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS){
-                    fprintf(stderr, "MPI_Recv failed while receiving segment hash from client %d.\n", rank);
-                    strcpy(m_tracker->data[rank - 1].files[j].segments[k].hash, ""); // Set to empty on failure
+    for(int rank = 1; rank < numtasks; ++rank){
+        const uint8_t* cursor = packed + displs[rank];
+
+        for(int local = 0; local < per_rank; ++local){
+            int slot = rank * per_rank + local;
+            int client_id = client_id_of(rank, local);
+            TrackerData_t* client_data = &m_tracker->data[client_id - 1];
+            client_data->client_id = client_id;
+            client_data->client_type = (Client_Type_t)headers[slot].client_type;
+
+            if(kept[slot] != HELD_FILES_ALL){
+                // Anything else the snapshot had for this client is stale
+                if(from_snapshot)
+                    drop_stale_files(client_data, &held[slot], kept[slot]);
+                if(!unpack_registration(m_tracker, client_data, &headers[slot], cursor)){
+                    fprintf(stderr, "Malformed registration from client %d; keeping %zu files.\n", client_id, client_data->files_count);
                 }
+                cursor += headers[slot].packed_size;
             }
+
+            for(size_t j = 0; j < client_data->files_count; ++j)
+                max_file_id = MAX(max_file_id, client_data->files[j].file_id);
         }
     }
 
-    // After receiving all clients' data, create swarms based on the maximum file ID
-    m_tracker->swarm_size = max_file_id;
-    if(m_tracker->swarm_size == 0){
-        m_tracker->swarms = NULL;
-        return;
+    free(packed);
+    free(displs);
+    free(counts);
+    free(kept);
+    free(held);
+    free(headers);
+
+    if(from_snapshot){
+        printf("Tracker restored from snapshot: %d of %d clients unchanged, %d files of the others kept.\n",
+               known_clients, m_tracker->client_count, kept_files);
     }
 
-    create_file_swarms(m_tracker, numtasks);
+    // After receiving all clients' data, create swarms based on the maximum file ID
+    resize_swarms(m_tracker, max_file_id);
+    if(m_tracker->swarm_size > 0){
+        create_file_swarms(m_tracker);
+        if(options.dedup)
+            dedup_index(m_tracker);
+        if(options.snapshot_path)
+            snapshot_write(m_tracker, options.snapshot_path);
+    }
 
     // Notify all clients that the tracker has successfully initialized
-    for(int rank = 1; rank < numtasks; ++rank){
-        if(MPI_Send("OK", 2, MPI_CHAR, rank, ACK_TAG, MPI_COMM_WORLD) != MPI_SUCCESS){
-            fprintf(stderr, "MPI_Send failed while sending OK to client %d.\n", rank);
-        }
+    char ack[3] = "OK";
+    if(MPI_Bcast(ack, 2, MPI_CHAR, TRACKER_RANK, CONTROL_COMM) != MPI_SUCCESS){
+        fprintf(stderr, "MPI_Bcast failed while sending OK to clients.\n");
     }
+
+    printf("Registered %d clients in %.3f ms.\n", m_tracker->client_count, (MPI_Wtime() - start_time) * 1000.0);
 }
 
 /**
  * Creates swarms for each file based on the tracker data.
  */
-void create_file_swarms(TrackerDataSet_t* m_tracker, int numtasks) {
-    // Allocate memory for all swarms based on the swarm size
-    m_tracker->swarms = (Swarm_t*)malloc(sizeof(Swarm_t) * m_tracker->swarm_size);
+void create_file_swarms(TrackerDataSet_t* m_tracker) {
+    // Allocate memory for all swarms on the first call; later calls rebuild the member lists in place
     if(!m_tracker->swarms){
-        fprintf(stderr, "Memory allocation failed for swarms.\n");
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        m_tracker->swarms = (Swarm_t*)calloc(m_tracker->swarm_size, sizeof(Swarm_t));
+        if(!m_tracker->swarms){
+            fprintf(stderr, "Memory allocation failed for swarms.\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
     }
 
-    // Initialize each swarm with the corresponding file name
+    // Initialize each swarm with the corresponding file name, keeping its version
     for(int i = 0; i < m_tracker->swarm_size; ++i) {
         snprintf(m_tracker->swarms[i].file_name, MAX_FILENAME, "file%d", i + 1);
+        free(m_tracker->swarms[i].clients_in_swarm);
         m_tracker->swarms[i].clients_in_swarm = NULL;
         m_tracker->swarms[i].clients_in_swarm_count = 0;
     }
 
-    // Populate each swarm with the ranks of clients that own the file
-    for(int rank = 1; rank < numtasks; ++rank) {
-        TrackerData_t* client_data = &m_tracker->data[rank - 1];
+    // Populate each swarm with the ids of clients that own the file
+    for(int client_id = 1; client_id <= m_tracker->client_count; ++client_id) {
+        TrackerData_t* client_data = &m_tracker->data[client_id - 1];
 
         for (int i = 0; i < client_data->files_count; ++i) {
             int file_id = client_data->files[i].file_id;
             // Validate the file ID
             if(file_id <= 0 || file_id > m_tracker->swarm_size){
-                fprintf(stderr, "Invalid file ID %d for client %d.\n", file_id, rank);
+                fprintf(stderr, "Invalid file ID %d for client %d.\n", file_id, client_id);
                 continue;
             }
 
             Swarm_t* current_swarm = &m_tracker->swarms[file_id - 1];
             int* swarm_count = &current_swarm->clients_in_swarm_count;
 
-            // Allocate or reallocate memory to store client ranks in the swarm
+            // Allocate or reallocate memory to store client ids in the swarm
             if(current_swarm->clients_in_swarm == NULL){
                 current_swarm->clients_in_swarm = (int*)malloc(sizeof(int));
                 if(!current_swarm->clients_in_swarm){
                     fprintf(stderr, "Memory allocation failed for Swarm_t %d.\n", file_id);
                     continue;
                 }
-                current_swarm->clients_in_swarm[0] = rank;
+                current_swarm->clients_in_swarm[0] = client_id;
                 (*swarm_count) = 1;
             }
             else{
@@ -290,7 +675,7 @@ void create_file_swarms(TrackerDataSet_t* m_tracker, int numtasks) {
                     continue;
                 }
                 current_swarm->clients_in_swarm = temp;
-                current_swarm->clients_in_swarm[*swarm_count] = rank;
+                current_swarm->clients_in_swarm[*swarm_count] = client_id;
                 (*swarm_count)++;
             }
         }
@@ -298,20 +683,21 @@ void create_file_swarms(TrackerDataSet_t* m_tracker, int numtasks) {
 }
 
 /**
- * Checks if a client already has a specific file.
+ * Finds what the tracker knows a client holds of a file, or NULL if it holds nothing of it.
  */
-bool tracker_client_has_file(TrackerDataSet_t* m_tracker, int file_id, int rank_index){
-    // If the client has no files, return false
-    if(m_tracker->data[rank_index].files_count == 0)
-        return false;
-
-    // Iterate through the client's files to check for the file ID
-    for(int i = 0; i < m_tracker->data[rank_index].files_count; ++i){
-        if(m_tracker->data[rank_index].files[i].file_id == file_id)
-            return true;
+TrackerFile_t* tracker_find_file(TrackerData_t* client_data, int file_id){
+    for(size_t i = 0; i < client_data->files_count; ++i){
+        if(client_data->files[i].file_id == file_id)
+            return &client_data->files[i];
     }
+    return NULL;
+}
 
-    return false;
+/**
+ * Checks if a client already has a specific file.
+ */
+bool tracker_client_has_file(TrackerDataSet_t* m_tracker, int file_id, int rank_index){
+    return tracker_find_file(&m_tracker->data[rank_index], file_id) != NULL;
 }
 
 /**
@@ -321,21 +707,11 @@ void tracker_add_file_to_owned(TrackerDataSet_t* m_tracker, int file_id, int ran
     // Calculate the new file count after adding the file
     size_t new_files_count = m_tracker->data[rank_index].files_count + 1;
 
-    FileData_t* updated_files = NULL;
     // Allocate or reallocate memory for the client's files
-    if(m_tracker->data[rank_index].files == NULL){
-        updated_files = (FileData_t*)malloc(sizeof(FileData_t) * new_files_count);
-        if(!updated_files){
-            fprintf(stderr, "Memory allocation failed while adding file to client %d.\n", m_tracker->data[rank_index].rank);
-            return;
-        }
-    }
-    else{
-        updated_files = (FileData_t*)realloc(m_tracker->data[rank_index].files, sizeof(FileData_t) * new_files_count);
-        if(!updated_files){
-            fprintf(stderr, "Realloc failed while adding file to client %d.\n", m_tracker->data[rank_index].rank);
-            return;
-        }
+    TrackerFile_t* updated_files = (TrackerFile_t*)realloc(m_tracker->data[rank_index].files, sizeof(TrackerFile_t) * new_files_count);
+    if(!updated_files){
+        fprintf(stderr, "Realloc failed while adding file to client %d.\n", m_tracker->data[rank_index].client_id);
+        return;
     }
 
     // Update the tracker with the new file array and count
@@ -343,11 +719,93 @@ void tracker_add_file_to_owned(TrackerDataSet_t* m_tracker, int file_id, int ran
     m_tracker->data[rank_index].files_count = new_files_count;
 
     // Initialize the new file's data
-    FileData_t* new_file = &m_tracker->data[rank_index].files[new_files_count - 1];
-    memset(new_file, 0, sizeof(FileData_t));
-    snprintf(new_file->file_name, MAX_FILENAME, "file%d", file_id);
+    TrackerFile_t* new_file = &m_tracker->data[rank_index].files[new_files_count - 1];
+    memset(new_file, 0, sizeof(TrackerFile_t));
     new_file->file_id = file_id;
-    new_file->segment_count = 0;
+}
+
+// A client still downloads until it sends FINISHED_DOWN_ALL.
+static bool is_downloading(const TrackerData_t* client_data) {
+    return client_data->wanted_count > 0 && !client_data->finished;
+}
+
+/**
+ * Stops the uploads of every client that no unfinished downloader needs anymore: for each file
+ * the client holds, every downloader that wants the file has (as far as the tracker knows) all
+ * of the client's segments. With --dedup the same goes for the contents of every file the
+ * client holds, whichever file the downloaders want them for. Downloaders ask only for segments
+ * they miss and announce what they got, so a released client never gets another request.
+ * Returns how many clients were released.
+ */
+int release_idle_uploaders(TrackerDataSet_t* m_tracker) {
+    if(m_tracker->swarm_size == 0)
+        return 0;
+
+    // needed[f - 1] = segments of file f that some downloader still misses
+    uint64_t (*needed)[SEGMENT_WORDS] = calloc(m_tracker->swarm_size, sizeof(*needed));
+    // needed_content = contents some downloader still misses (with --dedup)
+    uint64_t* needed_content = calloc(dedup_content_words(m_tracker), sizeof(uint64_t));
+    if(!needed || !needed_content){
+        fprintf(stderr, "Memory allocation failed while releasing uploaders.\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < m_tracker->client_count; ++i){
+        TrackerData_t* downloader = &m_tracker->data[i];
+        if(!is_downloading(downloader))
+            continue;
+
+        for(uint32_t j = 0; j < downloader->wanted_count; ++j){
+            int file_id = downloader->wanted_files[j];
+            if(file_id <= 0 || file_id > m_tracker->swarm_size)
+                continue;
+
+            TrackerFile_t* file_data = tracker_find_file(downloader, file_id);
+            for(int word = 0; word < SEGMENT_WORDS; ++word)
+                needed[file_id - 1][word] |= file_data ? ~file_data->have[word] : ~(uint64_t)0;
+
+            const Swarm_t* swarm = &m_tracker->swarms[file_id - 1];
+            for(uint32_t idx = 0; idx < swarm->segment_total && swarm->content; ++idx){
+                if(!file_data || !segment_bit_test(file_data->have, idx))
+                    segment_bit_set(needed_content, swarm->content[idx]);
+            }
+        }
+    }
+
+    int released = 0;
+    for(int i = 0; i < m_tracker->client_count; ++i){
+        TrackerData_t* client_data = &m_tracker->data[i];
+        if(client_data->released || client_data->client_type == LEECHER || is_downloading(client_data))
+            continue;
+
+        bool still_needed = false;
+        for(size_t j = 0; j < client_data->files_count && !still_needed; ++j){
+            const TrackerFile_t* file_data = &client_data->files[j];
+            if(file_data->file_id <= 0 || file_data->file_id > m_tracker->swarm_size)
+                continue;
+            for(int word = 0; word < SEGMENT_WORDS; ++word)
+                still_needed |= (file_data->have[word] & needed[file_data->file_id - 1][word]) != 0;
+
+            const Swarm_t* swarm = &m_tracker->swarms[file_data->file_id - 1];
+            for(uint32_t idx = 0; idx < file_data->segment_count && swarm->content && !still_needed; ++idx)
+                still_needed = segment_bit_test(file_data->have, idx) && segment_bit_test(needed_content, swarm->content[idx]);
+        }
+        if(still_needed)
+            continue;
+
+        int client_id = i + 1;
+        ControlMessage_t stop = {.request_id = 0, .client_id = client_id, .opcode = "STOP_UPLOADING"};
+        if(send_to_client(client_id, REQUEST_TAG, &stop, sizeof(stop)) != MPI_SUCCESS){
+            fprintf(stderr, "MPI_Send failed while releasing client %d.\n", client_id);
+            continue;
+        }
+        client_data->released = true;
+        released++;
+    }
+
+    free(needed_content);
+    free(needed);
+    return released;
 }
 
 /**
@@ -372,6 +830,8 @@ void free_tracker(TrackerDataSet_t* m_tracker) {
                 free(m_tracker->swarms[i].clients_in_swarm);
                 m_tracker->swarms[i].clients_in_swarm = NULL;
             }
+            free(m_tracker->swarms[i].leaves);
+            free(m_tracker->swarms[i].content);
         }
         free(m_tracker->swarms);
         m_tracker->swarms = NULL;
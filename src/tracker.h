@@ -4,18 +4,24 @@
 #include "utils.h"
 #include "download.h"
 
+int send_to_client(int client_id, int tag, const void* data, int size);
+
 void send_peers_to_clients(TrackerDataSet_t* m_tracker);
 
+TrackerFile_t* tracker_find_file(TrackerData_t* client_data, int file_id);
 bool tracker_client_has_file(TrackerDataSet_t* m_tracker, int file_id, int rank);
 void tracker_add_file_to_owned(TrackerDataSet_t* m_tracker, int file_id, int rank);
 
 
-void update_tracker_swarm(TrackerDataSet_t* m_tracker, int rank, char* buff);
+void apply_segment_records(TrackerDataSet_t* m_tracker, int client_id, const SegmentRecord_t* records, int record_count);
+void update_tracker_swarm(TrackerDataSet_t* m_tracker, int client_id, int source_rank, char* buff);
 
 
 void receive_data_from_clients(TrackerDataSet_t* m_tracker, int numtasks);
 
-void create_file_swarms(TrackerDataSet_t* m_tracker, int numtasks);
+void create_file_swarms(TrackerDataSet_t* m_tracker);
+
+int release_idle_uploaders(TrackerDataSet_t* m_tracker);
 
 void free_tracker(TrackerDataSet_t* m_tracker);
 
@@ -3,6 +3,7 @@
 
 // * Macros
 #define MAX(a, b) ((a > b) ? a : b)
+#define MIN(a, b) ((a < b) ? a : b)
 
 // * Mpi TAGS
 #define HASH_TAG 0
@@ -11,13 +12,23 @@
 #define PEERS_SEEDERS_TRANSFER_TAG 3
 #define REQUEST_TAG 4
 #define INFORM_TAG 5
+#define DHT_TAG 6 // * DHT requests (peer channel) and their replies (data channel)
+#define SYNC_TAG 7 // * clock alignment of --trace, at startup (control channel)
+// * (the engine puts the receiver's local client id above these, see COMM_WIRE_TAG)
 
 
 #define TRACKER_RANK 0
 #define MAX_FILES 10
 #define MAX_FILENAME 15
-#define HASH_SIZE 32
+#ifndef DIGEST_SIZE
+#define DIGEST_SIZE 16 // * raw digest bytes (16 or 32)
+#endif
+#define HASH_SIZE (2 * DIGEST_SIZE) // * hex characters of a digest
 #define MAX_CHUNKS 100
+#define SEGMENT_WORDS ((MAX_CHUNKS + 63) / 64) // * 64-bit words of a segment bitfield
+#define MERKLE_DEPTH 7 // * levels above the leaves of a Merkle tree over MAX_CHUNKS segments
+#define MERKLE_INNER (MAX_CHUNKS + MERKLE_DEPTH) // * inner nodes of such a tree, promoted ones included
+#define MERKLE_WORDS ((MAX_CHUNKS + MERKLE_INNER + 63) / 64) // * words of a bitfield over all its nodes
 #define BUFF_SIZE 64
 
 #include <mpi.h>
@@ -36,19 +47,151 @@ typedef enum Client_Type_t {
     LEECHER
 } Client_Type_t;
 
-// * File Segment Structure
+// * Raw Segment Digest (what travels on the wire)
+typedef struct Digest_t {
+    uint8_t bytes[DIGEST_SIZE];
+} Digest_t;
+
+// * File Segment Structure: the segment's raw digest (hex only in the manifests and the outputs),
+// * so an array of segments has the layout of an array of digests
 typedef struct FileSegment_t {
-    char hash[HASH_SIZE + 1];
+    Digest_t digest;
 } FileSegment_t;
 
+_Static_assert(sizeof(FileSegment_t) == DIGEST_SIZE, "segments travel as packed digests");
+_Static_assert((1 << MERKLE_DEPTH) >= MAX_CHUNKS, "MERKLE_DEPTH too small for MAX_CHUNKS");
+
+// * Announced Segment (index of the segment in its file, whose Merkle root the tracker knows)
+typedef struct SegmentRecord_t {
+    int32_t file_id;
+    uint32_t segment_idx;
+} SegmentRecord_t;
+
 // * File Data Structure
+// * segments[i] is held only if bit i of have is set; segment_count = highest held index + 1.
+// * The file is identified by the root of a Merkle tree over its segment_total segment digests.
+// * The tree nodes the client knows (its segments, and the siblings and ancestors that proved
+// * them) are kept so it can prove every segment it uploads; a node once known never changes.
 typedef struct FileData_t {
     char file_name[MAX_FILENAME];
     int file_id; // * ID of the file (e.g., file<file_id>)
     size_t segment_count;
-    FileSegment_t segments[MAX_CHUNKS];
+    uint64_t have[SEGMENT_WORDS];
+    FileSegment_t segments[MAX_CHUNKS]; // * the leaves of the tree
+    size_t segment_total; // * segments of the whole file (0 while unknown)
+    Digest_t root;
+    uint64_t known[MERKLE_WORDS]; // * tree nodes known: node i < MAX_CHUNKS is segment i, then inner[]
+    Digest_t inner[MERKLE_INNER]; // * inner nodes, level by level from the one above the leaves
 } FileData_t;
 
+// * Merkle Proof: the sibling digests on the way from a segment up to the root (levels where the
+// * segment's ancestor is promoted have none)
+typedef struct MerkleProof_t {
+    uint32_t length;
+    uint32_t reserved;
+    Digest_t siblings[MERKLE_DEPTH];
+} MerkleProof_t;
+
+// * Request IDs: every request and its reply start with the id the requester picked, so a
+// * reply can never be taken for the answer to another request
+#define OPCODE_SIZE 20
+
+// * Control Message (client -> tracker on the control channel)
+typedef struct ControlMessage_t {
+    uint32_t request_id;
+    int32_t client_id; // * sender; a rank may host several clients
+    char opcode[OPCODE_SIZE]; // * "DOWN_10", "DOWN_X", "RESTORED", "GIVE_PEERS", ...
+} ControlMessage_t;
+
+// * Segment Request (client -> client on the peer channel)
+#define SEGMENT_REQUEST_INSIST 1 // * flag: the requester found no other source, a super-seeder should serve it
+#define SEGMENT_REQUEST_BY_CONTENT 2 // * flag: any held segment with the digest will do (--dedup)
+
+typedef struct SegmentRequest_t {
+    uint32_t request_id;
+    int32_t client_id; // * requester, who gets the reply
+    uint32_t flags; // * SEGMENT_REQUEST_* bits
+    int32_t file_id;
+    uint32_t segment_idx;
+    Digest_t digest; // * the segment's content, with SEGMENT_REQUEST_BY_CONTENT
+} SegmentRequest_t;
+
+// * Reply (tracker ACKs on the control channel)
+typedef struct Reply_t {
+    uint32_t request_id;
+    char status[4]; // * "OK"
+} Reply_t;
+
+// * Segment Reply (on the data channel): with "OK", the segment and the proof that takes it to
+// * the file's root
+#define SEGMENT_NOT_HELD "NH" // * reply status: the uploader does not hold the segment
+
+typedef struct SegmentReply_t {
+    uint32_t request_id;
+    char status[4]; // * "OK", SEGMENT_NOT_HELD or SUPERSEED_REFUSED
+    int32_t uploader_id; // * the client that answered
+    Digest_t segment;
+    MerkleProof_t proof;
+} SegmentReply_t;
+
+// * Wanted Files (client -> tracker, once, before the swarm lists)
+typedef struct WantedFiles_t {
+    int32_t client_id;
+    int32_t client_type;
+    uint32_t count;
+    int32_t file_ids[MAX_FILES];
+    uint32_t flags; // * WANTED_SUBSCRIBE (--subscribe)
+} WantedFiles_t;
+
+// * Registration Header (one per client, gathered by the tracker at startup)
+typedef struct RegistrationHeader_t {
+    uint64_t fingerprint; // * of the files the client holds (see fingerprint_file())
+    int32_t client_type;
+    uint32_t files_count;
+    uint32_t packed_size; // * bytes of the packed files sent after the headers
+    uint32_t reserved;
+} RegistrationHeader_t;
+
+// * Held Files (one table per client, gathered after the headers by a tracker with --snapshot):
+// * the owned files in registration order, then the files a checkpoint holds segments of
+typedef struct HeldFile_t {
+    int32_t file_id;
+    uint32_t packed_size; // * bytes of the file in the packed files (0 = held in the checkpoint only)
+    uint64_t fingerprint; // * fingerprint_file() of the file and its held segments
+} HeldFile_t;
+
+#define HELD_FILES_MAX (2 * MAX_FILES)
+// * The tracker's reply: a bit per held file it kept from its snapshot, or all of them
+#define HELD_FILES_ALL UINT32_MAX
+
+typedef struct HeldFiles_t {
+    uint32_t count;
+    uint32_t reserved;
+    HeldFile_t files[HELD_FILES_MAX];
+} HeldFiles_t;
+
+static inline bool held_file_kept(uint32_t kept, size_t idx) {
+    return kept == HELD_FILES_ALL || (idx < HELD_FILES_MAX && (kept >> idx) & 1);
+}
+
+// * Packed Owned File: a whole file, known by its Merkle root
+typedef struct RegisteredFile_t {
+    char file_name[MAX_FILENAME + 1];
+    int32_t file_id;
+    uint32_t segment_count;
+    Digest_t root;
+} RegisteredFile_t;
+
+// * Swarm Header (tracker -> client, for each wanted file): what identifies the file, followed
+// * by the file's segment digests (with --dedup), the member ids and what each member holds
+typedef struct SwarmHeader_t {
+    int32_t member_count;
+    uint32_t version;
+    uint32_t segment_total;
+    uint32_t leaves; // * 1 if the segment digests follow
+    Digest_t root;
+} SwarmHeader_t;
+
 // * File Name Structure
 typedef struct FileName_t {
     char file_name[MAX_FILENAME];
@@ -62,30 +205,53 @@ typedef struct Swarm_t {
     char file_name[MAX_FILENAME];
     int *clients_in_swarm;
     int clients_in_swarm_count;
+    uint32_t version; // * bumped every time a member announces new segments
+    uint32_t segment_total; // * segments of the file (0 until a client registers it)
+    Digest_t root; // * Merkle root of the file, its identity
+    Digest_t *leaves; // * segment digests, checked against the root (with --dedup, NULL until registered)
+    uint32_t *content; // * content id of each segment: equal digests share one (with --dedup)
 } Swarm_t;
 
 // * Peer Information Structure
 typedef struct PeerInfo_t {
     int file_id; // * ID of the file (Swarm_t associated with file<file_id>)
-    int peer_rank;
+    int peer_id;
+    bool refused; // * turned the downloader away since its last downloaded segment (super-seeding)
     size_t segment_count;
-    FileSegment_t segments[MAX_CHUNKS];
+    uint64_t have[SEGMENT_WORDS];
+    uint64_t withheld[SEGMENT_WORDS]; // * held by a super-seeder, but not shown to this downloader yet
 } PeerInfo_t;
 
+// * What the tracker keeps of a client's file: the segments it holds (the file is its swarm's root)
+typedef struct TrackerFile_t {
+    int32_t file_id;
+    uint32_t segment_count; // * highest held index + 1
+    uint64_t have[SEGMENT_WORDS];
+} TrackerFile_t;
+
 
 // * Tracker Data Structure
 // * TrackerData_t[0] = data for Client 1, and so on
 typedef struct TrackerData_t {
-    int rank; // * Rank of the client
+    int client_id; // * Id of the client (its rank when every rank hosts one client)
     size_t files_count;
-    FileData_t *files; // * Files that the client owns
+    TrackerFile_t *files; // * Files that the client owns
     Client_Type_t client_type;
+    uint64_t fingerprint; // * Fingerprint of the files as of the last tracker snapshot
+    uint32_t wanted_count; // * Files the client downloads (from its WantedFiles_t)
+    int32_t wanted_files[MAX_FILES];
+    bool finished; // * Sent FINISHED_DOWN_ALL
+    bool released; // * Told to stop uploading before the end of the run
 } TrackerData_t;
 
 // * Peers List Structure
 typedef struct PeersList_t {
     PeerInfo_t *peers_array; // * Array of peers/seeders
     int peers_count;
+    uint32_t swarm_version; // * Swarm_t version the list was built from
+    size_t segment_total; // * segments of the file and its Merkle root, as the swarm knows them
+    Digest_t root;
+    FileData_t *catalog; // * the file's whole tree, built from the digests the tracker sent (with --dedup)
 } PeersList_t;
 
 typedef struct TrackerDataSet_t {
@@ -93,18 +259,74 @@ typedef struct TrackerDataSet_t {
     TrackerData_t *data;
     Swarm_t *swarms; // * swarms for each file
     int swarm_size;
+    uint32_t content_count; // * distinct segment digests over all swarms (with --dedup)
 } TrackerDataSet_t;
 
+struct OutputWriter_t;
+struct Checkpoint_t;
+struct DhtNode_t;
+struct PexState_t;
+struct SuperSeed_t;
+struct UploadLoad_t;
+struct StreamState_t;
+struct DownloadBudget_t;
+
 // * Client Files Structure
 typedef struct ClientFiles_t {
-    int client_rank;
-    size_t owned_files_count;
+    int client_id;
+    size_t owned_files_count; // * published to the upload thread with release stores
+    size_t owned_files_capacity; // * room for the wanted files too, so owned_files never moves
     FileData_t *owned_files;
     size_t wanted_files_count;
     FileName_t *wanted_files;
     PeersList_t *peers;
     Client_Type_t client_type;
+    struct OutputWriter_t *writer; // * Background writer of the downloaded files
+    struct Checkpoint_t *checkpoint; // * Persisted download progress (NULL if disabled)
+    struct DhtNode_t *dht; // * Node of the trackerless DHT (NULL unless --dht)
+    struct PexState_t *pex; // * Peer exchange tables (NULL unless --pex)
+    struct SuperSeed_t *superseed; // * Super-seeding state (NULL unless --super-seed and an initial seeder)
+    struct UploadLoad_t *load; // * Uploads served per requester and segment (NULL unless --fairness)
+    struct StreamState_t *stream; // * Playback of the file being downloaded (NULL unless --stream)
+    struct DownloadBudget_t *budget; // * Token bucket of the download requests (NULL unless --download-rate)
+    uint64_t segments_uploaded; // * Segments the upload thread agreed to send
+    uint64_t segments_reused; // * Segments copied from another held segment with the same digest (--dedup)
+    uint64_t segments_by_content; // * Segments served for a file the client does not hold them in (--dedup)
+    uint64_t pushed_entries; // * Entries of the tracker's pushes taken in, and the new sources they brought (--subscribe)
+    uint64_t sources_pushed;
+    double first_copy_time; // * Seconds from the start of the downloads to the first complete file (0 = none)
+    uint32_t files_completed; // * Wanted files the download thread finished
+    double completion_time; // * Seconds from the start of the downloads to the last wanted file (0 = unfinished)
+    uint64_t internode_segments; // * Segments downloaded from another node
+    uint64_t internode_bytes; // * Bytes of the requests and replies of those segments
+    double discovery_time; // * Seconds the download thread spent building the peer lists
+    uint32_t last_request_id; // * Id of the download thread's latest request
 } ClientFiles_t;
 
+// * Segment Bitfield Helpers
+static inline bool segment_bit_test(const uint64_t *bits, size_t idx) {
+    return (bits[idx / 64] >> (idx % 64)) & 1;
+}
+
+static inline void segment_bit_set(uint64_t *bits, size_t idx) {
+    bits[idx / 64] |= (uint64_t)1 << (idx % 64);
+}
+
+// Sets a bit the upload thread may be reading: everything stored before it is visible to a
+// reader that sees it through segment_bit_acquire(). Only one thread may set bits of a field.
+static inline void segment_bit_publish(uint64_t *bits, size_t idx) {
+    __atomic_store_n(&bits[idx / 64], bits[idx / 64] | (uint64_t)1 << (idx % 64), __ATOMIC_RELEASE);
+}
+
+static inline bool segment_bit_acquire(const uint64_t *bits, size_t idx) {
+    return (__atomic_load_n(&bits[idx / 64], __ATOMIC_ACQUIRE) >> (idx % 64)) & 1;
+}
+
+static inline void segment_bits_fill(uint64_t *bits, size_t count) {
+    memset(bits, 0, sizeof(uint64_t) * SEGMENT_WORDS);
+    for (size_t idx = 0; idx < count; ++idx)
+        segment_bit_set(bits, idx);
+}
+
 
 #endif
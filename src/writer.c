@@ -0,0 +1,332 @@
+#include "writer.h"
+#include "digest.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// * Output name while it is being written; renamed to the final name on completion
+#define PART_SUFFIX ".part"
+
+// * Outputs kept open at once; with many clients per rank the least recently written ones
+// * are closed and reopened on their next write
+#define WRITER_MAX_OPEN 64
+
+typedef enum WriteOp_t {
+    WRITE_SEGMENT = 0,
+    WRITE_FINISH
+} WriteOp_t;
+
+typedef struct WriteEvent_t {
+    WriteOp_t op;
+    int client_id;
+    int file_id;
+    size_t segment_idx; // * segment index, or the final segment count for WRITE_FINISH
+    union {
+        Digest_t digest; // * as queued
+        char record[OUTPUT_RECORD_SIZE]; // * the output line, formatted by the writer thread
+    };
+} WriteEvent_t;
+
+typedef struct WriteQueue_t {
+    WriteEvent_t* events;
+    size_t count;
+    size_t capacity;
+} WriteQueue_t;
+
+typedef struct OpenOutput_t {
+    int client_id;
+    int file_id;
+    int fd; // * -1 while closed to make room for other outputs
+    uint64_t last_use;
+} OpenOutput_t;
+
+struct OutputWriter_t {
+    pthread_t thread;
+
+    // * Shared with the download thread, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    WriteQueue_t pending;
+    bool stopping;
+
+    // * Owned by the writer thread
+    WriteQueue_t batch;
+    OpenOutput_t* outputs; // * files started and not finished yet
+    size_t outputs_count;
+    size_t outputs_capacity;
+    size_t open_count;
+    uint64_t clock;
+};
+
+// Builds "client<id>_file<id>" (plus an optional suffix) into name.
+static void output_name(int client_id, int file_id, const char* suffix, char* name, size_t size) {
+    snprintf(name, size, "client%d_file%d%s", client_id, file_id, suffix);
+}
+
+// Closes the least recently written output, keeping its entry so it can be reopened.
+static void close_oldest_output(OutputWriter_t* writer) {
+    OpenOutput_t* oldest = NULL;
+    for (size_t i = 0; i < writer->outputs_count; ++i) {
+        OpenOutput_t* output = &writer->outputs[i];
+        if (output->fd >= 0 && (!oldest || output->last_use < oldest->last_use))
+            oldest = output;
+    }
+    if (!oldest)
+        return;
+
+    close(oldest->fd);
+    oldest->fd = -1;
+    writer->open_count--;
+}
+
+// Returns the open output of a file, creating its .part file on first use.
+static OpenOutput_t* get_output(OutputWriter_t* writer, int client_id, int file_id) {
+    OpenOutput_t* output = NULL;
+    for (size_t i = 0; i < writer->outputs_count; ++i) {
+        if (writer->outputs[i].client_id == client_id && writer->outputs[i].file_id == file_id) {
+            output = &writer->outputs[i];
+            break;
+        }
+    }
+    if (output && output->fd >= 0) {
+        output->last_use = ++writer->clock;
+        return output;
+    }
+
+    if (!output && writer->outputs_count == writer->outputs_capacity) {
+        size_t capacity = writer->outputs_capacity ? writer->outputs_capacity * 2 : MAX_FILES;
+        OpenOutput_t* outputs = realloc(writer->outputs, sizeof(OpenOutput_t) * capacity);
+        if (!outputs) {
+            fprintf(stderr, "Error: Memory allocation failed for outputs of client %d.\n", client_id);
+            return NULL;
+        }
+        writer->outputs = outputs;
+        writer->outputs_capacity = capacity;
+    }
+
+    if (writer->open_count >= WRITER_MAX_OPEN)
+        close_oldest_output(writer);
+
+    // A reopened output keeps what was written before it was closed
+    char name[64];
+    output_name(client_id, file_id, PART_SUFFIX, name, sizeof(name));
+    int fd = open(name, output ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file %s for writing.\n", name);
+        return NULL;
+    }
+
+    if (!output) {
+        output = &writer->outputs[writer->outputs_count++];
+        output->client_id = client_id;
+        output->file_id = file_id;
+    }
+    output->fd = fd;
+    output->last_use = ++writer->clock;
+    writer->open_count++;
+    return output;
+}
+
+// Writes a run of contiguous records with as few pwritev calls as possible.
+static void write_run(OpenOutput_t* output, struct iovec* iov, int iov_count, size_t first_idx) {
+    off_t offset = (off_t)(first_idx * OUTPUT_RECORD_SIZE);
+
+    while (iov_count > 0) {
+        ssize_t written = pwritev(output->fd, iov, iov_count, offset);
+        if (written < 0) {
+            fprintf(stderr, "Error: pwritev failed for file%d.\n", output->file_id);
+            return;
+        }
+        offset += written;
+
+        // Skip fully written records and resume a partially written one
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Truncates the output to its final size and renames it into place atomically.
+static void finish_output(OutputWriter_t* writer, int client_id, int file_id, size_t segment_count) {
+    char part_name[64], final_name[64];
+    output_name(client_id, file_id, PART_SUFFIX, part_name, sizeof(part_name));
+    output_name(client_id, file_id, "", final_name, sizeof(final_name));
+
+    if (segment_count == 0) {
+        fprintf(stderr, "Warning: finishing empty output %s.\n", final_name);
+    }
+
+    OpenOutput_t* output = get_output(writer, client_id, file_id);
+    if (!output)
+        return;
+
+    uint64_t started = trace_start();
+    if (ftruncate(output->fd, (off_t)(segment_count * OUTPUT_RECORD_SIZE)) != 0 || close(output->fd) != 0) {
+        fprintf(stderr, "Error: Could not complete file %s.\n", part_name);
+    }
+    if (rename(part_name, final_name) != 0) {
+        fprintf(stderr, "Error: Could not rename %s to %s.\n", part_name, final_name);
+    }
+
+    // Drop the entry, keeping the table compact
+    writer->open_count--;
+    *output = writer->outputs[--writer->outputs_count];
+    trace_record(TRACE_FILE_WRITTEN, started, false, client_id, file_id, (int)segment_count, 0, TRACE_OK);
+}
+
+// Writes one batch of events, coalescing consecutive records of the same file into one pwritev.
+static void process_batch(OutputWriter_t* writer, WriteQueue_t* batch) {
+    struct iovec iov[IOV_MAX];
+    int iov_count = 0;
+    OpenOutput_t* run_output = NULL;
+    size_t run_first = 0;
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        WriteEvent_t* event = &batch->events[i];
+
+        bool extends_run = run_output && event->op == WRITE_SEGMENT &&
+                           run_output->client_id == event->client_id &&
+                           run_output->file_id == event->file_id &&
+                           event->segment_idx == run_first + iov_count &&
+                           iov_count < IOV_MAX;
+        if (!extends_run && iov_count > 0) {
+            write_run(run_output, iov, iov_count, run_first);
+            iov_count = 0;
+            run_output = NULL;
+        }
+
+        if (event->op == WRITE_FINISH) {
+            finish_output(writer, event->client_id, event->file_id, event->segment_idx);
+            continue;
+        }
+
+        if (iov_count == 0) {
+            run_output = get_output(writer, event->client_id, event->file_id);
+            if (!run_output)
+                continue;
+            run_first = event->segment_idx;
+        }
+        // The digest becomes hex only here, on its way to the output
+        Digest_t digest = event->digest;
+        digest_to_hex(&digest, event->record);
+        event->record[HASH_SIZE] = '\n';
+        iov[iov_count].iov_base = event->record;
+        iov[iov_count].iov_len = OUTPUT_RECORD_SIZE;
+        iov_count++;
+    }
+
+    if (iov_count > 0)
+        write_run(run_output, iov, iov_count, run_first);
+    batch->count = 0;
+}
+
+// Writer thread: swaps out everything queued so far and writes it, until stopped and drained.
+static void* writer_thread_func(void* arg) {
+    OutputWriter_t* writer = (OutputWriter_t*)arg;
+    trace_attach(TRACE_THREAD_WRITER);
+
+    while (true) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->pending.count == 0 && !writer->stopping)
+            pthread_cond_wait(&writer->wake, &writer->lock);
+
+        bool last_batch = writer->stopping;
+        WriteQueue_t swap = writer->batch;
+        writer->batch = writer->pending;
+        writer->pending = swap;
+        pthread_mutex_unlock(&writer->lock);
+
+        process_batch(writer, &writer->batch);
+
+        if (last_batch)
+            break;
+    }
+
+    return NULL;
+}
+
+// Queues an event; only an array append happens under the lock, never file I/O.
+static void push_event(OutputWriter_t* writer, const WriteEvent_t* event) {
+    pthread_mutex_lock(&writer->lock);
+
+    WriteQueue_t* queue = &writer->pending;
+    if (queue->count == queue->capacity) {
+        size_t new_capacity = queue->capacity ? queue->capacity * 2 : MAX_CHUNKS;
+        WriteEvent_t* events = realloc(queue->events, sizeof(WriteEvent_t) * new_capacity);
+        if (!events) {
+            pthread_mutex_unlock(&writer->lock);
+            fprintf(stderr, "Error: Memory allocation failed in output writer.\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        queue->events = events;
+        queue->capacity = new_capacity;
+    }
+    queue->events[queue->count++] = *event;
+
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Starts the background writer shared by the clients of a rank.
+OutputWriter_t* writer_start(void) {
+    OutputWriter_t* writer = calloc(1, sizeof(OutputWriter_t));
+    if (!writer) {
+        fprintf(stderr, "Error: Memory allocation failed for output writer.\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+
+    if (pthread_create(&writer->thread, NULL, writer_thread_func, writer)) {
+        fprintf(stderr, "Error creating writer thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    return writer;
+}
+
+// Queues a segment's digest as soon as the segment has been downloaded.
+void writer_segment(OutputWriter_t* writer, int client_id, int file_id, size_t segment_idx, const Digest_t* digest) {
+    WriteEvent_t event = {.op = WRITE_SEGMENT, .client_id = client_id, .file_id = file_id, .segment_idx = segment_idx};
+    event.digest = *digest;
+    push_event(writer, &event);
+}
+
+// Marks a file complete; the writer publishes it under its final name once all lines are written.
+void writer_finish(OutputWriter_t* writer, int client_id, int file_id, size_t segment_count) {
+    WriteEvent_t event = {.op = WRITE_FINISH, .client_id = client_id, .file_id = file_id, .segment_idx = segment_count};
+    push_event(writer, &event);
+}
+
+// Drains the queue, joins the writer thread and frees it.
+void writer_stop(OutputWriter_t* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (pthread_join(writer->thread, NULL)) {
+        fprintf(stderr, "Error joining writer thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    free(writer->pending.events);
+    free(writer->batch.events);
+    free(writer->outputs);
+    free(writer);
+}
@@ -0,0 +1,19 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include "utils.h"
+
+// * One output line per segment: the hex hash and a newline
+#define OUTPUT_RECORD_SIZE (HASH_SIZE + 1)
+
+typedef struct OutputWriter_t OutputWriter_t;
+
+OutputWriter_t* writer_start(void);
+
+void writer_segment(OutputWriter_t* writer, int client_id, int file_id, size_t segment_idx, const Digest_t* digest);
+
+void writer_finish(OutputWriter_t* writer, int client_id, int file_id, size_t segment_count);
+
+void writer_stop(OutputWriter_t* writer);
+
+#endif